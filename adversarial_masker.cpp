@@ -0,0 +1,322 @@
+// C++ version of the python adversarial_masker (rf_pipelines/transforms/adversarial_masker.py).
+//
+// From python, the two versions are constructed as 'adversarial_masker' and 'adversarial_masker_cpp'.
+// In the pipeline json output, they are represented as 'adversarial_masker' and 'adversarial_masker_cpp'.
+//
+// The adversarial_masker is intended to stress-test online variance estimation (and bonsai's handling
+// of gaps), by masking a long sequence of rectangle-shaped regions of the (freq,time) plane.  The list of
+// rectangles is the same as the python version, but the python version scans every rectangle in every
+// chunk.  Here, the rectangles are sorted by starting time, and _process_chunk() only touches rectangles
+// which overlap the chunk, so long runs (with ~1000 minefield rectangles per nt_minefield) are cheap.
+//
+// Differences from the python version:
+//
+//   - Random numbers are generated from a seed, so the mask is reproducible.
+//
+//   - In the "randomly masked samples" section, each sample is masked with probability 1/2.  (The python
+//     version multiplied the weights by numpy.random.randint(0,1), which masked every sample.)
+//
+//   - In the "groups of adjacent frequencies" section, the python version had a buggy wraparound condition.
+//     Here, a group which extends past the top of the band wraps around to the bottom.
+
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+struct adversarial_masker : public wi_transform
+{
+    struct rectangle {
+	ssize_t ifreq0;
+	ssize_t ifreq1;
+	ssize_t it0;
+	ssize_t it1;
+	bool random;    // if true, samples are masked with probability 1/2
+    };
+
+    const ssize_t nt_reset;
+    const ssize_t nt_minefield;
+    const ssize_t seed;
+    const counter_rng mask_rng;
+
+    // Initialized in _bind_transform().
+    vector<rectangle> rectangles;    // sorted by it0
+    ssize_t nt_max = 0;
+
+    // Per-run state, reset in _start_pipeline().
+    // Rectangles [0:irect_next) have been moved to 'active' (or have already been fully masked).
+    size_t irect_next = 0;
+    vector<const rectangle *> active;
+
+    // Scratch space for random masking, length nt_chunk.
+    vector<float> rbuf;
+
+
+    adversarial_masker(ssize_t nt_chunk_, ssize_t nt_reset_, ssize_t nt_minefield_, ssize_t seed_) :
+	wi_transform("adversarial_masker_cpp"),
+	nt_reset(nt_reset_),
+	nt_minefield(nt_minefield_),
+	seed(seed_ ? seed_ : counter_rng::random_seed()),
+	mask_rng(seed, 0)
+    {
+	stringstream ss;
+	ss << "adversarial_masker_cpp(nt_chunk=" << nt_chunk_ << ", nt_reset=" << nt_reset << ", nt_minefield=" << nt_minefield << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+
+	if (nt_chunk <= 0)
+	    _throw("expected nt_chunk > 0");
+	if (nt_reset < 128)
+	    _throw("expected nt_reset >= 128");
+	if (nt_minefield < 0)
+	    _throw("expected nt_minefield >= 0");
+	if (seed <= 0)
+	    _throw("expected seed >= 0");
+    }
+
+
+    void _add(ssize_t ifreq0, ssize_t ifreq1, ssize_t it0, ssize_t it1, bool random=false)
+    {
+	ifreq0 = max(ifreq0, ssize_t(0));
+	ifreq1 = min(ifreq1, nfreq);
+
+	if ((ifreq0 >= ifreq1) || (it0 >= it1))
+	    return;
+
+	rectangle r;
+	r.ifreq0 = ifreq0;
+	r.ifreq1 = ifreq1;
+	r.it0 = it0;
+	r.it1 = it1;
+	r.random = random;
+
+	rectangles.push_back(r);
+    }
+
+
+    // Same sequence of rectangles as the python version.
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	std::mt19937 rng(seed);
+	auto randint = [&rng](ssize_t lo, ssize_t hi) { return std::uniform_int_distribution<ssize_t>(lo,hi)(rng); };   // inclusive, as in python
+	auto round_up = [](ssize_t m, ssize_t n) { return ((m+n-1)/n) * n; };
+
+	this->rectangles.clear();
+	this->nt_max = nt_reset;
+
+	// Timestream gaps of different sizes, with all frequencies masked.
+	for (int i = 0; i < 8; i++) {
+	    ssize_t nt_rect = nt_reset >> i;
+	    _add(0, nfreq, nt_max, nt_max + nt_rect);
+	    nt_max += nt_rect + nt_reset;
+	}
+
+	// Long stretches with (3/4) of the frequency band masked.
+	nt_max = round_up(nt_max, 2048);
+	_add(nfreq/4, nfreq, nt_max, nt_max + nt_reset);
+	nt_max += 2 * nt_reset;
+
+	nt_max = round_up(nt_max, 2048);
+	_add(0, (3*nfreq)/4, nt_max, nt_max + nt_reset);
+	nt_max += 2 * nt_reset;
+
+	// Masking random frequency channels within each rectangle.
+	for (int i = 0; i < 8; i++) {
+	    ssize_t nt_rect = nt_reset >> i;
+	    ssize_t n_masked = randint(nfreq/4, nfreq-1);
+
+	    for (ssize_t n = 0; n < n_masked; n++) {
+		ssize_t ifreq = randint(0, nfreq-1);
+		_add(ifreq, ifreq+1, nt_max, nt_max + nt_rect);
+	    }
+
+	    nt_max += nt_rect + nt_reset;
+	}
+
+	// Masking groups of adjacent frequencies.
+	for (int i = 0; i < 8; i++) {
+	    ssize_t nt_rect = nt_reset >> i;
+	    ssize_t n_masked = randint(nfreq/4, nfreq-1);
+	    ssize_t start = randint(0, nfreq);
+
+	    if (start + n_masked > nfreq)
+		_add(0, start + n_masked - nfreq, nt_max, nt_max + nt_rect);
+
+	    _add(start, min(nfreq, start + n_masked), nt_max, nt_max + nt_rect);
+	    nt_max += nt_rect + nt_reset;
+	}
+
+	// Vertical stripes.
+	for (int i = 0; i < 8; i++) {
+	    ssize_t nt_rect = nt_reset >> i;
+	    ssize_t stripe_width = nt_rect / 8;
+	    ssize_t stripe_end = nt_max;
+
+	    for (int j = 0; j < 4; j++) {
+		_add(0, nfreq, stripe_end, stripe_end + stripe_width);
+		stripe_end += 2 * stripe_width;
+	    }
+
+	    nt_max += nt_rect + nt_reset;
+	}
+
+	// Horizontal stripes.
+	const int n_stripes = 40;
+
+	for (int i = 0; i < 8; i++) {
+	    ssize_t nt_rect = nt_reset >> i;
+	    ssize_t stripe_width = nfreq / (2 * n_stripes);
+	    ssize_t stripe_end = 0;
+
+	    for (int j = 0; j < n_stripes; j++) {
+		_add(stripe_end, stripe_end + stripe_width, nt_max, nt_max + nt_rect);
+		stripe_end += 2 * stripe_width;
+	    }
+
+	    nt_max += nt_rect + nt_reset;
+	}
+
+	// Rectangles with randomly masked samples.
+	for (int i = 0; i < 8; i++) {
+	    ssize_t nt_rect = nt_reset >> i;
+	    _add(0, nfreq, nt_max, nt_max + nt_rect, true);
+	    nt_max += nt_rect + nt_reset;
+	}
+
+	// "Minefield" of randomly placed rectangles.
+	for (ssize_t i = 0; i < nt_minefield / 3000; i++) {
+	    ssize_t freq0 = randint(-ssize_t(0.2*nfreq), nfreq-1);
+	    ssize_t freq1 = randint(0, ssize_t(1.2*nfreq));
+
+	    double t = std::uniform_real_distribution<double>(-1.0, 1.0)(rng);
+	    t = (t >= 0.0) ? cbrt(t) : -cbrt(-t);
+	    ssize_t it0 = nt_max + ssize_t((t+1)/2. * nt_minefield);
+
+	    double lnt = std::uniform_real_distribution<double>(log(100.), log(10000.))(rng);
+	    ssize_t nt = ssize_t(exp(lnt));
+
+	    _add(min(freq0,freq1), max(freq0,freq1) + 1, it0, it0 + nt);
+	}
+
+	nt_max += nt_minefield;
+
+	std::stable_sort(rectangles.begin(), rectangles.end(), [](const rectangle &a, const rectangle &b) { return a.it0 < b.it0; });
+
+	// FIXME if (verbosity >= 2) ...
+	cout << "adversarial_masker_cpp: nt_max=" << nt_max << ", nrect=" << rectangles.size() << endl;
+    }
+
+
+    virtual void _allocate() override
+    {
+	this->rbuf.resize(nt_chunk);
+    }
+
+
+    virtual void _start_pipeline(Json::Value &json_attrs) override
+    {
+	this->irect_next = 0;
+	this->active.clear();
+    }
+
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	ssize_t pos_end = pos + nt_chunk;
+
+	// Activate rectangles which start before the end of this chunk.
+	while ((irect_next < rectangles.size()) && (rectangles[irect_next].it0 < pos_end)) {
+	    if (rectangles[irect_next].it1 > pos)
+		active.push_back(&rectangles[irect_next]);
+	    irect_next++;
+	}
+
+	size_t nactive = 0;
+
+	for (const rectangle *r: active) {
+	    ssize_t lo = max(r->it0, pos);
+	    ssize_t hi = min(r->it1, pos_end);
+
+	    for (ssize_t ifreq = r->ifreq0; ifreq < r->ifreq1; ifreq++) {
+		float *w = weights + ifreq*wstride + (lo - pos);
+
+		if (!r->random) {
+		    memset(w, 0, (hi-lo) * sizeof(float));
+		    continue;
+		}
+
+		mask_rng.fill_uniform(&rbuf[0], hi-lo, ifreq, lo);
+		for (ssize_t i = 0; i < hi-lo; i++)
+		    w[i] = (rbuf[i] < 0.5f) ? 0.0f : w[i];
+	    }
+
+	    // Keep rectangles which extend past this chunk.
+	    if (r->it1 > pos_end)
+		active[nactive++] = r;
+	}
+
+	active.resize(nactive);
+    }
+
+
+    virtual void _deallocate() override
+    {
+	this->rbuf = vector<float> ();
+    }
+
+
+    virtual void _unbind_transform() override
+    {
+	this->rectangles = vector<rectangle> ();
+	this->active = vector<const rectangle *> ();
+    }
+
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "adversarial_masker_cpp";
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+	ret["nt_reset"] = Json::Int64(nt_reset);
+	ret["nt_minefield"] = Json::Int64(nt_minefield);
+	ret["seed"] = Json::Int64(seed);
+
+	return ret;
+    }
+
+
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
+	ssize_t nt_reset = ssize_t_from_json(j, "nt_reset");
+	ssize_t nt_minefield = ssize_t_from_json(j, "nt_minefield");
+	ssize_t seed = j.isMember("seed") ? ssize_t_from_json(j, "seed") : 0;
+
+	return make_shared<adversarial_masker> (nt_chunk, nt_reset, nt_minefield, seed);
+    }
+};
+
+
+shared_ptr<wi_transform> make_adversarial_masker(ssize_t nt_chunk, ssize_t nt_reset, ssize_t nt_minefield, ssize_t seed)
+{
+    return make_shared<adversarial_masker> (nt_chunk, nt_reset, nt_minefield, seed);
+}
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("adversarial_masker_cpp", adversarial_masker::from_json);
+	}
+    } init;
+}
+
+
+}  // namespace rf_pipelines
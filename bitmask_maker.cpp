@@ -0,0 +1,316 @@
+#include "rf_pipelines_internals.hpp"
+#include "rf_pipelines_inventory.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RF_BITMASK_X86 1
+#else
+#define RF_BITMASK_X86 0
+#endif
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+using namespace std;
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// make_bitmask() kernels.
+//
+// Input: float32 array with shape (nfreq,nt) and arbitrary stride.
+// Output: uint8 array with shape (nfreq,nt/8) and arbitrary stride.
+//
+// Bit (it % 8) of byte (it / 8) is set iff weight > 0.  This is the same convention as
+// rf_kernels::mask_counter_data::out_bitmask, and ch_frb_io::assembled_chunk::rfi_mask.
+//
+// There is one kernel per instruction set, and the fastest one supported by the CPU
+// is selected at runtime.  This means that the binary doesn't need to be compiled with
+// -march=native (or -mavx2 etc.) to get the fast kernels.  Each SIMD kernel processes
+// 32 samples per iteration, then falls through to the scalar kernel for the remainder.
+
+
+// Slow reference version.  Processes samples [it0,nt) in each row.
+static void _make_bitmask_scalar(uint8_t *out, ssize_t ostride, ssize_t nfreq, ssize_t nt, const float *in, ssize_t istride, ssize_t it0=0)
+{
+    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	for (ssize_t it = it0; it < nt; it += 8) {
+	    uint8_t b = 0;
+
+	    for (int j = 0; j < 8; j++) {
+		float w = in[ifreq*istride + it + j];
+		b |= ((w > 0.0f) ? 1 : 0) << j;
+	    }
+
+	    out[ifreq*ostride + it/8] = b;
+	}
+    }
+}
+
+
+#if RF_BITMASK_X86
+
+// Helper for the SIMD kernels: writes 32 bits (as 4 bytes, in little-endian order).
+inline void _store_u32(uint8_t *out, uint32_t x)
+{
+    memcpy(out, &x, sizeof(x));
+}
+
+
+__attribute__((target("sse2")))
+static void _make_bitmask_sse2(uint8_t *out, ssize_t ostride, ssize_t nfreq, ssize_t nt, const float *in, ssize_t istride)
+{
+    const __m128 zero = _mm_setzero_ps();
+    ssize_t nt32 = nt & ~ssize_t(31);
+
+    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	const float *p = in + ifreq*istride;
+	uint8_t *q = out + ifreq*ostride;
+
+	for (ssize_t it = 0; it < nt32; it += 32) {
+	    uint32_t x = 0;
+	    for (int j = 0; j < 8; j++)
+		x |= uint32_t(_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(p+it+4*j), zero))) << (4*j);
+	    _store_u32(q + it/8, x);
+	}
+    }
+
+    _make_bitmask_scalar(out, ostride, nfreq, nt, in, istride, nt32);
+}
+
+
+__attribute__((target("avx2")))
+static void _make_bitmask_avx2(uint8_t *out, ssize_t ostride, ssize_t nfreq, ssize_t nt, const float *in, ssize_t istride)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    ssize_t nt32 = nt & ~ssize_t(31);
+
+    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	const float *p = in + ifreq*istride;
+	uint8_t *q = out + ifreq*ostride;
+
+	for (ssize_t it = 0; it < nt32; it += 32) {
+	    uint32_t x0 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p+it), zero, _CMP_GT_OQ));
+	    uint32_t x1 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p+it+8), zero, _CMP_GT_OQ));
+	    uint32_t x2 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p+it+16), zero, _CMP_GT_OQ));
+	    uint32_t x3 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p+it+24), zero, _CMP_GT_OQ));
+	    _store_u32(q + it/8, x0 | (x1 << 8) | (x2 << 16) | (x3 << 24));
+	}
+    }
+
+    _make_bitmask_scalar(out, ostride, nfreq, nt, in, istride, nt32);
+}
+
+
+__attribute__((target("avx512f")))
+static void _make_bitmask_avx512(uint8_t *out, ssize_t ostride, ssize_t nfreq, ssize_t nt, const float *in, ssize_t istride)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    ssize_t nt32 = nt & ~ssize_t(31);
+
+    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	const float *p = in + ifreq*istride;
+	uint8_t *q = out + ifreq*ostride;
+
+	for (ssize_t it = 0; it < nt32; it += 32) {
+	    uint32_t x0 = _mm512_cmp_ps_mask(_mm512_loadu_ps(p+it), zero, _CMP_GT_OQ);
+	    uint32_t x1 = _mm512_cmp_ps_mask(_mm512_loadu_ps(p+it+16), zero, _CMP_GT_OQ);
+	    _store_u32(q + it/8, x0 | (x1 << 16));
+	}
+    }
+
+    _make_bitmask_scalar(out, ostride, nfreq, nt, in, istride, nt32);
+}
+
+#endif  // RF_BITMASK_X86
+
+
+static int _detect_bitmask_simd_level()
+{
+#if RF_BITMASK_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+	return BITMASK_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+	return BITMASK_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+	return BITMASK_SSE2;
+#endif
+
+    return BITMASK_SCALAR;
+}
+
+
+int bitmask_simd_level()
+{
+    static const int level = _detect_bitmask_simd_level();
+    return level;
+}
+
+
+void make_bitmask(uint8_t *out, ssize_t ostride, ssize_t nfreq, ssize_t nt, const float *in, ssize_t istride, int simd_level)
+{
+    rf_assert(out != nullptr);
+    rf_assert(in != nullptr);
+    rf_assert(nfreq > 0);
+    rf_assert(nt > 0);
+    rf_assert(nt % 8 == 0);
+    rf_assert(ostride >= nt/8);
+
+    int max_level = bitmask_simd_level();
+
+    if (simd_level < 0)
+	simd_level = max_level;
+    if (simd_level > max_level)
+	throw runtime_error("rf_pipelines::make_bitmask(): simd_level=" + to_string(simd_level) + " was requested, but this CPU only supports simd_level <= " + to_string(max_level));
+
+#if RF_BITMASK_X86
+    if (simd_level == BITMASK_AVX512)
+	_make_bitmask_avx512(out, ostride, nfreq, nt, in, istride);
+    else if (simd_level == BITMASK_AVX2)
+	_make_bitmask_avx2(out, ostride, nfreq, nt, in, istride);
+    else if (simd_level == BITMASK_SSE2)
+	_make_bitmask_sse2(out, ostride, nfreq, nt, in, istride);
+    else
+#endif
+	_make_bitmask_scalar(out, ostride, nfreq, nt, in, istride);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// bitmask_maker
+//
+// The output ring buffer 'output_bufname' has the same shape as the weights, but with an extra
+// factor 32 of downsampling (nds_out = 32 * nds_in).  Each float32 element is really a uint32_t
+// containing 32 bits of the mask.  Since the ring buffer only copies its contents with memcpy(),
+// the bits are preserved.  Downstream consumers should access it as follows:
+//
+//   ring_buffer_subarray bm(rb_bitmask, pos, pos + nt_chunk, ring_buffer::ACCESS_READ);
+//   const uint8_t *p = reinterpret_cast<const uint8_t *> (bm.data);   // shape (nfreq, nt_chunk/(8*nds_in))
+//   ssize_t stride = 4 * bm.stride;                                    // byte stride
+//
+// Each row is then in the same format as ch_frb_io::assembled_chunk::rfi_mask, i.e. it can be
+// memcpy'd directly into an assembled_chunk.
+
+
+struct bitmask_maker : public chunked_pipeline_object
+{
+    const string output_bufname;
+    const int simd_level;
+
+    // Initialized in _bindc().
+    shared_ptr<ring_buffer> rb_weights;
+    shared_ptr<ring_buffer> rb_bitmask;
+    ssize_t nfreq = 0;
+    ssize_t nds_in = 0;
+
+
+    bitmask_maker(const string &output_bufname_, ssize_t nt_chunk_, int simd_level_) :
+	chunked_pipeline_object("bitmask_maker", false),   // can_be_first=false
+	output_bufname(output_bufname_),
+	simd_level(simd_level_)
+    {
+	if (output_bufname.size() == 0)
+	    _throw("'output_bufname' must be a nonempty string");
+	if ((output_bufname == "INTENSITY") || (output_bufname == "WEIGHTS"))
+	    _throw("'output_bufname' cannot be \"INTENSITY\" or \"WEIGHTS\"");
+	if (nt_chunk_ < 0)
+	    _throw("expected nt_chunk >= 0");
+	if (simd_level > BITMASK_AVX512)
+	    _throw("invalid 'simd_level' argument");
+
+	this->nt_chunk = nt_chunk_;
+
+	stringstream ss;
+	ss << "bitmask_maker(output_bufname='" << output_bufname << "'";
+	if (nt_chunk_ != 0)
+	    ss << ",nt_chunk=" << nt_chunk_;
+	if (simd_level >= 0)
+	    ss << ",simd_level=" << simd_level;
+	ss << ")";
+
+	this->name = ss.str();
+    }
+
+
+    virtual void _bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override
+    {
+	this->rb_weights = this->get_buffer(rb_dict, "WEIGHTS");
+
+	if (rb_weights->cdims.size() != 1)
+	    _throw("expected weights array to be two-dimensional");
+
+	this->nfreq = rb_weights->cdims[0];
+	this->nds_in = rb_weights->nds;
+	this->rb_bitmask = this->create_buffer(rb_dict, output_bufname, { nfreq }, 32 * nds_in);
+
+	// Check early, rather than in _process_chunk().
+	if (simd_level > bitmask_simd_level())
+	    _throw("simd_level=" + to_string(simd_level) + " was requested, but this CPU only supports simd_level <= " + to_string(bitmask_simd_level()));
+    }
+
+
+    virtual bool _process_chunk(ssize_t pos) override
+    {
+	ring_buffer_subarray w(rb_weights, pos, pos + nt_chunk, ring_buffer::ACCESS_READ);
+	ring_buffer_subarray bm(rb_bitmask, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
+
+	uint8_t *out = reinterpret_cast<uint8_t *> (bm.data);
+	make_bitmask(out, 4 * bm.stride, nfreq, xdiv(nt_chunk, nds_in), w.data, w.stride, simd_level);
+
+	return true;
+    }
+
+
+    virtual void _unbindc() override
+    {
+	this->rb_weights.reset();
+	this->rb_bitmask.reset();
+    }
+
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "bitmask_maker";
+	ret["output_bufname"] = output_bufname;
+	ret["nt_chunk"] = int(this->get_prebind_nt_chunk());
+	ret["simd_level"] = simd_level;
+
+	return ret;
+    }
+
+
+    static shared_ptr<bitmask_maker> from_json(const Json::Value &j)
+    {
+	string output_bufname = string_from_json(j, "output_bufname");
+	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
+	int simd_level = j.isMember("simd_level") ? int_from_json(j, "simd_level") : -1;
+
+	return make_shared<bitmask_maker> (output_bufname, nt_chunk, simd_level);
+    }
+};
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("bitmask_maker", bitmask_maker::from_json);
+	}
+    } init;
+}
+
+
+// Externally callable factory function
+shared_ptr<pipeline_object> make_bitmask_maker(const string &output_bufname, ssize_t nt_chunk, int simd_level)
+{
+    return make_shared<bitmask_maker> (output_bufname, nt_chunk, simd_level);
+}
+
+
+}  // namespace rf_pipelines
@@ -3,6 +3,9 @@
 // In the pipeline json output, they are represented as 'bonsai_dedisperser_python' and 'bonsai_dedisperser_cpp'.
 // The two versions of the bonsai_dedisperser will be combined eventually!
 
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "rf_pipelines_internals.hpp"
 
 #ifdef HAVE_BONSAI
@@ -27,34 +30,81 @@ shared_ptr<wi_transform> make_bonsai_dedisperser(const string &config_filename,
 #else  // HAVE_BONSAI
 
 
+// If nbuf_async > 0, then the dedisperser runs asynchronously in a worker thread.  In _process_chunk(),
+// the (intensity, weights) chunk is copied into one of 'nbuf_async' buffers, and handed off to the
+// worker thread, so that upstream transforms can proceed with the next chunk while bonsai runs.
+// If all buffers are in use, _process_chunk() blocks until the worker thread frees one.
+//
+// Buffer i is in use if (nconsumed <= i < nproduced), modulo nbuf_async.  The worker thread is
+// joined in _end_pipeline(), before calling dedisperser->end_dedispersion().  An exception thrown
+// in the worker thread is rethrown once, in the next call to _process_chunk() or (if there are no
+// more chunks) in _end_pipeline().  If the worker failed, end_dedispersion() is not called.
+//
+// In async mode, bonsai doesn't modify the pipeline's (intensity, weights) arrays, so async mode
+// can't be combined with 'fill_rfi_mask' (the constructor throws an exception).
+
 struct bonsai_dedisperser : public wi_transform {
     shared_ptr<bonsai::dedisperser> dedisperser;
     shared_ptr<bonsai::global_max_tracker> max_tracker;
+    const ssize_t nbuf_async;
+
+    // Async mode only: shape (nbuf_async, nfreq, nt_chunk) arrays, allocated in _allocate().
+    vector<float> async_intensity;
+    vector<float> async_weights;
+
+    // Async mode only: worker thread state, protected by 'lock'.
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable cv;
+    ssize_t nproduced = 0;
+    ssize_t nconsumed = 0;
+    bool worker_done = false;
+    bool worker_failed = false;        // set when the worker throws, reset in _start_pipeline()
+    std::exception_ptr worker_error;   // cleared when rethrown
 
     // Note: if 'tp' is a nonempty pointer, then caller is responsible for calling dp->add_processor(tp).
     // This is a little "fragile", but since this is an internal interface, I didn't bother improving it!
-    bonsai_dedisperser(const shared_ptr<bonsai::dedisperser> &dp, const shared_ptr<bonsai::global_max_tracker> &tp);
+    bonsai_dedisperser(const shared_ptr<bonsai::dedisperser> &dp, const shared_ptr<bonsai::global_max_tracker> &tp, ssize_t nbuf_async=0);
+    virtual ~bonsai_dedisperser();
 
     virtual void _bind_transform(Json::Value &json_attrs) override;
     virtual void _allocate() override;
     virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override;
     virtual void _start_pipeline(Json::Value &json_attrs) override;
     virtual void _end_pipeline(Json::Value &json_output) override;
+    virtual void _reset() override;
     virtual void _deallocate() override;
     
     virtual Json::Value jsonize() const override;
     static shared_ptr<bonsai_dedisperser> from_json(const Json::Value &j);
+
+    void _worker_main();
+    void _stop_worker();
+    void _rethrow_worker_error();
 };
 
 
-bonsai_dedisperser::bonsai_dedisperser(const shared_ptr<bonsai::dedisperser> &dp, const shared_ptr<bonsai::global_max_tracker> &tp) :
+bonsai_dedisperser::bonsai_dedisperser(const shared_ptr<bonsai::dedisperser> &dp, const shared_ptr<bonsai::global_max_tracker> &tp, ssize_t nbuf_async_) :
     wi_transform("bonsai_dedisperser_cpp"),
     dedisperser(dp), 
-    max_tracker(tp)
+    max_tracker(tp),
+    nbuf_async(nbuf_async_)
 { 
     // initialize members of wi_transform base class
     this->name = "bonsai_dedisperser_cpp(" + dp->config.name + ")";
     this->nt_chunk = dedisperser->nt_chunk;
+
+    if (nbuf_async < 0)
+	_throw("expected nbuf_async >= 0");
+    if ((nbuf_async > 0) && dedisperser->ini_params.fill_rfi_mask)
+	_throw("nbuf_async > 0 can't be combined with fill_rfi_mask=true, since the filled data would not be written back to the pipeline");
+}
+
+
+bonsai_dedisperser::~bonsai_dedisperser()
+{
+    // Only reached with the worker still running if the pipeline was destroyed in the middle of a run.
+    _stop_worker();
 }
 
 
@@ -62,6 +112,11 @@ void bonsai_dedisperser::_allocate()
 {
     // If dedisperser is already allocated, this no-ops.
     this->dedisperser->allocate();
+
+    if (nbuf_async > 0) {
+	this->async_intensity.resize(nbuf_async * nfreq * nt_chunk, 0.0);
+	this->async_weights.resize(nbuf_async * nfreq * nt_chunk, 0.0);
+    }
 }
 
 
@@ -103,7 +158,95 @@ void bonsai_dedisperser::_bind_transform(Json::Value &json_attrs)
 void bonsai_dedisperser::_process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos)
 {
     // Note: rf_pipelines and bonsai use the same frequency channel ordering (highest-to-lowest), so we can pass the arrays and stride "as is"
-    dedisperser->run(intensity, istride, weights, wstride);
+    if (nbuf_async == 0) {
+	dedisperser->run(intensity, istride, weights, wstride);
+	return;
+    }
+
+    // Async mode: wait for a free buffer.
+    unique_lock<mutex> l(lock);
+    while ((nproduced - nconsumed >= nbuf_async) && !worker_failed)
+	cv.wait(l);
+
+    if (worker_failed) {
+	// If the error was already delivered, _process_chunk() isn't called again (run() stops advancing),
+	// but we're paranoid and throw something anyway.
+	_rethrow_worker_error();
+	_throw("async worker thread failed");
+    }
+
+    ssize_t ibuf = nproduced % nbuf_async;
+    l.unlock();
+
+    // The worker thread doesn't access buffer 'ibuf' until 'nproduced' is incremented below.
+    float *dst_i = &async_intensity[ibuf * nfreq * nt_chunk];
+    float *dst_w = &async_weights[ibuf * nfreq * nt_chunk];
+
+    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	memcpy(dst_i + ifreq*nt_chunk, intensity + ifreq*istride, nt_chunk * sizeof(float));
+	memcpy(dst_w + ifreq*nt_chunk, weights + ifreq*wstride, nt_chunk * sizeof(float));
+    }
+
+    l.lock();
+    nproduced++;
+    cv.notify_all();
+}
+
+
+void bonsai_dedisperser::_worker_main()
+{
+    try {
+	for (;;) {
+	    unique_lock<mutex> l(lock);
+	    while ((nconsumed == nproduced) && !worker_done)
+		cv.wait(l);
+
+	    if (nconsumed == nproduced)
+		break;
+
+	    ssize_t ibuf = nconsumed % nbuf_async;
+	    l.unlock();
+
+	    dedisperser->run(&async_intensity[ibuf * nfreq * nt_chunk], nt_chunk, &async_weights[ibuf * nfreq * nt_chunk], nt_chunk);
+
+	    l.lock();
+	    nconsumed++;
+	    cv.notify_all();
+	}
+    } catch (...) {
+	// Saved for the main thread, which will rethrow.
+	lock_guard<mutex> l(lock);
+	worker_error = std::current_exception();
+	worker_failed = true;
+	cv.notify_all();
+    }
+}
+
+
+// Caller must hold the lock.  The error is only rethrown once.
+void bonsai_dedisperser::_rethrow_worker_error()
+{
+    if (!worker_error)
+	return;
+
+    std::exception_ptr e = worker_error;
+    worker_error = nullptr;
+    std::rethrow_exception(e);
+}
+
+
+// Signals the worker thread to exit (after processing all queued chunks), and joins it.
+void bonsai_dedisperser::_stop_worker()
+{
+    if (!worker.joinable())
+	return;
+
+    unique_lock<mutex> l(lock);
+    worker_done = true;
+    cv.notify_all();
+    l.unlock();
+
+    worker.join();
 }
 
 
@@ -115,11 +258,32 @@ void bonsai_dedisperser::_start_pipeline(Json::Value &json_attrs)
 
     string s = json_stringify(json_attrs);
     dedisperser->set_opaque_context(s);
+
+    if (nbuf_async > 0) {
+	this->nproduced = 0;
+	this->nconsumed = 0;
+	this->worker_done = false;
+	this->worker_failed = false;
+	this->worker_error = nullptr;
+	this->worker = std::thread(&bonsai_dedisperser::_worker_main, this);
+    }
 }
 
 
 void bonsai_dedisperser::_end_pipeline(Json::Value &json_output)
 {
+    // In async mode, wait for all queued chunks to be dedispersed.
+    _stop_worker();
+
+    if (worker_failed) {
+	// The dedisperser is in an undefined state, so we skip end_dedispersion().  If the error
+	// hasn't been delivered yet, it's thrown here (and reported by pipeline_object::run()).
+	json_output["worker_failed"] = true;
+	lock_guard<mutex> l(lock);
+	_rethrow_worker_error();
+	return;
+    }
+
     dedisperser->end_dedispersion();
 
     for (int itree = 0; itree < dedisperser->ntrees; itree++)
@@ -133,10 +297,19 @@ void bonsai_dedisperser::_end_pipeline(Json::Value &json_output)
 }
 
 
+void bonsai_dedisperser::_reset()
+{
+    _stop_worker();
+}
+
+
 void bonsai_dedisperser::_deallocate()
 {
     // If dedisperser is already deallocated, this no-ops.
     this->dedisperser->deallocate();
+
+    this->async_intensity = vector<float> ();
+    this->async_weights = vector<float> ();
 }
 
 
@@ -156,6 +329,7 @@ Json::Value bonsai_dedisperser::jsonize() const
 
     ret["class_name"] = "bonsai_dedisperser_cpp";
     ret["config_filename"] = dedisperser->config.name;
+    ret["nbuf_async"] = Json::Int64(nbuf_async);
 
     // FIXME the next code block will become bonsai::dedisperser::initializer::jsonize(),
     // as soon as bonsai gets jsoncpp as an (optional?) dependency.
@@ -189,10 +363,11 @@ shared_ptr<bonsai_dedisperser> bonsai_dedisperser::from_json(const Json::Value &
     ini_params.force_unnormalized_triggers = bool_from_json(jini, "force_unnormalized_triggers");
 
     string config_filename = string_from_json(j, "config_filename");
+    ssize_t nbuf_async = j.isMember("nbuf_async") ? ssize_t_from_json(j, "nbuf_async") : 0;
     auto dp = make_shared<bonsai::dedisperser> (config_filename, ini_params);
     
     shared_ptr<bonsai::global_max_tracker> tp;  // empty
-    return make_shared<bonsai_dedisperser> (dp, tp);
+    return make_shared<bonsai_dedisperser> (dp, tp, nbuf_async);
 }
 
 
@@ -231,7 +406,7 @@ shared_ptr<wi_transform> make_bonsai_dedisperser(const std::string &config_filen
 	dedisperser->add_processor(t);
     }
 
-    return make_shared<bonsai_dedisperser> (dedisperser, max_tracker);
+    return make_shared<bonsai_dedisperser> (dedisperser, max_tracker, ini_params.nbuf_async);
 }
 
 
@@ -0,0 +1,228 @@
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+// Philox-4x32-10 (Salmon et al, "Parallel random numbers: as easy as 1, 2, 3", SC 2011).
+//
+// Each call to the Philox block function maps a 128-bit counter to 128 random bits.  We use the
+// counter (j_lo, j_hi, irow, stream), where j = (pos/4), and the key (seed_lo, seed_hi).  Thus each
+// block function call produces the random numbers for 4 consecutive time samples.
+//
+// To help the compiler vectorize, we always evaluate 'nlanes' independent block function calls
+// in lockstep, and write the inner loops over lanes.
+
+static constexpr int nlanes = 16;
+static constexpr int nblock = 4 * nlanes;   // number of samples per call to _philox_lanes()
+
+static constexpr uint32_t philox_M0 = 0xD2511F53;
+static constexpr uint32_t philox_M1 = 0xCD9E8D57;
+static constexpr uint32_t philox_W0 = 0x9E3779B9;
+static constexpr uint32_t philox_W1 = 0xBB67AE85;
+
+
+// Writes out[4*l+w] = (word w of Philox block function at counter j=j0+l) for 0 <= l < nlanes.
+static void _philox_lanes(uint32_t *out, uint64_t seed, uint32_t stream, uint32_t irow, uint64_t j0)
+{
+    const uint32_t key0 = uint32_t(seed);
+    const uint32_t key1 = uint32_t(seed >> 32);
+
+    // Written so that the outer loop over lanes is vectorized.
+    for (int l = 0; l < nlanes; l++) {
+	uint64_t j = j0 + l;
+	uint32_t c0 = uint32_t(j);
+	uint32_t c1 = uint32_t(j >> 32);
+	uint32_t c2 = irow;
+	uint32_t c3 = stream;
+	uint32_t k0 = key0;
+	uint32_t k1 = key1;
+
+	for (int iround = 0; iround < 10; iround++) {
+	    uint64_t p0 = uint64_t(philox_M0) * uint64_t(c0);
+	    uint64_t p1 = uint64_t(philox_M1) * uint64_t(c2);
+	    c0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+	    c2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+	    c1 = uint32_t(p1);
+	    c3 = uint32_t(p0);
+	    k0 += philox_W0;
+	    k1 += philox_W1;
+	}
+
+	out[4*l] = c0;
+	out[4*l+1] = c1;
+	out[4*l+2] = c2;
+	out[4*l+3] = c3;
+    }
+}
+
+
+// Converts a random 32-bit integer to a float in the open interval (0,1).
+// We keep the top 24 bits, which is all that a float can represent.
+inline float _u32_to_open_unit(uint32_t x)
+{
+    return (float(x >> 8) + 0.5f) * (1.0f / 16777216.0f);
+}
+
+
+// Branch-free approximations to log(x), sin(2 pi t), cos(2 pi t), which can be inlined into vectorized loops.
+// (The libm versions are not vectorized by gcc.)  Polynomial coefficients are from cephes, and the
+// approximations are accurate to a few ulp.
+
+// Assumes x > 0 (and not denormal).
+inline float _fast_logf(float x)
+{
+    uint32_t ix;
+    memcpy(&ix, &x, sizeof(ix));
+
+    // Write x = m 2^e, with m in [sqrt(1/2), sqrt(2)).
+    // Adding (1 - sqrt(1/2)) to the mantissa bits before extracting the exponent does the rounding.
+    ix += 0x3f800000 - 0x3f3504f3;
+    float e = float(int32_t(ix >> 23) - 127);
+    ix = (ix & 0x007fffff) + 0x3f3504f3;
+
+    float m;
+    memcpy(&m, &ix, sizeof(m));
+    m -= 1.0f;
+
+    float z = m * m;
+    float y = 7.0376836292e-2f;
+    y = y * m - 1.1514610310e-1f;
+    y = y * m + 1.1676998740e-1f;
+    y = y * m - 1.2420140846e-1f;
+    y = y * m + 1.4249322787e-1f;
+    y = y * m - 1.6668057665e-1f;
+    y = y * m + 2.0000714765e-1f;
+    y = y * m - 2.4999993993e-1f;
+    y = y * m + 3.3333331174e-1f;
+    y *= m * z;
+
+    y += -2.12194440e-4f * e;
+    y += -0.5f * z;
+    return m + y + 0.693359375f * e;
+}
+
+// Assumes 0 <= t < 1.
+inline void _fast_sincos_2pi(float t, float &s, float &c)
+{
+    // Reduce to an angle x in [-pi/4, pi/4], plus a quadrant q.
+    float q = floorf(4.0f * t + 0.5f);
+    float x = (2.0f * (float)M_PI) * (t - 0.25f * q);
+    int iq = int(q) & 3;
+
+    float x2 = x * x;
+    float sx = ((-1.9515295891e-4f * x2 + 8.3321608736e-3f) * x2 - 1.6666654611e-1f) * x2 * x + x;
+    float cx = ((2.443315711809948e-5f * x2 - 1.388731625493765e-3f) * x2 + 4.166664568298827e-2f) * x2 * x2 - 0.5f * x2 + 1.0f;
+
+    // Rotate by q*(pi/2).
+    float s0 = (iq & 1) ? cx : sx;
+    float c0 = (iq & 1) ? sx : cx;
+    s = (iq & 2) ? -s0 : s0;
+    c = ((iq+1) & 2) ? -c0 : c0;
+}
+
+
+// Converts 'nblock' random integers to Gaussian random numbers, using the Box-Muller transform
+// on consecutive pairs.
+static void _box_muller(float *out, const uint32_t *in, float rms)
+{
+    float g0[nblock/2], g1[nblock/2];
+
+    for (int k = 0; k < nblock/2; k++) {
+	float u1 = _u32_to_open_unit(in[2*k]);
+	float u2 = float(in[2*k+1] >> 8) * (1.0f / 16777216.0f);   // [0,1) is okay here
+	float r = rms * sqrtf(-2.0f * _fast_logf(u1));
+	float s, c;
+
+	_fast_sincos_2pi(u2, s, c);
+	g0[k] = r * c;
+	g1[k] = r * s;
+    }
+
+    for (int k = 0; k < nblock/2; k++) {
+	out[2*k] = g0[k];
+	out[2*k+1] = g1[k];
+    }
+}
+
+
+static void _uniform(float *out, const uint32_t *in, float lo, float hi)
+{
+    const float scale = (hi - lo) * (1.0f / 16777216.0f);
+
+    for (int k = 0; k < nblock; k++)
+	out[k] = lo + scale * float(in[k] >> 8);
+}
+
+
+// Helper for fill_gaussian() and fill_uniform(): loops over blocks of 'nblock' samples which overlap
+// the range [pos, pos+n), calls 'transform' to convert raw random bits to floats, and copies the
+// overlapping part to 'out'.
+template<typename F>
+static void _fill(float *out, ssize_t n, ssize_t irow, ssize_t pos, uint64_t seed, uint32_t stream, const F &transform)
+{
+    rf_assert(n >= 0);
+    rf_assert(irow >= 0);
+    rf_assert(pos >= 0);
+
+    uint32_t raw[nblock];
+    float buf[nblock];
+
+    // Start of first Philox block, rounded down so that every sample has a fixed place in the counter space.
+    ssize_t s0 = (pos / 4) * 4;
+
+    for (ssize_t s = s0; s < pos+n; s += nblock) {
+	_philox_lanes(raw, seed, stream, uint32_t(irow), uint64_t(s/4));
+
+	ssize_t lo = max(s, pos);
+	ssize_t hi = min(s + nblock, pos + n);
+
+	if ((lo == s) && (hi == s + nblock)) {
+	    // Fast path: block is entirely contained in the output range.
+	    transform(out + (s-pos), raw);
+	    continue;
+	}
+
+	transform(buf, raw);
+	memcpy(out + (lo-pos), buf + (lo-s), (hi-lo) * sizeof(float));
+    }
+}
+
+
+counter_rng::counter_rng(uint64_t seed_, uint32_t stream_) :
+    seed(seed_), stream(stream_)
+{ }
+
+
+void counter_rng::fill_gaussian(float *out, ssize_t n, ssize_t irow, ssize_t pos, float rms) const
+{
+    _fill(out, n, irow, pos, seed, stream, [rms](float *dst, const uint32_t *src) { _box_muller(dst, src, rms); });
+}
+
+
+void counter_rng::fill_uniform(float *out, ssize_t n, ssize_t irow, ssize_t pos, float lo, float hi) const
+{
+    _fill(out, n, irow, pos, seed, stream, [lo,hi](float *dst, const uint32_t *src) { _uniform(dst, src, lo, hi); });
+}
+
+
+// static member function
+ssize_t counter_rng::random_seed()
+{
+    std::random_device rd;
+
+    for (;;) {
+	uint64_t s0 = rd();
+	uint64_t s1 = rd();
+	ssize_t ret = ((s0 << 32) ^ s1) >> 1;
+	if (ret > 0)
+	    return ret;
+    }
+}
+
+
+}  // namespace rf_pipelines
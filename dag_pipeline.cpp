@@ -0,0 +1,501 @@
+// dag_pipeline: a container whose elements form a directed acyclic graph (see rf_pipelines_inventory.hpp).
+//
+// Each element j declares a list of bufnames.  Element j depends on an earlier element i if they
+// declare a common bufname (after removing dependencies which are implied transitively).
+//
+// Bookkeeping in _bind() and _advance() is a generalization of pipeline::_bind() and pipeline::_advance().
+// In a pipeline, element j receives its input from element (j-1), i.e. its pos_hi is the previous element's
+// pos_lo.  In a dag_pipeline, element j's pos_hi is the minimum of pos_lo over its dependencies, rounded down
+// to a multiple of its nt_chunk_in (which is the lcm of the nt_chunk_out values of its dependencies).
+//
+// We keep track of gap[j], an upper bound on (pos_hi - elements[j]->pos_hi), where pos_hi is the pos_hi of
+// the dag_pipeline.  In a pipeline, this would be the sum of nt_maxgap over previous elements.  Here, it is
+// the max over dependencies k of (gap[k] + elements[k]->nt_maxgap), plus nt_chunk_in if the rounding step
+// above can lose samples (i.e. if there is more than one dependency).
+//
+// Scheduling: in each call to _advance(), every element is advanced exactly once.  Element j can be advanced
+// as soon as all of its dependencies have been advanced.  If nthreads > 1, this is done by a pool of worker
+// threads (started in _start_pipeline()), together with the calling thread.  Since elements without a
+// dependency path between them don't share ring_buffers (this is checked in _bind()), no further
+// synchronization is needed.
+//
+// If an exception is thrown by an element, the rest of the round is still "completed" (in the sense that
+// the remaining elements are marked done, without being advanced), and the exception is rethrown in the
+// calling thread.  This ensures that no worker thread is still running an element when control returns
+// to pipeline_object::run().
+
+#include "rf_pipelines_internals.hpp"
+#include "rf_pipelines_inventory.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}  // namespace rf_pipelines
+#endif
+
+
+dag_pipeline::dag_pipeline(const vector<shared_ptr<pipeline_object>> &elements_, const vector<vector<string>> &bufnames_, ssize_t nthreads_, const string &name_) :
+    pipeline_object("dag_pipeline", name_),
+    elements(elements_),
+    bufnames(bufnames_),
+    nthreads(nthreads_)
+{
+    int n = elements.size();
+
+    if (n == 0)
+	_throw("dag_pipeline is empty (length-zero)");
+    if (bufnames.size() != elements.size())
+	_throw("expected 'elements' and 'bufnames' to have the same length");
+    if (nthreads < 0)
+	_throw("expected nthreads >= 0");
+
+    for (const auto &p: elements)
+	if (p.get() == nullptr)
+	    _throw("null pointer in dag_pipeline constructor");
+
+    // Direct dependencies (before transitive reduction).
+    vector<vector<int>> d(n);
+    unordered_map<string,int> last_user;
+
+    for (int j = 0; j < n; j++) {
+	for (const string &s: bufnames[j]) {
+	    if (s.size() == 0)
+		_throw("empty bufname in dag_pipeline constructor");
+
+	    auto it = last_user.find(s);
+	    if ((it != last_user.end()) && (it->second != j))
+		d[j].push_back(it->second);
+
+	    last_user[s] = j;
+	}
+
+	// Note: it suffices to depend on the most recent user of each bufname, since it depends on earlier users.
+	std::sort(d[j].begin(), d[j].end());
+	d[j].erase(std::unique(d[j].begin(), d[j].end()), d[j].end());
+    }
+
+    this->ancestors.assign(n, vector<bool> (n, false));
+
+    for (int j = 0; j < n; j++) {
+	for (int k: d[j]) {
+	    ancestors[j][k] = true;
+	    for (int i = 0; i < k; i++)
+		if (ancestors[k][i])
+		    ancestors[j][i] = true;
+	}
+    }
+
+    // Transitive reduction: drop dependency k if it is an ancestor of another dependency of j.
+    this->deps.resize(n);
+    this->dependents.resize(n);
+
+    for (int j = 0; j < n; j++) {
+	for (int k: d[j]) {
+	    bool redundant = false;
+	    for (int k2: d[j])
+		if ((k2 != k) && ancestors[k2][k])
+		    redundant = true;
+
+	    if (!redundant) {
+		deps[j].push_back(k);
+		dependents[k].push_back(j);
+	    }
+	}
+    }
+
+    for (int j = 0; j < n; j++)
+	if (dependents[j].size() == 0)
+	    sinks.push_back(j);
+}
+
+
+dag_pipeline::~dag_pipeline()
+{
+    _stop_workers();
+}
+
+
+void dag_pipeline::_bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
+{
+    int n = elements.size();
+    vector<ssize_t> gap(n, 0);
+
+    for (int j = 0; j < n; j++) {
+	ssize_t nt_chunk_j = nt_chunk_in;
+
+	if (deps[j].size() > 0) {
+	    nt_chunk_j = elements[deps[j][0]]->nt_chunk_out;
+	    for (int k: deps[j]) {
+		nt_chunk_j = lcm(nt_chunk_j, elements[k]->nt_chunk_out);
+		gap[j] = max(gap[j], gap[k] + elements[k]->nt_maxgap);
+	    }
+	}
+
+	if (deps[j].size() > 1)
+	    gap[j] += nt_chunk_j;
+
+	run_params params = this->get_params();
+	params.container_depth++;
+	params.container_index = j;
+
+	elements[j]->bind(params, rb_dict, nt_chunk_j, nt_maxlag + gap[j], json_attrs, this->out_mp);
+    }
+
+    this->nt_chunk_out = elements[sinks[0]]->nt_chunk_out;
+    this->nt_maxgap = 0;
+    this->nt_contig = 1;
+
+    for (int j: sinks) {
+	nt_chunk_out = lcm(nt_chunk_out, elements[j]->nt_chunk_out);
+	nt_maxgap = max(nt_maxgap, gap[j] + elements[j]->nt_maxgap);
+    }
+
+    if (sinks.size() > 1)
+	nt_maxgap += nt_chunk_out;
+
+    // Check that elements which share a ring_buffer are ordered by the dependency graph.
+    // A missing bufname would otherwise be a race condition between worker threads.
+    // Ring buffers are keyed by their cow_root(), since a copy-on-write child can alias its parent.
+
+    unordered_map<const ring_buffer *, pair<int,string>> last_user;   // (element index, bufname)
+
+    for (int j = 0; j < n; j++) {
+	unordered_map<const ring_buffer *, string> rbs;
+
+	auto f = [&rbs](const shared_ptr<pipeline_object> &p, int depth) {
+	    for (const auto &rb: p->all_ring_buffers)
+		rbs[rb->cow_root()] = rb->name;
+	};
+
+	visit_pipeline(f, elements[j]);
+
+	for (const auto &r: rbs) {
+	    auto it = last_user.find(r.first);
+
+	    if ((it != last_user.end()) && !ancestors[j][it->second.first]) {
+		int i = it->second.first;
+		string s = (it->second.second == r.second) ? ("ring buffer '" + r.second + "'")
+		    : ("ring buffers '" + it->second.second + "' and '" + r.second + "' (which share storage)");
+
+		_throw("elements " + to_string(i) + " (" + elements[i]->name + ") and " + to_string(j) + " (" + elements[j]->name
+		       + ") both use " + s + ", but don't depend on each other (maybe a bufname is missing?)");
+	    }
+
+	    last_user[r.first] = { j, r.second };
+	}
+    }
+}
+
+
+// Advances element j.  Caller must ensure that all dependencies of j have already been advanced in this round.
+ssize_t dag_pipeline::_run_element(int j)
+{
+    auto p = elements[j];
+    ssize_t pos_hi_j = pos_hi;
+
+    if (deps[j].size() > 0) {
+	pos_hi_j = SSIZE_MAX;
+	for (int k: deps[j])
+	    pos_hi_j = min(pos_hi_j, elements[k]->pos_lo.load());
+	pos_hi_j -= (pos_hi_j % p->nt_chunk_in);
+    }
+
+    ssize_t m = p->pos_lo;  // only needed for debug print
+    ssize_t ret = p->advance(pos_hi_j, pos_max);
+
+    if (_params.noisy())
+	p->_print("advance " + to_string(m) + " -> " + to_string(p->pos_lo));
+
+    return ret;
+}
+
+
+// Called with lock held, and removes one element from the 'ready' queue.
+void dag_pipeline::_advance_element(unique_lock<mutex> &l)
+{
+    int j = ready.back();
+    ready.pop_back();
+
+    // If an exception has been thrown, then subsequent elements are skipped (but still marked done).
+    bool skip = (round_error != nullptr);
+    ssize_t ret = SSIZE_MAX;
+    std::exception_ptr err;
+
+    l.unlock();
+
+    if (!skip) {
+	try {
+	    ret = _run_element(j);
+	} catch (...) {
+	    err = std::current_exception();
+	}
+    }
+
+    l.lock();
+
+    round_ret = min(round_ret, ret);
+    if (err && !round_error)
+	round_error = err;
+
+    for (int s: dependents[j])
+	if (--npending[s] == 0)
+	    ready.push_back(s);
+
+    nremaining--;
+    cv.notify_all();
+}
+
+
+void dag_pipeline::_worker_main()
+{
+    unique_lock<mutex> l(lock);
+
+    for (;;) {
+	while (!workers_done && ready.empty())
+	    cv.wait(l);
+
+	if (workers_done)
+	    return;
+
+	_advance_element(l);
+    }
+}
+
+
+void dag_pipeline::_stop_workers()
+{
+    if (workers.size() == 0)
+	return;
+
+    unique_lock<mutex> l(lock);
+    workers_done = true;
+    cv.notify_all();
+    l.unlock();
+
+    for (auto &t: workers)
+	t.join();
+
+    workers.clear();
+}
+
+
+ssize_t dag_pipeline::_advance()
+{
+    int n = elements.size();
+    ssize_t ret = SSIZE_MAX;
+
+    if (workers.size() == 0) {
+	for (int j = 0; j < n; j++)
+	    ret = min(ret, _run_element(j));
+    }
+    else {
+	unique_lock<mutex> l(lock);
+
+	// Roots are pushed in reverse order, so that they are popped in list order.
+	ready.clear();
+	for (int j = n-1; j >= 0; j--)
+	    if (deps[j].size() == 0)
+		ready.push_back(j);
+
+	for (int j = 0; j < n; j++)
+	    npending[j] = deps[j].size();
+
+	nremaining = n;
+	round_ret = SSIZE_MAX;
+	round_error = nullptr;
+	cv.notify_all();
+
+	// The calling thread also runs elements.
+	while (nremaining > 0) {
+	    if (ready.size() > 0)
+		_advance_element(l);
+	    else
+		cv.wait(l);
+	}
+
+	ret = round_ret;
+
+	if (round_error) {
+	    std::exception_ptr e = round_error;
+	    round_error = nullptr;
+	    std::rethrow_exception(e);
+	}
+    }
+
+    ssize_t pos = SSIZE_MAX;
+    for (int j: sinks)
+	pos = min(pos, elements[j]->pos_lo.load());
+
+    this->pos_lo = pos - (pos % nt_chunk_out);
+    return ret;
+}
+
+
+ssize_t dag_pipeline::get_preferred_chunk_size()
+{
+    return elements[0]->get_preferred_chunk_size();
+}
+
+
+Json::Value dag_pipeline::jsonize() const
+{
+    Json::Value ret;
+    ret["class_name"] = "dag_pipeline";
+    ret["name"] = name;
+    ret["nthreads"] = Json::Int64(nthreads);
+
+    for (size_t i = 0; i < elements.size(); i++)
+	ret["elements"].append(elements[i]->jsonize());
+
+    for (size_t i = 0; i < bufnames.size(); i++) {
+	Json::Value jb(Json::arrayValue);
+	for (const string &s: bufnames[i])
+	    jb.append(s);
+	ret["bufnames"].append(jb);
+    }
+
+    return ret;
+}
+
+
+shared_ptr<dag_pipeline> dag_pipeline::from_json(const Json::Value &x)
+{
+    if (string_from_json(x,"class_name") != "dag_pipeline")
+	throw runtime_error("rf_pipelines: expected class_name=\"dag_pipeline\" in dag_pipeline json constructor");
+
+    string name = string_from_json(x, "name");
+    ssize_t nthreads = ssize_t_from_json(x, "nthreads");
+
+    vector<shared_ptr<pipeline_object>> elements;
+    for (const auto &s: array_from_json(x, "elements"))
+	elements.push_back(pipeline_object::from_json(s));
+
+    vector<vector<string>> bufnames;
+    for (const auto &jb: array_from_json(x, "bufnames")) {
+	if (!jb.isArray())
+	    throw runtime_error("dag_pipeline::from_json: expected each element of 'bufnames' array to be an array of strings");
+
+	bufnames.push_back(vector<string> ());
+	for (const auto &s: jb) {
+	    if (!s.isString())
+		throw runtime_error("dag_pipeline::from_json: expected each element of 'bufnames' array to be an array of strings");
+	    bufnames.back().push_back(s.asString());
+	}
+    }
+
+    return make_shared<dag_pipeline> (elements, bufnames, nthreads, name);
+}
+
+
+void dag_pipeline::_allocate()
+{
+    for (auto &p: this->elements)
+	p->allocate();
+}
+
+void dag_pipeline::_deallocate()
+{
+    for (auto &p: this->elements)
+	p->deallocate();
+}
+
+void dag_pipeline::_start_pipeline(Json::Value &json_attrs)
+{
+    for (auto &p: this->elements)
+	p->start_pipeline(json_attrs);
+
+    // Total number of threads, including the caller.
+    ssize_t nt = nthreads ? nthreads : ssize_t(sinks.size());
+    nt = min(nt, ssize_t(elements.size()));
+
+    rf_assert(workers.size() == 0);
+    this->npending.assign(elements.size(), 0);
+    this->ready.clear();
+    this->workers_done = false;
+
+    for (ssize_t i = 1; i < nt; i++)
+	workers.push_back(std::thread(&dag_pipeline::_worker_main, this));
+}
+
+void dag_pipeline::_end_pipeline(Json::Value &json_output)
+{
+    _stop_workers();
+
+    // As in pipeline::_end_pipeline(), later elements are ended even if an earlier one throws.
+    std::exception_ptr err;
+
+    for (int i = 0; i < (int)elements.size(); i++) {
+	json_output["pipeline"].append(Json::Value(Json::objectValue));
+
+	try {
+	    elements[i]->end_pipeline(json_output["pipeline"][i]);
+	} catch (...) {
+	    if (!err)
+		err = std::current_exception();
+	}
+    }
+
+    if (err)
+	std::rethrow_exception(err);
+}
+
+void dag_pipeline::_reset()
+{
+    _stop_workers();
+
+    for (auto &p: this->elements)
+	p->reset();
+}
+
+void dag_pipeline::_unbind()
+{
+    _stop_workers();
+
+    for (auto &p: this->elements)
+	p->unbind();
+}
+
+void dag_pipeline::_get_info(Json::Value &j)
+{
+    j["pipeline"] = Json::Value(Json::arrayValue);
+    j["deps"] = Json::Value(Json::arrayValue);
+    double mb_cumul = 0.0;
+
+    for (size_t i = 0; i < elements.size(); i++) {
+	Json::Value jr = elements[i]->get_info();
+	double mb = double_from_json(jr, "mb_cumul");
+
+	Json::Value jd(Json::arrayValue);
+	for (int k: deps[i])
+	    jd.append(k);
+
+	j["pipeline"].append(jr);
+	j["deps"].append(jd);
+	mb_cumul += mb;
+    }
+
+    j["mb_cumul"] = mb_cumul;
+}
+
+
+void dag_pipeline::_visit_pipeline(std::function<void(const std::shared_ptr<pipeline_object>&,int)> f, const std::shared_ptr<pipeline_object> &self, int depth)
+{
+    rf_assert(self.get() == this);
+    f(self, depth);
+
+    for (auto &p: this->elements)
+	visit_pipeline(f, p, depth+1);
+}
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("dag_pipeline", dag_pipeline::from_json);
+	}
+    } init;
+}
+
+
+}  // namespace rf_pipelines
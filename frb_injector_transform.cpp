@@ -0,0 +1,329 @@
+// C++ version of the python frb_injector_transform (rf_pipelines/transforms/frb_injector_transform.py).
+//
+// From python, the two versions are constructed as 'frb_injector_transform' and 'frb_injector_transform_cpp'.
+// In the pipeline json output, they are represented as 'frb_injector_transform' and 'frb_injector_transform_cpp'.
+//
+// The python version calls simpulse in every chunk.  Here, the pulse profile in each frequency channel
+// is computed once in _bind_transform(), and stored sparsely (each channel only stores the time samples
+// which the pulse overlaps).  Then _process_chunk() just adds the overlapping part of each profile.
+
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+struct frb_injector_transform : public wi_transform
+{
+    // Constructor arguments.
+    const double snr;
+    const double undispersed_arrival_time;
+    const double dm;
+    const vector<double> variance;   // length 1 or nfreq
+    const double intrinsic_width;
+    const double sm;
+    const double spectral_index;
+
+    // Number of "subsamples" per time sample, when computing the profile.
+    static constexpr int nsub = 16;
+
+    // Sparse representation of the pulse, initialized in _bind_transform().
+    // The profile in channel 'ifreq' is prof_data[prof_offset[ifreq]:prof_offset[ifreq+1]], starting at time index prof_it0[ifreq].
+    vector<float> prof_data;
+    vector<ssize_t> prof_offset;   // length (nfreq+1)
+    vector<ssize_t> prof_it0;      // length nfreq
+
+    ssize_t pos_end = 0;           // for the end-of-stream warning in _end_pipeline().
+
+
+    frb_injector_transform(double snr_, double undispersed_arrival_time_, double dm_, const vector<double> &variance_,
+			   double intrinsic_width_, double sm_, double spectral_index_, ssize_t nt_chunk_) :
+	wi_transform("frb_injector_transform_cpp"),
+	snr(snr_),
+	undispersed_arrival_time(undispersed_arrival_time_),
+	dm(dm_),
+	variance(variance_),
+	intrinsic_width(intrinsic_width_),
+	sm(sm_),
+	spectral_index(spectral_index_)
+    {
+	stringstream ss;
+	ss << "frb_injector_transform_cpp(snr=" << snr << ", undispersed_arrival_time=" << undispersed_arrival_time
+	   << ", dm=" << dm << ", intrinsic_width=" << intrinsic_width << ", sm=" << sm
+	   << ", spectral_index=" << spectral_index << ", nt_chunk=" << nt_chunk_ << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+
+	if (snr <= 0.0)
+	    _throw("expected snr > 0");
+	if ((dm < 0.0) || (intrinsic_width < 0.0) || (sm < 0.0))
+	    _throw("expected dm, intrinsic_width, sm >= 0");
+	if (variance.size() == 0)
+	    _throw("'variance' must be a nonempty list");
+
+	for (double v: variance)
+	    if (v < 0.0)
+		_throw("'variance' array has negative elements");
+    }
+
+    virtual ~frb_injector_transform() { }
+
+
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	if (!json_attrs.isMember("freq_lo_MHz") || !json_attrs.isMember("freq_hi_MHz"))
+	    _throw("expected json_attrs to contain members 'freq_lo_MHz' and 'freq_hi_MHz'");
+	if (!json_attrs.isMember("dt_sample"))
+	    _throw("expected json_attrs to contain member 'dt_sample'");
+	if ((variance.size() != 1) && (ssize_t(variance.size()) != nfreq))
+	    _throw("length of 'variance' array (=" + to_string(variance.size()) + ") must be either 1 or nfreq (=" + to_string(nfreq) + ")");
+
+	double freq_lo_MHz = json_attrs["freq_lo_MHz"].asDouble();
+	double freq_hi_MHz = json_attrs["freq_hi_MHz"].asDouble();
+	double dt_sample = json_attrs["dt_sample"].asDouble();
+	double t_initial = json_attrs.isMember("t_initial") ? json_attrs["t_initial"].asDouble() : 0.0;
+
+	// Arrival time at infinite frequency, in samples relative to the start of the stream.
+	double t0 = (undispersed_arrival_time - t_initial) / dt_sample;
+	double df = (freq_hi_MHz - freq_lo_MHz) / nfreq;
+
+	this->prof_data.clear();
+	this->prof_offset.assign(nfreq+1, 0);
+	this->prof_it0.assign(nfreq, 0);
+
+	// Signal-to-noise, for a pulse with unit fluence at freq_hi_MHz, using channel weights (1 or 0),
+	// as in the python version (see comments in frb_injector_transform.py).
+	double snr_num = 0.0;
+	double snr_den = 0.0;
+
+	// Note that rf_pipelines orders frequency channels from highest to lowest.
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    double fhi = freq_hi_MHz - ifreq * df;
+	    double flo = fhi - df;
+	    double fmid = fhi - 0.5 * df;
+
+	    double ta = t0 + dispersion_delay(dm, fhi) / dt_sample;
+	    double tb = t0 + dispersion_delay(dm, flo) / dt_sample;
+	    double sigma = intrinsic_width / dt_sample;
+	    double tau = 1.0e-3 * sm * pow(fmid/1000.0, -4.4) / dt_sample;
+	    double fluence = pow(fmid/freq_hi_MHz, spectral_index);
+
+	    ssize_t it0 = 0;
+	    vector<float> prof = _compute_profile(ta, tb, sigma, tau, it0);
+
+	    double var = (variance.size() == 1) ? variance[0] : variance[ifreq];
+	    double s2 = 0.0;
+
+	    for (float &x: prof) {
+		x *= fluence;
+		s2 += double(x) * double(x);
+	    }
+
+	    if (var > 0.0) {
+		snr_num += s2;
+		snr_den += var * s2;
+	    }
+
+	    prof_it0[ifreq] = it0;
+	    prof_data.insert(prof_data.end(), prof.begin(), prof.end());
+	    prof_offset[ifreq+1] = prof_data.size();
+	}
+
+	if ((snr_num <= 0.0) || (snr_den <= 0.0))
+	    _throw("couldn't compute signal-to-noise of pulse (all variances are zero?)");
+
+	// Rescale the pulse to get the requested signal-to-noise.
+	double normalization = snr / (snr_num / sqrt(snr_den));
+
+	for (float &x: prof_data)
+	    x *= normalization;
+    }
+
+
+    // Returns the profile of a pulse with unit fluence, which is a boxcar on the time interval [ta,tb] (representing
+    // intra-channel dispersion delay), convolved with a Gaussian with rms 'sigma' (representing intrinsic width),
+    // convolved with a one-sided exponential with timescale 'tau' (representing scattering).  All times are in samples.
+    //
+    // The return value is the integral of the profile over each time sample [it0, it0+1, ...].
+    // We integrate exactly over subsamples, before applying the (one-pole IIR) scattering filter.
+
+    static vector<float> _compute_profile(double ta, double tb, double sigma, double tau, ssize_t &it0)
+    {
+	double lo = ta - 6.0 * sigma;
+	double hi = tb + 6.0 * sigma + 12.0 * tau;
+
+	it0 = ssize_t(floor(lo));
+	ssize_t nt = ssize_t(ceil(hi)) - it0 + 1;
+	ssize_t nfine = nt * nsub;
+
+	// Cumulative profile (before scattering), as a function of time t.
+	auto cumulative = [ta,tb,sigma](double t) -> double
+	{
+	    if (sigma <= 0.0) {
+		if (tb - ta < 1.0e-6)
+		    return (t >= ta) ? 1.0 : 0.0;
+		return min(max((t-ta)/(tb-ta), 0.0), 1.0);
+	    }
+
+	    if (tb - ta < 1.0e-6 * sigma)
+		return 0.5 * erfc(-(t-ta) / (M_SQRT2 * sigma));
+
+	    // The antiderivative of Phi(x) is psi(x) = x Phi(x) + phi(x).
+	    auto psi = [](double x) { return 0.5 * x * erfc(-x/M_SQRT2) + exp(-0.5*x*x) / sqrt(2*M_PI); };
+	    return sigma * (psi((t-ta)/sigma) - psi((t-tb)/sigma)) / (tb-ta);
+	};
+
+	vector<double> fine(nfine);
+	double c0 = cumulative(it0);
+
+	for (ssize_t i = 0; i < nfine; i++) {
+	    double c1 = cumulative(it0 + double(i+1) / nsub);
+	    fine[i] = c1 - c0;
+	    c0 = c1;
+	}
+
+	if (tau * nsub > 1.0e-3) {
+	    double a = exp(-1.0 / (tau * nsub));
+	    double y = 0.0;
+	    for (ssize_t i = 0; i < nfine; i++)
+		fine[i] = y = a*y + (1-a) * fine[i];
+	}
+
+	vector<float> ret(nt, 0.0);
+	for (ssize_t i = 0; i < nfine; i++)
+	    ret[i/nsub] += fine[i];
+
+	// Trim negligible samples at the ends.
+	float thresh = 1.0e-7 * *max_element(ret.begin(), ret.end());
+	ssize_t i0 = 0;
+	ssize_t i1 = nt;
+
+	while ((i0 < i1) && (ret[i0] <= thresh))
+	    i0++;
+	while ((i1 > i0) && (ret[i1-1] <= thresh))
+	    i1--;
+
+	it0 += i0;
+	return vector<float> (ret.begin() + i0, ret.begin() + i1);
+    }
+
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    ssize_t n = prof_offset[ifreq+1] - prof_offset[ifreq];
+	    ssize_t it0 = prof_it0[ifreq];
+	    ssize_t lo = max(it0, pos);
+	    ssize_t hi = min(it0 + n, pos + nt_chunk);
+
+	    if (lo >= hi)
+		continue;
+
+	    const float *src = &prof_data[prof_offset[ifreq]] + (lo - it0);
+	    float *dst = intensity + ifreq*istride + (lo - pos);
+
+	    for (ssize_t i = 0; i < hi-lo; i++)
+		dst[i] += src[i];
+	}
+
+	this->pos_end = pos + nt_chunk;
+    }
+
+
+    virtual void _end_pipeline(Json::Value &json_output) override
+    {
+	// We print warning if the pulse isn't entirely contained in the stream,
+	// since this is probably unintentional.
+	double tot = 0.0;
+	double missing = 0.0;
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    for (ssize_t i = prof_offset[ifreq]; i < prof_offset[ifreq+1]; i++) {
+		ssize_t it = prof_it0[ifreq] + (i - prof_offset[ifreq]);
+		tot += prof_data[i];
+		if ((it < 0) || (it >= pos_end))
+		    missing += prof_data[i];
+	    }
+	}
+
+	if ((tot > 0.0) && (missing > 1.0e-3 * tot))
+	    cerr << "frb_injector_transform_cpp: warning: " << (100. * missing / tot) << " percent of pulse was outside stream endpoints\n";
+    }
+
+
+    virtual void _unbind_transform() override
+    {
+	this->prof_data = vector<float> ();
+	this->prof_offset = vector<ssize_t> ();
+	this->prof_it0 = vector<ssize_t> ();
+	this->pos_end = 0;
+    }
+
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "frb_injector_transform_cpp";
+	ret["snr"] = snr;
+	ret["undispersed_arrival_time"] = undispersed_arrival_time;
+	ret["dm"] = dm;
+	ret["intrinsic_width"] = intrinsic_width;
+	ret["sm"] = sm;
+	ret["spectral_index"] = spectral_index;
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+
+	for (double v: variance)
+	    ret["variance"].append(v);
+
+	return ret;
+    }
+
+    static shared_ptr<frb_injector_transform> from_json(const Json::Value &j)
+    {
+	double snr = double_from_json(j, "snr");
+	double undispersed_arrival_time = double_from_json(j, "undispersed_arrival_time");
+	double dm = double_from_json(j, "dm");
+	double intrinsic_width = double_from_json(j, "intrinsic_width");
+	double sm = double_from_json(j, "sm");
+	double spectral_index = double_from_json(j, "spectral_index");
+	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
+
+	// As in the python version, 'variance' can be either a scalar or a list.
+	vector<double> variance;
+	if (j.isMember("variance") && j["variance"].isNumeric())
+	    variance.push_back(double_from_json(j, "variance"));
+	else {
+	    Json::Value a = array_from_json(j, "variance");
+	    for (const Json::Value &v: a)
+		variance.push_back(v.asDouble());
+	}
+
+	return make_shared<frb_injector_transform> (snr, undispersed_arrival_time, dm, variance, intrinsic_width, sm, spectral_index, nt_chunk);
+    }
+};
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("frb_injector_transform_cpp", frb_injector_transform::from_json);
+	}
+    } init;
+}
+
+
+// Externally visible
+shared_ptr<wi_transform> make_frb_injector_transform(double snr, double undispersed_arrival_time, double dm, const vector<double> &variance,
+						     double intrinsic_width, double sm, double spectral_index, ssize_t nt_chunk)
+{
+    return make_shared<frb_injector_transform> (snr, undispersed_arrival_time, dm, variance, intrinsic_width, sm, spectral_index, nt_chunk);
+}
+
+
+}  // namespace rf_pipelines
@@ -1,4 +1,4 @@
-#include <random>
+#include <thread>
 #include "rf_pipelines_internals.hpp"
 
 using namespace std;
@@ -18,12 +18,17 @@ protected:
     const double dt_sample;
     const double sample_rms;
     const bool randomize_weights;
+    const ssize_t seed;
+    const int nthreads;
 
-    std::mt19937 rng;
-    std::normal_distribution<float> gdist;
+    // The random number at (ifreq, pos) is a pure function of (seed, ifreq, pos), so the stream
+    // output is deterministic, independent of nt_chunk and nthreads, and can be filled in parallel.
+    const counter_rng intensity_rng;
+    const counter_rng weight_rng;
 
 public:
-    gaussian_noise_stream(ssize_t nfreq_, ssize_t nt_tot_, double freq_lo_MHz_, double freq_hi_MHz_, double dt_sample_, double sample_rms_, ssize_t nt_chunk_, bool randomize_weights_) :
+    // If seed=0, a random (positive) seed is chosen (and recorded in jsonize(), so that the run can be reproduced).
+    gaussian_noise_stream(ssize_t nfreq_, ssize_t nt_tot_, double freq_lo_MHz_, double freq_hi_MHz_, double dt_sample_, double sample_rms_, ssize_t nt_chunk_, bool randomize_weights_, ssize_t seed_, int nthreads_) :
 	wi_stream("gaussian_noise_stream"),
 	nt_tot(nt_tot_),
 	freq_lo_MHz(freq_lo_MHz_),
@@ -31,8 +36,10 @@ public:
 	dt_sample(dt_sample_),
 	sample_rms(sample_rms_),
 	randomize_weights(randomize_weights_),
-	rng(std::random_device{}()),
-	gdist(0, sample_rms_)
+	seed(seed_ ? seed_ : counter_rng::random_seed()),
+	nthreads(nthreads_),
+	intensity_rng(seed, 0),
+	weight_rng(seed, 1)
     {
 	this->nfreq = nfreq_;
 	this->nt_chunk = nt_chunk_;
@@ -45,13 +52,12 @@ public:
 	rf_assert(dt_sample > 0.0);
 	rf_assert(sample_rms >= 0.0);
 	rf_assert(nt_chunk >= 0);
+	rf_assert(seed > 0);
+	rf_assert(nthreads > 0);
 
 	// Default nt_chunk
 	if (nt_chunk == 0)
 	    nt_chunk = 1024;
-
-	// Improved RNG seeding.
-	rng.discard(700000);
     }
 
     virtual ~gaussian_noise_stream() { }
@@ -71,11 +77,20 @@ public:
 	nt = max(nt, ssize_t(0));
 
 	// Fill the intensity array with Gaussian random numbers, and initialize the weights to 1.
-	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
-	    for (ssize_t it = 0; it < nt; it++) {
-		intensity[ifreq*istride + it] = gdist(rng);
-		weights[ifreq*wstride + it] = randomize_weights ? std::uniform_real_distribution<>()(rng) : 1.0;
+	// Frequency channels are divided evenly between threads.
+	int nth = min(ssize_t(nthreads), nfreq);
+
+	if (nth <= 1)
+	    _fill_rows(intensity, istride, weights, wstride, pos, nt, 0, nfreq);
+	else {
+	    vector<std::thread> threads;
+	    for (int ith = 0; ith < nth; ith++) {
+		ssize_t f0 = (ith * nfreq) / nth;
+		ssize_t f1 = ((ith+1) * nfreq) / nth;
+		threads.push_back(std::thread(&gaussian_noise_stream::_fill_rows, this, intensity, istride, weights, wstride, pos, nt, f0, f1));
 	    }
+	    for (auto &t: threads)
+		t.join();
 	}
 
 	// The return value from _fill_stream() should be 'true' normally, or 'false' if end-of-stream has been reached.
@@ -90,6 +105,22 @@ public:
 	return false;
     }
 
+    // Fills frequency channels [f0,f1) with 'nt' samples.  Thread-safe, since the RNGs are stateless.
+    void _fill_rows(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos, ssize_t nt, ssize_t f0, ssize_t f1) const
+    {
+	for (ssize_t ifreq = f0; ifreq < f1; ifreq++) {
+	    intensity_rng.fill_gaussian(intensity + ifreq*istride, nt, ifreq, pos, sample_rms);
+
+	    if (randomize_weights)
+		weight_rng.fill_uniform(weights + ifreq*wstride, nt, ifreq, pos);
+	    else {
+		float *w = weights + ifreq*wstride;
+		for (ssize_t it = 0; it < nt; it++)
+		    w[it] = 1.0;
+	    }
+	}
+    }
+
     virtual Json::Value jsonize() const override
     {
 	Json::Value ret;
@@ -103,6 +134,8 @@ public:
 	ret["sample_rms"] = sample_rms;
 	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
 	ret["randomize_weights"] = randomize_weights;
+	ret["seed"] = Json::Int64(seed);
+	ret["nthreads"] = nthreads;
 
 	return ret;
     }
@@ -118,7 +151,11 @@ public:
 	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
 	bool randomize_weights = bool_from_json(j, "randomize_weights");
 
-	return make_shared<gaussian_noise_stream> (nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, sample_rms, nt_chunk, randomize_weights);
+	// 'seed' and 'nthreads' are optional, for compatibility with json files written by older versions.
+	ssize_t seed = j.isMember("seed") ? ssize_t_from_json(j, "seed") : 0;
+	int nthreads = j.isMember("nthreads") ? int_from_json(j, "nthreads") : 1;
+
+	return make_shared<gaussian_noise_stream> (nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, sample_rms, nt_chunk, randomize_weights, seed, nthreads);
     }
 };
 
@@ -137,9 +174,9 @@ namespace {
 // source file to avoid overpopulating rf_pipelines.hpp with definitions of many classes, but
 // this is just a preference!)
 
-shared_ptr<wi_stream> make_gaussian_noise_stream(ssize_t nfreq, ssize_t nt_tot, double freq_lo_MHz, double freq_hi_MHz, double dt_sample, double sample_rms, ssize_t nt_chunk, bool randomize_weights)
+shared_ptr<wi_stream> make_gaussian_noise_stream(ssize_t nfreq, ssize_t nt_tot, double freq_lo_MHz, double freq_hi_MHz, double dt_sample, double sample_rms, ssize_t nt_chunk, bool randomize_weights, ssize_t seed, int nthreads)
 {
-    return make_shared<gaussian_noise_stream> (nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, sample_rms, nt_chunk, randomize_weights);
+    return make_shared<gaussian_noise_stream> (nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, sample_rms, nt_chunk, randomize_weights, seed, nthreads);
 }
 
 
@@ -0,0 +1,137 @@
+#include "rf_pipelines_internals.hpp"
+
+#ifdef HAVE_HDF5
+#include <H5Cpp.h>
+#endif
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}  // emacs pacifier
+#endif
+
+
+hdf5_writer_thread::~hdf5_writer_thread()
+{
+    // Only reached with the thread still running if the owner was destroyed in the middle of a run.
+    join();
+}
+
+
+void hdf5_writer_thread::start()
+{
+    if (thread.joinable())
+	throw runtime_error("rf_pipelines::hdf5_writer_thread::start() called twice without stop() or join()");
+
+    this->queue.clear();
+    this->done = false;
+    this->has_failed = false;
+    this->error = nullptr;
+    this->thread = std::thread(&hdf5_writer_thread::_thread_main, this);
+}
+
+
+void hdf5_writer_thread::push(const std::function<void()> &job)
+{
+    lock_guard<mutex> l(lock);
+
+    if (has_failed) {
+	_rethrow_error();
+	return;
+    }
+
+    queue.push_back(job);
+    cv.notify_all();
+}
+
+
+void hdf5_writer_thread::stop(const std::function<void()> &last_job)
+{
+    unique_lock<mutex> l(lock);
+
+    if (!has_failed && last_job)
+	queue.push_back(last_job);
+
+    l.unlock();
+    join();
+
+    l.lock();
+    _rethrow_error();
+}
+
+
+void hdf5_writer_thread::join()
+{
+    if (!thread.joinable())
+	return;
+
+    unique_lock<mutex> l(lock);
+    done = true;
+    cv.notify_all();
+    l.unlock();
+
+    thread.join();
+}
+
+
+bool hdf5_writer_thread::failed()
+{
+    lock_guard<mutex> l(lock);
+    return has_failed;
+}
+
+
+void hdf5_writer_thread::_thread_main()
+{
+    for (;;) {
+	unique_lock<mutex> l(lock);
+	while (queue.empty() && !done)
+	    cv.wait(l);
+
+	if (queue.empty())
+	    return;
+
+	std::function<void()> job = std::move(queue.front());
+	queue.pop_front();
+	l.unlock();
+
+	std::exception_ptr e;
+
+	try {
+	    job();
+	}
+#ifdef HAVE_HDF5
+	catch (H5::Exception &h5e) {
+	    e = std::make_exception_ptr(runtime_error("HDF5 error in " + h5e.getFuncName() + ": " + h5e.getDetailMsg()));
+	}
+#endif
+	catch (...) {
+	    e = std::current_exception();
+	}
+
+	if (e) {
+	    // Saved for the main thread, which will rethrow.  Remaining jobs are discarded.
+	    l.lock();
+	    this->error = e;
+	    this->has_failed = true;
+	    this->queue.clear();
+	    return;
+	}
+    }
+}
+
+
+// Caller must hold the lock.  The error is only rethrown once.
+void hdf5_writer_thread::_rethrow_error()
+{
+    if (!error)
+	return;
+
+    std::exception_ptr e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+}
+
+
+}  // namespace rf_pipelines
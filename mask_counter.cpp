@@ -8,6 +8,17 @@
 namespace ch_frb_io { class assembled_chunk; }
 #endif
 
+#ifdef HAVE_HDF5
+#include <sp_hdf5.hpp>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RF_MC_X86 1
+#else
+#define RF_MC_X86 0
+#endif
+
 using namespace std;
 
 namespace rf_pipelines {
@@ -16,12 +27,277 @@ namespace rf_pipelines {
 #endif
 
 
-mask_counter_transform::mask_counter_transform(int nt_chunk_, string where_) :
+#ifdef HAVE_HDF5
+
+// -------------------------------------------------------------------------------------------------
+//
+// Counting kernels: returns the number of nonzero (i.e. unmasked) weights in w[0:n].
+//
+// As in bitmask_maker.cpp, the kernel is selected at runtime based on the CPU, and each SIMD
+// kernel falls through to the scalar kernel for the remainder.  The SIMD kernels compare 4 or 8
+// weights at a time, and popcount the resulting movemask.
+
+
+static ssize_t _count_nonzero_scalar(const float *w, ssize_t n, ssize_t k0=0)
+{
+    ssize_t ret = 0;
+    for (ssize_t k = k0; k < n; k++)
+	ret += (w[k] != 0.0f) ? 1 : 0;
+    return ret;
+}
+
+
+#if RF_MC_X86
+
+__attribute__((target("sse2")))
+static ssize_t _count_nonzero_sse2(const float *w, ssize_t n)
+{
+    const __m128 zero = _mm_setzero_ps();
+    ssize_t n4 = n & ~ssize_t(3);
+    ssize_t ret = 0;
+
+    for (ssize_t k = 0; k < n4; k += 4)
+	ret += __builtin_popcount(_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(w+k), zero)));
+
+    return ret + _count_nonzero_scalar(w, n, n4);
+}
+
+
+__attribute__((target("avx2,popcnt")))
+static ssize_t _count_nonzero_avx2(const float *w, ssize_t n)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    ssize_t n8 = n & ~ssize_t(7);
+    ssize_t ret = 0;
+
+    // _CMP_NEQ_UQ treats NaN as nonzero, consistent with the scalar kernel.
+    for (ssize_t k = 0; k < n8; k += 8)
+	ret += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(w+k), zero, _CMP_NEQ_UQ)));
+
+    return ret + _count_nonzero_scalar(w, n, n8);
+}
+
+#endif  // RF_MC_X86
+
+
+using count_nonzero_kernel_t = ssize_t (*)(const float *, ssize_t);
+
+static ssize_t _count_nonzero_scalar_n(const float *w, ssize_t n)
+{
+    return _count_nonzero_scalar(w, n);
+}
+
+static count_nonzero_kernel_t _select_count_nonzero_kernel()
+{
+#if RF_MC_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	return _count_nonzero_avx2;
+    if (__builtin_cpu_supports("sse2"))
+	return _count_nonzero_sse2;
+#endif
+
+    return _count_nonzero_scalar_n;
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// mask_occupancy_map: helper class for mask_counter_transform (see comment in rf_pipelines_inventory.hpp).
+//
+// Per-bin counts are accumulated in _process_chunk().  Completed bins are converted to masked fractions,
+// and accumulated in batches of 'nbins_per_batch', which are handed off to an hdf5_writer_thread which
+// does all HDF5 I/O (including opening and closing the file).  This is the same scheme as the
+// variance_estimator, and the same caveat applies: if other pipeline_objects use HDF5 concurrently
+// from the main thread, libhdf5 must be built thread-safe.
+
+
+struct mask_occupancy_map {
+    static constexpr ssize_t nbins_per_batch = 64;
+
+    const ssize_t nfreq;
+    const ssize_t Df;
+    const ssize_t Dt;         // toplevel time samples per bin
+    const ssize_t nds;
+    const ssize_t nfreq_out;  // nfreq / Df
+    const ssize_t nt_bin;     // Dt / nds, i.e. number of samples per bin in the weights array
+
+    string h5_fullname;
+
+    // Unmasked counts in the current bin, length nfreq_out.
+    vector<ssize_t> counts;
+    ssize_t nt_curr = 0;
+
+    // Current batch: 'masked_fraction' array has shape (nfreq_out, nbins_per_batch), the first nbins columns are valid.
+    struct batch {
+	vector<float> masked_fraction;
+	ssize_t nbins = 0;
+    };
+
+    batch curr_batch;
+
+    // Only accessed by jobs running in the writer thread (see _open_file() etc. below).
+    H5::H5File h5_file;
+    unique_ptr<sp_hdf5::hdf5_extendable_dataset<float>> dset;
+    vector<float> buf;
+
+    // Declared after the HDF5 state, so that it is destroyed (and joined) first.
+    hdf5_writer_thread writer;
+
+
+    mask_occupancy_map(ssize_t nfreq_, ssize_t Df_, ssize_t Dt_, ssize_t nds_) :
+	nfreq(nfreq_), Df(Df_), Dt(Dt_), nds(nds_),
+	nfreq_out(nfreq_ / Df_), 
+	nt_bin(Dt_ / nds_),
+	counts(nfreq_out, 0)
+    {
+	rf_assert(nfreq_out * Df == nfreq);
+	rf_assert(nt_bin * nds == Dt);
+    }
+
+    ~mask_occupancy_map()
+    {
+	// Only reached with the writer still running if the pipeline was destroyed in the middle of a run.
+	writer.join();
+    }
+
+    void start(const string &h5_fullname_)
+    {
+	this->h5_fullname = h5_fullname_;
+	this->counts.assign(nfreq_out, 0);
+	this->nt_curr = 0;
+	this->curr_batch = _new_batch();
+
+	writer.start();
+	writer.push([this]() { this->_open_file(); });
+    }
+
+    void add_chunk(const float *weights, ssize_t wstride, ssize_t nt)
+    {
+	static const count_nonzero_kernel_t count_nonzero = _select_count_nonzero_kernel();
+
+	for (ssize_t it = 0; it < nt; ) {
+	    ssize_t n = min(nt - it, nt_bin - nt_curr);
+
+	    for (ssize_t ifreq_out = 0; ifreq_out < nfreq_out; ifreq_out++) {
+		const float *w = weights + ifreq_out * Df * wstride + it;
+		ssize_t c = 0;
+
+		for (ssize_t j = 0; j < Df; j++)
+		    c += count_nonzero(w + j*wstride, n);
+
+		counts[ifreq_out] += c;
+	    }
+
+	    this->nt_curr += n;
+	    it += n;
+
+	    if (nt_curr == nt_bin)
+		_end_bin();
+	}
+    }
+
+    // Writes any remaining data (including a partial bin), and waits for the writer thread.
+    // If the writer failed, the error is rethrown here only if it wasn't already delivered by add_chunk().
+    void end()
+    {
+	if (nt_curr > 0)
+	    _end_bin();
+
+	auto b = make_shared<batch> (std::move(curr_batch));
+	this->curr_batch = batch();
+
+	writer.stop([this,b]() {
+	    if (b->nbins > 0)
+		this->_write_batch(*b);
+	    this->_close_file();
+	});
+    }
+
+    // Called in _reset(), without delivering errors.
+    void reset()
+    {
+	writer.join();
+	_close_file();
+    }
+
+    void _end_bin()
+    {
+	ssize_t ib = curr_batch.nbins;
+	double nsamples = double(Df * nt_curr);
+
+	for (ssize_t ifreq_out = 0; ifreq_out < nfreq_out; ifreq_out++)
+	    curr_batch.masked_fraction[ifreq_out*nbins_per_batch + ib] = 1.0 - counts[ifreq_out] / nsamples;
+
+	this->counts.assign(nfreq_out, 0);
+	this->nt_curr = 0;
+
+	if (++curr_batch.nbins == nbins_per_batch) {
+	    auto bp = make_shared<batch> (std::move(curr_batch));
+	    this->curr_batch = _new_batch();
+	    writer.push([this,bp]() { this->_write_batch(*bp); });
+	}
+    }
+
+    batch _new_batch() const
+    {
+	batch ret;
+	ret.masked_fraction.resize(nfreq_out * nbins_per_batch, 0.0);
+	return ret;
+    }
+
+    // The remaining member functions run in the writer thread.
+
+    void _open_file()
+    {
+	this->h5_file = sp_hdf5::hdf5_open_trunc(h5_fullname);
+
+	for (const auto &p: { make_pair("nfreq", nfreq), make_pair("Df", Df), make_pair("Dt", Dt) }) {
+	    int val = p.second;
+	    H5::Attribute a = h5_file.createAttribute(p.first, H5::PredType::NATIVE_INT, H5::DataSpace(H5S_SCALAR));
+	    a.write(H5::PredType::NATIVE_INT, &val);
+	}
+
+	vector<hsize_t> chunk_shape = { hsize_t(nfreq_out), 1 };
+	this->dset = make_unique<sp_hdf5::hdf5_extendable_dataset<float>> (h5_file, "masked_fraction", chunk_shape, 1);
+    }
+
+    void _write_batch(const batch &b)
+    {
+	// Repack (nfreq_out, nbins_per_batch) -> (nfreq_out, nbins).
+	ssize_t nbins = b.nbins;
+	buf.resize(nfreq_out * nbins);
+	for (ssize_t ifreq_out = 0; ifreq_out < nfreq_out; ifreq_out++)
+	    memcpy(&buf[ifreq_out*nbins], &b.masked_fraction[ifreq_out*nbins_per_batch], nbins * sizeof(float));
+
+	dset->write(&buf[0], { hsize_t(nfreq_out), hsize_t(nbins) });
+    }
+
+    void _close_file()
+    {
+	this->dset.reset();
+	this->h5_file.close();
+    }
+};
+
+#endif  // HAVE_HDF5
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+mask_counter_transform::mask_counter_transform(int nt_chunk_, string where_, int occupancy_Df_, int occupancy_Dt_) :
     wi_transform("mask_counter"),
-    where(where_)
+    where(where_),
+    occupancy_Df(occupancy_Df_),
+    occupancy_Dt(occupancy_Dt_)
 {	
     stringstream ss;
-    ss << "mask_counter(nt_chunk=" << nt_chunk_ << ", where=" << where << ")";
+    ss << "mask_counter(nt_chunk=" << nt_chunk_ << ", where=" << where;
+    if (occupancy_Df > 0)
+	ss << ", occupancy_Df=" << occupancy_Df << ", occupancy_Dt=" << occupancy_Dt;
+    ss << ")";
 
     this->name = ss.str();
     this->nt_chunk = nt_chunk_;
@@ -29,6 +305,15 @@ mask_counter_transform::mask_counter_transform(int nt_chunk_, string where_) :
 
     if (nt_chunk == 0)
         throw runtime_error("rf_pipelines::mask_counter: nt_chunk must be specified");
+    if ((occupancy_Df < 0) || (occupancy_Dt < 0))
+	throw runtime_error("rf_pipelines::mask_counter: expected occupancy_Df, occupancy_Dt >= 0");
+    if ((occupancy_Df > 0) && (occupancy_Dt == 0))
+	throw runtime_error("rf_pipelines::mask_counter: occupancy_Df was specified, but occupancy_Dt was not");
+
+#ifndef HAVE_HDF5
+    if (occupancy_Df > 0)
+	throw runtime_error("rf_pipelines::mask_counter: occupancy map was requested, but rf_pipelines was compiled without HAVE_HDF5");
+#endif
 }
 
 
@@ -68,6 +353,13 @@ void mask_counter_transform::_bind_transform(Json::Value &json_attrs)
     }
 #endif
 
+    if (occupancy_Df > 0) {
+	if (nfreq % occupancy_Df)
+	    throw runtime_error("mask_counter: nfreq (=" + to_string(nfreq) + ") must be a multiple of occupancy_Df (=" + to_string(occupancy_Df) + ")");
+	if (occupancy_Dt % nds)
+	    throw runtime_error("mask_counter: occupancy_Dt (=" + to_string(occupancy_Dt) + ") must be a multiple of nds (=" + to_string(nds) + ")");
+    }
+
     // Check for other mask_counters with duplicate "where" names.
     string keyname = "mask_counter_name_list";
     if (!json_attrs.isMember(keyname))
@@ -103,24 +395,39 @@ void mask_counter_transform::_start_pipeline(Json::Value &json_attrs)
 	    throw runtime_error("mask_counter: value of 'fpga_counts_per_sample' in chime_intensity_stream does not match the value in _start_pipeline()");
     }
 #endif
+
+#ifdef HAVE_HDF5
+    if (occupancy)
+	occupancy->start(this->out_mp->add_file("mask_occupancy_" + where + ".h5"));
+#endif
 }
 
 
 // virtual override
-void mask_counter_transform::_process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos)
+void mask_counter_transform::_allocate()
 {
-    mask_measurements meas;
+    // Allocated here (not per chunk), so that _process_chunk() does no heap allocation.
+    if (ringbuf)
+	this->ringbuf_fcounts.resize(nfreq);
+
+#ifdef HAVE_HDF5
+    if (occupancy_Df > 0)
+	this->occupancy = make_shared<mask_occupancy_map> (nfreq, occupancy_Df, occupancy_Dt, nds);
+#endif
+}
 
+
+// virtual override
+void mask_counter_transform::_process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos)
+{
     rf_kernels::mask_counter_data d;
     d.nfreq = nfreq;
     d.nt_chunk = nt_chunk / nds;      // not 'nt_chunk'
     d.in = weights;                   // not 'intensity'
     d.istride = wstride;              // not 'istride'
 
-    if (ringbuf) {
-	meas = mask_measurements(pos, d.nfreq, d.nt_chunk);
-	d.out_fcounts = meas.freqs_unmasked.get();
-    }
+    if (ringbuf)
+	d.out_fcounts = &ringbuf_fcounts[0];
 
 #ifdef HAVE_CH_FRB_IO
     // Declared outside the if-statement below, so that we hold the shared_ptr<> reference while the kernel is being called.
@@ -157,10 +464,13 @@ void mask_counter_transform::_process_chunk(float *intensity, ssize_t istride, f
     int nunmasked = d.mask_count();
     this->nunmasked_tot += nunmasked;
 
-    if (ringbuf) {
-	meas.nsamples_unmasked = nunmasked;
-	ringbuf->add(meas);
-    }
+    if (ringbuf)
+	ringbuf->add(pos, d.nfreq, d.nt_chunk, nunmasked, &ringbuf_fcounts[0]);
+
+#ifdef HAVE_HDF5
+    if (occupancy)
+	occupancy->add_chunk(weights, wstride, d.nt_chunk);
+#endif
 
 #ifdef HAVE_CH_FRB_IO
     if (chunk) {
@@ -179,6 +489,41 @@ void mask_counter_transform::_end_pipeline(Json::Value &json_attrs)
 {
     string k = "nunmasked_samples_" + this->where;
     json_attrs[k] = Json::Int64(this->nunmasked_tot);
+
+#ifdef HAVE_HDF5
+    if (occupancy) {
+	string kf = "occupancy_writer_failed_" + this->where;
+
+	if (occupancy->writer.failed())
+	    json_attrs[kf] = true;
+
+	occupancy->end();
+
+	if (occupancy->writer.failed())
+	    return;
+
+	// FIXME if (verbosity >= 2) ...
+	cout << "mask_counter: wrote " << occupancy->h5_fullname << endl;
+    }
+#endif
+}
+
+
+// virtual override
+void mask_counter_transform::_reset()
+{
+#ifdef HAVE_HDF5
+    if (occupancy)
+	occupancy->reset();
+#endif
+}
+
+
+// virtual override
+void mask_counter_transform::_deallocate()
+{
+    this->ringbuf_fcounts = vector<int> ();
+    this->occupancy.reset();
 }
 
 
@@ -189,6 +534,12 @@ Json::Value mask_counter_transform::jsonize() const
     ret["class_name"] = "mask_counter";
     ret["nt_chunk"] = int(this->get_prebind_nt_chunk());
     ret["where"] = where;
+
+    if (occupancy_Df > 0) {
+	ret["occupancy_Df"] = occupancy_Df;
+	ret["occupancy_Dt"] = occupancy_Dt;
+    }
+
     return ret;
 }
 
@@ -198,7 +549,10 @@ mask_counter_transform::from_json(const Json::Value &j)
 {
     ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
     string where = string_from_json(j, "where");
-    return make_shared<mask_counter_transform> (nt_chunk, where);
+    int occupancy_Df = j.isMember("occupancy_Df") ? int_from_json(j, "occupancy_Df") : 0;
+    int occupancy_Dt = j.isMember("occupancy_Dt") ? int_from_json(j, "occupancy_Dt") : 0;
+
+    return make_shared<mask_counter_transform> (nt_chunk, where, occupancy_Df, occupancy_Dt);
 }
 
 
@@ -215,9 +569,9 @@ namespace {
 
 
 // Externally callable
-shared_ptr<wi_transform> make_mask_counter(int nt_chunk, string where)
+shared_ptr<wi_transform> make_mask_counter(int nt_chunk, string where, int occupancy_Df, int occupancy_Dt)
 {
-    return make_shared<mask_counter_transform> (nt_chunk, where);
+    return make_shared<mask_counter_transform> (nt_chunk, where, occupancy_Df, occupancy_Dt);
 }
 
 
@@ -0,0 +1,367 @@
+// C++ version of the python mask_filler (rf_pipelines/transforms/mask_filler.py).
+//
+// From python, the two versions are constructed as 'mask_filler' and 'mask_filler_cpp'.
+// In the pipeline json output, they are represented as 'mask_filler' and 'mask_filler_cpp'.
+
+#include "rf_pipelines_internals.hpp"
+
+#ifdef HAVE_HDF5
+#include <sp_hdf5.hpp>
+#endif
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+#ifndef HAVE_HDF5
+
+shared_ptr<wi_transform> make_mask_filler(const string &var_file, double w_cutoff, ssize_t nt_chunk, ssize_t seed)
+{
+    throw runtime_error("rf_pipelines::make_mask_filler() was called, but this rf_pipelines was compiled without HAVE_HDF5");
+}
+
+struct mask_filler {
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	throw runtime_error("rf_pipelines: attempt to deserialize mask_filler_cpp, but this rf_pipelines was compiled without HAVE_HDF5");
+    }
+};
+
+#else // HAVE_HDF5
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// variance_estimates: C++ version of rf_pipelines.utils.Variance_Estimates.
+//
+// Reads an HDF5 file written by the variance_estimator (either version), and interpolates
+// the per-channel variance in time.
+
+
+struct variance_estimates {
+    ssize_t nfreq = 0;
+    ssize_t nt = 0;
+
+    vector<float> var;   // shape (nfreq, nt)
+    vector<double> t;    // length nt
+
+    double warn_tmin = 0.0;
+    double warn_tmax = 0.0;
+    bool warn_flag = false;
+
+
+    variance_estimates(const string &filename)
+    {
+	H5::H5File f(filename, H5F_ACC_RDONLY);
+
+	vector<hsize_t> vshape = _read(f, "variance", var);
+	vector<float> tbuf;
+	vector<hsize_t> tshape = _read(f, "time", tbuf);
+
+	// As in the python version, the 'time' dataset is 2-d with shape (1,N).
+	if ((vshape.size() != 2) || (tshape.size() != 2) || (tshape[0] != 1) || (vshape[1] != tshape[1]) || (vshape[1] == 0))
+	    throw runtime_error("rf_pipelines: variance file '" + filename + "' has unexpected dataset shapes");
+
+	this->nfreq = vshape[0];
+	this->nt = vshape[1];
+	this->t = vector<double> (tbuf.begin(), tbuf.end());
+
+	// Interpolate zeros.  If fewer than 25% of the estimates in a channel are nonzero, the channel is zeroed.
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	    _interpolate_zeros(&var[ifreq*nt]);
+
+	double size = (nt > 1) ? ((t[1] - t[0]) / 2.) : 0.0;
+	this->warn_tmin = t[0] - size;
+	this->warn_tmax = t[nt-1] + size;
+    }
+
+    // Writes the variance at time 't0' (linearly interpolated, clamped to the endpoints) to out[0:nfreq].
+    void eval(float *out, double t0)
+    {
+	if (!warn_flag && ((t0 < warn_tmin) || (t0 > warn_tmax))) {
+	    warn_flag = true;  // only warn once
+	    cout << "variance_estimates: This variance file ranges approximately from times " << warn_tmin << " to " << warn_tmax << "\n"
+		 << "variance_estimates: Requesting variances outside of this time range will result in eval() returning"
+		 << " the endpoints of the variance array." << endl;
+	}
+
+	ssize_t i = upper_bound(t.begin(), t.end(), t0) - t.begin();
+
+	if ((i == 0) || (i == nt)) {
+	    ssize_t j = (i == 0) ? 0 : (nt-1);
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+		out[ifreq] = var[ifreq*nt + j];
+	    return;
+	}
+
+	float w = (t0 - t[i-1]) / (t[i] - t[i-1]);
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	    out[ifreq] = (1-w) * var[ifreq*nt + i-1] + w * var[ifreq*nt + i];
+    }
+
+    // Same as np.interp(indices, nonzero, v[nonzero]).
+    void _interpolate_zeros(float *v) const
+    {
+	vector<ssize_t> nz;
+	for (ssize_t i = 0; i < nt; i++)
+	    if (v[i] != 0.0f)
+		nz.push_back(i);
+
+	if (4 * ssize_t(nz.size()) < nt) {
+	    memset(v, 0, nt * sizeof(float));
+	    return;
+	}
+
+	ssize_t n = nz.size();
+
+	for (ssize_t i = 0; i < nz[0]; i++)
+	    v[i] = v[nz[0]];
+	for (ssize_t i = nz[n-1]+1; i < nt; i++)
+	    v[i] = v[nz[n-1]];
+
+	for (ssize_t k = 0; k < n-1; k++) {
+	    ssize_t i0 = nz[k];
+	    ssize_t i1 = nz[k+1];
+	    for (ssize_t i = i0+1; i < i1; i++)
+		v[i] = v[i0] + (v[i1] - v[i0]) * float(i-i0) / float(i1-i0);
+	}
+    }
+
+    static vector<hsize_t> _read(H5::H5File &f, const string &dset_name, vector<float> &out)
+    {
+	H5::DataSet dset = f.openDataSet(dset_name);
+	H5::DataSpace space = dset.getSpace();
+
+	int ndim = space.getSimpleExtentNdims();
+	vector<hsize_t> shape(ndim);
+	space.getSimpleExtentDims(&shape[0]);
+
+	hsize_t size = 1;
+	for (hsize_t s: shape)
+	    size *= s;
+
+	out.resize(size);
+	if (size > 0)
+	    dset.read(&out[0], H5::PredType::NATIVE_FLOAT);
+
+	return shape;
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// mask_filler
+//
+// If the weight is > w_cutoff, the intensity is left unmodified.  Otherwise, the intensity is replaced
+// by Gaussian random noise whose variance is given by the variance file (evaluated at the center of the
+// chunk).  In both cases the weight is set to 2.0.  If the variance is zero (i.e. the channel was masked
+// when the variance was estimated), then all weights in the channel are set to zero.
+//
+// Differences from the python version:
+//
+//   - Random numbers are only generated for masked samples, using the counter_rng.  The random number
+//     at (ifreq, pos) is a pure function of (seed, ifreq, pos), so output is independent of nt_chunk.
+//
+//   - In a channel with zero variance, the intensity is left unmodified (the python version replaces
+//     masked samples by unit-variance noise, but since all weights are set to zero, this is irrelevant).
+//
+//   - The C++ version can run in a wi_sub_pipeline.  In this case, the variance file must have nfreq equal
+//     to (pipeline nfreq) * Df, and the variance is downsampled to the variance of a downsampled sample,
+//     i.e. (mean variance of the nonzero high-resolution channels) / (number of high-resolution samples).
+
+
+struct mask_filler : public wi_transform
+{
+    // Unmasked gaps shorter than this are filled in the same call to counter_rng::fill_gaussian()
+    // as the surrounding masked samples, since the RNG generates samples in blocks anyway.
+    static constexpr ssize_t min_gap = 64;
+
+    const string var_file;
+    const double w_cutoff;
+    const ssize_t seed;
+    const counter_rng rng;
+
+    variance_estimates variance;
+
+    double t_initial = 0.0;
+    double dt_sample = 0.0;
+
+    ssize_t Df = 1;          // frequency downsampling factor (see above)
+
+    vector<float> var_buf;   // length (nfreq * Df)
+    vector<float> rand_buf;  // length (nt_chunk / nds)
+
+
+    mask_filler(const string &var_file_, double w_cutoff_, ssize_t nt_chunk_, ssize_t seed_) :
+	wi_transform("mask_filler_cpp"),
+	var_file(var_file_),
+	w_cutoff(w_cutoff_),
+	seed(seed_ ? seed_ : counter_rng::random_seed()),
+	rng(seed, 0),
+	variance(var_file_)
+    {
+	stringstream ss;
+	ss << "mask_filler_cpp(var_file=" << var_file << ", w_cutoff=" << w_cutoff << ", nt_chunk=" << nt_chunk_ << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nds = 0;   // allows mask_filler to run in a wi_sub_pipeline.
+
+	if (nt_chunk <= 0)
+	    _throw("expected nt_chunk > 0");
+	if (seed <= 0)
+	    _throw("expected seed >= 0");
+    }
+
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	if (!json_attrs.isMember("dt_sample"))
+	    _throw("expected json_attrs to contain member 'dt_sample'");
+	if (variance.nfreq % nfreq)
+	    _throw("variance file '" + var_file + "' has nfreq=" + to_string(variance.nfreq) + ", which is not a multiple of pipeline nfreq=" + to_string(nfreq));
+
+	this->Df = xdiv(variance.nfreq, nfreq);
+
+	// As in the C++ variance_estimator, we don't require 't_initial' (in order to allow synthetic streams).
+	this->t_initial = json_attrs.isMember("t_initial") ? json_attrs["t_initial"].asDouble() : 0.0;
+	this->dt_sample = json_attrs["dt_sample"].asDouble();
+    }
+
+    virtual void _allocate() override
+    {
+	this->var_buf.resize(nfreq * Df);
+	this->rand_buf.resize(xdiv(nt_chunk, nds));
+    }
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	double t0 = t_initial + dt_sample * pos;
+	double t1 = t_initial + dt_sample * (pos + nt_chunk);
+	variance.eval(&var_buf[0], (t0+t1)/2.);
+
+	// Note that 'pos' and 'nt_chunk' are high-resolution sample counts.
+	ssize_t nt_ds = xdiv(nt_chunk, nds);
+	ssize_t pos_ds = xdiv(pos, nds);
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    float *ivec = intensity + ifreq * istride;
+	    float *wvec = weights + ifreq * wstride;
+	    float v = _downsampled_variance(ifreq);
+
+	    if (v > 0.0f)
+		_fill_row(ivec, wvec, nt_ds, ifreq, pos_ds, sqrtf(v));
+
+	    float w = (v > 0.0f) ? 2.0f : 0.0f;
+	    for (ssize_t it = 0; it < nt_ds; it++)
+		wvec[it] = w;
+	}
+    }
+
+    inline float _downsampled_variance(ssize_t ifreq) const
+    {
+	if ((Df == 1) && (nds == 1))
+	    return var_buf[ifreq];
+
+	float vsum = 0.0;
+	ssize_t n = 0;
+
+	for (ssize_t j = ifreq*Df; j < (ifreq+1)*Df; j++) {
+	    vsum += var_buf[j];
+	    n += (var_buf[j] > 0.0f) ? 1 : 0;
+	}
+
+	return (n > 0) ? (vsum / float(n*n*nds)) : 0.0f;
+    }
+
+    // Replaces masked samples (weight <= w_cutoff) in one channel by Gaussian noise.
+    inline void _fill_row(float *ivec, const float *wvec, ssize_t nt, ssize_t ifreq, ssize_t pos, float rms)
+    {
+	const float wc = w_cutoff;
+	float *rvec = &rand_buf[0];
+	ssize_t it = 0;
+
+	for (;;) {
+	    // Skip unmasked samples.
+	    while ((it < nt) && (wvec[it] > wc))
+		it++;
+
+	    if (it >= nt)
+		return;
+
+	    // Find the end of the masked run, absorbing short unmasked gaps.
+	    ssize_t it0 = it;
+	    ssize_t it1 = it+1;
+
+	    for (ssize_t j = it1; (j < nt) && (j < it1 + min_gap); j++)
+		if (wvec[j] <= wc)
+		    it1 = j+1;
+
+	    ssize_t n = it1 - it0;
+	    rng.fill_gaussian(rvec, n, ifreq, pos + it0, rms);
+
+	    // Vectorizable merge.
+	    for (ssize_t j = 0; j < n; j++)
+		ivec[it0+j] = (wvec[it0+j] <= wc) ? rvec[j] : ivec[it0+j];
+
+	    it = it1;
+	}
+    }
+
+    virtual void _deallocate() override
+    {
+	this->var_buf = vector<float> ();
+	this->rand_buf = vector<float> ();
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "mask_filler_cpp";
+	ret["var_file"] = var_file;
+	ret["w_cutoff"] = w_cutoff;
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+	ret["seed"] = Json::Int64(seed);
+
+	return ret;
+    }
+
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	string var_file = string_from_json(j, "var_file");
+	double w_cutoff = double_from_json(j, "w_cutoff");
+	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
+	ssize_t seed = j.isMember("seed") ? ssize_t_from_json(j, "seed") : 0;
+
+	return make_shared<mask_filler> (var_file, w_cutoff, nt_chunk, seed);
+    }
+};
+
+
+shared_ptr<wi_transform> make_mask_filler(const string &var_file, double w_cutoff, ssize_t nt_chunk, ssize_t seed)
+{
+    return make_shared<mask_filler> (var_file, w_cutoff, nt_chunk, seed);
+}
+
+#endif // HAVE_HDF5
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("mask_filler_cpp", mask_filler::from_json);
+	}
+    } init;
+}
+
+
+}  // namespace rf_pipelines
@@ -8,9 +8,6 @@ namespace rf_pipelines {
 }; // pacify emacs c-mode
 #endif
 
-typedef lock_guard<mutex> ulock;
-
-
 mask_measurements::mask_measurements(ssize_t pos_, int nf_, int nt_)
 {
     this->pos = pos_;
@@ -22,63 +19,238 @@ mask_measurements::mask_measurements(ssize_t pos_, int nf_, int nt_)
 
 
 mask_measurements_ringbuf::mask_measurements_ringbuf(int nhistory) :
-    next(0),
-    maxsize(nhistory)
+    maxsize(nhistory),
+    next(0)
 {
     if (nhistory <= 0)
 	throw runtime_error("rf_pipelines::mask_measurements_ringbuf constructor called with nhistory <= 0");
 
-    // Allocate ring buffer
-    ringbuf.resize(nhistory);
+    this->slots.reset(new slot[nhistory]);
+
+    for (int i = 0; i < nhistory; i++)
+	slots[i].seq.store(0, std::memory_order_relaxed);
+}
+
+
+void mask_measurements_ringbuf::add(ssize_t pos, int nf_, int nt, int nsamples_unmasked, const int *freqs_unmasked)
+{
+    if (nf_ <= 0)
+	throw runtime_error("rf_pipelines::mask_measurements_ringbuf::add(): expected nf > 0");
+    if (!freqs_unmasked)
+	throw runtime_error("rf_pipelines::mask_measurements_ringbuf::add(): freqs_unmasked pointer was null");
+
+    // One-time allocation.  Readers don't look at 'nf' or 'freqs' until they see next > 0 (acquire),
+    // and the release-store to 'next' below orders these writes before it.
+    if (!freqs) {
+	this->freqs.reset(new std::atomic<int>[size_t(maxsize) * size_t(nf_)]);
+	this->cum_freqs.reset(new std::atomic<int64_t>[size_t(maxsize) * size_t(nf_)]);
+	this->tot_freqs.assign(nf_, 0);
+	this->nf = nf_;
+    }
+    else if (nf_ != nf)
+	throw runtime_error("rf_pipelines::mask_measurements_ringbuf::add(): nf (=" + to_string(nf_) + ") changed between calls (previous nf=" + to_string(nf) + ")");
+
+    int64_t i = next.load(std::memory_order_relaxed);   // only the producer writes 'next'
+    uint64_t igen = uint64_t(i / maxsize);
+    slot &s = slots[i % maxsize];
+    std::atomic<int> *f = &freqs[(i % maxsize) * nf];
+    std::atomic<int64_t> *cf = &cum_freqs[(i % maxsize) * nf];
+
+    s.seq.store(2*igen+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s.pos.store(pos, std::memory_order_relaxed);
+    s.nt.store(nt, std::memory_order_relaxed);
+    s.nsamples_unmasked.store(nsamples_unmasked, std::memory_order_relaxed);
+    s.cum_nsamples.store(tot_nsamples, std::memory_order_relaxed);
+    s.cum_unmasked.store(tot_unmasked, std::memory_order_relaxed);
+
+    for (int ifreq = 0; ifreq < nf; ifreq++) {
+	f[ifreq].store(freqs_unmasked[ifreq], std::memory_order_relaxed);
+	cf[ifreq].store(tot_freqs[ifreq], std::memory_order_relaxed);
+	tot_freqs[ifreq] += freqs_unmasked[ifreq];
+    }
+
+    tot_nsamples += int64_t(nf) * int64_t(nt);
+    tot_unmasked += nsamples_unmasked;
+
+    s.seq.store(2*igen+2, std::memory_order_release);
+    next.store(i+1, std::memory_order_release);
+}
+
+
+void mask_measurements_ringbuf::add(rf_pipelines::mask_measurements& meas)
+{
+    this->add(meas.pos, meas.nf, meas.nt, meas.nsamples_unmasked, meas.freqs_unmasked.get());
 }
 
-void mask_measurements_ringbuf::add(rf_pipelines::mask_measurements& meas) {
-    ulock l(mutex);
-    ringbuf[next % maxsize] = meas;
-    next++;
+
+bool mask_measurements_ringbuf::_read_entry(int64_t i, mask_measurements &out, int *out_freqs) const
+{
+    uint64_t expected_seq = 2 * uint64_t(i / maxsize) + 2;
+    const slot &s = slots[i % maxsize];
+
+    if (s.seq.load(std::memory_order_acquire) != expected_seq)
+	return false;
+
+    out.pos = s.pos.load(std::memory_order_relaxed);
+    out.nf = nf;
+    out.nt = s.nt.load(std::memory_order_relaxed);
+    out.nsamples = out.nf * out.nt;
+    out.nsamples_unmasked = s.nsamples_unmasked.load(std::memory_order_relaxed);
+
+    if (out_freqs) {
+	const std::atomic<int> *f = &freqs[(i % maxsize) * nf];
+	for (int ifreq = 0; ifreq < nf; ifreq++)
+	    out_freqs[ifreq] = f[ifreq].load(std::memory_order_relaxed);
+    }
+
+    // If the producer started overwriting the slot while we were copying, the sequence number has changed.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (s.seq.load(std::memory_order_relaxed) == expected_seq);
 }
+
+
+
+bool mask_measurements_ringbuf::_read_prefix(int64_t i, bool inclusive, int64_t &out_nsamples, int64_t &out_unmasked, int64_t *out_freqs) const
+{
+    uint64_t expected_seq = 2 * uint64_t(i / maxsize) + 2;
+    const slot &s = slots[i % maxsize];
+
+    if (s.seq.load(std::memory_order_acquire) != expected_seq)
+	return false;
+
+    out_nsamples = s.cum_nsamples.load(std::memory_order_relaxed);
+    out_unmasked = s.cum_unmasked.load(std::memory_order_relaxed);
+
+    if (inclusive) {
+	out_nsamples += int64_t(nf) * int64_t(s.nt.load(std::memory_order_relaxed));
+	out_unmasked += s.nsamples_unmasked.load(std::memory_order_relaxed);
+    }
+
+    if (out_freqs) {
+	const std::atomic<int> *f = &freqs[(i % maxsize) * nf];
+	const std::atomic<int64_t> *cf = &cum_freqs[(i % maxsize) * nf];
+
+	for (int ifreq = 0; ifreq < nf; ifreq++)
+	    out_freqs[ifreq] = cf[ifreq].load(std::memory_order_relaxed) + (inclusive ? f[ifreq].load(std::memory_order_relaxed) : 0);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (s.seq.load(std::memory_order_relaxed) == expected_seq);
+}
+
+
+int64_t mask_measurements_ringbuf::_read_window(int nchunks, int64_t &out_nsamples, int64_t &out_unmasked, vector<int64_t> *out_freqs) const
+{
+    nchunks = min(nchunks, maxsize);
+    out_nsamples = out_unmasked = 0;
+
+    if (nchunks <= 0)
+	return 0;
+
+    // Window is entries [start,end).  We read the prefix sums at both endpoints.  Readers never wait
+    // for the producer:
+    //
+    //   - If nchunks == maxsize, then the 'start' entry shares a slot with the next entry to be
+    //     added, and may be overwritten while we're reading it.  In this case, we drop it from the
+    //     window (so the stats cover one fewer entry), instead of retrying until the producer is done.
+    //
+    //   - If the producer laps the whole ring buffer while we're reading (i.e. the reader was
+    //     descheduled for maxsize chunks), we start over with a fresh window.
+
+    int64_t end = next.load(std::memory_order_acquire);
+    int64_t start = max(end - nchunks, int64_t(0));
+
+    if (start >= end)
+	return 0;
+
+    // Note: 'nf' can't be read until we've seen (next > 0), see add().
+    vector<int64_t> fbuf;
+
+    if (out_freqs) {
+	fbuf.resize(nf);
+	out_freqs->resize(nf);
+    }
+
+    int64_t ns0, nu0, ns1, nu1;
+
+    for (;;) {
+	if (!_read_prefix(start, false, ns0, nu0, out_freqs ? &fbuf[0] : nullptr))
+	    start++;
+	else if (_read_prefix(end-1, true, ns1, nu1, out_freqs ? &(*out_freqs)[0] : nullptr))
+	    break;
+	else
+	    start = end;   // lapped, see above
+
+	if (start >= end) {
+	    end = next.load(std::memory_order_acquire);
+	    start = max(end - nchunks, int64_t(0));
+	}
+    }
+
+    out_nsamples = ns1 - ns0;
+    out_unmasked = nu1 - nu0;
+
+    if (out_freqs) {
+	for (int ifreq = 0; ifreq < nf; ifreq++)
+	    (*out_freqs)[ifreq] -= fbuf[ifreq];
+    }
+
+    return end - start;
+}
+
     
 std::vector<rf_pipelines::mask_measurements>
 mask_measurements_ringbuf::get_all_measurements() {
     std::vector<rf_pipelines::mask_measurements> copy;
-    {
-        ulock l(mutex);
-        // The returned vector has the chunks listed in time order
-        int start;
-        int end;
-        if (next <= maxsize) {
-            start = 0;
-            end = next;
-        } else {
-            start = next;
-            end = next + maxsize;
-        }
-        for (int i=start; i<end; i++)
-            copy.push_back(ringbuf[i % maxsize]);
+
+    // The returned vector has the chunks listed in time order.  Entries which are overwritten
+    // by the producer while we're copying are dropped (they were the oldest in the ring buffer).
+    int64_t end = next.load(std::memory_order_acquire);
+    int64_t start = max(end - maxsize, int64_t(0));
+
+    copy.reserve(end - start);
+
+    for (int64_t i = start; i < end; i++) {
+	mask_measurements m;
+	m.freqs_unmasked = make_sptr<int> (nf);
+
+	if (_read_entry(i, m, m.freqs_unmasked.get()))
+	    copy.push_back(m);
     }
+
     return copy;
 }
 
 std::unordered_map<std::string, float> 
 mask_measurements_ringbuf::get_stats(int nchunks) {
     unordered_map<string, float> stats;
-    float totsamp = 0;
-    float totunmasked = 0;
-    if (nchunks > maxsize)
-        nchunks = maxsize;
-    {
-        ulock l(mutex);
-        int start = next - nchunks;
-        if (start < 0)
-            start = 0;
-        for (int i=start; i<next; i++) {
-            int reali = (i % maxsize);
-            totsamp     += ringbuf[reali].nsamples;
-            totunmasked += ringbuf[reali].nsamples_unmasked;
-        }
-    }
-    stats["rfi_mask_pct_masked"]   = 100. * (totsamp - totunmasked) / max(totsamp, 1.f);
+    int64_t totsamp, totunmasked;
+
+    _read_window(nchunks, totsamp, totunmasked, nullptr);
+
+    stats["rfi_mask_pct_masked"]   = 100. * double(totsamp - totunmasked) / double(max(totsamp, int64_t(1)));
     return stats;
 }
 
+
+std::vector<float>
+mask_measurements_ringbuf::get_freq_masked_fractions(int nchunks) {
+    int64_t totsamp, totunmasked;
+    vector<int64_t> fsum;
+
+    if (_read_window(nchunks, totsamp, totunmasked, &fsum) == 0)
+	return vector<float> ();
+
+    // Each frequency channel has (totsamp / nf) samples in the window.
+    int64_t nt_tot = totsamp / nf;
+    vector<float> ret(nf);
+
+    for (int ifreq = 0; ifreq < nf; ifreq++)
+	ret[ifreq] = double(nt_tot - fsum[ifreq]) / double(max(nt_tot, int64_t(1)));
+
+    return ret;
+}
+
 }  // namespace rf_pipelines
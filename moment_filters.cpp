@@ -0,0 +1,427 @@
+// C++ versions of the old python transforms kurtosis_filter and thermal_noise_weight (which were
+// written for the pre-rf_pipelines2 API, and lived in to_resurrect/).  Both transforms are built
+// on the weighted_moments() kernel below, which computes per-channel moments in a single pass.
+
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// weighted_moments() kernel.
+//
+// The intensity/weights arrays are first downsampled by (Df,Dt), in the same way as the clippers:
+// the downsampled weight is the sum of the weights, and the downsampled intensity is the weighted
+// mean.  (If Df=Dt=1, the downsampling step is skipped.)  Then, in each downsampled channel, the
+// weighted sums of (x-x0)^n are accumulated for 0 <= n <= 4, where x0 is the first unmasked sample.
+// Subtracting x0 is cheap, and avoids most of the roundoff error in the float32 accumulators.
+//
+// The inner loops are written with NL independent accumulators, so that the compiler can vectorize
+// them (-O3 -march=native -ffast-math), and the accumulators are flushed to double precision every
+// 'nt_flush' samples.
+
+
+static constexpr int NL = 16;
+static constexpr ssize_t nt_flush = 256;
+
+
+// Accumulates weighted moments of (x[j]-x0) for 0 <= j < n, into acc[0:5].
+// If 'wx' is true, then x[] actually contains (w*x), and must be divided by w[].
+template<bool wx>
+static inline void _accumulate_moments(double *acc, const float *w, const float *x, ssize_t n, float x0)
+{
+    for (ssize_t j0 = 0; j0 < n; j0 += nt_flush) {
+	ssize_t nb = min(nt_flush, n - j0);
+	ssize_t nv = nb - (nb % NL);
+
+	float a0[NL], a1[NL], a2[NL], a3[NL], a4[NL];
+	for (int l = 0; l < NL; l++)
+	    a0[l] = a1[l] = a2[l] = a3[l] = a4[l] = 0.0f;
+
+	for (ssize_t j = j0; j < j0 + nv; j += NL) {
+	    for (int l = 0; l < NL; l++) {
+		float wj = w[j+l];
+		float xj = wx ? ((wj > 0.0f) ? (x[j+l] / wj) : x0) : x[j+l];
+		float d = xj - x0;
+		float wd = wj * d;
+		float wdd = wd * d;
+		a0[l] += wj;
+		a1[l] += wd;
+		a2[l] += wdd;
+		a3[l] += wdd * d;
+		a4[l] += wdd * d * d;
+	    }
+	}
+
+	for (ssize_t j = j0 + nv; j < j0 + nb; j++) {
+	    float wj = w[j];
+	    float xj = wx ? ((wj > 0.0f) ? (x[j] / wj) : x0) : x[j];
+	    float d = xj - x0;
+	    float wd = wj * d;
+	    a0[0] += wj;
+	    a1[0] += wd;
+	    a2[0] += wd * d;
+	    a3[0] += wd * d * d;
+	    a4[0] += wd * d * d * d;
+	}
+
+	for (int l = 0; l < NL; l++) {
+	    acc[0] += a0[l];
+	    acc[1] += a1[l];
+	    acc[2] += a2[l];
+	    acc[3] += a3[l];
+	    acc[4] += a4[l];
+	}
+    }
+}
+
+
+// Converts raw moments of (x-x0) to (W, mean, m2, m3, m4), where m_n is the normalized central moment.
+static inline void _finalize_moments(double *out, const double *acc, double x0)
+{
+    double W = acc[0];
+
+    if (W <= 0.0) {
+	out[0] = out[1] = out[2] = out[3] = out[4] = 0.0;
+	return;
+    }
+
+    double mu = acc[1] / W;
+    double r2 = acc[2] / W;
+    double r3 = acc[3] / W;
+    double r4 = acc[4] / W;
+
+    out[0] = W;
+    out[1] = x0 + mu;
+    out[2] = max(r2 - mu*mu, 0.0);
+    out[3] = r3 - 3*mu*r2 + 2*mu*mu*mu;
+    out[4] = max(r4 - 4*mu*r3 + 6*mu*mu*r2 - 3*mu*mu*mu*mu, 0.0);
+}
+
+
+static inline float _first_unmasked(const float *w, const float *x, ssize_t n, bool wx)
+{
+    for (ssize_t j = 0; j < n; j++)
+	if (w[j] > 0.0f)
+	    return wx ? (x[j] / w[j]) : x[j];
+    return 0.0f;
+}
+
+
+void weighted_moments(double *out, ssize_t nfreq, ssize_t nt, const float *intensity, ssize_t istride, const float *weights, ssize_t wstride, int Df, int Dt)
+{
+    rf_assert(nfreq > 0);
+    rf_assert(nt > 0);
+    rf_assert(Df > 0);
+    rf_assert(Dt > 0);
+    rf_assert(nfreq % Df == 0);
+    rf_assert(nt % Dt == 0);
+
+    ssize_t nfreq_ds = nfreq / Df;
+    ssize_t nt_ds = nt / Dt;
+
+    if ((Df == 1) && (Dt == 1)) {
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    const float *w = weights + ifreq*wstride;
+	    const float *x = intensity + ifreq*istride;
+	    float x0 = _first_unmasked(w, x, nt, false);
+
+	    double acc[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+	    _accumulate_moments<false> (acc, w, x, nt, x0);
+	    _finalize_moments(out + 5*ifreq, acc, x0);
+	}
+	return;
+    }
+
+    // Downsampled case: the downsampled (w, w*x) are accumulated in scratch arrays of length nt_ds.
+    vector<float> wds(nt_ds);
+    vector<float> wxds(nt_ds);
+
+    for (ssize_t ifreq_ds = 0; ifreq_ds < nfreq_ds; ifreq_ds++) {
+	std::fill(wds.begin(), wds.end(), 0.0f);
+	std::fill(wxds.begin(), wxds.end(), 0.0f);
+
+	for (ssize_t ifreq = ifreq_ds*Df; ifreq < (ifreq_ds+1)*Df; ifreq++) {
+	    const float *w = weights + ifreq*wstride;
+	    const float *x = intensity + ifreq*istride;
+
+	    for (ssize_t j = 0; j < nt_ds; j++) {
+		float sw = 0.0f;
+		float swx = 0.0f;
+		for (int k = 0; k < Dt; k++) {
+		    sw += w[j*Dt+k];
+		    swx += w[j*Dt+k] * x[j*Dt+k];
+		}
+		wds[j] += sw;
+		wxds[j] += swx;
+	    }
+	}
+
+	float x0 = _first_unmasked(&wds[0], &wxds[0], nt_ds, true);
+
+	double acc[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+	_accumulate_moments<true> (acc, &wds[0], &wxds[0], nt_ds, x0);
+	_finalize_moments(out + 5*ifreq_ds, acc, x0);
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// moment_filter_base: helper base class for transforms which compute per-channel moments
+// in each chunk, and then do something to each block of Df channels.
+
+
+struct moment_filter_base : public wi_transform
+{
+    const int Df;
+    const int Dt;
+
+    // Shape (nfreq/Df, 5), allocated in _allocate().
+    vector<double> moments;
+
+    moment_filter_base(const string &class_name, int nt_chunk_, int Df_, int Dt_) :
+	wi_transform(class_name),
+	Df(Df_),
+	Dt(Dt_)
+    {
+	this->nt_chunk = nt_chunk_;
+	this->kernel_chunk_size = Dt;
+	this->nds = 0;   // allows moment filters to run in a wi_sub_pipeline.
+
+	if (nt_chunk <= 0)
+	    _throw("expected nt_chunk > 0");
+	if ((Df <= 0) || (Dt <= 0))
+	    _throw("expected Df > 0 and Dt > 0");
+    }
+
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	if (nfreq % Df)
+	    _throw("nfreq (=" + to_string(nfreq) + ") is not divisible by frequency downsampling factor Df=" + to_string(Df));
+    }
+
+    virtual void _allocate() override
+    {
+	this->moments.resize(5 * (nfreq / Df));
+    }
+
+    virtual void _deallocate() override
+    {
+	this->moments = vector<double> ();
+    }
+
+    // Note xdiv(nt_chunk, nds) here.
+    void _compute_moments(const float *intensity, ssize_t istride, const float *weights, ssize_t wstride)
+    {
+	weighted_moments(&moments[0], nfreq, xdiv(nt_chunk,nds), intensity, istride, weights, wstride, Df, Dt);
+    }
+
+    // Multiplies the weights in downsampled channel 'ifreq_ds' (i.e. Df channels) by 'x'.
+    void _scale_weights(float *weights, ssize_t wstride, ssize_t ifreq_ds, float x)
+    {
+	ssize_t nt = xdiv(nt_chunk, nds);
+
+	for (ssize_t ifreq = ifreq_ds*Df; ifreq < (ifreq_ds+1)*Df; ifreq++) {
+	    float *w = weights + ifreq*wstride;
+	    for (ssize_t it = 0; it < nt; it++)
+		w[it] *= x;
+	}
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// kurtosis_filter: masks channels whose excess kurtosis (in each chunk) is outside [lo_cut, hi_cut].
+//
+// Differences from the old python version:
+//
+//   - The python version used the weights only as a mask (through np.ma.masked_where), whereas here
+//     the moments are weighted.  For 0/1 weights, the two are the same.
+//
+//   - Downsampling by (Df,Dt) is supported.  If Df > 1, then blocks of Df channels are masked together.
+//
+// As in the python version, if the kurtosis is undefined (all samples masked, or zero variance), it is
+// treated as -4, so that the channel is masked with the default thresholds.
+
+
+struct kurtosis_filter : public moment_filter_base
+{
+    const double lo_cut;
+    const double hi_cut;
+
+    kurtosis_filter(int nt_chunk_, double lo_cut_, double hi_cut_, int Df_, int Dt_) :
+	moment_filter_base("kurtosis_filter", nt_chunk_, Df_, Dt_),
+	lo_cut(lo_cut_),
+	hi_cut(hi_cut_)
+    {
+	stringstream ss;
+	ss << "kurtosis_filter(nt_chunk=" << nt_chunk_ << ", lo_cut=" << lo_cut << ", hi_cut=" << hi_cut
+	   << ", Df=" << Df << ", Dt=" << Dt << ")";
+
+	this->name = ss.str();
+
+	if (lo_cut >= hi_cut)
+	    _throw("expected lo_cut < hi_cut");
+    }
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	this->_compute_moments(intensity, istride, weights, wstride);
+
+	for (ssize_t ifreq_ds = 0; ifreq_ds < nfreq/Df; ifreq_ds++) {
+	    const double *m = &moments[5*ifreq_ds];
+	    double k = (m[2] > 0.0) ? (m[4] / (m[2]*m[2]) - 3.0) : -4.0;
+
+	    if ((k < lo_cut) || (k > hi_cut))
+		this->_scale_weights(weights, wstride, ifreq_ds, 0.0);
+	}
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "kurtosis_filter";
+	ret["nt_chunk"] = int(this->get_prebind_nt_chunk());
+	ret["lo_cut"] = lo_cut;
+	ret["hi_cut"] = hi_cut;
+	ret["Df"] = Df;
+	ret["Dt"] = Dt;
+
+	return ret;
+    }
+
+    static shared_ptr<kurtosis_filter> from_json(const Json::Value &j)
+    {
+	int nt_chunk = int_from_json(j, "nt_chunk");
+	double lo_cut = double_from_json(j, "lo_cut");
+	double hi_cut = double_from_json(j, "hi_cut");
+	int Df = int_from_json(j, "Df");
+	int Dt = int_from_json(j, "Dt");
+
+	return make_shared<kurtosis_filter> (nt_chunk, lo_cut, hi_cut, Df, Dt);
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// thermal_noise_weight: for thermal-noise dominated data, reweights each channel by the inverse of
+// its expected (radiometer equation) noise rms, mean/sqrt(2 * dt_sample * delta_f).  This is a
+// rewrite of Kiyo's ch_L1Mock code (preprocess.py).  Note that it probably can't be used in tandem
+// with detrending, since it needs the mean intensity.
+//
+// Channels whose total weight is less than 0.001 times the mean (over channels), or whose mean
+// intensity is <= 0, are masked.  (The python version only masked channels with mean exactly zero,
+// and could produce negative weights.)  If Df > 1, the mean is computed over blocks of Df channels.
+
+
+struct thermal_noise_weight : public moment_filter_base
+{
+    // Initialized in _bind_transform().
+    double delta_f = 0.0;   // Hz
+    double delta_t = 0.0;   // seconds
+
+    thermal_noise_weight(int nt_chunk_, int Df_, int Dt_) :
+	moment_filter_base("thermal_noise_weight", nt_chunk_, Df_, Dt_)
+    {
+	stringstream ss;
+	ss << "thermal_noise_weight(nt_chunk=" << nt_chunk_ << ", Df=" << Df << ", Dt=" << Dt << ")";
+	this->name = ss.str();
+    }
+
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	moment_filter_base::_bind_transform(json_attrs);
+
+	if (!json_attrs.isMember("freq_lo_MHz") || !json_attrs.isMember("freq_hi_MHz") || !json_attrs.isMember("dt_sample"))
+	    _throw("expected json_attrs to contain members 'freq_lo_MHz', 'freq_hi_MHz', 'dt_sample'");
+
+	double freq_lo_MHz = json_attrs["freq_lo_MHz"].asDouble();
+	double freq_hi_MHz = json_attrs["freq_hi_MHz"].asDouble();
+	double dt_sample = json_attrs["dt_sample"].asDouble();
+
+	// In a wi_sub_pipeline, 'nfreq' is the downsampled channel count, and each sample is 'nds' high-res samples.
+	this->delta_f = (freq_hi_MHz - freq_lo_MHz) * 1.0e6 / nfreq;
+	this->delta_t = dt_sample * nds;
+
+	if ((delta_f <= 0.0) || (delta_t <= 0.0))
+	    _throw("expected freq_hi_MHz > freq_lo_MHz and dt_sample > 0");
+    }
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	this->_compute_moments(intensity, istride, weights, wstride);
+
+	ssize_t nfreq_ds = nfreq / Df;
+	double wmean = 0.0;
+
+	for (ssize_t ifreq_ds = 0; ifreq_ds < nfreq_ds; ifreq_ds++)
+	    wmean += moments[5*ifreq_ds] / nfreq_ds;
+
+	double rnorm = sqrt(2 * delta_t * delta_f);
+
+	for (ssize_t ifreq_ds = 0; ifreq_ds < nfreq_ds; ifreq_ds++) {
+	    const double *m = &moments[5*ifreq_ds];
+	    bool bad = (m[0] < 0.001 * wmean) || (m[0] <= 0.0) || (m[1] <= 0.0);
+	    this->_scale_weights(weights, wstride, ifreq_ds, bad ? 0.0 : (rnorm / m[1]));
+	}
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "thermal_noise_weight";
+	ret["nt_chunk"] = int(this->get_prebind_nt_chunk());
+	ret["Df"] = Df;
+	ret["Dt"] = Dt;
+
+	return ret;
+    }
+
+    static shared_ptr<thermal_noise_weight> from_json(const Json::Value &j)
+    {
+	int nt_chunk = int_from_json(j, "nt_chunk");
+	int Df = int_from_json(j, "Df");
+	int Dt = int_from_json(j, "Dt");
+
+	return make_shared<thermal_noise_weight> (nt_chunk, Df, Dt);
+    }
+};
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("kurtosis_filter", kurtosis_filter::from_json);
+	    pipeline_object::register_json_deserializer("thermal_noise_weight", thermal_noise_weight::from_json);
+	}
+    } init;
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+// Externally visible
+shared_ptr<wi_transform> make_kurtosis_filter(int nt_chunk, double lo_cut, double hi_cut, int Df, int Dt)
+{
+    return make_shared<kurtosis_filter> (nt_chunk, lo_cut, hi_cut, Df, Dt);
+}
+
+shared_ptr<wi_transform> make_thermal_noise_weight(int nt_chunk, int Df, int Dt)
+{
+    return make_shared<thermal_noise_weight> (nt_chunk, Df, Dt);
+}
+
+
+}  // namespace rf_pipelines
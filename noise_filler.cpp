@@ -0,0 +1,201 @@
+// C++ version of the python noise_filler (rf_pipelines/transforms/noise_filler.py).
+//
+// From python, the two versions are constructed as 'noise_filler' and 'noise_filler_cpp'.
+// In the pipeline json output, they are represented as 'noise_filler' and 'noise_filler_cpp'.
+//
+// The noise_filler replaces the intensity array with simulated Gaussian noise, leaving the weights unchanged.
+// The noise rms is constant within each chunk, and is incremented by 'increment' between chunks.  The initial
+// rms in each channel is a uniform random number in [0.02, 2.02), as in the python version.
+//
+// Differences from the python version:
+//
+//   - Random numbers are generated with the counter_rng, so output is reproducible given the seed.
+//
+//   - The simulated variance (i.e. rms^2) is written to a single HDF5 file 'var_filename', rather than
+//     a sequence of timestamped files.  Since the file also contains a 'time' dataset, it has the same
+//     layout as the variance_estimator output, and can be used to check the variance_estimator.
+//     If 'var_filename' is empty, no file is written (and rf_pipelines need not be compiled with HDF5).
+
+#include "rf_pipelines_internals.hpp"
+
+#ifdef HAVE_HDF5
+#include <sp_hdf5.hpp>
+#endif
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+struct noise_filler : public wi_transform
+{
+    const double increment;
+    const string var_filename;
+    const ssize_t seed;
+    const counter_rng intensity_rng;
+    const counter_rng rms_rng;
+
+    double t_initial = 0.0;
+    double dt_sample = 0.0;
+
+    // Length-nfreq array, initialized in _start_pipeline().
+    vector<float> current_rms;
+    vector<float> var_buf;
+
+#ifdef HAVE_HDF5
+    H5::H5File h5_file;
+    unique_ptr<sp_hdf5::hdf5_extendable_dataset<float>> h5_var;
+    unique_ptr<sp_hdf5::hdf5_extendable_dataset<float>> h5_time;
+#endif
+
+
+    noise_filler(ssize_t nt_chunk_, double increment_, const string &var_filename_, ssize_t seed_) :
+	wi_transform("noise_filler_cpp"),
+	increment(increment_),
+	var_filename(var_filename_),
+	seed(seed_ ? seed_ : counter_rng::random_seed()),
+	intensity_rng(seed, 0),
+	rms_rng(seed, 1)
+    {
+	stringstream ss;
+	ss << "noise_filler_cpp(nt_chunk=" << nt_chunk_ << ", increment=" << increment;
+	if (var_filename.size() > 0)
+	    ss << ", var_filename=" << var_filename;
+	ss << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nds = 0;   // allows noise_filler to run in a wi_sub_pipeline.
+
+	if (nt_chunk <= 0)
+	    _throw("expected nt_chunk > 0");
+	if (seed <= 0)
+	    _throw("expected seed >= 0");
+
+#ifndef HAVE_HDF5
+	if (var_filename.size() > 0)
+	    _throw("nonempty 'var_filename' was specified, but this rf_pipelines was compiled without HAVE_HDF5");
+#endif
+    }
+
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	if ((var_filename.size() > 0) && !json_attrs.isMember("dt_sample"))
+	    _throw("expected json_attrs to contain member 'dt_sample' (needed to write 'var_filename')");
+
+	this->t_initial = json_attrs.isMember("t_initial") ? json_attrs["t_initial"].asDouble() : 0.0;
+	this->dt_sample = json_attrs.isMember("dt_sample") ? json_attrs["dt_sample"].asDouble() : 0.0;
+    }
+
+    virtual void _allocate() override
+    {
+	this->current_rms.resize(nfreq);
+	this->var_buf.resize(nfreq);
+    }
+
+    virtual void _start_pipeline(Json::Value &json_attrs) override
+    {
+	rms_rng.fill_uniform(&current_rms[0], nfreq, 0, 0, 0.02, 2.02);
+
+#ifdef HAVE_HDF5
+	if (var_filename.size() > 0) {
+	    vector<hsize_t> v_chunk_shape = { hsize_t(nfreq), 1 };
+	    vector<hsize_t> t_chunk_shape = { 1, 1 };
+
+	    this->h5_file = sp_hdf5::hdf5_open_trunc(var_filename);
+	    this->h5_var = make_unique<sp_hdf5::hdf5_extendable_dataset<float>> (h5_file, "variance", v_chunk_shape, 1);
+	    this->h5_time = make_unique<sp_hdf5::hdf5_extendable_dataset<float>> (h5_file, "time", t_chunk_shape, 1);
+	}
+#endif
+    }
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	// Note that 'pos' and 'nt_chunk' are high-resolution sample counts.
+	ssize_t nt_ds = xdiv(nt_chunk, nds);
+	ssize_t pos_ds = xdiv(pos, nds);
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	    intensity_rng.fill_gaussian(intensity + ifreq*istride, nt_ds, ifreq, pos_ds, current_rms[ifreq]);
+
+#ifdef HAVE_HDF5
+	if (h5_var) {
+	    float t = t_initial + dt_sample * (pos + 0.5 * nt_chunk);
+
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+		var_buf[ifreq] = current_rms[ifreq] * current_rms[ifreq];
+
+	    h5_var->write(&var_buf[0], { hsize_t(nfreq), 1 });
+	    h5_time->write(&t, { 1, 1 });
+	}
+#endif
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	    current_rms[ifreq] += increment;
+    }
+
+    virtual void _end_pipeline(Json::Value &json_output) override
+    {
+#ifdef HAVE_HDF5
+	if (h5_var) {
+	    // Reset in this order, so that the file is closed after the datasets.
+	    this->h5_var.reset();
+	    this->h5_time.reset();
+	    this->h5_file = H5::H5File();
+
+	    // FIXME if (verbosity >= 2) ...
+	    cout << "noise_filler_cpp: wrote " << var_filename << endl;
+	}
+#endif
+    }
+
+    virtual void _deallocate() override
+    {
+	this->current_rms = vector<float> ();
+	this->var_buf = vector<float> ();
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "noise_filler_cpp";
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+	ret["increment"] = increment;
+	ret["var_filename"] = var_filename;
+	ret["seed"] = Json::Int64(seed);
+
+	return ret;
+    }
+
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
+	double increment = double_from_json(j, "increment");
+	string var_filename = j.isMember("var_filename") ? string_from_json(j, "var_filename") : string();
+	ssize_t seed = j.isMember("seed") ? ssize_t_from_json(j, "seed") : 0;
+
+	return make_shared<noise_filler> (nt_chunk, increment, var_filename, seed);
+    }
+};
+
+
+shared_ptr<wi_transform> make_noise_filler(ssize_t nt_chunk, double increment, const string &var_filename, ssize_t seed)
+{
+    return make_shared<noise_filler> (nt_chunk, increment, var_filename, seed);
+}
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("noise_filler_cpp", noise_filler::from_json);
+	}
+    } init;
+}
+
+
+}  // namespace rf_pipelines
@@ -0,0 +1,193 @@
+#include "rf_kernels/online_mask_filler.hpp"
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// online_mask_filler
+//
+// Keeps a running (exponentially averaged) variance estimate in each frequency channel, which is
+// updated every 'v1_chunk' samples, and uses it to replace masked samples by Gaussian random noise.
+// The running variance and running weights are kept in the rf_kernels::online_mask_filler, and
+// persist across chunks (they are reset between pipeline runs).
+//
+// The heavy lifting is done by rf_kernels::online_mask_filler::mask_fill(), which is vectorized.
+// The scalar reference kernel can be selected with use_scalar_kernel=true (for testing).
+
+
+struct online_mask_filler : public wi_transform {
+    const int v1_chunk;
+    const float var_weight;
+    const float w_clamp;
+    const float w_cutoff;
+    const bool modify_weights;
+    const bool multiply_intensity_by_weights;
+    const bool use_scalar_kernel;
+
+    // Initialized in _bind_transform(), since 'nfreq' is not known until then.
+    unique_ptr<rf_kernels::online_mask_filler> kernel;
+
+    online_mask_filler(int v1_chunk_, float var_weight_, float w_clamp_, float w_cutoff_, int nt_chunk_,
+		       bool modify_weights_, bool multiply_intensity_by_weights_, bool use_scalar_kernel_) :
+	wi_transform("online_mask_filler"),
+	v1_chunk(v1_chunk_),
+	var_weight(var_weight_),
+	w_clamp(w_clamp_),
+	w_cutoff(w_cutoff_),
+	modify_weights(modify_weights_),
+	multiply_intensity_by_weights(multiply_intensity_by_weights_),
+	use_scalar_kernel(use_scalar_kernel_)
+    {
+	stringstream ss;
+	ss << "online_mask_filler(v1_chunk=" << v1_chunk
+	   << ",var_weight=" << var_weight
+	   << ",w_clamp=" << w_clamp
+	   << ",w_cutoff=" << w_cutoff
+	   << ",nt_chunk=" << nt_chunk_
+	   << ",modify_weights=" << modify_weights
+	   << ",multiply_intensity_by_weights=" << multiply_intensity_by_weights
+	   << ",use_scalar_kernel=" << use_scalar_kernel
+	   << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->kernel_chunk_size = v1_chunk;
+	this->nds = 0;   // allows online_mask_filler to run in a wi_sub_pipeline.
+
+	// The vectorized kernel assumes v1_chunk=32.
+	if (v1_chunk != 32)
+	    _throw("currently, v1_chunk must be 32");
+	if (nt_chunk <= 0)
+	    _throw("expected nt_chunk > 0");
+	if ((var_weight <= 0) || (w_clamp <= 0) || (w_cutoff < 0))
+	    _throw("expected var_weight > 0, w_clamp > 0, w_cutoff >= 0");
+
+	if (!modify_weights) {
+	    cout << "online_mask_filler.cpp warning: online_mask_filler is being run from rf_pipelines."
+		 << " Weights will not be modified."
+		 << " For old behaviour, set modify_weights to True." << endl;
+	}
+
+	if (multiply_intensity_by_weights) {
+	    cout << "online_mask_filler.cpp warning: online_mask_filler is being run from rf_pipelines."
+		 << " Intensities will be multiplied by the running weights."
+		 << " For old behaviour, set multiply_intensity_by_weights to False." << endl;
+	}
+    }
+
+    virtual ~online_mask_filler() { }
+
+    // Called after (nfreq, nds) are initialized.
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	this->_init_kernel();
+    }
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	rf_assert(kernel.get() != nullptr);
+
+	// The rf_kernel uses a single stride for the intensity and weights arrays.
+	// (This is currently always the case in rf_pipelines, since the ring buffers have the same shape.)
+	if (istride != wstride)
+	    _throw("intensity and weights arrays have different strides, this is currently unsupported");
+
+	// Note xdiv(nt_chunk, nds) here.
+	int nt = xdiv(nt_chunk, nds);
+
+	if (use_scalar_kernel)
+	    kernel->scalar_mask_fill(nt, istride, intensity, weights);
+	else
+	    kernel->mask_fill(nt, istride, intensity, weights);
+    }
+
+    // Between pipeline runs, we reset the running variance and weights by constructing a new kernel.
+    virtual void _reset() override
+    {
+	if (kernel)
+	    this->_init_kernel();
+    }
+
+    virtual void _unbind_transform() override
+    {
+	this->kernel.reset();
+    }
+
+    void _init_kernel()
+    {
+	this->kernel = make_unique<rf_kernels::online_mask_filler> (nfreq);
+
+	kernel->v1_chunk = this->v1_chunk;
+	kernel->var_weight = this->var_weight;
+	kernel->w_clamp = this->w_clamp;
+	kernel->w_cutoff = this->w_cutoff;
+	kernel->modify_weights = this->modify_weights;
+	kernel->multiply_intensity_by_weights = this->multiply_intensity_by_weights;
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "online_mask_filler";
+	ret["v1_chunk"] = v1_chunk;
+	ret["var_weight"] = var_weight;
+	ret["w_clamp"] = w_clamp;
+	ret["w_cutoff"] = w_cutoff;
+	ret["nt_chunk"] = int(this->get_prebind_nt_chunk());
+	ret["modify_weights"] = modify_weights;
+	ret["multiply_intensity_by_weights"] = multiply_intensity_by_weights;
+	ret["use_scalar_kernel"] = use_scalar_kernel;
+
+	return ret;
+    }
+
+    static shared_ptr<online_mask_filler> from_json(const Json::Value &j)
+    {
+	int v1_chunk = int_from_json(j, "v1_chunk");
+	double var_weight = double_from_json(j, "var_weight");
+	double w_clamp = double_from_json(j, "w_clamp");
+	double w_cutoff = double_from_json(j, "w_cutoff");
+	int nt_chunk = int_from_json(j, "nt_chunk");
+	bool modify_weights = bool_from_json(j, "modify_weights");
+	bool multiply_intensity_by_weights = bool_from_json(j, "multiply_intensity_by_weights");
+	bool use_scalar_kernel = j.isMember("use_scalar_kernel") ? bool_from_json(j, "use_scalar_kernel") : false;
+
+	return make_shared<online_mask_filler> (v1_chunk, var_weight, w_clamp, w_cutoff, nt_chunk, modify_weights, multiply_intensity_by_weights, use_scalar_kernel);
+    }
+};
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("online_mask_filler", online_mask_filler::from_json);
+	}
+    } init;
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Externally-visible factory functions: return pointer to newly constructed online_mask_filler object
+
+
+shared_ptr<wi_transform> make_online_mask_filler(int v1_chunk, float var_weight, float w_clamp, float w_cutoff, int nt_chunk, bool modify_weights, bool multiply_intensity_by_weights)
+{
+    return make_shared<online_mask_filler> (v1_chunk, var_weight, w_clamp, w_cutoff, nt_chunk, modify_weights, multiply_intensity_by_weights, false);
+}
+
+shared_ptr<wi_transform> make_scalar_mask_filler(int v1_chunk, float var_weight, float w_clamp, float w_cutoff, int nt_chunk, bool modify_weights, bool multiply_intensity_by_weights)
+{
+    return make_shared<online_mask_filler> (v1_chunk, var_weight, w_clamp, w_cutoff, nt_chunk, modify_weights, multiply_intensity_by_weights, true);
+}
+
+
+}  // namespace rf_pipelines
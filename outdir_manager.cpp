@@ -10,10 +10,14 @@ namespace rf_pipelines {
 #endif
 
     
-outdir_manager::outdir_manager(const string &outdir_, bool clobber_ok_) :
+outdir_manager::outdir_manager(const string &outdir_, bool clobber_ok_, int png_nthreads_) :
     outdir(outdir_),
-    clobber_ok(clobber_ok_)
+    clobber_ok(clobber_ok_),
+    png_nthreads(png_nthreads_)
 {
+    if (png_nthreads < 0)
+	throw runtime_error("rf_pipelines: outdir_manager constructor: expected png_nthreads >= 0");
+
     if (outdir.size() == 0)
 	return;
 
@@ -39,7 +43,10 @@ string outdir_manager::add_file(const string &basename)
 
     // The return value of unordered_set::insert() is a std::pair whose 
     // second element is 'true' if the inserted value doesn't already exist.
+    unique_lock<mutex> l(lock);
     bool is_new = basenames.insert(basename).second;
+    l.unlock();
+
     string ret = outdir + basename;
 
     if (!is_new)
@@ -47,6 +54,116 @@ string outdir_manager::add_file(const string &basename)
 
     return ret;
 }
-    
+
+
+outdir_manager::~outdir_manager()
+{
+    if (png_threads.size() == 0)
+	return;
+
+    // Pending files are still written (but errors are dropped).
+    unique_lock<mutex> l(png_lock);
+    png_done = true;
+    png_cv.notify_all();
+    l.unlock();
+
+    for (auto &t: png_threads)
+	t.join();
+}
+
+
+void outdir_manager::write_png_async(const string &filename, vector<uint8_t> &&rgb, int m, int n, bool ymajor, bool ytop_to_bottom, int compression, const string &filter)
+{
+    rf_assert(ssize_t(rgb.size()) == ssize_t(m) * ssize_t(n) * 3);
+
+    if (png_nthreads == 0) {
+	write_rgb8_png(filename, &rgb[0], m, n, ymajor, ytop_to_bottom, compression, filter);
+	return;
+    }
+
+    png_job job;
+    job.filename = filename;
+    job.rgb = std::move(rgb);
+    job.m = m;
+    job.n = n;
+    job.ymajor = ymajor;
+    job.ytop_to_bottom = ytop_to_bottom;
+    job.compression = compression;
+    job.filter = filter;
+
+    size_t max_queued = max(int(png_max_queued), 2 * png_nthreads);
+    unique_lock<mutex> l(png_lock);
+
+    if (png_threads.size() == 0) {
+	for (int i = 0; i < png_nthreads; i++)
+	    png_threads.push_back(std::thread(&outdir_manager::_png_worker_main, this));
+    }
+
+    while (!png_error && (png_queue.size() >= max_queued))
+	png_cv.wait(l);
+
+    _rethrow_png_error();
+
+    png_queue.push_back(std::move(job));
+    png_cv.notify_all();
+}
+
+
+void outdir_manager::wait_for_pngs()
+{
+    unique_lock<mutex> l(png_lock);
+
+    while (!png_error && ((png_queue.size() > 0) || (png_nbusy > 0)))
+	png_cv.wait(l);
+
+    _rethrow_png_error();
+}
+
+
+void outdir_manager::_png_worker_main()
+{
+    unique_lock<mutex> l(png_lock);
+
+    for (;;) {
+	while (!png_done && png_queue.empty())
+	    png_cv.wait(l);
+
+	if (png_queue.empty())
+	    return;   // png_done is set, and queue is drained
+
+	png_job job = std::move(png_queue.front());
+	png_queue.pop_front();
+	png_nbusy++;
+	png_cv.notify_all();   // wake up write_png_async(), if waiting for queue space
+	l.unlock();
+
+	std::exception_ptr err;
+
+	try {
+	    write_rgb8_png(job.filename, &job.rgb[0], job.m, job.n, job.ymajor, job.ytop_to_bottom, job.compression, job.filter);
+	} catch (...) {
+	    err = std::current_exception();
+	}
+
+	l.lock();
+	png_nbusy--;
+	if (err && !png_error)
+	    png_error = err;
+	png_cv.notify_all();
+    }
+}
+
+
+// Caller must hold the lock.  The error is only rethrown once.
+void outdir_manager::_rethrow_png_error()
+{
+    if (!png_error)
+	return;
+
+    std::exception_ptr e = png_error;
+    png_error = nullptr;
+    std::rethrow_exception(e);
+}
+
 
 }  // namespace rf_pipelines
@@ -51,6 +51,9 @@ void pipeline::_bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
     for (size_t i = 0; i < elements.size(); i++) {
 	auto p = elements[i];
 
+	// Consecutive wi_sub_pipelines can share downsampled data (see wi_sub_pipeline.cpp).
+	wi_sub_pipeline::_plan_pyramid(elements, i, rb_dict);
+
 	run_params params = this->get_params();
 	params.container_depth++;
 	params.container_index = i;
@@ -145,10 +148,22 @@ void pipeline::_start_pipeline(Json::Value &json_attrs)
 
 void pipeline::_end_pipeline(Json::Value &json_output)
 {
+    // If an element throws, we still call end_pipeline() on later elements, and rethrow the first exception.
+    std::exception_ptr err;
+
     for (int i = 0; i < (int)elements.size(); i++) {
 	json_output["pipeline"].append(Json::Value(Json::objectValue));
-	elements[i]->end_pipeline(json_output["pipeline"][i]);
+
+	try {
+	    elements[i]->end_pipeline(json_output["pipeline"][i]);
+	} catch (...) {
+	    if (!err)
+		err = std::current_exception();
+	}
     }
+
+    if (err)
+	std::rethrow_exception(err);
 }
 
 void pipeline::_reset()
@@ -8,6 +8,17 @@ namespace rf_pipelines {
 #endif
 
 
+// pipeline_fork: creates new ring_buffers by copying existing ones.
+//
+// If 'copy_on_write' is true, then the output ring_buffers are lazy copies (see
+// ring_buffer::set_cow_parent()), and _advance() doesn't copy any data.  A range is only
+// copied when one side writes to it, so a fork which is only read downstream (e.g. by a plotter
+// or mask_counter) is nearly free.  The price is a larger input ring_buffer, and a runtime error
+// if some pipeline_object writes the input while reading the output over the same range.
+//
+// Copy-on-write is not supported if the input is itself a copy-on-write buffer, and in this
+// case we silently fall back to copying.
+
 struct pipeline_fork : public pipeline_object
 {
     struct element {
@@ -19,13 +30,16 @@ struct pipeline_fork : public pipeline_object
 	shared_ptr<ring_buffer> input_buffer;
 	shared_ptr<ring_buffer> output_buffer;
 	ssize_t csize = 0;
+	bool cow = false;
     };
 
+    const bool copy_on_write;
     vector<element> elements;
 
 
-    pipeline_fork(const vector<pair<string,string>> &bufnames) :
-	pipeline_object("pipeline_fork")
+    pipeline_fork(const vector<pair<string,string>> &bufnames, bool copy_on_write_) :
+	pipeline_object(copy_on_write_ ? "pipeline_fork(copy_on_write=true)" : "pipeline_fork"),
+	copy_on_write(copy_on_write_)
     {
 	unordered_set<string> all_names;
 
@@ -56,6 +70,10 @@ struct pipeline_fork : public pipeline_object
 	    e.input_buffer = this->get_buffer(rb_dict, e.input_bufname);
 	    e.output_buffer = this->create_buffer(rb_dict, e.output_bufname, e.input_buffer->cdims, e.input_buffer->nds);
 	    e.csize = prod(e.input_buffer->cdims);
+	    e.cow = copy_on_write && !e.input_buffer->has_cow_parent();
+
+	    if (e.cow)
+		e.output_buffer->set_cow_parent(e.input_buffer);
 	}
     }
 
@@ -63,6 +81,11 @@ struct pipeline_fork : public pipeline_object
     virtual ssize_t _advance() override
     {
 	for (element &e: this->elements) {
+	    if (e.cow) {
+		e.output_buffer->cow_append(pos_lo, pos_hi);
+		continue;
+	    }
+
 	    ring_buffer_subarray src(e.input_buffer, pos_lo, pos_hi, ring_buffer::ACCESS_READ);
 	    ring_buffer_subarray dst(e.output_buffer, pos_lo, pos_hi, ring_buffer::ACCESS_APPEND);
 
@@ -81,6 +104,7 @@ struct pipeline_fork : public pipeline_object
 
 	ret["class_name"] = "pipeline_fork";
 	ret["bufnames"] = Json::Value(Json::arrayValue);
+	ret["copy_on_write"] = copy_on_write;
 
 	for (const element &e: this->elements) {
 	    Json::Value je(Json::arrayValue);
@@ -107,7 +131,8 @@ struct pipeline_fork : public pipeline_object
 	    bufnames.push_back(pair<string,string> (input_bufname, output_bufname));
 	}
 
-	return make_shared<pipeline_fork> (bufnames);
+	bool copy_on_write = j.isMember("copy_on_write") ? bool_from_json(j, "copy_on_write") : false;
+	return make_shared<pipeline_fork> (bufnames, copy_on_write);
     }
 };
 
@@ -122,9 +147,9 @@ namespace {
 
 
 // Externally callable factory function
-shared_ptr<pipeline_object> make_pipeline_fork(const vector<pair<string,string>> &bufnames)
+shared_ptr<pipeline_object> make_pipeline_fork(const vector<pair<string,string>> &bufnames, bool copy_on_write)
 {
-    return make_shared<pipeline_fork> (bufnames);
+    return make_shared<pipeline_fork> (bufnames, copy_on_write);
 }
 
 
@@ -88,7 +88,7 @@ void pipeline_object::bind(const run_params &params)
     this->json_attrs1 = params.extra_attrs;
 
     ring_buffer_dict rb_dict;
-    shared_ptr<outdir_manager> mp = make_shared<outdir_manager> (params.outdir, params.clobber);
+    shared_ptr<outdir_manager> mp = make_shared<outdir_manager> (params.outdir, params.clobber, params.png_nthreads);
     
     this->bind(params, rb_dict, n, n, json_attrs1, mp);
 }
@@ -360,6 +360,10 @@ Json::Value pipeline_object::run(const run_params &params, const callback_t &cal
     json_output["img_nzoom"] = Json::Int64(_params.img_nzoom);
     json_output["img_nds"] = Json::Int64(_params.img_nds);
     json_output["img_nx"] = Json::Int64(_params.img_nx);
+    json_output["png_compression"] = _params.png_compression;
+    json_output["png_filter"] = _params.png_filter;
+    json_output["png_nthreads"] = _params.png_nthreads;
+    json_output["png_store_intermediate"] = _params.png_store_intermediate;
     json_output["verbosity"] = _params.verbosity;
     json_output["debug"] = _params.debug;
 
@@ -369,7 +373,31 @@ Json::Value pipeline_object::run(const run_params &params, const callback_t &cal
     if (params.verbosity >= 2)
 	cout << "rf_pipelines: calling end_pipeline()\n";
 
-    this->end_pipeline(json_output);
+    // Exceptions from end_pipeline() (e.g. errors from background threads which were not delivered
+    // during the advance() loop) are treated like exceptions from the advance() loop, so that we
+    // still wait for plots and write the json file.
+    try {
+	this->end_pipeline(json_output);
+    } catch (std::exception &e) {
+	if (!exception_thrown) {
+	    exception_text = e.what();
+	    exception_thrown = true;
+	    json_output["success"] = false;
+	    json_output["error_message"] = exception_text;
+	}
+    }
+
+    // Wait for plots which are being written in the background (see zoomable_tileset.cpp).
+    try {
+	out_mp->wait_for_pngs();
+    } catch (std::exception &e) {
+	if (!exception_thrown) {
+	    exception_text = e.what();
+	    exception_thrown = true;
+	    json_output["success"] = false;
+	    json_output["error_message"] = exception_text;
+	}
+    }
 
     // Try to write json file, even if exception was thrown.
     if (params.outdir.size() > 0) {
@@ -460,7 +488,15 @@ void pipeline_object::end_pipeline(Json::Value &json_output)
     if (!json_output.isObject())
 	_throw("end_pipeline(): internal error: Json::Value was not an Object as expected");
 
-    this->_end_pipeline(json_output);
+    // If _end_pipeline() throws, we finish the bookkeeping below before rethrowing,
+    // so that the json output is complete and the state is consistent.
+    std::exception_ptr err;
+
+    try {
+	this->_end_pipeline(json_output);
+    } catch (...) {
+	err = std::current_exception();
+    }
 
     for (const auto &p: this->zoomable_tilesets)
 	p->flush();
@@ -496,6 +532,9 @@ void pipeline_object::end_pipeline(Json::Value &json_output)
 	for (const auto &j: p->json_output)
 	    json_output["plots"].append(j);
     }
+
+    if (err)
+	std::rethrow_exception(err);
 }
 
 
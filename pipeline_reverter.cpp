@@ -0,0 +1,134 @@
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// pipeline_reverter: undoes the effect of all pipeline_objects since a previous pipeline_fork,
+// by rebinding buffer names, rather than copying data.
+//
+// For each (saved_bufname, bufname) pair, the ring_buffer which was previously called 'saved_bufname'
+// is also called 'bufname' in the rest of the pipeline.  Since this happens in bind(), _advance()
+// doesn't need to do anything.  The ring_buffer which was previously called 'bufname' is still
+// allocated (by the pipeline_object which created it), but is no longer visible to pipeline_objects
+// which come after the pipeline_reverter.
+//
+// Note that after the pipeline_reverter, both names refer to the same ring_buffer.  In particular,
+// if a downstream transform modifies 'bufname', then 'saved_bufname' will also be modified.
+
+struct pipeline_reverter : public pipeline_object
+{
+    vector<pair<string,string>> bufnames;
+
+
+    pipeline_reverter(const vector<pair<string,string>> &bufnames_) :
+	pipeline_object("pipeline_reverter"),
+	bufnames(bufnames_)
+    {
+	unordered_set<string> all_names;
+
+	if (bufnames.size() == 0)
+	    _throw("empty 'bufnames' list was specified");
+
+	for (const auto &p: bufnames) {
+	    for (const string &s: { p.first, p.second }) {
+		if (s.size() == 0)
+		    _throw("empty bufname string was specified");
+		if (all_names.count(s) > 0)
+		    _throw("duplicate bufname '" + s + "' was specified");
+		all_names.insert(s);
+	    }
+	}
+    }
+
+
+    virtual void _bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override
+    {
+	this->nt_chunk_out = nt_chunk_in;
+	this->nt_contig = 1;
+	this->nt_maxgap = 0;
+
+	// First pass: check everything, before modifying rb_dict.
+	for (const auto &p: bufnames) {
+	    if (!has_key(rb_dict, p.first))
+		_throw("saved buffer '" + p.first + "' does not exist in pipeline (maybe a pipeline_fork is missing?)");
+	    if (!has_key(rb_dict, p.second))
+		_throw("buffer '" + p.second + "' does not exist in pipeline");
+
+	    // Don't call pipeline_object::get_buffer() here, since the pipeline_reverter never
+	    // accesses the ring_buffers (in the same way as wi_sub_pipeline::_bind()).
+	    const auto &rb_saved = rb_dict[p.first];
+	    const auto &rb = rb_dict[p.second];
+
+	    if ((rb_saved->cdims != rb->cdims) || (rb_saved->nds != rb->nds))
+		_throw("buffers '" + p.first + "' and '" + p.second + "' have different shapes or downsampling factors");
+	}
+
+	for (const auto &p: bufnames)
+	    rb_dict[p.second] = rb_dict[p.first];
+    }
+
+
+    virtual ssize_t _advance() override
+    {
+	this->pos_lo = pos_hi.load();
+	return SSIZE_MAX;
+    }
+
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "pipeline_reverter";
+	ret["bufnames"] = Json::Value(Json::arrayValue);
+
+	for (const auto &p: this->bufnames) {
+	    Json::Value je(Json::arrayValue);
+	    je.append(p.first);
+	    je.append(p.second);
+
+	    ret["bufnames"].append(je);
+	}
+
+	return ret;
+    }
+
+    static shared_ptr<pipeline_reverter> from_json(const Json::Value &j)
+    {
+	const Json::Value &jb = array_from_json(j, "bufnames");
+	vector<pair<string,string>> bufnames;
+
+	for (int i = 0; i < int(jb.size()); i++) {
+	    if (!jb[i].isArray() || (jb[i].size() != 2) || !jb[i][0].isString() || !jb[i][1].isString())
+		throw runtime_error("pipeline_reverter::from_json: expected each element of 'bufnames' array to be a pair of strings");
+
+	    bufnames.push_back(pair<string,string> (jb[i][0].asString(), jb[i][1].asString()));
+	}
+
+	return make_shared<pipeline_reverter> (bufnames);
+    }
+};
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("pipeline_reverter", pipeline_reverter::from_json);
+	}
+    } init;
+}
+
+
+// Externally callable factory function
+shared_ptr<pipeline_object> make_pipeline_reverter(const vector<pair<string,string>> &bufnames)
+{
+    return make_shared<pipeline_reverter> (bufnames);
+}
+
+
+}  // namespace rf_pipelines
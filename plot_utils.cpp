@@ -13,7 +13,7 @@ namespace rf_pipelines {
 
 #ifndef HAVE_PNG
 
-void write_rgb8_png(const string &filename, uint8_t *rgb, int m, int n, bool ymajor, bool ytop_to_bottom)
+void write_rgb8_png(const string &filename, uint8_t *rgb, int m, int n, bool ymajor, bool ytop_to_bottom, int compression, const string &filter)
 {
     throw runtime_error("write_rgb8_png() was called, but this version of librf_pipelines wasn't compiled with libpng");
 }
@@ -31,8 +31,11 @@ public:
     // @rgb should be an array of shape (ny,nx,3) where the last index is "rgb".
     // The 'ytop_to_bottom' flag controls whether the outer index ("y") runs from
     // top to bottom in the image, or from bottom to top.
+    //
+    // The 'compression' and 'filter_flags' args are passed to png_set_compression_level()
+    // and png_set_filter(), unless they are negative (in which case libpng defaults are used).
 
-    void write_rgb8(const string &filename, uint8_t *rgb_ymajor, int nx, int ny, bool ytop_to_bottom);
+    void write_rgb8(const string &filename, uint8_t *rgb_ymajor, int nx, int ny, bool ytop_to_bottom, int compression=-1, int filter_flags=-1);
 
     png_writer() { }
     ~png_writer();
@@ -107,7 +110,30 @@ void png_writer::move(png_writer &src)
 }
 
 
-void png_writer::write_rgb8(const string &filename, uint8_t *rgb_ymajor, int nx, int ny, bool ytop_to_bottom)
+// Converts run_params::png_filter to libpng flags (-1 means "use libpng default").
+// Must be kept in sync with run_params::check().
+static int _png_filter_flags(const string &filter)
+{
+    if (filter == "default")
+	return -1;
+    if (filter == "none")
+	return PNG_FILTER_NONE;
+    if (filter == "sub")
+	return PNG_FILTER_SUB;
+    if (filter == "up")
+	return PNG_FILTER_UP;
+    if (filter == "avg")
+	return PNG_FILTER_AVG;
+    if (filter == "paeth")
+	return PNG_FILTER_PAETH;
+    if (filter == "all")
+	return PNG_ALL_FILTERS;
+
+    throw runtime_error("rf_pipelines: unrecognized png filter \"" + filter + "\"");
+}
+
+
+void png_writer::write_rgb8(const string &filename, uint8_t *rgb_ymajor, int nx, int ny, bool ytop_to_bottom, int compression, int filter_flags)
 {
     // Just in case any state remains from a previous call
     // FIXME (low-priority, just curious): is it necessary to reallocate the 'png_structp' and 'png_infop' between writes?
@@ -135,6 +161,11 @@ void png_writer::write_rgb8(const string &filename, uint8_t *rgb_ymajor, int nx,
 
     png_init_io(png_ptr, fp);
 
+    if (compression >= 0)
+	png_set_compression_level(png_ptr, compression);
+    if (filter_flags >= 0)
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filter_flags);
+
     png_set_IHDR(png_ptr, info_ptr, nx, ny,
 		 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 		 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
@@ -162,8 +193,10 @@ void png_writer::write_rgb8(const string &filename, uint8_t *rgb_ymajor, int nx,
 // The 'ymajor' flag controls whether the major (length-m) index of the array is the y-axis of the
 // plots, i.e. the plot dimensions are either (n,m) or (m,n) depending on whether ymajor is true or false.
 
-void write_rgb8_png(const string &filename, uint8_t *rgb, int m, int n, bool ymajor, bool ytop_to_bottom)
+void write_rgb8_png(const string &filename, uint8_t *rgb, int m, int n, bool ymajor, bool ytop_to_bottom, int compression, const string &filter)
 {
+    int filter_flags = _png_filter_flags(filter);
+
     // temporary buffer, if transpose is needed.
     vector<uint8_t> tmp;
 
@@ -183,7 +216,7 @@ void write_rgb8_png(const string &filename, uint8_t *rgb, int m, int n, bool yma
     }
 
     png_writer pw;
-    pw.write_rgb8(filename, rgb, n, m, ytop_to_bottom);
+    pw.write_rgb8(filename, rgb, n, m, ytop_to_bottom, compression, filter_flags);
 }
 
 #endif  // HAVE_PNG
@@ -0,0 +1,577 @@
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include "rf_pipelines_internals.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_PSRFITS
+extern "C" {
+#include <psrfits_utils/psrfits.h>
+}
+#endif // HAVE_PSRFITS
+
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// transpose_uint8_to_float(): cache-blocked transpose/convert kernel used by the psrfits_stream.
+//
+// The outer loop is over blocks of 'nt_block' time samples, so that the source block (nt_block * nfreq bytes)
+// stays in cache while we loop over frequencies.  Within a block, we transpose 16-by-16 tiles (using SSE2
+// if available), and fall back to scalar code for the edges.
+
+
+static constexpr ssize_t nt_block = 64;
+
+
+static inline void _transpose_scalar(float *dst, ssize_t dstride, const uint8_t *src, ssize_t sstride, ssize_t f0, ssize_t f1, ssize_t t0, ssize_t t1)
+{
+    for (ssize_t ifreq = f0; ifreq < f1; ifreq++)
+	for (ssize_t it = t0; it < t1; it++)
+	    dst[ifreq*dstride + it] = src[it*sstride + ifreq];
+}
+
+
+#ifdef __SSE2__
+
+// Transposes a 16-by-16 tile (the input is 16 time samples of 16 frequencies).
+static inline void _transpose_16x16(float *dst, ssize_t dstride, const uint8_t *src, ssize_t sstride)
+{
+    __m128i r[16];
+    __m128i s[16];
+
+    for (int i = 0; i < 16; i++)
+	r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *> (src + i*sstride));
+
+    // Four rounds of interleaving rows i and i+8 give the transpose.
+    for (int iround = 0; iround < 4; iround++) {
+	for (int i = 0; i < 8; i++) {
+	    s[2*i] = _mm_unpacklo_epi8(r[i], r[i+8]);
+	    s[2*i+1] = _mm_unpackhi_epi8(r[i], r[i+8]);
+	}
+	for (int i = 0; i < 16; i++)
+	    r[i] = s[i];
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int i = 0; i < 16; i++) {
+	__m128i lo = _mm_unpacklo_epi8(r[i], zero);
+	__m128i hi = _mm_unpackhi_epi8(r[i], zero);
+	float *d = dst + i*dstride;
+
+	_mm_storeu_ps(d, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+	_mm_storeu_ps(d+4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+	_mm_storeu_ps(d+8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+	_mm_storeu_ps(d+12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+}
+
+#else  // !__SSE2__
+
+static inline void _transpose_16x16(float *dst, ssize_t dstride, const uint8_t *src, ssize_t sstride)
+{
+    _transpose_scalar(dst, dstride, src, sstride, 0, 16, 0, 16);
+}
+
+#endif  // __SSE2__
+
+
+void transpose_uint8_to_float(float *dst, ssize_t dstride, const uint8_t *src, ssize_t sstride, ssize_t nfreq, ssize_t nt)
+{
+    rf_assert(nfreq > 0);
+    rf_assert(nt >= 0);
+    rf_assert(sstride >= nfreq);
+
+    ssize_t nfreq16 = nfreq & ~ssize_t(15);
+
+    for (ssize_t t0 = 0; t0 < nt; t0 += nt_block) {
+	ssize_t t1 = min(t0 + nt_block, nt);
+	ssize_t t16 = t0 + ((t1-t0) & ~ssize_t(15));
+
+	for (ssize_t f0 = 0; f0 < nfreq16; f0 += 16)
+	    for (ssize_t it = t0; it < t16; it += 16)
+		_transpose_16x16(dst + f0*dstride + it, dstride, src + it*sstride + f0, sstride);
+
+	_transpose_scalar(dst, dstride, src, sstride, 0, nfreq16, t16, t1);
+	_transpose_scalar(dst, dstride, src, sstride, nfreq16, nfreq, t0, t1);
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+#ifndef HAVE_PSRFITS
+
+shared_ptr<wi_stream> make_psrfits_stream(const string &filename, ssize_t nt_chunk, int nrows_prefetch)
+{
+    throw runtime_error("make_psrfits_stream() was called, but this rf_pipelines instance was compiled without psrfits");
+}
+
+struct psrfits_stream {
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	throw runtime_error("rf_pipelines: attempt to deserialize psrfits_stream, but this rf_pipelines was compiled without psrfits");
+    }
+};
+
+#else  // HAVE_PSRFITS
+
+//
+// The psrfits reader is factored as two classes:
+//   psrfits_wrapper: lightweight standalone C++ wrapper for 'struct psrfits'.
+//   psrfits_stream: wraps around the psrfits_wrapper, and implements the rf_pipeline stream API.
+//
+// I factored things this way because I thought the psrfits_wrapper might some day be useful
+// outside rf_pipelines.
+//
+// Note: I haven't learned how the psrfits library works yet, and the code below is
+// brain-dead cut-and-paste from a toy program Scott Ransom sent me!
+//
+
+
+// One row of the FITS file.
+//
+// The data is represented as a shape-(nt_per_row, nfreq) unsigned 8-bit integer array.
+// Note that time is the slowest varying index.  This is the opposite of the rf_pipelines
+// convention, so there is a transpose in psrfits_stream::_fill_chunk() below.
+//
+// The psrfits file format supports a per-frequency floating-point weight.
+// Note that there is no way to get a per-(frequency,time_sample) weight.
+
+struct psrfits_row {
+    uptr<uint8_t> data;
+    uptr<float> freq_weights;
+};
+
+
+// psrfits_wrapper: a lightweight standalone C++ wrapper for 'struct psrfits' from Scott Ransom C library
+struct psrfits_wrapper {
+    struct psrfits pf;
+    string filename;
+
+    ssize_t nfreq;
+    ssize_t npol;
+    ssize_t nt_per_row;
+    ssize_t nbytes_per_row;
+
+    double freq_lo_MHz;
+    double freq_hi_MHz;
+    double dt_sample;     // in seconds
+
+    // If true, then frequency channels in the file are ordered from lowest to highest.
+    // In rf_pipelines, frequencies are ordered from highest to lowest, so the psrfits_stream flips them.
+    bool frequencies_are_increasing;
+
+    // When the psrfits_wrapper object is created, it reads the first row of the FITS file into this->first_row.
+    unique_ptr<psrfits_row> first_row;
+
+    // make noncopyable
+    psrfits_wrapper(const psrfits_wrapper &) = delete;
+    psrfits_wrapper &operator=(const psrfits_wrapper &) = delete;
+
+    explicit psrfits_wrapper(const string &filename_)
+	: filename(filename_)
+    {
+	memset(&pf, 0, sizeof(pf));   // This just seems like a good idea
+
+	// FIXME not sure if strdup() is needed here; does psrfits hang on to the pointer?
+	// (Also, there is currently a small memory leak here.)
+	char *f = strdup(filename.c_str());
+
+	char *filenames[2] = { f, nullptr };
+	psrfits_set_files(&pf, 1, filenames);
+
+	pf.tot_rows = 0;
+	pf.N = 0;
+	pf.T = 0;
+	pf.status = 0;
+
+	int rv = psrfits_open(&pf);
+	if (rv) {
+	    // FIXME print error to string and include text in exception, rather than printing to stderr
+	    fits_report_error(stderr, rv);
+	    throw runtime_error(filename + ": file not found or wrong format");
+	}
+
+	// I think this case should be OK, but this warning seems like a good idea...
+	if (pf.hdr.nbits != 8)
+	    cerr << (filename + ": warning: bit depth is not equal to 8, this is a case that has never been tested so there may be bugs!\n");
+
+	this->nfreq = pf.hdr.nchan;
+	this->npol = pf.hdr.npol;
+
+	rf_assert(nfreq >= 2);
+	rf_assert(npol == 1);  // FIXME not sure how to handle the case where npol != 1
+
+	// Allocate buffers
+	pf.sub.dat_freqs = aligned_alloc<float> (nfreq);
+	pf.sub.dat_weights = aligned_alloc<float> (nfreq);
+	pf.sub.dat_offsets = aligned_alloc<float> (nfreq * npol);
+	pf.sub.dat_scales = aligned_alloc<float> (nfreq * npol);
+
+	int bits_per_subint = pf.sub.bytes_per_subint * 8;
+	if (bits_per_subint % pf.hdr.nbits)
+	    throw runtime_error(filename + ": bits_per_subint is not divisible by hdr.nbits, not quite sure what do in this case");
+
+	this->nbytes_per_row = bits_per_subint / pf.hdr.nbits;
+	this->first_row = make_row();
+
+	if (!read_row(*first_row))
+	    throw runtime_error(filename + ": couldn't read first row of FITS file");
+
+	// Not sure whether it's necessary to call psrfits_read_subint() before making the assignments below
+
+	this->nt_per_row = pf.hdr.nsblk;
+	this->dt_sample = pf.hdr.dt;
+
+	if (nt_per_row * nfreq > nbytes_per_row)
+	    throw runtime_error(filename + ": row size is smaller than (nsblk * nchan)?!");
+
+	float freq0 = pf.sub.dat_freqs[nfreq-1];
+	float freq1 = pf.sub.dat_freqs[0];
+
+	this->frequencies_are_increasing = (freq0 > freq1);
+	if (frequencies_are_increasing)
+	    std::swap(freq0, freq1);
+
+	this->freq_lo_MHz = freq0 - (0.5/(nfreq-1)) * (freq1-freq0);
+	this->freq_hi_MHz = freq1 + (0.5/(nfreq-1)) * (freq1-freq0);
+    }
+
+    unique_ptr<psrfits_row> make_row() const
+    {
+	unique_ptr<psrfits_row> ret = make_unique<psrfits_row> ();
+	ret->data = make_uptr<uint8_t> (nbytes_per_row);
+	ret->freq_weights = make_uptr<float> (nfreq);
+	return ret;
+    }
+
+    // Reads next FITS row into 'row'.  Returns false if the row couldn't be read.
+    // FIXME how to differentiate errors from end-of-file?
+    bool read_row(psrfits_row &row)
+    {
+	// psrfits_read_subint() reads into pf.sub.data, so we point it at the caller's buffer.
+	pf.sub.data = row.data.get();
+	pf.sub.rawdata = row.data.get();
+
+	int rv = psrfits_read_subint(&pf);
+
+	pf.sub.data = pf.sub.rawdata = nullptr;
+
+	if (rv != 0)
+	    return false;
+
+	memcpy(row.freq_weights.get(), pf.sub.dat_weights, nfreq * sizeof(float));
+	return true;
+    }
+
+    ~psrfits_wrapper()
+    {
+	free(pf.sub.dat_freqs);
+	free(pf.sub.dat_weights);
+	free(pf.sub.dat_offsets);
+	free(pf.sub.dat_scales);
+
+	pf.sub.dat_freqs = pf.sub.dat_weights = pf.sub.dat_offsets = pf.sub.dat_scales = nullptr;
+    }
+};
+
+
+// psrfits_stream: wraps around the psrfits_wrapper class, and implements the rf_pipeline stream API.
+//
+// FITS rows are read by a background thread, which stays up to 'nrows_prefetch' rows ahead of the
+// pipeline, so that disk I/O overlaps with processing.  Each call to _fill_chunk() transposes as many
+// rows (or partial rows) as needed to fill the chunk.
+
+struct psrfits_stream : public wi_stream
+{
+    const string filename;
+    const int nrows_prefetch;
+
+    // Initialized in _bind_stream().
+    shared_ptr<psrfits_wrapper> p;
+
+    // Row currently being transposed (owned by the main thread), and the index of the next time sample.
+    unique_ptr<psrfits_row> curr_row;
+    ssize_t it_row = 0;
+
+    // Reader thread state, protected by 'lock'.
+    std::thread reader;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<unique_ptr<psrfits_row>> full_rows;
+    std::vector<unique_ptr<psrfits_row>> free_rows;
+    bool reader_eof = false;
+    bool reader_done = false;
+    std::exception_ptr reader_error;
+
+
+    psrfits_stream(const string &filename_, ssize_t nt_chunk_, int nrows_prefetch_) :
+	wi_stream("psrfits_stream"),
+	filename(filename_),
+	nrows_prefetch(nrows_prefetch_)
+    {
+	if (nrows_prefetch <= 0)
+	    _throw("expected nrows_prefetch > 0");
+
+	// We initialize nt_chunk here, but defer initialization of nfreq to _bind_stream().
+	this->nt_chunk = (nt_chunk_ > 0) ? nt_chunk_ : 1024;
+    }
+
+    virtual ~psrfits_stream()
+    {
+	_stop_reader();
+    }
+
+    virtual void _bind_stream(Json::Value &json_attrs) override
+    {
+	this->p = make_shared<psrfits_wrapper> (filename);
+	this->nfreq = p->nfreq;
+
+	json_attrs["freq_lo_MHz"] = p->freq_lo_MHz;
+	json_attrs["freq_hi_MHz"] = p->freq_hi_MHz;
+	json_attrs["dt_sample"] = p->dt_sample;
+
+	// FIXME psrfits_stream currently sets the initial time of the stream to zero.
+	// What's a sensible way to determine an initial time from a 'struct psrfits'?
+	json_attrs["t_initial"] = 0.0;
+    }
+
+    virtual void _allocate() override
+    {
+	// One row for the main thread, plus 'nrows_prefetch' rows for the reader thread.
+	// (The first row was allocated by the psrfits_wrapper.)
+	for (int i = 0; i < nrows_prefetch; i++)
+	    free_rows.push_back(p->make_row());
+    }
+
+    virtual void _start_pipeline(Json::Value &json_attrs) override
+    {
+	// The psrfits_wrapper reads the first row when it is constructed.
+	// If this is not the first pipeline run, we need to reopen the file.
+	if (!p->first_row) {
+	    auto new_p = make_shared<psrfits_wrapper> (filename);
+	    if ((new_p->nfreq != p->nfreq) || (new_p->nbytes_per_row != p->nbytes_per_row))
+		_throw("file '" + filename + "' changed between pipeline runs?!");
+	    this->p = new_p;
+	}
+
+	this->curr_row = std::move(p->first_row);
+	this->it_row = 0;
+	this->reader_eof = false;
+	this->reader_done = false;
+	this->reader_error = nullptr;
+	this->reader = std::thread(&psrfits_stream::_reader_main, this);
+    }
+
+    virtual bool _fill_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	const ssize_t nt_per_row = p->nt_per_row;
+	ssize_t it_chunk = 0;
+
+	// In rf_pipelines, frequencies must be ordered from highest frequency to lowest.
+	// If the file uses the opposite ordering, we reorder by using a negative stride.
+	bool incflag = p->frequencies_are_increasing;
+	float *dst_int = incflag ? (intensity + (nfreq-1)*istride) : intensity;
+	float *dst_wt = incflag ? (weights + (nfreq-1)*wstride) : weights;
+	ssize_t dst_istride = incflag ? (-istride) : istride;
+	ssize_t dst_wstride = incflag ? (-wstride) : wstride;
+
+	while (it_chunk < nt_chunk) {
+	    if (it_row >= nt_per_row) {
+		_next_row();
+		this->it_row = 0;
+	    }
+
+	    if (!curr_row) {
+		// End of stream: zero the rest of the chunk.
+		for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+		    memset(intensity + ifreq*istride + it_chunk, 0, (nt_chunk - it_chunk) * sizeof(float));
+		    memset(weights + ifreq*wstride + it_chunk, 0, (nt_chunk - it_chunk) * sizeof(float));
+		}
+		return false;
+	    }
+
+	    ssize_t n = min(nt_per_row - it_row, nt_chunk - it_chunk);
+
+	    // Transpose and convert uint8 -> float
+	    transpose_uint8_to_float(dst_int + it_chunk, dst_istride, curr_row->data.get() + it_row*nfreq, nfreq, nfreq, n);
+
+	    // psrfits weights are per-(frequency,row), not per-(frequency,sample)
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+		float w = curr_row->freq_weights[ifreq];
+		if (w < 0.0)
+		    throw runtime_error(filename + ": negative weight in file, this is currently treated as an error");
+
+		float *wp = dst_wt + ifreq*dst_wstride + it_chunk;
+		for (ssize_t it = 0; it < n; it++)
+		    wp[it] = w;
+	    }
+
+	    it_row += n;
+	    it_chunk += n;
+	}
+
+	return true;
+    }
+
+    // Returns the current row to the reader thread, and waits for the next one.
+    // On exit, curr_row is empty iff end-of-stream has been reached.
+    void _next_row()
+    {
+	unique_lock<mutex> l(lock);
+
+	if (curr_row) {
+	    free_rows.push_back(std::move(curr_row));
+	    cv.notify_all();
+	}
+
+	while (full_rows.empty() && !reader_eof && !reader_error)
+	    cv.wait(l);
+
+	if (reader_error)
+	    std::rethrow_exception(reader_error);
+
+	if (!full_rows.empty()) {
+	    this->curr_row = std::move(full_rows.front());
+	    full_rows.pop_front();
+	    cv.notify_all();
+	}
+    }
+
+    void _reader_main()
+    {
+	try {
+	    for (;;) {
+		unique_lock<mutex> l(lock);
+		while (free_rows.empty() && !reader_done)
+		    cv.wait(l);
+
+		if (reader_done)
+		    return;
+
+		unique_ptr<psrfits_row> row = std::move(free_rows.back());
+		free_rows.pop_back();
+		l.unlock();
+
+		// Read outside the lock.
+		bool ok = p->read_row(*row);
+
+		l.lock();
+
+		if (!ok) {
+		    free_rows.push_back(std::move(row));
+		    reader_eof = true;
+		    cv.notify_all();
+		    return;
+		}
+
+		full_rows.push_back(std::move(row));
+		cv.notify_all();
+	    }
+	} catch (...) {
+	    // Saved for the main thread, which will rethrow.
+	    lock_guard<mutex> l(lock);
+	    reader_error = std::current_exception();
+	    cv.notify_all();
+	}
+    }
+
+    // Signals the reader thread to exit, joins it, and returns all rows to the pool.
+    void _stop_reader()
+    {
+	if (!reader.joinable())
+	    return;
+
+	unique_lock<mutex> l(lock);
+	reader_done = true;
+	cv.notify_all();
+	l.unlock();
+
+	reader.join();
+
+	if (curr_row)
+	    free_rows.push_back(std::move(curr_row));
+
+	while (!full_rows.empty()) {
+	    free_rows.push_back(std::move(full_rows.front()));
+	    full_rows.pop_front();
+	}
+    }
+
+    virtual void _end_pipeline(Json::Value &json_output) override
+    {
+	_stop_reader();
+    }
+
+    virtual void _reset() override
+    {
+	_stop_reader();
+    }
+
+    virtual void _deallocate() override
+    {
+	_stop_reader();
+	this->free_rows.clear();
+    }
+
+    virtual void _unbind_stream() override
+    {
+	this->p.reset();
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "psrfits_stream";
+	ret["filename"] = filename;
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+	ret["nrows_prefetch"] = nrows_prefetch;
+
+	return ret;
+    }
+
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	string filename = string_from_json(j, "filename");
+	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
+	int nrows_prefetch = j.isMember("nrows_prefetch") ? int_from_json(j, "nrows_prefetch") : 2;
+
+	return make_shared<psrfits_stream> (filename, nt_chunk, nrows_prefetch);
+    }
+};
+
+
+// Factory function returning new stream
+shared_ptr<wi_stream> make_psrfits_stream(const string &filename, ssize_t nt_chunk, int nrows_prefetch)
+{
+    return make_shared<psrfits_stream> (filename, nt_chunk, nrows_prefetch);
+}
+
+
+#endif  // HAVE_PSRFITS
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("psrfits_stream", psrfits_stream::from_json);
+	}
+    } init;
+}
+
+
+}   // namespace rf_pipelines
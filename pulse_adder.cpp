@@ -0,0 +1,242 @@
+#include <algorithm>
+#include "rf_pipelines_internals.hpp"
+#include "rf_pipelines_inventory.hpp"
+
+#ifdef HAVE_SIMPULSE
+#include <simpulse.hpp>
+#endif
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+#ifndef HAVE_SIMPULSE
+
+shared_ptr<wi_transform> make_pulse_adder(ssize_t nt_chunk, const vector<shared_ptr<simpulse::single_pulse>> &pulses, double weight)
+{
+    throw runtime_error("make_pulse_adder() was called, but this rf_pipelines instance was compiled without simpulse");
+}
+
+#else  // HAVE_SIMPULSE
+
+
+// pulse_adder: adds one or more simpulse::single_pulse objects to the intensity array.
+//
+// The old version called simpulse::single_pulse::add_to_timestream() for every pulse in every chunk,
+// which dominates the running time when there are many pulses.  Here, each pulse is rendered once in
+// _bind_transform(), and stored sparsely as a list of "segments" (one per frequency channel overlapped
+// by the pulse), sorted by starting time sample.  In _process_chunk(), we only touch the segments
+// which overlap the chunk, so the cost is proportional to the number of (freq,time) samples where
+// some pulse is nonzero.
+
+struct pulse_adder : public wi_transform
+{
+    struct segment {
+	ssize_t ifreq;
+	ssize_t it0;      // first time sample (relative to start of stream)
+	ssize_t it1;      // last time sample + 1
+	ssize_t offset;   // index of first sample in 'prof_data'
+    };
+
+    const vector<shared_ptr<simpulse::single_pulse>> pulses;
+    const double weight;
+
+    // Initialized in _bind_transform().
+    vector<float> prof_data;
+    vector<segment> segments;    // sorted by it0
+
+    // Per-run state, reset in _start_pipeline().
+    // Segments [0:iseg_next) have been moved to 'active' (or have already been fully added).
+    size_t iseg_next = 0;
+    vector<const segment *> active;
+
+
+    pulse_adder(ssize_t nt_chunk_, const vector<shared_ptr<simpulse::single_pulse>> &pulses_, double weight_) :
+	wi_transform("pulse_adder"),
+	pulses(pulses_),
+	weight(weight_)
+    {
+	stringstream ss;
+	ss << "pulse_adder(nt_chunk=" << nt_chunk_ << ", npulses=" << pulses.size() << ", weight=" << weight << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+
+	if (nt_chunk <= 0)
+	    _throw("expected nt_chunk > 0");
+	if (pulses.size() == 0)
+	    _throw("empty 'pulses' list was specified");
+
+	for (const auto &p: pulses)
+	    if (!p)
+		_throw("empty shared_ptr<simpulse::single_pulse> was specified");
+    }
+
+    virtual ~pulse_adder() { }
+
+
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	if (!json_attrs.isMember("dt_sample"))
+	    _throw("expected json_attrs to contain member 'dt_sample'");
+
+	double dt_sample = json_attrs["dt_sample"].asDouble();
+	double t_initial = json_attrs.isMember("t_initial") ? json_attrs["t_initial"].asDouble() : 0.0;
+
+	this->prof_data.clear();
+	this->segments.clear();
+
+	for (const auto &p: pulses) {
+	    if (p->nfreq != nfreq)
+		_throw("pulse nfreq (=" + to_string(p->nfreq) + ") doesn't match pipeline nfreq (=" + to_string(nfreq) + ")");
+	    this->_add_pulse(*p, t_initial, dt_sample);
+	}
+
+	std::stable_sort(segments.begin(), segments.end(), [](const segment &a, const segment &b) { return a.it0 < b.it0; });
+    }
+
+
+    // Renders the pulse in blocks of 'nb' samples, and appends its segments.
+    void _add_pulse(const simpulse::single_pulse &p, double t_initial, double dt_sample)
+    {
+	double pt0, pt1;
+	p.get_endpoints(pt0, pt1);
+
+	ssize_t it_lo = max(ssize_t(floor((pt0 - t_initial) / dt_sample)), ssize_t(0));
+	ssize_t it_hi = ssize_t(ceil((pt1 - t_initial) / dt_sample)) + 1;
+
+	if (it_lo >= it_hi)
+	    return;
+
+	// Block size is chosen so that the scratch buffer is <= 16 MB.
+	ssize_t nb = max(ssize_t(16), min(ssize_t(1024), ssize_t(1<<22) / nfreq));
+	vector<float> buf(nfreq * nb);
+
+	// Per-channel segment under construction (it1 == -1 if none).
+	vector<ssize_t> seg_it0(nfreq, -1);
+	vector<ssize_t> seg_it1(nfreq, -1);
+	vector<vector<float>> seg_data(nfreq);
+
+	for (ssize_t b0 = it_lo; b0 < it_hi; b0 += nb) {
+	    std::fill(buf.begin(), buf.end(), 0.0f);
+
+	    // simpulse orders frequency channels from lowest to highest, so we use a negative stride.
+	    p.add_to_timestream(&buf[0] + (nfreq-1)*nb, t_initial + b0 * dt_sample, t_initial + (b0+nb) * dt_sample, nb, -nb, weight);
+
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+		const float *row = &buf[ifreq*nb];
+		ssize_t i0 = 0;
+		ssize_t i1 = nb;
+
+		while ((i0 < i1) && (row[i0] == 0.0f))
+		    i0++;
+		while ((i1 > i0) && (row[i1-1] == 0.0f))
+		    i1--;
+
+		if (i0 == i1)
+		    continue;
+
+		vector<float> &v = seg_data[ifreq];
+
+		if (seg_it1[ifreq] < 0)
+		    seg_it0[ifreq] = b0 + i0;
+		else
+		    v.resize(v.size() + (b0 + i0 - seg_it1[ifreq]), 0.0f);   // zero-pad the gap
+
+		v.insert(v.end(), row + i0, row + i1);
+		seg_it1[ifreq] = b0 + i1;
+	    }
+	}
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    if (seg_it1[ifreq] < 0)
+		continue;
+
+	    segment s;
+	    s.ifreq = ifreq;
+	    s.it0 = seg_it0[ifreq];
+	    s.it1 = seg_it1[ifreq];
+	    s.offset = prof_data.size();
+
+	    prof_data.insert(prof_data.end(), seg_data[ifreq].begin(), seg_data[ifreq].end());
+	    segments.push_back(s);
+	}
+    }
+
+
+    virtual void _start_pipeline(Json::Value &json_attrs) override
+    {
+	this->iseg_next = 0;
+	this->active.clear();
+    }
+
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	ssize_t pos_end = pos + nt_chunk;
+
+	// Activate segments which start before the end of this chunk.
+	while ((iseg_next < segments.size()) && (segments[iseg_next].it0 < pos_end)) {
+	    if (segments[iseg_next].it1 > pos)
+		active.push_back(&segments[iseg_next]);
+	    iseg_next++;
+	}
+
+	size_t nactive = 0;
+
+	for (const segment *s: active) {
+	    ssize_t lo = max(s->it0, pos);
+	    ssize_t hi = min(s->it1, pos_end);
+
+	    const float *src = &prof_data[s->offset] + (lo - s->it0);
+	    float *dst = intensity + s->ifreq * istride + (lo - pos);
+
+	    for (ssize_t i = 0; i < hi-lo; i++)
+		dst[i] += src[i];
+
+	    // Keep segments which extend past this chunk.
+	    if (s->it1 > pos_end)
+		active[nactive++] = s;
+	}
+
+	active.resize(nactive);
+    }
+
+
+    virtual void _unbind_transform() override
+    {
+	this->prof_data = vector<float> ();
+	this->segments = vector<segment> ();
+	this->active = vector<const segment *> ();
+    }
+
+
+    // Note: there is no from_json(), since simpulse::single_pulse objects can't be deserialized.
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "pulse_adder";
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+	ret["npulses"] = Json::Int64(pulses.size());
+	ret["weight"] = weight;
+
+	return ret;
+    }
+};
+
+
+// Externally visible factory function.
+shared_ptr<wi_transform> make_pulse_adder(ssize_t nt_chunk, const vector<shared_ptr<simpulse::single_pulse>> &pulses, double weight)
+{
+    return make_shared<pulse_adder> (nt_chunk, pulses, weight);
+}
+
+
+#endif  // HAVE_SIMPULSE
+
+}  // namespace rf_pipelines
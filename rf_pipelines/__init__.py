@@ -15,6 +15,7 @@ Container classes
 -----------------
   pipeline
   wi_sub_pipeline
+  dag_pipeline
 
 Streams
 -------
@@ -26,6 +27,7 @@ Streams
   chime_frb_stream_from_glob
   chime_network_stream
   gaussian_noise_stream
+  psrfits_stream
 
 Detrenders
 ----------
@@ -36,8 +38,15 @@ Clippers
 --------
   intensity_clipper
   std_dev_clipper
+  kurtosis_filter
   mask_expander
 
+Utility classes
+---------------
+  pipeline_fork
+  pipeline_reverter
+  bitmask_maker
+
 CHIME-specific
 --------------
   chime_file_writer
@@ -48,16 +57,16 @@ CHIME-specific
 
 Miscellaneous transforms
 ------------------------
-  adversarial_masker (*)
-  badchannel_mask (*)
-  bonsai_dedisperser (*)
-  chime_file_writer (*)
-  chime_packetizer (*)
-  frb_injector_transform (*)
-  mask_filler (*) 
-  noise_filler (*)
+  adversarial_masker (**)
+  badchannel_mask
+  bonsai_dedisperser (**)
+  frb_injector_transform (**)
+  mask_filler (**)
+  noise_filler (**)
+  online_mask_filler
   plotter_transform (*)
-  variance_estimator (*)
+  thermal_noise_weight
+  variance_estimator (**)
 
 Utilities
 ---------
@@ -68,6 +77,7 @@ Utilities
   wi_downsample
 
 (*) = python-only
+(**) = has both python and C++ versions (the C++ version has a "_cpp" suffix, e.g. variance_estimator_cpp)
 """
 
 
@@ -102,7 +112,6 @@ from .transforms.frb_injector_transform import frb_injector_transform
 from .transforms.variance_estimator import variance_estimator
 from .transforms.mask_filler import mask_filler
 from .transforms.noise_filler import noise_filler
-#from .transforms.online_mask_filler import online_mask_filler
 
 # Helper routines for implementing new transforms in python.
 
@@ -1,8 +1,4 @@
-// FIXME the big missing feature here is pythonizing 'class ring_buffer', and
-// extending the pythonization of 'pipeline_object' and 'chunked_pipeline_object'.
-//
-// FIXME: currently we can define wi_streams and wi_transforms from python, but not more
-// general pipeline_objects.
+// FIXME the pythonization of 'chunked_pipeline_object' is still partial (can't be subclassed from python).
 //
 // FIXME (minor): wi_stream, wi_transform constructors should have optional 'name' arg,
 // for consistency with C++ API.
@@ -285,12 +281,41 @@ static std::function<py_object(C*, py_tuple, py_dict)> wrap_j(void (C::*f)(Json:
 // Upcalling helpers.
 //
 // FIXME generalize and move to pyclops.
+//
+// The GIL is released while a pipeline is running (see wrap_pipeline_object() below), so that
+// C++ pipeline_objects don't serialize other python threads.  Therefore, every upcall must
+// reacquire the GIL before touching python objects, by constructing a 'gil_acquirer' first.
+// (PyGILState_Ensure() is reentrant, so this is also OK if the GIL is already held.)
+
+
+struct gil_acquirer {
+    PyGILState_STATE state;
+
+    gil_acquirer() : state(PyGILState_Ensure()) { }
+    ~gil_acquirer() { PyGILState_Release(state); }
+
+    gil_acquirer(const gil_acquirer &) = delete;
+    gil_acquirer &operator=(const gil_acquirer &) = delete;
+};
+
+
+// Must be constructed with the GIL held.
+struct gil_releaser {
+    PyThreadState *tstate;
+
+    gil_releaser() : tstate(PyEval_SaveThread()) { }
+    ~gil_releaser() { PyEval_RestoreThread(tstate); }
+
+    gil_releaser(const gil_releaser &) = delete;
+    gil_releaser &operator=(const gil_releaser &) = delete;
+};
 
 
 // "_nodef": no default virtual (or rather, default virtual does nothing)
 template<typename T, typename B, typename TT>
 static inline void _upcall_nodef(const extension_type<T,B> &type, TT *self, const char *method_name)
 {
+    gil_acquirer gil;
     virtual_function<void> vf(type, self, method_name);
     if (vf.exists)
 	vf.upcall();
@@ -301,6 +326,7 @@ static inline void _upcall_nodef(const extension_type<T,B> &type, TT *self, cons
 template<typename T, typename B, typename TT>
 static inline void _upcall_nodef_j(const extension_type<T,B> &type, TT *self, const char *method_name, Json::Value &j)
 {
+    gil_acquirer gil;
     virtual_function<void> vf(type, self, method_name);
 
     if (!vf.exists)
@@ -327,17 +353,35 @@ static inline void _upcall_nodef_j(const extension_type<T,B> &type, TT *self, co
 static string doc_pipeline_object =
     ("pipeline_object: rf_pipelines base class.\n"
      "\n"
-     "Current pythonization is partial: can call run(), bind(), allocate(), jsonize(), etc.\n"
-     "but new pipeline_objects can't be defined from python.  This is because 'class ring_buffer'\n"
-     "isn't pythonized yet (this is on my todo list!)\n"
+     "To run a pipeline, just call pipeline.run()!\n"
+     "\n"
+     "New pipeline_objects can be defined from python, by subclassing pipeline_object and defining\n"
+     "_bind(json_attrs) and _advance().  Syntax is similar to the C++ API:\n"
+     "\n"
+     "   class X(rf_pipelines.pipeline_object):\n"
+     "       def __init__(self):\n"
+     "           rf_pipelines.pipeline_object.__init__(self, 'X')\n"
      "\n"
-     "To run a pipeline, just call pipeline.run()!\n");
+     "       def _bind(self, json_attrs):\n"
+     "           # Must initialize nt_chunk_out, nt_maxgap, nt_contig, and call get_buffer() or create_buffer().\n"
+     "           self.nt_chunk_out = self.nt_chunk_in\n"
+     "           self.nt_maxgap = 0\n"
+     "           self.nt_contig = self.nt_chunk_in\n"
+     "           self.rb_weights = self.get_buffer('WEIGHTS')\n"
+     "\n"
+     "       def _advance(self):\n"
+     "           # Must advance pos_lo, and return the end-of-stream sample count (or a large number).\n"
+     "           for pos in xrange(self.pos_lo, self.pos_hi, self.nt_chunk_out):\n"
+     "               with self.rb_weights.get(pos, pos + self.nt_chunk_out, 'rw') as w:\n"
+     "                   w[:,:] *= 0.5    # 'w' is a numpy array which aliases ring_buffer memory\n"
+     "           self.pos_lo = self.pos_hi\n"
+     "           return 2**62\n");
 
 static string doc_chunked_pipeline_object =
     ("chunked_pipeline_object: represents any pipeline_object which processes in fixed-size chunks.\n"
      "\n"
      "Current pythonization is partial: new chunked_pipeline_objects can't be defined from python.\n"
-     "This is because 'class ring_buffer' isn't pythonized yet (this is on my todo list!)\n");
+     "(If you need this, subclass wi_stream, wi_transform, or pipeline_object instead.)\n");
 
 static string doc_wi_stream =
     ("wi_stream: represents any pipeline_object which outputs intensity/weights arrays in fixed-size chunks");
@@ -356,12 +400,13 @@ static string doc_wi_sub_pipeline =
      "lower (freqency, time) resolution, then upsample and apply the resulting mask.\n"
      "\n"
      "Constructor syntax:\n"
-     "    p = wi_sub_pipeline(sub_pipeline, w_cutoff=0.0, nt_chunk=0, nfreq_out=0, nds_out=0, Df=0, Dt=0)\n"
+     "    p = wi_sub_pipeline(sub_pipeline, w_cutoff=0.0, nt_chunk=0, nfreq_out=0, nds_out=0, Df=0, Dt=0, nbuf_async=0)\n"
      "\n"
      " 	  nfreq_out = number of frequency channels after downsampling to sub-pipeline\n"
      "    nds_out = cumulative time downsampling (relative to input data) after downsampling to sub-pipeline\n"
      "    Df = frequency downsampling factor (between input pipeline and sub-pipeline)\n"
      "    Dt = time downsampling factor (between input pipeline and sub-pipeline)\n"
+     "    nbuf_async = if nonzero, the sub-pipeline runs in a helper thread, with this many chunks in flight\n"
      "\n"
      "The initializer allows a flexible syntax where some fields can be specified (i.e. nonzero)\n"
      "and others unspecified (i.e. zero).  For example:\n"
@@ -373,6 +418,41 @@ static string doc_wi_sub_pipeline =
      "\n"
      "The parameter pair (nds_out, Dt) behaves similarly.");
 
+static string doc_dag_pipeline =
+    ("dag_pipeline: this container class runs pipeline_objects which form a directed acyclic graph,\n"
+     "so that independent branches (e.g. diagnostics and triggering) can run concurrently.\n"
+     "\n"
+     "Constructor syntax:\n"
+     "    p = dag_pipeline(object_list, bufnames, nthreads=0, name=\"\")\n"
+     "\n"
+     "    bufnames = list (same length as object_list) of lists of ring buffer names used by each object\n"
+     "    nthreads = total number of threads, including the caller (if zero, one per \"sink\" object)\n"
+     "\n"
+     "An object depends on an earlier object if they use a common bufname, and objects without a\n"
+     "dependency path between them run in parallel.  Note that reading a ring buffer counts as using it.");
+
+
+static string doc_ring_buffer =
+    ("ring_buffer: pipeline buffer, which python pipeline_objects obtain in _bind() by calling\n"
+     "pipeline_object.get_buffer() or pipeline_object.create_buffer().\n"
+     "\n"
+     "Data is accessed with ring_buffer.get(pos0, pos1, access_mode), which returns a context manager:\n"
+     "\n"
+     "   with rb.get(pos0, pos1, 'rw') as a:\n"
+     "       # 'a' is a numpy array of shape cdims + ((pos1-pos0)//nds,)\n"
+     "\n"
+     "The array aliases the ring_buffer memory (no copy), and is returned to the ring_buffer when\n"
+     "the 'with' block exits.  References to the array must not be used after that point!\n"
+     "\n"
+     "The 'access_mode' argument is one of 'r', 'w', 'rw', 'append'.  As in C++, the time indices\n"
+     "'pos0' and 'pos1' do not have the downsampling factor 'nds' applied, but the array dimensions do.\n"
+     "The ring_buffer dimensions (cdims, nds, etc.) can be obtained with ring_buffer.get_info().");
+
+static string doc_ring_buffer_subarray =
+    ("ring_buffer_subarray: returned by ring_buffer.get(), this is a context manager whose __enter__()\n"
+     "method returns a numpy array.  As an alternative to the 'with' statement, asarray() and put() can\n"
+     "be called directly (every get() must be followed by a put() before the next get()).");
+
 
 static extension_type<pipeline_object>
 pipeline_object_type("pipeline_object", doc_pipeline_object);
@@ -392,6 +472,15 @@ pipeline_type("pipeline", doc_pipeline, pipeline_object_type);
 static extension_type<wi_sub_pipeline, pipeline>
 wi_sub_pipeline_type("wi_sub_pipeline", doc_wi_sub_pipeline, pipeline_type);
 
+static extension_type<dag_pipeline, pipeline_object>
+dag_pipeline_type("dag_pipeline", doc_dag_pipeline, pipeline_object_type);
+
+static extension_type<ring_buffer>
+ring_buffer_type("ring_buffer", doc_ring_buffer);
+
+static extension_type<ring_buffer_subarray>
+ring_buffer_subarray_type("ring_buffer_subarray", doc_ring_buffer_subarray);
+
 
 namespace pyclops {
     template<> struct xconverter<pipeline_object>  { static constexpr auto *type = &pipeline_object_type; };    
@@ -401,34 +490,230 @@ namespace pyclops {
     template<> struct xconverter<wi_transform>     { static constexpr auto *type = &wi_transform_type; };
     template<> struct xconverter<pipeline>         { static constexpr auto *type = &pipeline_type; };
     template<> struct xconverter<wi_sub_pipeline>  { static constexpr auto *type = &wi_sub_pipeline_type; };
+    template<> struct xconverter<dag_pipeline>     { static constexpr auto *type = &dag_pipeline_type; };
+
+    template<> struct xconverter<ring_buffer>           { static constexpr auto *type = &ring_buffer_type; };
+    template<> struct xconverter<ring_buffer_subarray>  { static constexpr auto *type = &ring_buffer_subarray_type; };
 }
 
 
 // -------------------------------------------------------------------------------------------------
 //
-// wrap_pipeline_object()
+// wrap_ring_buffer()
+//
+// The numpy arrays returned by ring_buffer_subarray alias the ring_buffer memory, so that python
+// pipeline_objects can process data in place, without allocating or copying arrays in each chunk.
+// As with the (intensity, weights) arrays in py_wi_transform, it is the caller's responsibility not
+// to use the array after the ring_buffer_subarray has been put() back.
+
+
+static int access_mode_from_string(const string &s)
+{
+    const char *c = s.c_str();
+
+    if (!strcasecmp(c,"r") || !strcasecmp(c,"read") || !strcasecmp(c,"access_read"))
+	return ring_buffer::ACCESS_READ;
+    if (!strcasecmp(c,"w") || !strcasecmp(c,"write") || !strcasecmp(c,"access_write"))
+	return ring_buffer::ACCESS_WRITE;
+    if (!strcasecmp(c,"rw") || !strcasecmp(c,"access_rw"))
+	return ring_buffer::ACCESS_RW;
+    if (!strcasecmp(c,"a") || !strcasecmp(c,"append") || !strcasecmp(c,"access_append"))
+	return ring_buffer::ACCESS_APPEND;
+
+    throw runtime_error("ring_buffer.get(): bad 'access_mode' parameter '" + s + "' (expected one of 'r', 'w', 'rw', 'append')");
+}
+
+
+// Returns numpy array of shape cdims + ((pos1-pos0)/nds,), which aliases the ring_buffer memory.
+static py_array subarray_to_numpy(ring_buffer_subarray *self)
+{
+    if (!self->buf)
+	throw runtime_error("ring_buffer_subarray: array has already been put() back to the ring_buffer");
+
+    const vector<ssize_t> &cdims = self->buf->cdims;
+    int ndim = cdims.size() + 1;
+
+    npy_intp sf = npy_intp(sizeof(float));
+    vector<npy_intp> py_shape(ndim);
+    vector<npy_intp> py_strides(ndim);
+
+    py_shape[ndim-1] = (self->pos1 - self->pos0) / self->buf->nds;
+    py_strides[ndim-1] = sf;
+
+    npy_intp s = self->stride * sf;
+    for (int i = ndim-2; i >= 0; i--) {
+	py_shape[i] = cdims[i];
+	py_strides[i] = s;
+	s *= cdims[i];
+    }
+
+    int flags = (self->access_mode & ring_buffer::ACCESS_WRITE) ? NPY_ARRAY_WRITEABLE : 0;
+    return py_array::from_pointer(ndim, &py_shape[0], &py_strides[0], sizeof(float), self->data, NPY_FLOAT, flags);
+}
+
+
+static void wrap_ring_buffer(extension_module &m)
+{
+    std::function<ring_buffer* ()>
+	_rb_init = []() -> ring_buffer* { throw runtime_error("rf_pipelines.ring_buffer cannot be constructed from python (use pipeline_object.create_buffer())"); };
+
+    // The ring_buffer_subarray holds an owning reference to the ring_buffer (every ring_buffer is
+    // created by make_shared<>), so that the python subarray can't outlive its buffer.
+    std::function<shared_ptr<ring_buffer_subarray> (ring_buffer *, ssize_t, ssize_t, const string &)>
+	_get = [](ring_buffer *self, ssize_t pos0, ssize_t pos1, const string &access_mode)
+	{
+	    return make_shared<ring_buffer_subarray> (self->shared_from_this(), pos0, pos1, access_mode_from_string(access_mode));
+	};
+
+    ring_buffer_type.add_constructor(wrap_constructor(_rb_init));
+    ring_buffer_type.add_method("get", "get(pos0, pos1, access_mode) -> ring_buffer_subarray (context manager)", wrap_method(_get, "pos0", "pos1", "access_mode"));
+    ring_buffer_type.add_method("get_info", "get_info() -> json (includes cdims, nds, etc.)", wrap_method(&ring_buffer::get_info));
+
+    std::function<ring_buffer_subarray* ()>
+	_sa_init = []() -> ring_buffer_subarray* { throw runtime_error("rf_pipelines.ring_buffer_subarray cannot be constructed from python (use ring_buffer.get())"); };
+
+    std::function<py_array (ring_buffer_subarray *)>
+	_asarray = [](ring_buffer_subarray *self) { return subarray_to_numpy(self); };
+
+    std::function<void (ring_buffer_subarray *)>
+	_put = [](ring_buffer_subarray *self) { self->reset(); };
+
+    // Returns false, so that exceptions raised in the 'with' block are propagated.
+    std::function<bool (ring_buffer_subarray *, const py_object &, const py_object &, const py_object &)>
+	_exit = [](ring_buffer_subarray *self, const py_object &exc_type, const py_object &exc_value, const py_object &traceback)
+	{
+	    self->reset();
+	    return false;
+	};
+
+    ring_buffer_subarray_type.add_constructor(wrap_constructor(_sa_init));
+    ring_buffer_subarray_type.add_method("asarray", "asarray() -> numpy array (aliases ring_buffer memory)", wrap_method(_asarray));
+    ring_buffer_subarray_type.add_method("put", "put(): returns array to ring_buffer (called automatically at end of 'with' block)", wrap_method(_put));
+    ring_buffer_subarray_type.add_method("__enter__", "", wrap_method(_asarray));
+    ring_buffer_subarray_type.add_method("__exit__", "", wrap_method(_exit, "exc_type", "exc_value", "traceback"));
+
+    m.add_type(ring_buffer_type);
+    m.add_type(ring_buffer_subarray_type);
+}
+
+
+// -------------------------------------------------------------------------------------------------
 //
-// Current pythonization is partial: can call run(), bind(), allocate(), jsonize(), etc.
-// but new pipeline_objects can't be defined from python.  This is because 'class ring_buffer'
-// isn't pythonized yet (this is on my todo list!)
+// wrap_pipeline_object()
+
+
+// "Upcalling" class for python subclasses of pipeline_object.
 //
-// Note: the "upcalling" class
-//   struct py_pipeline_object : pipeline_object { ... };
+// The C++ _bind() takes a (ring_buffer_dict &), which isn't python-wrapped.  Instead, the python
+// _bind() takes a single 'json_attrs' argument, and calls self.get_buffer() or self.create_buffer(),
+// which use the ring_buffer_dict saved in 'curr_rb_dict' (only valid while _bind() is running).
 //
-// is not needed, since subclassing from python isn't implemented yet.
+// Similarly, pos_lo, pos_hi, pos_max are std::atomics, which can't be python properties.  Before
+// _advance() is upcalled, they are copied to the py_pos_* members (exposed to python as properties
+// named pos_lo, pos_hi, pos_max), and after _advance() returns, py_pos_lo is copied back to pos_lo.
+
+struct py_pipeline_object : pipeline_object {
+    ring_buffer_dict *curr_rb_dict = nullptr;
+
+    ssize_t py_pos_lo = 0;
+    ssize_t py_pos_hi = 0;
+    ssize_t py_pos_max = 0;
+
+    py_pipeline_object(const string &class_name_) :
+	pipeline_object(class_name_)
+    { }
+
+    // _bind() and _advance() are the only pure virtuals.
+    virtual void _bind(ring_buffer_dict &rb_dict, Json::Value &j) override
+    {
+	gil_acquirer gil;
+	pure_virtual_function<void> vf(pipeline_object_type, this, "_bind");
+
+	// Deep-copy the Json::Value, as in _upcall_nodef_j().
+	py_object py_json = converter<Json::Value>::to_python(j);
+
+	this->curr_rb_dict = &rb_dict;
+
+	try {
+	    vf.upcall(py_json);
+	} catch (...) {
+	    this->curr_rb_dict = nullptr;
+	    throw;
+	}
+
+	this->curr_rb_dict = nullptr;
+	j = converter<Json::Value>::from_python(py_json);
+    }
+
+    virtual ssize_t _advance() override
+    {
+	gil_acquirer gil;
+	pure_virtual_function<ssize_t> vf(pipeline_object_type, this, "_advance");
+
+	this->py_pos_lo = pos_lo;
+	this->py_pos_hi = pos_hi;
+	this->py_pos_max = pos_max;
+
+	ssize_t ret = vf.upcall();
+
+	this->pos_lo = py_pos_lo;
+	return ret;
+    }
+
+    // Non-pure virtuals follow.
+
+    virtual Json::Value jsonize() const override
+    {
+	gil_acquirer gil;
+	virtual_function<Json::Value> vf(pipeline_object_type, this, "jsonize");
+	return vf.exists ? vf.upcall() : pipeline_object::jsonize();
+    }
+
+    virtual ssize_t get_preferred_chunk_size() override
+    {
+	gil_acquirer gil;
+	virtual_function<ssize_t> vf(pipeline_object_type, this, "get_preferred_chunk_size");
+	return vf.exists ? vf.upcall() : pipeline_object::get_preferred_chunk_size();
+    }
+
+    virtual void _start_pipeline(Json::Value &j) override { _upcall_nodef_j(pipeline_object_type, this, "_start_pipeline", j); }
+    virtual void _end_pipeline(Json::Value &j) override   { _upcall_nodef_j(pipeline_object_type, this, "_end_pipeline", j); }
+    virtual void _get_info(Json::Value &j) override       { _upcall_nodef_j(pipeline_object_type, this, "_get_info", j); }
+
+    virtual void _allocate() override    { _upcall_nodef(pipeline_object_type, this, "_allocate"); }
+    virtual void _deallocate() override  { _upcall_nodef(pipeline_object_type, this, "_deallocate"); }
+    virtual void _unbind() override      { _upcall_nodef(pipeline_object_type, this, "_unbind"); }
+    virtual void _reset() override       { _upcall_nodef(pipeline_object_type, this, "_reset"); }
+};
+
+
+// Helper for python-callable methods which only make sense for python subclasses of pipeline_object.
+static py_pipeline_object *_py_self(pipeline_object *self, const char *method_name)
+{
+    py_pipeline_object *ret = dynamic_cast<py_pipeline_object *> (self);
+
+    if (!ret)
+	throw runtime_error(self->name + ": pipeline_object." + method_name + " can only be used in pipeline_objects defined from python");
+
+    return ret;
+}
 
 
 // Helper function, passed as 'callback' in pipeline_object::run(), so that the pipeline
 // will periodically check for control-C, and throw the appropriate exception.
 static void check_signals(ssize_t pos_lo, ssize_t pos_hi)
 {
+    gil_acquirer gil;
+
     if (PyErr_Occurred() || PyErr_CheckSignals())
 	throw pyerr_occurred();
 }
 
 
 // Used to wrap pipeline_object::bind() and pipeline_object::run().
-static run_params make_run_params(const py_object &outdir, bool clobber, ssize_t img_nzoom, ssize_t img_nds, ssize_t img_nx, int verbosity, bool debug, const py_object &extra_attrs)
+static run_params make_run_params(const py_object &outdir, bool clobber, ssize_t img_nzoom, ssize_t img_nds, ssize_t img_nx,
+				  int png_compression, const string &png_filter, int png_nthreads, bool png_store_intermediate,
+				  int verbosity, bool debug, const py_object &extra_attrs)
 {
     run_params ret;
 
@@ -450,6 +735,10 @@ static run_params make_run_params(const py_object &outdir, bool clobber, ssize_t
     ret.img_nzoom = img_nzoom;
     ret.img_nds = img_nds;
     ret.img_nx = img_nx;
+    ret.png_compression = png_compression;
+    ret.png_filter = png_filter;
+    ret.png_nthreads = png_nthreads;
+    ret.png_store_intermediate = png_store_intermediate;
     ret.verbosity = verbosity;
     ret.debug = debug;
 
@@ -459,8 +748,12 @@ static run_params make_run_params(const py_object &outdir, bool clobber, ssize_t
 
 static void wrap_pipeline_object(extension_module &m)
 {
-    std::function<pipeline_object* ()>
-	_init = []() -> pipeline_object* { throw runtime_error("rf_pipelines.pipeline_object cannot be directly subclassed from python (yet)"); };
+    // constructor for python subclasses of pipeline_object
+    std::function<pipeline_object* (const string &)>
+	_init = [](const string &class_name) -> pipeline_object*
+	{
+	    return new py_pipeline_object(class_name);
+	};
 
     std::function<string& (pipeline_object *)>
 	_name = [](pipeline_object *self) -> string& { return self->name; };
@@ -468,20 +761,55 @@ static void wrap_pipeline_object(extension_module &m)
     std::function<string& (pipeline_object *)>
 	_class_name = [](pipeline_object *self) -> string& { return self->class_name; };
 
-    std::function<void (pipeline_object *, const py_object &, bool, ssize_t, ssize_t, ssize_t, int, bool, const py_object &)>
-	_bind = [](pipeline_object *self, const py_object &outdir, bool clobber, ssize_t img_nzoom, ssize_t img_nds, ssize_t img_nx, int verbosity, bool debug, const py_object &extra_attrs)
+    // Chunk size properties (see comments in rf_pipelines_base_classes.hpp).
+    std::function<ssize_t& (pipeline_object *)> _nt_chunk_in = [](pipeline_object *self) -> ssize_t& { return self->nt_chunk_in; };
+    std::function<ssize_t& (pipeline_object *)> _nt_maxlag = [](pipeline_object *self) -> ssize_t& { return self->nt_maxlag; };
+    std::function<ssize_t& (pipeline_object *)> _nt_chunk_out = [](pipeline_object *self) -> ssize_t& { return self->nt_chunk_out; };
+    std::function<ssize_t& (pipeline_object *)> _nt_maxgap = [](pipeline_object *self) -> ssize_t& { return self->nt_maxgap; };
+    std::function<ssize_t& (pipeline_object *)> _nt_contig = [](pipeline_object *self) -> ssize_t& { return self->nt_contig; };
+
+    // Stream position properties (python subclasses only, see py_pipeline_object above).
+    std::function<ssize_t& (pipeline_object *)> _pos_lo = [](pipeline_object *self) -> ssize_t& { return _py_self(self,"pos_lo")->py_pos_lo; };
+    std::function<ssize_t& (pipeline_object *)> _pos_hi = [](pipeline_object *self) -> ssize_t& { return _py_self(self,"pos_hi")->py_pos_hi; };
+    std::function<ssize_t& (pipeline_object *)> _pos_max = [](pipeline_object *self) -> ssize_t& { return _py_self(self,"pos_max")->py_pos_max; };
+
+    std::function<shared_ptr<ring_buffer> (pipeline_object *, const string &)>
+	_get_buffer = [](pipeline_object *self, const string &bufname)
 	{
-	    run_params p = make_run_params(outdir, clobber, img_nzoom, img_nds, img_nx, verbosity, debug, extra_attrs);
+	    py_pipeline_object *p = _py_self(self, "get_buffer()");
+	    if (!p->curr_rb_dict)
+		throw runtime_error(self->name + ": pipeline_object.get_buffer() must be called from _bind()");
+	    return self->get_buffer(*p->curr_rb_dict, bufname);
+	};
+
+    std::function<shared_ptr<ring_buffer> (pipeline_object *, const string &, const vector<ssize_t> &, ssize_t)>
+	_create_buffer = [](pipeline_object *self, const string &bufname, const vector<ssize_t> &cdims, ssize_t nds)
+	{
+	    py_pipeline_object *p = _py_self(self, "create_buffer()");
+	    if (!p->curr_rb_dict)
+		throw runtime_error(self->name + ": pipeline_object.create_buffer() must be called from _bind()");
+	    return self->create_buffer(*p->curr_rb_dict, bufname, cdims, nds);
+	};
+
+    std::function<void (pipeline_object *, const py_object &, bool, ssize_t, ssize_t, ssize_t, int, const string &, int, bool, int, bool, const py_object &)>
+	_bind = [](pipeline_object *self, const py_object &outdir, bool clobber, ssize_t img_nzoom, ssize_t img_nds, ssize_t img_nx,
+		   int png_compression, const string &png_filter, int png_nthreads, bool png_store_intermediate, int verbosity, bool debug, const py_object &extra_attrs)
+	{
+	    run_params p = make_run_params(outdir, clobber, img_nzoom, img_nds, img_nx, png_compression, png_filter, png_nthreads, png_store_intermediate, verbosity, debug, extra_attrs);
+	    gil_releaser nogil;
 	    return self->bind(p);
 	};
 
-    std::function<Json::Value (pipeline_object *, const py_object &, bool, ssize_t, ssize_t, ssize_t, int, bool, const py_object &)>
-	_run = [](pipeline_object *self, const py_object &outdir, bool clobber, ssize_t img_nzoom, ssize_t img_nds, ssize_t img_nx, int verbosity, bool debug, const py_object &extra_attrs)
+    std::function<Json::Value (pipeline_object *, const py_object &, bool, ssize_t, ssize_t, ssize_t, int, const string &, int, bool, int, bool, const py_object &)>
+	_run = [](pipeline_object *self, const py_object &outdir, bool clobber, ssize_t img_nzoom, ssize_t img_nds, ssize_t img_nx,
+		  int png_compression, const string &png_filter, int png_nthreads, bool png_store_intermediate, int verbosity, bool debug, const py_object &extra_attrs)
 	{
 	    // FIXME for completeness, should allow python caller to specify a callback function.
 	    // (This should be called via a C++ wrapper which also calls check_signals().)
 
-	    run_params p = make_run_params(outdir, clobber, img_nzoom, img_nds, img_nx, verbosity, debug, extra_attrs);
+	    // The GIL is released while the pipeline runs, and reacquired in upcalls to python pipeline_objects.
+	    run_params p = make_run_params(outdir, clobber, img_nzoom, img_nds, img_nx, png_compression, png_filter, png_nthreads, png_store_intermediate, verbosity, debug, extra_attrs);
+	    gil_releaser nogil;
 	    return self->run(p, check_signals);
 	};
 
@@ -502,6 +830,7 @@ static void wrap_pipeline_object(extension_module &m)
 	    std::function<shared_ptr<pipeline_object> (const Json::Value &)>
 	    _constructor = [f](const Json::Value &json_data)
 	    {
+		gil_acquirer gil;
 		py_object py_json = converter<Json::Value>::to_python(json_data);
 		py_tuple py_args = py_tuple::make(py_json);
 		py_object py_ret = f.call(py_args);
@@ -512,7 +841,8 @@ static void wrap_pipeline_object(extension_module &m)
 	};
 
     // doc_rp1, doc_rp2 are building blocks for doc_bind, doc_run, which both take a run_params.
-    string doc_rp1 = ("outdir='.', clobber=True, img_nzoom=4, img_nds=16, img_nx=256, verbosity=2, debug=False, extra_attrs=None");
+    string doc_rp1 = ("outdir='.', clobber=True, img_nzoom=4, img_nds=16, img_nx=256, png_compression=-1, png_filter='default',\n"
+		      "    png_nthreads=1, png_store_intermediate=False, verbosity=2, debug=False, extra_attrs=None");
 
     string doc_rp2 = ("'outdir' is the rf_pipelines output directory, where the rf_pipelines json file will\n"
 		      "be written, in addition to other transform-specific output files such as plots.\n"
@@ -529,6 +859,13 @@ static void wrap_pipeline_object(extension_module &m)
 		      "   img_nds = time downsampling factor of plots at lowest zoom level\n"
 		      "   img_nx = number of x-pixels (i.e. time axis) in each plot tile\n"
 		      "\n"
+		      "PNG encoder params:\n"
+		      "   png_compression = zlib compression level (0-9), or -1 for the zlib default (level 6)\n"
+		      "   png_filter = row filter ('default', 'none', 'sub', 'up', 'avg', 'paeth', or 'all')\n"
+		      "   png_nthreads = number of background threads encoding plot tiles (0 = encode in pipeline thread)\n"
+		      "   png_store_intermediate = if True, tiles at intermediate zoom levels (i.e. not the first or\n"
+		      "      last zoom level) are written without deflate compression, and with no row filter.\n"
+		      "\n"
 		      "The meaning of the 'verbosity' argument is:\n"
 		      "    0 = no output\n"
 		      "    1 = high-level summary output (names of transforms, number of samples processed etc.)\n"
@@ -612,6 +949,18 @@ static void wrap_pipeline_object(extension_module &m)
 			   "\n"
 			   "The return value is the full pathname ('basename' with the pipeline output_dir prepended)");
 
+    string doc_get_buffer = ("get_buffer(bufname) -> ring_buffer\n"
+			     "\n"
+			     "Called from _bind(), for each pre-existing pipeline ring buffer which the pipeline_object uses.\n"
+			     "Currently, this can only be called from pipeline_objects which are defined in python.");
+
+    string doc_create_buffer = ("create_buffer(bufname, cdims, nds) -> ring_buffer\n"
+				"\n"
+				"Called from _bind(), for each new pipeline ring buffer which the pipeline_object creates.\n"
+				"The 'cdims' arg is a list of \"complementary\" dimensions (all dimensions except time axis),\n"
+				"and 'nds' is the time downsampling factor of the new buffer.\n"
+				"Currently, this can only be called from pipeline_objects which are defined in python.");
+
     string doc_add_file = ("add_file(basename) -> fullpath [string]\n"
 			   "\n"
 			   "This helper function is used by pipeline_objects which write output files which are not plots.\n"
@@ -624,16 +973,28 @@ static void wrap_pipeline_object(extension_module &m)
     auto _add_plot = wrap_method(&pipeline_object::add_plot, "basename", "it0", "nt", "nx", "ny", kwarg("group_id",0));
     auto _add_file = wrap_method(&pipeline_object::add_file, "basename");
     
-    pipeline_object_type.add_constructor(wrap_constructor(_init));
+    pipeline_object_type.add_constructor(wrap_constructor(_init, "class_name"));
     pipeline_object_type.add_property("name", "Name of pipeline_object", _name);
     pipeline_object_type.add_property("class_name", "Name of pipeline_object subclass", _class_name);
 
+    pipeline_object_type.add_property("nt_chunk_in", "Input chunk size (initialized before _bind() is called)", _nt_chunk_in);
+    pipeline_object_type.add_property("nt_maxlag", "Max lag when _advance() is called (initialized before _bind() is called)", _nt_maxlag);
+    pipeline_object_type.add_property("nt_chunk_out", "Output chunk size (must be initialized in _bind())", _nt_chunk_out);
+    pipeline_object_type.add_property("nt_maxgap", "Max allowed (pos_hi-pos_lo) after _advance() returns (must be initialized in _bind())", _nt_maxgap);
+    pipeline_object_type.add_property("nt_contig", "Max contiguous chunk size requested from ring buffers (must be initialized in _bind())", _nt_contig);
+
+    pipeline_object_type.add_property("pos_lo", "Number of samples processed (python subclasses only, must be advanced in _advance())", _pos_lo);
+    pipeline_object_type.add_property("pos_hi", "Number of samples ready for processing (python subclasses only)", _pos_hi);
+    pipeline_object_type.add_property("pos_max", "Number of samples which have entered the pipeline (python subclasses only)", _pos_max);
+
     pipeline_object_type.add_method("run", doc_run, wrap_method(_run, kwarg("outdir",py_object()), kwarg("clobber",true), kwarg("img_nzoom",4), 
-								kwarg("img_nds",16), kwarg("img_nx",256), kwarg("verbosity",2), kwarg("debug",false),
+								kwarg("img_nds",16), kwarg("img_nx",256), kwarg("png_compression",-1), kwarg("png_filter",string("default")),
+								kwarg("png_nthreads",1), kwarg("png_store_intermediate",false), kwarg("verbosity",2), kwarg("debug",false),
 								kwarg("extra_attrs",py_object())));
 
     pipeline_object_type.add_method("bind", doc_bind, wrap_method(_bind, kwarg("outdir",py_object()), kwarg("clobber",true), kwarg("img_nzoom",4), 
-								  kwarg("img_nds",16), kwarg("img_nx",256), kwarg("verbosity",2), kwarg("debug",false),
+								  kwarg("img_nds",16), kwarg("img_nx",256), kwarg("png_compression",-1), kwarg("png_filter",string("default")),
+								  kwarg("png_nthreads",1), kwarg("png_store_intermediate",false), kwarg("verbosity",2), kwarg("debug",false),
 								  kwarg("extra_attrs",py_object())));
 							 
     pipeline_object_type.add_method("allocate", "Allocates all pipeline buffers", wrap_method(&pipeline_object::allocate));
@@ -652,7 +1013,11 @@ static void wrap_pipeline_object(extension_module &m)
     pipeline_object_type.add_method("add_plot", doc_add_plot, _add_plot);
     pipeline_object_type.add_method("add_file", doc_add_file, _add_file);
 
-    // FIXME _bind() unwrapped for now, since ring_buffer class and friends are not python-wrapped
+    pipeline_object_type.add_method("get_buffer", doc_get_buffer, wrap_method(_get_buffer, "bufname"));
+    pipeline_object_type.add_method("create_buffer", doc_create_buffer, wrap_method(_create_buffer, "bufname", "cdims", "nds"));
+
+    // Note: C++ _bind() and _advance() are not python-callable, since they must be called by the "generic"
+    // logic in pipeline_object::bind() and pipeline_object::advance().  (They can be overridden in python though.)
     pipeline_object_type.add_method("_allocate", "_allocate(): optional", wrap_method(&pipeline_object::_allocate));
     pipeline_object_type.add_method("_deallocate", "_deallocate(): optional", wrap_method(&pipeline_object::_deallocate));
     pipeline_object_type.add_method("_start_pipeline", "_start_pipeline(): optional", wrap_j(&pipeline_object::_start_pipeline));
@@ -673,7 +1038,6 @@ static void wrap_pipeline_object(extension_module &m)
 // wrap_chunked_pipeline_object
 //
 // Current pythonization is partial: new chunked_pipeline_objects can't be defined from python.
-// This is because 'class ring_buffer' isn't pythonized yet (this is on my todo list!)
 
 
 // Note: the "upcalling" class
@@ -711,6 +1075,7 @@ struct py_wi_stream : wi_stream {
     // _fill_chunk() is the only pure virtual.
     virtual bool _fill_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
     {
+	gil_acquirer gil;
 	pure_virtual_function<bool> vf(wi_stream_type, this, "_fill_chunk");
 
 	// Conversion of C++ arguments to python arguments is nontrivial here...
@@ -735,6 +1100,7 @@ struct py_wi_stream : wi_stream {
 
     virtual Json::Value jsonize() const override
     {
+	gil_acquirer gil;
 	virtual_function<Json::Value> vf(wi_stream_type, this, "jsonize");
 	return vf.exists ? vf.upcall() : wi_stream::jsonize();
     }
@@ -798,6 +1164,7 @@ struct py_wi_transform : wi_transform {
     // _process_chunk() is the only pure virtual.
     virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
     {
+	gil_acquirer gil;
 	pure_virtual_function<void> vf(wi_transform_type, this, "_process_chunk");
 
 	// Conversion of C++ arguments to python arguments is nontrivial here...
@@ -820,6 +1187,7 @@ struct py_wi_transform : wi_transform {
 
     virtual Json::Value jsonize() const override
     {
+	gil_acquirer gil;
 	virtual_function<Json::Value> vf(wi_transform_type, this, "jsonize");
 	return vf.exists ? vf.upcall() : wi_transform::jsonize();
     }
@@ -894,8 +1262,8 @@ static void wrap_containers(extension_module &m)
     pipeline_type.add_method("add", doc_add, wrap_method(&pipeline::add, "object"));
     pipeline_type.add_property("size", "Number of pipeline_objects in pipeline container", _pipeline_size);
 
-    std::function<wi_sub_pipeline* (const shared_ptr<pipeline_object> &ds_pipeline, double, ssize_t, ssize_t, ssize_t, ssize_t, ssize_t)>
-	_ws_init = [](const shared_ptr<pipeline_object> &ds_pipeline, double w_cutoff, ssize_t nt_chunk, ssize_t nfreq_out, ssize_t nds_out, ssize_t Df, ssize_t Dt)
+    std::function<wi_sub_pipeline* (const shared_ptr<pipeline_object> &ds_pipeline, double, ssize_t, ssize_t, ssize_t, ssize_t, ssize_t, ssize_t)>
+	_ws_init = [](const shared_ptr<pipeline_object> &ds_pipeline, double w_cutoff, ssize_t nt_chunk, ssize_t nfreq_out, ssize_t nds_out, ssize_t Df, ssize_t Dt, ssize_t nbuf_async)
 	{
 	    wi_sub_pipeline::initializer ini_params;
 	    ini_params.w_cutoff = w_cutoff;
@@ -904,17 +1272,27 @@ static void wrap_containers(extension_module &m)
 	    ini_params.nds_out = nds_out;
 	    ini_params.Df = Df;
 	    ini_params.Dt = Dt;
+	    ini_params.nbuf_async = nbuf_async;
 
 	    return new wi_sub_pipeline(ds_pipeline, ini_params);
 	};
 
     auto ws_init = wrap_constructor(_ws_init, "sub_pipeline", kwarg("w_cutoff",0.0), kwarg("nt_chunk",0), 
-				    kwarg("nfreq_out",0), kwarg("nds_out",0), kwarg("Df",0), kwarg("Dt",0));
+				    kwarg("nfreq_out",0), kwarg("nds_out",0), kwarg("Df",0), kwarg("Dt",0), kwarg("nbuf_async",0));
 
     wi_sub_pipeline_type.add_constructor(ws_init);
 
+    std::function<dag_pipeline* (const chain_t &, const vector<vector<string>> &, ssize_t, const string &)>
+	_dag_init = [](const chain_t &stages, const vector<vector<string>> &bufnames, ssize_t nthreads, const string &name)
+	{
+	    return new dag_pipeline(stages, bufnames, nthreads, name);
+	};
+
+    dag_pipeline_type.add_constructor(wrap_constructor(_dag_init, "object_list", "bufnames", kwarg("nthreads",0), kwarg("name",string())));
+
     m.add_type(pipeline_type);
     m.add_type(wi_sub_pipeline_type);
+    m.add_type(dag_pipeline_type);
 }
 
 
@@ -983,12 +1361,41 @@ static void wrap_utility_classes(extension_module &m)
 		   wrap_func(make_mask_expander, "axis", "prev_wname", "width", "threshold", kwarg("alpha",0.0), kwarg("nt_chunk",0)));
 		   
     m.add_function("pipeline_fork",
-		   "pipeline_fork(bufnames) -> pipeline_object\n"
+		   "pipeline_fork(bufnames, copy_on_write=False) -> pipeline_object\n"
 		   "\n"
 		   "Creates one or more new pipeline ring_buffers, by copying existing ring_buffers.\n"
 		   "The 'bufnames' argument should be a list of (input_bufname, output_bufname) pairs.\n"
-		   "Frequently, the input_bufname will be one of the built-in names \"INTENSITY\" or \"WEIGHTS\".\n",
-		   wrap_func(make_pipeline_fork, "bufnames"));
+		   "Frequently, the input_bufname will be one of the built-in names \"INTENSITY\" or \"WEIGHTS\".\n"
+		   "\n"
+		   "If copy_on_write=True, then data is only copied when either the input or output buffer\n"
+		   "is written downstream, which makes forks that are only read (e.g. by plotters) nearly free.\n"
+		   "This uses a larger input ring_buffer, and throws an exception if a pipeline_object writes\n"
+		   "the input while reading the output over the same time range.\n",
+		   wrap_func(make_pipeline_fork, "bufnames", kwarg("copy_on_write",false)));
+
+    m.add_function("pipeline_reverter",
+		   "pipeline_reverter(bufnames) -> pipeline_object\n"
+		   "\n"
+		   "Undoes the effect of all pipeline_objects since a previous pipeline_fork, by rebinding buffer names\n"
+		   "(no data is copied).  The 'bufnames' argument should be a list of (saved_bufname, bufname) pairs,\n"
+		   "where 'saved_bufname' is the output_bufname of the pipeline_fork.  For example, to try a mask and\n"
+		   "then undo it:\n"
+		   "\n"
+		   "   [ pipeline_fork([('WEIGHTS','WEIGHTS_SAVE1')]), ...masking transforms..., pipeline_reverter([('WEIGHTS_SAVE1','WEIGHTS')]) ]\n"
+		   "\n"
+		   "After the pipeline_reverter, both names refer to the same ring_buffer.\n",
+		   wrap_func(make_pipeline_reverter, "bufnames"));
+
+    m.add_function("bitmask_maker",
+		   "bitmask_maker(output_bufname='BITMASK', nt_chunk=0, simd_level=-1) -> pipeline_object\n"
+		   "\n"
+		   "Creates a new pipeline ring_buffer containing the RFI mask as a packed bitmask (bit set iff weight > 0),\n"
+		   "in the same format as ch_frb_io::assembled_chunk::rfi_mask.  Each float32 element of the ring buffer\n"
+		   "holds 32 bits of the mask, so the ring buffer has an extra factor 32 of time downsampling.\n"
+		   "\n"
+		   "By default, the SIMD kernel is chosen at runtime (simd_level=-1).  To force a specific kernel (e.g. for\n"
+		   "testing), use simd_level=0 (scalar), 1 (SSE2), 2 (AVX2), 3 (AVX-512).\n",
+		   wrap_func(make_bitmask_maker, kwarg("output_bufname",string("BITMASK")), kwarg("nt_chunk",0), kwarg("simd_level",-1)));
 }
 
 
@@ -1152,7 +1559,7 @@ static void wrap_chime_ostreams(extension_module &m)
 
 static void wrap_misc_streams(extension_module &m)
 {
-    string doc_gs = ("gaussian_noise_stream(nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, sample_rms=1.0, nt_chunk=1024, randomize_weights=false)\n"
+    string doc_gs = ("gaussian_noise_stream(nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, sample_rms=1.0, nt_chunk=1024, randomize_weights=false, seed=0, nthreads=1)\n"
 		     "\n"
 		     "A simple stream which simulates Gaussian random noise.\n"
 		     "\n"
@@ -1163,12 +1570,23 @@ static void wrap_misc_streams(extension_module &m)
 		     "   freq_hi_MHz         Highest frequency in band (e.g. 800 for CHIME)\n"
 		     "   dt_sample           Length of a time sample in seconds\n"
 		     "   nt_chunk            Stream block size (if zero, will default to a reasonable value)\n"
-		     "   randomize_weights   If true, weights will be uniform random numbers (if false, all weights will be 1.0)\n");
+		     "   randomize_weights   If true, weights will be uniform random numbers (if false, all weights will be 1.0)\n"
+		     "   seed                RNG seed (nonnegative).  Output is a deterministic function of the seed (independent of nt_chunk\n"
+		     "                       and nthreads).  If zero, a random seed is chosen, and recorded in the json output.\n"
+		     "   nthreads            Number of threads used to generate random numbers in each chunk.\n");
     
     auto f_gs = wrap_func(make_gaussian_noise_stream, "nfreq", "nt_tot", "freq_lo_MHz", "freq_hi_MHz", "dt_sample",
-			  kwarg("sample_rms",1.0), kwarg("nt_chunk",1024), kwarg("randomize_weights",false));
+			  kwarg("sample_rms",1.0), kwarg("nt_chunk",1024), kwarg("randomize_weights",false),
+			  kwarg("seed",0), kwarg("nthreads",1));
 
     m.add_function("gaussian_noise_stream", doc_gs, f_gs);
+
+    m.add_function("psrfits_stream",
+		   "psrfits_stream(filename, nt_chunk=0, nrows_prefetch=2)\n\n"
+		   "Reads a PSRFITS search-mode file (requires rf_pipelines to be compiled with HAVE_PSRFITS).\n"
+		   "FITS rows are read ahead by a background thread, up to 'nrows_prefetch' rows.\n"
+		   "If 'nt_chunk' is zero, a reasonable default will be used.\n",
+		   wrap_func(make_psrfits_stream, "filename", kwarg("nt_chunk",0), kwarg("nrows_prefetch",2)));
 }
 
 
@@ -1280,23 +1698,38 @@ static void wrap_clippers(extension_module &m)
 			  kwarg("iter_sigma",0.0), kwarg("Df",1), kwarg("Dt",1), kwarg("two_pass",false));
 
     auto f_sd = wrap_func(make_std_dev_clipper, "nt_chunk", "axis", "sigma", kwarg("Df",1), kwarg("Dt",1), kwarg("two_pass",false));
+
+    string doc_kf = ("kurtosis_filter(nt_chunk=1024, lo_cut=-1.0, hi_cut=1.0, Df=1, Dt=1)\n"
+		     "\n"
+		     "kurtosis_filter: masks frequency channels whose excess kurtosis (computed independently in each chunk)\n"
+		     "is outside the range [lo_cut, hi_cut].  For Gaussian data, the excess kurtosis is zero.  If the kurtosis\n"
+		     "is undefined (e.g. all samples masked), it is treated as -4.\n"
+		     "\n"
+		     "The (Df,Dt) args are downsampling factors on the frequency/time axes.  The kurtosis is computed from the\n"
+		     "downsampled data, and if Df > 1, then blocks of Df channels are masked together.");
+
+    auto f_kf = wrap_func(make_kurtosis_filter, kwarg("nt_chunk",1024), kwarg("lo_cut",-1.0), kwarg("hi_cut",1.0), kwarg("Df",1), kwarg("Dt",1));
     
 
     m.add_function("badchannel_mask", doc_bm, f_bm);
     m.add_function("intensity_clipper", doc_ic, f_ic);
     m.add_function("std_dev_clipper", doc_sdc, f_sd);
+    m.add_function("kurtosis_filter", doc_kf, f_kf);
 }		   
 
 
 static void wrap_mask_counters(extension_module &m)
 {
-    string doc_mc = ("mask_counter(nt_chunk, where)\n"
+    string doc_mc = ("mask_counter(nt_chunk, where, occupancy_Df=0, occupancy_Dt=0)\n"
 		     "\n"
                      "mask_counter: this counts how many intensity samples per chunk have been masked out by previous steps in the RFI chain.\n"
                      "The 'where' argument, which must be a unique string (unique within the pipeline), is used for reporting where in the pipeline the measurement is being made.\n"
+		     "\n"
+		     "If 'occupancy_Df' is nonzero, the masked fraction is also accumulated in bins of 'occupancy_Df' frequency channels and\n"
+		     "'occupancy_Dt' time samples, and written to 'mask_occupancy_WHERE.h5' in the pipeline output directory (requires HDF5).\n"
 		     "");
 
-    auto f_mc = wrap_func(make_mask_counter, "nt_chunk", "where");
+    auto f_mc = wrap_func(make_mask_counter, "nt_chunk", "where", kwarg("occupancy_Df",0), kwarg("occupancy_Dt",0));
     m.add_function("mask_counter", doc_mc, f_mc);
 }
 
@@ -1558,6 +1991,94 @@ static void wrap_kernels(extension_module &m)
 			     kwarg("sigma",3.0), kwarg("two_pass",false)));
 }
 
+// -------------------------------------------------------------------------------------------------
+//
+// wrap_misc_transforms(): C++ versions of transforms which were originally written in python.
+
+
+static void wrap_misc_transforms(extension_module &m)
+{
+    string doc_fi = ("frb_injector_transform_cpp(snr, undispersed_arrival_time, dm, variance, intrinsic_width=0.0, sm=0.0, spectral_index=0.0, nt_chunk=1024)\n"
+		     "\n"
+		     "C++ version of frb_injector_transform: adds a simulated FRB to the intensity array (leaving weights unmodified).\n"
+		     "The pulse profile is precomputed in each frequency channel when the pipeline is bound, and added sparsely.\n"
+		     "\n"
+		     "Constructor arguments are the same as the python frb_injector_transform, except:\n"
+		     "   variance            must be a list of per-channel variances (length nfreq), or a list of length 1.\n"
+		     "                       (To use an HDF5 file from the variance_estimator, use rf_pipelines.utils.Variance_Estimates.)\n"
+		     "   intrinsic_width     is the Gaussian rms width in seconds.\n");
+
+    m.add_function("frb_injector_transform_cpp", doc_fi,
+		   wrap_func(make_frb_injector_transform, "snr", "undispersed_arrival_time", "dm", "variance",
+			     kwarg("intrinsic_width",0.0), kwarg("sm",0.0), kwarg("spectral_index",0.0), kwarg("nt_chunk",1024)));
+
+    string doc_ve = ("variance_estimator_cpp(var_filename, v1_chunk=128, v2_chunk=80, nt_chunk=1024)\n"
+		     "\n"
+		     "C++ version of variance_estimator: estimates the per-channel variance and writes the results into an\n"
+		     "HDF5 file (same file format as the python version, readable with rf_pipelines.utils.Variance_Estimates).\n"
+		     "The variance is computed across 'v1_chunk' time samples, then the median of 'v2_chunk' such estimates is taken.\n"
+		     "HDF5 writes are done in a background thread.\n");
+
+    m.add_function("variance_estimator_cpp", doc_ve,
+		   wrap_func(make_variance_estimator, "var_filename", kwarg("v1_chunk",128), kwarg("v2_chunk",80), kwarg("nt_chunk",1024)));
+
+    string doc_mf = ("mask_filler_cpp(var_file, w_cutoff, nt_chunk=1024, seed=0)\n"
+		     "\n"
+		     "C++ version of mask_filler: replaces masked samples (weight <= w_cutoff) by Gaussian noise, with variance\n"
+		     "read from an HDF5 file written by the variance_estimator, and sets weights to 2.0 (or 0.0 if the variance is zero).\n"
+		     "Random numbers are only generated for masked samples.  If seed=0, a random seed is chosen.\n");
+
+    m.add_function("mask_filler_cpp", doc_mf,
+		   wrap_func(make_mask_filler, "var_file", "w_cutoff", kwarg("nt_chunk",1024), kwarg("seed",0)));
+
+    string doc_nf = ("noise_filler_cpp(nt_chunk=512, increment=0.1, var_filename='', seed=0)\n"
+		     "\n"
+		     "C++ version of noise_filler: replaces the intensity by Gaussian noise, whose rms is incremented after each chunk.\n"
+		     "If 'var_filename' is nonempty, the simulated variance is written to an HDF5 file which has the same layout\n"
+		     "as the variance_estimator output.  If seed=0, a random seed is chosen.\n");
+
+    m.add_function("noise_filler_cpp", doc_nf,
+		   wrap_func(make_noise_filler, kwarg("nt_chunk",512), kwarg("increment",0.1), kwarg("var_filename",string()), kwarg("seed",0)));
+
+    string doc_om = ("online_mask_filler(v1_chunk=32, var_weight=2.0e-3, w_clamp=3.3e-3, w_cutoff=0.5, nt_chunk=1024, modify_weights=True,\n"
+		     "                   multiply_intensity_by_weights=False, use_scalar_kernel=False)\n"
+		     "\n"
+		     "Keeps a running variance estimate in each frequency channel, which is updated every 'v1_chunk' samples\n"
+		     "(an exponential average with weight 'var_weight'), and replaces samples whose weight is below 'w_cutoff'\n"
+		     "by Gaussian noise with the running variance.  The running weight in each channel is incremented or\n"
+		     "decremented by 'w_clamp', depending on whether the variance estimate succeeded.\n"
+		     "\n"
+		     "If 'use_scalar_kernel' is True, then the (slow) scalar reference kernel is used, instead of the vectorized kernel.\n");
+
+    std::function<shared_ptr<wi_transform>(int, float, float, float, int, bool, bool, bool)>
+	f_om = [](int v1_chunk, float var_weight, float w_clamp, float w_cutoff, int nt_chunk, bool modify_weights, bool multiply_intensity_by_weights, bool use_scalar_kernel)
+	{
+	    auto f = use_scalar_kernel ? make_scalar_mask_filler : make_online_mask_filler;
+	    return f(v1_chunk, var_weight, w_clamp, w_cutoff, nt_chunk, modify_weights, multiply_intensity_by_weights);
+	};
+
+    m.add_function("online_mask_filler", doc_om,
+		   wrap_func(f_om, kwarg("v1_chunk",32), kwarg("var_weight",2.0e-3), kwarg("w_clamp",3.3e-3), kwarg("w_cutoff",0.5), kwarg("nt_chunk",1024),
+			     kwarg("modify_weights",true), kwarg("multiply_intensity_by_weights",false), kwarg("use_scalar_kernel",false)));
+
+    m.add_function("thermal_noise_weight",
+		   "thermal_noise_weight(nt_chunk=512, Df=1, Dt=1)\n\n"
+		   "For thermal-noise dominated data, multiplies the weights in each channel by the inverse of the\n"
+		   "radiometer-equation noise rms, i.e. sqrt(2 * dt_sample * delta_f) / (mean intensity), computed independently\n"
+		   "in each chunk.  Channels with very small total weight, or nonpositive mean intensity, are masked.\n"
+		   "The (Df,Dt) args are downsampling factors, as in the clippers.  Probably can't be used in tandem with detrending!\n",
+		   wrap_func(make_thermal_noise_weight, kwarg("nt_chunk",512), kwarg("Df",1), kwarg("Dt",1)));
+
+    m.add_function("adversarial_masker_cpp",
+		   "adversarial_masker_cpp(nt_chunk=1024, nt_reset=65536, nt_minefield=4096*1024, seed=0)\n\n"
+		   "C++ version of adversarial_masker: masks a long sequence of rectangle-shaped regions of the (freq,time) plane,\n"
+		   "intended for stress-testing online variance estimation.  The rectangles are the same as the python version,\n"
+		   "but are sorted by time, so that each chunk only touches the rectangles which overlap it.\n"
+		   "If 'seed' is zero, a random seed is chosen, and recorded in the json output.\n",
+		   wrap_func(make_adversarial_masker, kwarg("nt_chunk",1024), kwarg("nt_reset",65536), kwarg("nt_minefield",4096*1024), kwarg("seed",0)));
+}
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // wrap_bonsai().
@@ -1565,26 +2086,32 @@ static void wrap_kernels(extension_module &m)
 
 static void wrap_bonsai(extension_module &m)
 {
-    string doc_bd = ("bonsai_dedisperser(config_filename, fill_rfi_mask=False, verbosity=1) -> pipeline_object\n"
+    string doc_bd = ("bonsai_dedisperser(config_filename, fill_rfi_mask=False, verbosity=1, nbuf_async=0) -> pipeline_object\n"
 		     "\n"
 		     "A \"transform\" which doesn't actually modify the data, it just runs the bonsai dedisperser (C++ version)\n"
 		     "\n"
+		     "If 'nbuf_async' is nonzero, then the dedisperser runs in its own thread, so that upstream transforms\n"
+		     "can process the next chunk in parallel.  Each chunk is copied into one of 'nbuf_async' buffers\n"
+		     "(e.g. nbuf_async=2 for double buffering).  Since the dedisperser then works on copies of the data,\n"
+		     "'nbuf_async' can't be combined with fill_rfi_mask=True (an exception is thrown).\n"
+		     "\n"
 		     "FIXME: currently, there are two versions of the bonsai_dedisperser, written in python and C++.\n"
 		     "From python, they are constructed as 'bonsai_dedisperser' and 'bonsai_dedisperser_cpp' respectively.\n"
 		     "In the pipeline json output, they are represented as 'bonsai_dedisperser_python' and 'bonsai_dedisperser_cpp'.\n"
 		     "The two versions of the bonsai_dedisperser will be combined eventually!\n");
 
-    std::function<shared_ptr<pipeline_object>(const string &, bool, int)>
-	f_bd = [](const string &config_filename, bool fill_rfi_mask, int verbosity) -> shared_ptr<pipeline_object>
+    std::function<shared_ptr<pipeline_object>(const string &, bool, int, int)>
+	f_bd = [](const string &config_filename, bool fill_rfi_mask, int verbosity, int nbuf_async) -> shared_ptr<pipeline_object>
 	{
 	    bonsai_initializer ini_params;
 	    ini_params.fill_rfi_mask = fill_rfi_mask;
 	    ini_params.verbosity = verbosity;
+	    ini_params.nbuf_async = nbuf_async;
 	    
 	    return make_bonsai_dedisperser(config_filename, ini_params);
 	};
 
-    m.add_function("bonsai_dedisperser_cpp", doc_bd, wrap_func(f_bd, "config_filename", kwarg("fill_rfi_mask",false), kwarg("verbosity",1)));
+    m.add_function("bonsai_dedisperser_cpp", doc_bd, wrap_func(f_bd, "config_filename", kwarg("fill_rfi_mask",false), kwarg("verbosity",1), kwarg("nbuf_async",0)));
 }
 
 
@@ -1595,9 +2122,13 @@ PyMODINIT_FUNC initrf_pipelines_c(void)
 {
     import_array();
 
+    // Needed in python 2, since the GIL is released in pipeline_object.run().
+    PyEval_InitThreads();
+
     extension_module m("rf_pipelines_c", "rf_pipelines_c: a C++ library containing low-level rf_pipelines code");
 
     // rf_pipelines_base_classes.hpp
+    wrap_ring_buffer(m);
     wrap_pipeline_object(m);
     wrap_chunked_pipeline_object(m);
     wrap_wi_stream(m);
@@ -1613,6 +2144,7 @@ PyMODINIT_FUNC initrf_pipelines_c(void)
     wrap_clippers(m);
     wrap_mask_counters(m);
     wrap_kernels(m);
+    wrap_misc_transforms(m);
     wrap_bonsai(m);
 
     m.finalize();
@@ -106,6 +106,13 @@ struct run_params {
     //   img_nds = time downsampling factor of plots at lowest zoom level
     //   img_nx = number of x-pixels (i.e. time axis) in each plot tile
     //
+    // PNG encoder params (see plot_utils.cpp and outdir_manager.cpp):
+    //   png_compression = zlib compression level (0-9), or -1 for the zlib default (level 6)
+    //   png_filter = row filter ("default", "none", "sub", "up", "avg", "paeth", or "all")
+    //   png_nthreads = number of background threads encoding plot tiles (0 = encode in pipeline thread)
+    //   png_store_intermediate = if true, tiles at intermediate zoom levels (i.e. not the first or
+    //      last zoom level) are written without deflate compression, and with no row filter.
+    //
     // The meaning of the 'verbosity' argument is:
     //   0 = no output
     //   1 = high-level summary output (names of transforms, number of samples processed etc.)
@@ -123,6 +130,10 @@ struct run_params {
     ssize_t img_nzoom = 4;
     ssize_t img_nds = 16;
     ssize_t img_nx = 256;
+    int png_compression = -1;
+    std::string png_filter = "default";
+    int png_nthreads = 1;
+    bool png_store_intermediate = false;
     int verbosity = 2;
     bool debug = false;
 
@@ -161,7 +172,10 @@ struct run_params {
 // is (pos1-pos0)/nds, not (pos1-pos0).
 
 
-class ring_buffer {
+// Inherits enable_shared_from_this, so that the python wrappers (which only see a bare ring_buffer *)
+// can hand out owning references, see ring_buffer.get() in rf_pipelines/rf_pipelines_c.cpp.
+
+class ring_buffer : public std::enable_shared_from_this<ring_buffer> {
 public:
     // "Complementary" dimensions (all dimensions except time axis)
     const std::vector<ssize_t> cdims;
@@ -213,6 +227,25 @@ public:
 
     Json::Value get_info();
 
+    // Copy-on-write support (used by pipeline_fork in copy_on_write mode).
+    //
+    // After set_cow_parent() is called (in bind(), before either buffer is allocated), this
+    // ring_buffer is a lazy copy of the parent.  Its creator calls cow_append() instead of
+    // get(ACCESS_APPEND), and no data is copied.  Read-only accesses return pointers into the
+    // parent's storage, so the stride can differ from get_stride() (ring_buffer_subarray::stride
+    // is always correct).  A range is copied into this buffer's own storage ("materialized") when
+    // either buffer requests ACCESS_WRITE on it, or just before the parent would overwrite it.
+    //
+    // The parent is enlarged in allocate(), so that it can serve the child's readers directly.
+    // It is an error to write a range of the parent while the same range of the child is being read.
+
+    void set_cow_parent(const std::shared_ptr<ring_buffer> &parent);
+    void cow_append(ssize_t pos0, ssize_t pos1);
+    bool has_cow_parent() const { return cow_parent != nullptr; }
+
+    // Returns the ring_buffer which owns the underlying storage (either 'this' or the cow_parent).
+    const ring_buffer *cow_root() const { return cow_parent ? cow_parent.get() : this; }
+
     // The ring_buffer is noncopyable, since it contains a bare pointer.
     // Move constructor/assignment would be trivial to implement, but I haven't needed it yet.
     // (I always use ring_buffers via a shared_ptr<ring_buffer>.)
@@ -247,20 +280,35 @@ protected:
     ssize_t optimal_period = 0;
     ssize_t nget_tot = 0;
     ssize_t nget_mirror = 0;
+    ssize_t nget_cow = 0;    // samples copied from cow_parent
 
     // Is there an active pointer?
     float *ap = nullptr;
     float ap_pos0 = 0;  // no downsampling factor applied
     float ap_pos1 = 0;  // no downsampling factor applied
     float ap_mode = ACCESS_NONE;
+    ssize_t ap_stride = 0;  // differs from 'stride' if ap_cow is true
+    bool ap_cow = false;    // does 'ap' point into cow_parent's storage?
+
+    // Copy-on-write state (see set_cow_parent() above).
+    // The child holds a reference to the parent, and removes itself from 'cow_children' in its destructor.
+    std::shared_ptr<ring_buffer> cow_parent;
+    std::vector<ring_buffer *> cow_children;
+    ssize_t cow_pos = 0;    // samples before cow_pos have been materialized (downsampling factor applied)
 
     // Helper functions for internal use.
     // All time indices have the downsampling factor applied.
     void _mirror_initial(ssize_t it0);
     void _mirror_final(ssize_t it1);
     void _copy(ssize_t it_dst, ssize_t it_src, ssize_t n);
+    void _update_valid(ssize_t it0, ssize_t it1);
     void _preallocate();
 
+    // Copy-on-write helpers (all time indices have the downsampling factor applied).
+    void _cow_before_write(ssize_t pos0, ssize_t pos1, int mode);  // called on parent
+    void _cow_materialize(ssize_t pos1);                           // called on child
+    float *_cow_peek(ssize_t pos0, ssize_t pos1);                  // called on parent
+
     friend struct ring_buffer_subarray;
 };
 
@@ -280,7 +328,7 @@ struct ring_buffer_subarray {
     ring_buffer_subarray(const std::shared_ptr<ring_buffer> &buf_, ssize_t pos0_, ssize_t pos1_, int access_mode_) :
 	buf(buf_),
 	data(buf_->get(pos0_,pos1_,access_mode_)),
-	stride(buf_->stride),
+	stride(buf_->ap_stride),
 	access_mode(access_mode_),
 	pos0(pos0_),
 	pos1(pos1_)
@@ -304,7 +352,7 @@ struct ring_buffer_subarray {
     {
 	this->reset();
 	this->data = buf_->get(pos0_, pos1_, access_mode_);
-	this->stride = buf_->stride;
+	this->stride = buf_->ap_stride;
 	this->buf = buf_;
 	this->pos0 = pos0_;
 	this->pos1 = pos1_;
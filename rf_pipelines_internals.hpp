@@ -5,11 +5,16 @@
 #error "This source file needs to be compiled with C++11 support (g++ -std=c++11)"
 #endif
 
+#include <mutex>
+#include <deque>
+#include <thread>
 #include <random>
 #include <cstring>
 #include <sstream>
 #include <algorithm>
 #include <unordered_set>
+#include <condition_variable>
+#include <functional>
 #include <sys/time.h>
 
 #include "rf_kernels/core.hpp"
@@ -52,13 +57,59 @@ struct outdir_manager {
     bool clobber_ok = true;
 
     std::unordered_set<std::string> basenames;
+    std::mutex lock;   // protects 'basenames', since add_file() can be called from helper threads (see wi_sub_pipeline.cpp)
+
+    // Number of background threads used by write_png_async() (see below).
+    // If zero, then write_png_async() writes the file synchronously.
+    const int png_nthreads;
 
     // Constructor creates the output directory.
-    outdir_manager(const std::string &outdir, bool clobber_ok);
+    outdir_manager(const std::string &outdir, bool clobber_ok, int png_nthreads=1);
 
     // Called before file is written, to test for filename collisions.
     // Returns the full pathname, throws exception if filename has already been written in this pipeline run.
     std::string add_file(const std::string &basename);
+
+    // Background PNG writer, used for zoomable_tileset output, so that PNG encoding doesn't stall
+    // pipeline_object::advance().  The arguments to write_png_async() are the same as write_rgb8_png().
+    // Files are encoded in parallel by 'png_nthreads' threads.  At most max(png_max_queued, 2*png_nthreads)
+    // files are pending; if the queue is full, write_png_async() blocks.
+    //
+    // wait_for_pngs() blocks until all pending files have been written (called at the end of
+    // pipeline_object::run()).  If an error occurs in the background thread, it is rethrown in the
+    // next call to write_png_async() or wait_for_pngs().
+
+    void write_png_async(const std::string &filename, std::vector<uint8_t> &&rgb, int m, int n, bool ymajor, bool ytop_to_bottom,
+			 int compression=-1, const std::string &filter="default");
+    void wait_for_pngs();
+
+    ~outdir_manager();
+
+    static constexpr int png_max_queued = 16;
+
+    struct png_job {
+	std::string filename;
+	std::vector<uint8_t> rgb;
+	int m = 0;
+	int n = 0;
+	bool ymajor = true;
+	bool ytop_to_bottom = false;
+	int compression = -1;
+	std::string filter;
+    };
+
+    // Protected by 'png_lock'.
+    std::deque<png_job> png_queue;
+    int png_nbusy = 0;      // number of jobs which have been removed from the queue, but not finished
+    bool png_done = false;  // set by destructor
+    std::exception_ptr png_error;
+
+    std::mutex png_lock;
+    std::condition_variable png_cv;
+    std::vector<std::thread> png_threads;   // started on first call to write_png_async()
+
+    void _png_worker_main();
+    void _rethrow_png_error();
 };
 
 
@@ -97,6 +148,11 @@ struct zoomable_tileset_state {
     const ssize_t ny_arr;     // number of y-pixels in RGB arrays
     const bool debug;
 
+    // PNG encoder params (from run_params).
+    const int png_compression;
+    const std::string png_filter;
+    const bool png_store_intermediate;
+
     bool is_allocated = false;
     bool is_flushed = false;
     ssize_t curr_pos = 0;
@@ -120,10 +176,6 @@ struct zoomable_tileset_state {
     // The 'rgb_zoom' array has logical shape (img_nzoom, zt->ny_arr, img_nx, 3)
     std::vector<uint8_t *> rgb_zoom;
 
-    // In the case where y-upsampling is done (i.e. zt->ny_arr < img_ny), 
-    // we need an need auxiliary buffer of shape (img_ny, img_nx, 3).
-    uint8_t *rgb_us = nullptr;
-
     Json::Value json_output;
     
     // Called by pipeline_object::bind().
@@ -156,6 +208,56 @@ struct zoomable_tileset_state {
 };
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// hdf5_writer_thread: runs HDF5 output in a background thread, so that the pipeline never blocks
+// on disk (used by variance_estimator and mask_counter, defined in hdf5_writer_thread.cpp).
+//
+// The caller queues "jobs" (closures), which are run in order by the background thread.  Usually
+// the first job opens the file, and the job passed to stop() writes any remaining data and closes it.
+// State which is used by the jobs should only be accessed from the main thread when the writer isn't
+// running (i.e. before start() or after stop()/join()).
+//
+// If a job throws, the remaining jobs are discarded, and the error is delivered exactly once: by the
+// next call to push(), or by stop().  An H5::Exception (which isn't a std::exception) is converted to
+// std::runtime_error, so that pipeline_object::run() reports it.
+//
+// Note: if other pipeline_objects use HDF5 concurrently from the main thread, libhdf5 must be built thread-safe.
+
+
+struct hdf5_writer_thread {
+    ~hdf5_writer_thread();
+
+    void start();
+
+    // Queues a job.  If a previous job failed, the new job is discarded, and the error is rethrown (if not already delivered).
+    void push(const std::function<void()> &job);
+
+    // Queues 'last_job' (unless a previous job failed), waits for all jobs to finish, and joins the thread.
+    // Rethrows an error which hasn't been delivered yet.
+    void stop(const std::function<void()> &last_job);
+
+    // Waits for queued jobs and joins the thread, without delivering errors (used in _reset() and destructors).
+    void join();
+
+    // True if a job has failed since start() (whether or not the error has been delivered).
+    bool failed();
+
+    // Protected by 'lock'.
+    std::deque<std::function<void()>> queue;
+    bool done = false;
+    bool has_failed = false;
+    std::exception_ptr error;   // cleared when delivered
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread thread;
+
+    void _thread_main();
+    void _rethrow_error();
+};
+
+
 // -------------------------------------------------------------------------------------------------
 
 
@@ -186,7 +288,11 @@ extern std::string json_stringify(const Json::Value &x);
 //
 // The 'ymajor' flag controls whether the major (length-m) index of the array is the y-axis of the
 // plots, i.e. the plot dimensions are either (n,m) or (m,n) depending on whether ymajor is true or false.
-extern void write_rgb8_png(const std::string &filename, uint8_t *rgb, int m, int n, bool ymajor, bool ytop_to_bottom);
+//
+// The 'compression' and 'filter' args have the same meaning as run_params::png_compression and
+// run_params::png_filter.  In particular, compression=0 skips deflate (zlib "stored" blocks).
+extern void write_rgb8_png(const std::string &filename, uint8_t *rgb, int m, int n, bool ymajor, bool ytop_to_bottom,
+			   int compression=-1, const std::string &filter="default");
 
 
 // -------------------------------------------------------------------------------------------------
@@ -258,6 +364,58 @@ inline std::vector<float> uniform_randvec(std::mt19937 &rng, ssize_t n, double l
 }
 
 
+// counter_rng: counter-based random number generator (Philox-4x32-10), defined in counter_rng.cpp.
+//
+// Unlike std::mt19937, there is no hidden state: the random number at (irow, pos) is a pure function
+// of (seed, stream, irow, pos).  This means that output is deterministic, independent of chunk size,
+// seekable, and can be generated from multiple threads without synchronization.
+//
+// The 'stream' argument can be used to get independent random numbers from the same seed
+// (e.g. gaussian_noise_stream uses stream=0 for intensities and stream=1 for weights).
+//
+// The fill_*() methods process blocks of samples in inner loops which are written so that
+// the compiler can vectorize them (-O3 -march=native -ffast-math).
+
+struct counter_rng {
+    const uint64_t seed;
+    const uint32_t stream;
+
+    counter_rng(uint64_t seed, uint32_t stream=0);
+
+    // Writes out[it] = (Gaussian random number with mean 0, rms 'rms') for 0 <= it < n,
+    // corresponding to sample indices (pos, pos+1, ..., pos+n-1) in row 'irow'.
+    void fill_gaussian(float *out, ssize_t n, ssize_t irow, ssize_t pos, float rms=1.0) const;
+
+    // Writes out[it] = (uniform random number in [lo,hi)), indexed the same way as fill_gaussian().
+    void fill_uniform(float *out, ssize_t n, ssize_t irow, ssize_t pos, float lo=0.0, float hi=1.0) const;
+
+    // Returns a positive seed drawn from std::random_device, for callers which want non-reproducible output.
+    // The seed is < 2^63, so that it can be stored in json as a signed 64-bit integer.
+    static ssize_t random_seed();
+};
+
+
+// transpose_uint8_to_float(): converts a shape-(nt,nfreq) uint8 array with time as the slowest-varying index
+// (the PSRFITS layout) to a shape-(nfreq,nt) float array (the rf_pipelines layout).  Defined in psrfits_stream.cpp,
+// but always compiled (not just if HAVE_PSRFITS is defined).
+//
+// The source stride 'sstride' is in bytes, and the destination stride 'dstride' is in floats.  The destination
+// stride can be negative, e.g. for reversing the frequency ordering.
+
+extern void transpose_uint8_to_float(float *dst, ssize_t dstride, const uint8_t *src, ssize_t sstride, ssize_t nfreq, ssize_t nt);
+
+
+// weighted_moments(): kernel used by the kurtosis_filter and thermal_noise_weight, defined in moment_filters.cpp.
+//
+// The (intensity, weights) arrays have shape (nfreq, nt), and are downsampled by (Df,Dt) in the same way
+// as the clippers.  For each downsampled channel, the output array 'out' (shape (nfreq/Df, 5)) contains
+// (W, mean, m2, m3, m4), where W is the total weight, and m_n is the weighted central moment of order n.
+// If W=0, all five outputs are zero.
+
+extern void weighted_moments(double *out, ssize_t nfreq, ssize_t nt, const float *intensity, ssize_t istride,
+			     const float *weights, ssize_t wstride, int Df=1, int Dt=1);
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // Allocators
@@ -363,6 +521,13 @@ inline int integer_log2(int n)
    return ret;
 }
 
+// Dispersion delay in seconds, at frequency 'freq_MHz', relative to infinite frequency.
+// The dispersion constant is the same as simpulse/bonsai.
+inline double dispersion_delay(double dm, double freq_MHz)
+{
+    return 4148.806 * dm / (freq_MHz * freq_MHz);
+}
+
 // Greatest common divisor
 inline ssize_t gcd(ssize_t m, ssize_t n)
 {
@@ -16,6 +16,7 @@
 // -----------------
 //   pipeline
 //   wi_sub_pipeline
+//   dag_pipeline
 //
 // Streams
 // -------
@@ -27,6 +28,8 @@
 //   chime_frb_stream_from_glob
 //   chime_network_stream
 //   gaussian_noise_stream
+//   synthetic_rfi_stream
+//   psrfits_stream
 //
 // Detrenders
 // ----------
@@ -37,8 +40,15 @@
 // --------
 //   intensity_clipper
 //   std_dev_clipper
+//   kurtosis_filter
 //   mask_expander
 //
+// Utility classes
+// ---------------
+//   pipeline_fork
+//   pipeline_reverter
+//   bitmask_maker
+//
 // CHIME-specific
 // --------------
 //   chime_file_writer
@@ -49,20 +59,25 @@
 //
 // Miscellaneous transforms
 // ------------------------
-//   adversarial_masker (*)
+//   adversarial_masker (**)
 //   badchannel_mask (*)
 //   bonsai_dedisperser (**) 
-//   frb_injector_transform (*)
-//   mask_filler (*) 
-//   noise_filler (*)
+//   frb_injector_transform (**)
+//   pulse_adder
+//   mask_filler (**)
+//   noise_filler (**)
+//   online_mask_filler
 //   plotter_transform (*)
-//   variance_estimator (*)
+//   thermal_noise_weight
+//   variance_estimator (**)
 //
 // (*) = python-only
-// (**) = the bonsai_dedisperser currently has both python and C++ versions
+// (**) = currently has both python and C++ versions
 
 #include <mutex>
 #include <atomic>
+#include <thread>
+#include <condition_variable>
 
 // ring_buffer, pipeline_object, etc.
 #include "rf_pipelines_base_classes.hpp"
@@ -73,6 +88,7 @@
 // A little hack so that all definitions still compile if optional dependencies are absent.
 namespace bonsai { class dedisperser; }
 namespace ch_frb_io { class intensity_network_stream; }
+namespace simpulse { struct single_pulse; }
 
 namespace rf_pipelines {
 #if 0
@@ -120,6 +136,16 @@ protected:
 //
 // wi_sub_pipeline: this more specialized container class is used to run a "sub-pipeline"
 // at lower (freqency, time) resolution, then upsample and apply the resulting mask.
+//
+// If a pipeline contains consecutive wi_sub_pipelines, then they share a "pyramid" of
+// downsampled data, so that (for example) a 4x-downsampled sub-pipeline can be built from
+// the 2x-downsampled data of a previous sibling, rather than from full resolution.
+// This is transparent to the caller (see comments in wi_sub_pipeline.cpp for details).
+//
+// If 'nbuf_async' is nonzero, then the sub-pipeline runs in a helper thread, and the mask is
+// applied in the main thread when it becomes available (up to 'nbuf_async' chunks later, plus
+// the lag of the sub-pipeline).  This uses an extra core, and increases latency and ring buffer
+// sizes.  Such wi_sub_pipelines don't participate in the pyramid.
 
 
 class wi_sub_pipeline : public pipeline {
@@ -141,6 +167,7 @@ public:
 	ssize_t nds_out = 0;    // cumulative time downsampling (relative to input data) after downsampling to sub-pipeline
 	ssize_t Df = 0;         // frequency downsampling factor (between input pipeline and sub-pipeline)
 	ssize_t Dt = 0;         // time downsampling factor (between input pipeline and sub-pipeline)
+	ssize_t nbuf_async = 0; // if nonzero, sub-pipeline runs in a helper thread, with this many chunks in flight
     };
 
     wi_sub_pipeline(const std::shared_ptr<pipeline_object> &sub_pipeline, const initializer &ini_params);
@@ -152,8 +179,32 @@ public:
     const initializer ini_params;
     const std::shared_ptr<pipeline_object> sub_pipeline;
 
+    // Used internally, to share downsampled data between consecutive wi_sub_pipelines.
+    // A pyramid_level is a pair of ring buffers, downsampled by (Df,Dt) relative to the parent pipeline.
+    struct pyramid_level {
+	ssize_t Df = 0;
+	ssize_t Dt = 0;
+	std::shared_ptr<ring_buffer> rb_intensity;   // initialized when the publishing wi_sub_pipeline is bound
+	std::shared_ptr<ring_buffer> rb_weights;
+    };
+
+    // Called by pipeline::_bind(), just before binding elements[i0].  If elements[i0] is the first
+    // in a sequence of consecutive wi_sub_pipelines, initializes the pyramid_* members below.
+    static void _plan_pyramid(const std::vector<std::shared_ptr<pipeline_object>> &elements, size_t i0, const ring_buffer_dict &rb_dict);
+
+    std::shared_ptr<pyramid_level> pyramid_src;                    // if nonempty, downsample from here (rather than full resolution)
+    std::shared_ptr<pyramid_level> pyramid_out;                    // if nonempty, publish pristine downsampled data here
+    std::vector<std::shared_ptr<pyramid_level>> pyramid_masked;    // pyramid levels which the upsampled mask is applied to
+
 protected:
+    // Computes (Df,Dt) from ini_params and parent pipeline parameters (nfreq_in, nds_in).
+    void _get_DfDt(ssize_t nfreq_in, ssize_t nds_in, ssize_t &Df, ssize_t &Dt) const;
+
+    // If the sub_pipeline is a single clipper or detrender, the downsampler/transform/upsampler can be fused.
+    bool _is_fusable(ssize_t min_nt_chunk) const;
+
     virtual void _bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override;
+    virtual void _unbind() override;
     virtual void _visit_pipeline(std::function<void(const std::shared_ptr<pipeline_object>&,int)> f, const std::shared_ptr<pipeline_object> &self, int depth) override;
     
     virtual ssize_t get_preferred_chunk_size() override;
@@ -162,7 +213,85 @@ protected:
 
 // -------------------------------------------------------------------------------------------------
 //
-// "Utility" classes: mask_expander, pipeline_fork
+// dag_pipeline: a container class whose elements form a directed acyclic graph, rather than
+// a chain, so that independent branches can run concurrently.
+//
+// Each element declares the names of the pipeline ring_buffers it uses (including buffers it
+// creates).  Element j depends on an earlier element i if they declare a common name, and
+// receives its input from the elements it depends on, rather than from the previous element.
+// Note that reading counts as using a buffer: ring_buffers are not thread-safe, even for reads.
+//
+// In each call to _advance(), every element is advanced once (in dependency order), and elements
+// without a dependency path between them run in parallel, on 'nthreads' threads (including the
+// caller).  If nthreads=0, one thread per "sink" element (element with no dependents) is used.
+//
+// A typical use is a stream and pipeline_fork, followed by a trigger branch (e.g. bonsai) which uses
+// INTENSITY/WEIGHTS, and a diagnostic branch which only uses the forked buffers.  The diagnostic
+// branch then runs concurrently with the trigger branch, instead of adding to its latency.
+//
+// The declarations are checked in bind(): if two elements use the same ring_buffer (or a copy-on-write
+// fork of it), without a dependency path between them, an exception is thrown.
+
+
+class dag_pipeline : public pipeline_object {
+public:
+    const std::vector<std::shared_ptr<pipeline_object>> elements;
+    const std::vector<std::vector<std::string>> bufnames;
+    const ssize_t nthreads;
+
+    dag_pipeline(const std::vector<std::shared_ptr<pipeline_object>> &elements,
+		 const std::vector<std::vector<std::string>> &bufnames,
+		 ssize_t nthreads=0, const std::string &name="");
+
+    virtual ~dag_pipeline();
+
+    virtual Json::Value jsonize() const override;
+    static std::shared_ptr<dag_pipeline> from_json(const Json::Value &x);
+
+protected:
+    // Dependency graph, initialized in constructor.
+    // All indices in deps[j] are < j, and redundant (transitively implied) dependencies are omitted.
+    std::vector<std::vector<int>> deps;
+    std::vector<std::vector<int>> dependents;
+    std::vector<std::vector<bool>> ancestors;    // ancestors[j][i] is true if j depends on i, possibly indirectly
+    std::vector<int> sinks;
+
+    // Worker threads, started in _start_pipeline() if nthreads > 1 (see dag_pipeline.cpp).
+    // The per-round scheduling state below 'lock' is protected by it.
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<int> ready;       // elements whose dependencies have all been advanced in this round
+    std::vector<int> npending;    // number of dependencies not yet advanced in this round
+    int nremaining = 0;
+    bool workers_done = false;
+    ssize_t round_ret = SSIZE_MAX;
+    std::exception_ptr round_error;
+
+    ssize_t _run_element(int j);
+    void _advance_element(std::unique_lock<std::mutex> &l);
+    void _worker_main();
+    void _stop_workers();
+
+    virtual void _bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override;
+    virtual ssize_t _advance() override;
+
+    virtual void _allocate() override;
+    virtual void _deallocate() override;
+    virtual void _start_pipeline(Json::Value &j) override;
+    virtual void _end_pipeline(Json::Value &j) override;
+    virtual void _reset() override;
+    virtual void _unbind() override;
+    virtual void _get_info(Json::Value &j) override;
+    virtual void _visit_pipeline(std::function<void(const std::shared_ptr<pipeline_object>&,int)> f, const std::shared_ptr<pipeline_object> &self, int depth) override;
+
+    virtual ssize_t get_preferred_chunk_size() override;
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// "Utility" classes: mask_expander, pipeline_fork, pipeline_reverter
 
 
 // mask_expander
@@ -228,9 +357,61 @@ extern std::shared_ptr<pipeline_object> make_mask_expander(rf_kernels::axis_type
 // Creates one or more new pipeline ring_buffers, by copying existing ring_buffers.
 // The 'bufnames' argument should be a list of (input_bufname, output_bufname) pairs.
 // Frequently, the input_bufname will be one of the built-in names "INTENSITY" or "WEIGHTS".
+//
+// If 'copy_on_write' is true, then data is only copied when either the input or output
+// buffer is written downstream, which makes forks that are only read (e.g. by plotters)
+// nearly free.  This uses a larger input ring_buffer, and throws an exception if a
+// pipeline_object writes the input while reading the output over the same time range.
+
+
+extern std::shared_ptr<pipeline_object> make_pipeline_fork(const std::vector<std::pair<std::string,std::string>> &bufnames, bool copy_on_write=false);
+
+
+// pipeline_reverter
+//
+// Undoes the effect of all pipeline_objects since a previous pipeline_fork, e.g. for "try a mask,
+// then undo it" pipelines.  The 'bufnames' argument should be a list of (saved_bufname, bufname)
+// pairs, where 'saved_bufname' is the output_bufname of the pipeline_fork.  After the pipeline_reverter,
+// 'bufname' refers to the saved ring_buffer.
+//
+// No data is copied: the pipeline_reverter just rebinds buffer names.  In particular, if the intervening
+// transforms only modify the weights, then only the weights need to be saved, and the only copy is the
+// one made by the pipeline_fork.  Note that after the pipeline_reverter, both names refer to the same
+// ring_buffer (so modifying 'bufname' also modifies 'saved_bufname').
+
+
+extern std::shared_ptr<pipeline_object> make_pipeline_reverter(const std::vector<std::pair<std::string,std::string>> &bufnames);
+
+
+// bitmask_maker
+//
+// Creates a new pipeline ring_buffer 'output_bufname', containing the RFI mask (derived from the
+// weights) as a packed bitmask.  Bit (it % 8) of byte (it / 8) is set iff weight > 0, which is
+// the same format as ch_frb_io::assembled_chunk::rfi_mask.  Each float32 element of the output
+// ring_buffer is really a uint32_t containing 32 bits of the mask, so the output ring_buffer has
+// an extra factor 32 of time downsampling, relative to the weights.  (See bitmask_maker.cpp for
+// an example of how downstream pipeline_objects should read it.)
+//
+// The 'simd_level' argument selects the kernel (see make_bitmask() below).  If negative, the
+// fastest kernel supported by the CPU is chosen at runtime.
+
+extern std::shared_ptr<pipeline_object> make_bitmask_maker(const std::string &output_bufname="BITMASK", ssize_t nt_chunk=0, int simd_level=-1);
+
+
+// make_bitmask(): kernel used by the bitmask_maker, which converts a float32 weights array with
+// shape (nfreq,nt) to a uint8 bitmask with shape (nfreq,nt/8).  Both arrays can have arbitrary
+// strides (in units of float32 and uint8 respectively), and nt must be a multiple of 8.
+//
+// The 'simd_level' argument is one of the BITMASK_* constants.  If negative, the fastest kernel
+// supported by the CPU (as returned by bitmask_simd_level()) is used.
 
+static constexpr int BITMASK_SCALAR = 0;
+static constexpr int BITMASK_SSE2 = 1;
+static constexpr int BITMASK_AVX2 = 2;
+static constexpr int BITMASK_AVX512 = 3;
 
-extern std::shared_ptr<pipeline_object> make_pipeline_fork(const std::vector<std::pair<std::string,std::string>> &bufnames);
+extern int bitmask_simd_level();
+extern void make_bitmask(uint8_t *out, ssize_t ostride, ssize_t nfreq, ssize_t nt, const float *in, ssize_t istride, int simd_level=-1);
 
 
 // -------------------------------------------------------------------------------------------------
@@ -329,6 +510,17 @@ extern std::shared_ptr<wi_transform>
 make_std_dev_clipper(int nt_chunk, rf_kernels::axis_type axis, double sigma, int Df=1, int Dt=1, bool two_pass=false);
 
 
+// kurtosis_filter: masks frequency channels whose excess kurtosis (computed independently in each chunk)
+// is outside the range [lo_cut, hi_cut].  For Gaussian data, the excess kurtosis is zero.  If the kurtosis
+// is undefined (e.g. all samples masked), it is treated as -4.
+//
+// The (Df,Dt) args are downsampling factors on the frequency/time axes.  The kurtosis is computed from the
+// downsampled data, and if Df > 1, then blocks of Df channels are masked together.
+
+extern std::shared_ptr<wi_transform>
+make_kurtosis_filter(int nt_chunk=1024, double lo_cut=-1.0, double hi_cut=1.0, int Df=1, int Dt=1);
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // bonsai_dedisperser: a "transform" which doesn't actually modify the data, it just runs the bonsai dedisperser.  
@@ -343,6 +535,12 @@ make_std_dev_clipper(int nt_chunk, rf_kernels::axis_type axis, double sigma, int
 //   frb_global_max_trigger_dm
 //   frb_global_max_trigger_tfinal
 //
+// If 'nbuf_async' is nonzero, then the dedisperser runs in its own thread, so that it doesn't serialize
+// with upstream transforms.  Each chunk is copied into one of 'nbuf_async' buffers (e.g. 2 = double
+// buffering), and the pipeline blocks if the dedisperser falls behind by more than nbuf_async chunks.
+// Since the dedisperser then works on copies, the filled data can't be written back to the pipeline,
+// so 'nbuf_async' can't be combined with 'fill_rfi_mask' (an exception is thrown).
+//
 // We don't currently define any mechanism for the C++ bonsai_transform to write plots,
 // but this should be easy to change if needed.  The python bonsai_transform does contain plotter logic.
 
@@ -357,6 +555,7 @@ struct bonsai_initializer {
     std::string file_type;                       // Filetype of config file.  Allowed values are { txt, hdf5 }.  Empty string means "infer from filename".
     std::string hdf5_output_filename;            // If this string is nonempty, then trigger HDF5 files will be written.
     int nt_per_hdf5_file = 0;                    // Only meaningful if hdf5_output_filename is nonempty.  Zero means "one big file".
+    int nbuf_async = 0;                          // If nonzero, dedisperser runs in a separate thread, with this many chunk buffers (incompatible with fill_rfi_mask).
 
     bonsai_initializer() { }
 };
@@ -368,6 +567,40 @@ extern std::shared_ptr<wi_transform> make_bonsai_dedisperser(const std::string &
 extern std::shared_ptr<wi_transform> make_bonsai_dedisperser(const std::shared_ptr<bonsai::dedisperser> &d);
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// frb_injector_transform: adds a simulated FRB to the intensity array (leaving weights unmodified).
+//
+// This is a C++ version of the python frb_injector_transform.  From python, the two versions are
+// constructed as 'frb_injector_transform' and 'frb_injector_transform_cpp' respectively.  The C++
+// version doesn't depend on simpulse, and doesn't currently support reading variances from an HDF5 file.
+//
+//   snr                        Signal-to-noise ratio in "sigmas"
+//   undispersed_arrival_time   Arrival time (in seconds) of the pulse without dispersion delay applied
+//   dm                         Dispersion measure in its usual units (pc cm^{-3})
+//   variance                   Per-channel variances (length nfreq), or a single variance (length 1)
+//   intrinsic_width            Gaussian rms width of the pulse in seconds (frequency-independent)
+//   sm                         Scattering timescale in milliseconds at 1 GHz (scales as frequency^(-4.4))
+//   spectral_index             Pulse fluence is proportional to frequency^spectral_index
+//
+// The pulse profile in each channel is computed once, in bind().  It is stored sparsely, so that the
+// cost of _process_chunk() is proportional to the number of (freq,time) samples overlapped by the pulse.
+
+extern std::shared_ptr<wi_transform> make_frb_injector_transform(double snr, double undispersed_arrival_time, double dm, const std::vector<double> &variance,
+								 double intrinsic_width=0.0, double sm=0.0, double spectral_index=0.0, ssize_t nt_chunk=1024);
+
+
+// pulse_adder: adds one or more simulated pulses (simpulse::single_pulse objects) to the intensity array,
+// multiplied by 'weight'.  Requires rf_pipelines to be compiled with HAVE_SIMPULSE.  The pulse nfreq must
+// match the pipeline, and the pulse times are interpreted in the same units as the stream's 't_initial'.
+//
+// Each pulse is rendered once, in bind(), and stored sparsely (one segment per overlapped channel).
+// The cost of each chunk is proportional to the number of (freq,time) samples where some pulse overlaps,
+// so many pulses can be added at once.
+
+extern std::shared_ptr<wi_transform> make_pulse_adder(ssize_t nt_chunk, const std::vector<std::shared_ptr<simpulse::single_pulse>> &pulses, double weight=1.0);
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // gaussian_noise_stream: simple stream which simulates Gaussian random noise.
@@ -380,10 +613,93 @@ extern std::shared_ptr<wi_transform> make_bonsai_dedisperser(const std::shared_p
 //   sample_rms          RMS of intensity samples (Gaussian distributed)
 //   nt_chunk            Stream block size (if zero, will default to a reasonable value)
 //   randomize_weights   If true, weights will be uniform random numbers (if false, all weights will be 1.0)
+//   seed                RNG seed (nonnegative).  The output is a deterministic function of the seed (independent of nt_chunk
+//                       and nthreads).  If zero, a random seed is chosen, and recorded in the json output.
+//   nthreads            Number of threads used to generate random numbers in each chunk.
 
 
 extern std::shared_ptr<wi_stream> make_gaussian_noise_stream(ssize_t nfreq, ssize_t nt_tot, double freq_lo_MHz, double freq_hi_MHz, 
-							     double dt_sample, double sample_rms=1.0, ssize_t nt_chunk=0, bool randomize_weights=false);
+							     double dt_sample, double sample_rms=1.0, ssize_t nt_chunk=0, bool randomize_weights=false,
+							     ssize_t seed=0, int nthreads=1);
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// synthetic_rfi_stream: extends gaussian_noise_stream with simulated RFI, dropped packets, the CHIME
+// 16K "ripple", and dispersed pulses.  Intended for benchmarking RFI-removal pipelines (e.g. with
+// rfp-time) on data whose masking behavior is more realistic than pure Gaussian noise.
+//
+// The output is a deterministic function of the seed (independent of nt_chunk and nthreads).
+// Each source of non-Gaussianity is disabled by default, and enabled by setting the corresponding
+// rate or amplitude to a nonzero value.  All amplitudes are in units of sample_rms.
+//
+// Narrowband RFI: a randomly chosen subset of channels (fraction 'narrowband_frac') is contaminated.
+// In each block of 'narrowband_nt' samples, a contaminated channel is "on" with probability
+// 'narrowband_duty_cycle', in which case 'narrowband_amplitude' is added.
+//
+// Broadband RFI: in each block of 'broadband_nt' samples, a burst occurs with probability
+// 'broadband_prob', in which case 'broadband_amplitude' is added to all channels.
+//
+// Dropped packets: the (freq,time) plane is divided into packets of shape (packet_nfreq, packet_nt),
+// and each packet is dropped with probability 'packet_loss_frac'.  Dropped packets have intensity
+// and weight zero.
+//
+// 16K ripple: the noise in channel 'ifreq' is multiplied by (1 + ripple_amplitude * (r[ifreq % 16] - 1)),
+// where r[] is the 16-channel ripple profile which is corrected by chime_16k_derippler.
+//
+// Dispersed pulses: one pulse is placed at a random time in each block of 'pulse_nt_spacing' samples,
+// with DM uniformly distributed in [pulse_dm_min, pulse_dm_max].  In each channel, the pulse is a boxcar
+// spanning the intra-channel dispersion delay (minimum width one sample), normalized so that its
+// fluence is 'pulse_amplitude' (times sample_rms times one sample).
+
+struct synthetic_rfi_initializer {
+    double sample_rms = 1.0;
+    ssize_t nt_chunk = 0;                  // If zero, will default to a reasonable value
+    ssize_t seed = 0;                      // If zero, a random seed is chosen (and recorded in the json output)
+    int nthreads = 1;
+
+    double narrowband_frac = 0.0;
+    double narrowband_amplitude = 10.0;
+    double narrowband_duty_cycle = 0.5;
+    ssize_t narrowband_nt = 1024;
+
+    double broadband_prob = 0.0;
+    double broadband_amplitude = 3.0;
+    ssize_t broadband_nt = 16;
+
+    double packet_loss_frac = 0.0;
+    ssize_t packet_nfreq = 16;
+    ssize_t packet_nt = 16;
+
+    double ripple_amplitude = 0.0;
+
+    ssize_t pulse_nt_spacing = 0;          // Zero means "no pulses"
+    double pulse_amplitude = 30.0;
+    double pulse_dm_min = 50.0;
+    double pulse_dm_max = 1000.0;
+
+    synthetic_rfi_initializer() { }
+};
+
+extern std::shared_ptr<wi_stream> make_synthetic_rfi_stream(ssize_t nfreq, ssize_t nt_tot, double freq_lo_MHz, double freq_hi_MHz,
+							    double dt_sample, const synthetic_rfi_initializer &ini_params = synthetic_rfi_initializer());
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// psrfits_stream: reads a PSRFITS search-mode file (requires rf_pipelines to be compiled with HAVE_PSRFITS).
+//
+//   filename            Name of the FITS file.
+//   nt_chunk            Stream block size (if zero, will default to a reasonable value).  Need not be a
+//                       multiple of the FITS row size.
+//   nrows_prefetch      Number of FITS rows which are read ahead by a background thread, so that disk I/O
+//                       overlaps with pipeline processing.
+//
+// The file's 8-bit samples are converted to float, and the per-(row,frequency) FITS weights are used as the
+// rf_pipelines weights.  Files with either frequency ordering are supported.
+
+
+extern std::shared_ptr<wi_stream> make_psrfits_stream(const std::string &filename, ssize_t nt_chunk=0, int nrows_prefetch=2);
 
 
 // -------------------------------------------------------------------------------------------------
@@ -445,6 +761,53 @@ extern std::shared_ptr<wi_transform> make_chime_16k_stripe_analyzer(ssize_t Dt1=
 // Experimental: writes HDF5 file containing the intensity spectrum.
 extern std::shared_ptr<wi_transform> make_spectrum_analyzer(ssize_t Dt1=16, ssize_t Dt2=16);
 
+// variance_estimator: a pseudo-transform (does not modify its input) which estimates the per-channel variance
+// and writes the results to an HDF5 file, in the same format as the python variance_estimator.
+//
+// This is a C++ version of the python variance_estimator.  From python, the two versions are constructed
+// as 'variance_estimator' and 'variance_estimator_cpp' respectively.  First, the weighted variance is computed
+// in blocks of 'v1_chunk' samples, then the median of 'v2_chunk' such estimates is written to the file.
+// HDF5 writes are done in a background thread.
+extern std::shared_ptr<wi_transform> make_variance_estimator(const std::string &var_filename, ssize_t v1_chunk=128, ssize_t v2_chunk=80, ssize_t nt_chunk=1024);
+
+// mask_filler: replaces masked samples (weight <= w_cutoff) by Gaussian noise, whose variance is read from
+// an HDF5 file written by the variance_estimator, and sets all weights to 2.0 (or 0.0 in channels whose
+// variance is zero).  This is a C++ version of the python mask_filler; from python, the two versions are
+// constructed as 'mask_filler' and 'mask_filler_cpp' respectively.  Random numbers are only generated for
+// masked samples.  If seed=0, a random seed is chosen (and recorded in the json output).
+extern std::shared_ptr<wi_transform> make_mask_filler(const std::string &var_file, double w_cutoff, ssize_t nt_chunk=1024, ssize_t seed=0);
+
+// noise_filler: replaces the intensity by Gaussian noise, whose rms is incremented by 'increment' after each chunk.
+// This is a C++ version of the python noise_filler; from python, the two versions are constructed as 'noise_filler'
+// and 'noise_filler_cpp' respectively.  If 'var_filename' is nonempty, the simulated variance is written to an HDF5
+// file with the same layout as the variance_estimator output.
+extern std::shared_ptr<wi_transform> make_noise_filler(ssize_t nt_chunk=512, double increment=0.1, const std::string &var_filename=std::string(), ssize_t seed=0);
+
+// online_mask_filler: keeps a running variance estimate in each frequency channel (an exponential average of
+// variances computed every 'v1_chunk' samples, weighted by 'var_weight'), and replaces samples whose weight is
+// below 'w_cutoff' by Gaussian noise with the running variance.  The running weight in each channel moves by
+// 'w_clamp' per v1_chunk, depending on whether the variance estimate succeeded.  Currently v1_chunk must be 32.
+//
+// make_scalar_mask_filler() returns the same transform, but using the (slow) scalar reference kernel.
+extern std::shared_ptr<wi_transform> make_online_mask_filler(int v1_chunk=32, float var_weight=2.0e-3, float w_clamp=3.3e-3, float w_cutoff=0.5, int nt_chunk=1024,
+							     bool modify_weights=true, bool multiply_intensity_by_weights=false);
+
+extern std::shared_ptr<wi_transform> make_scalar_mask_filler(int v1_chunk=32, float var_weight=2.0e-3, float w_clamp=3.3e-3, float w_cutoff=0.5, int nt_chunk=1024,
+							     bool modify_weights=true, bool multiply_intensity_by_weights=false);
+
+// thermal_noise_weight: for thermal-noise dominated data, multiplies the weights in each channel by the inverse of
+// the radiometer-equation noise rms, i.e. sqrt(2 * dt_sample * delta_f) / (mean intensity), computed independently
+// in each chunk.  Channels with very small total weight, or nonpositive mean intensity, are masked.  The (Df,Dt) args
+// are downsampling factors, as in the clippers.  Probably can't be used in tandem with detrending!
+extern std::shared_ptr<wi_transform> make_thermal_noise_weight(int nt_chunk=512, int Df=1, int Dt=1);
+
+// adversarial_masker: masks a long sequence of rectangle-shaped regions of the (freq,time) plane, intended for
+// stress-testing online variance estimation and bonsai's handling of gaps.  This is a C++ version of the python
+// adversarial_masker; from python, the two versions are constructed as 'adversarial_masker' and 'adversarial_masker_cpp'
+// respectively.  The rectangles are sorted by time, so that each chunk only touches the rectangles which overlap it.
+// If 'seed' is zero, a random seed is chosen, and recorded in the json output.
+extern std::shared_ptr<wi_transform> make_adversarial_masker(ssize_t nt_chunk=1024, ssize_t nt_reset=65536, ssize_t nt_minefield=4096*1024, ssize_t seed=0);
+
 
 // -------------------------------------------------------------------------------------------------
 //
@@ -515,9 +878,19 @@ extern std::shared_ptr<wi_transform> make_chime_packetizer(const std::string &ds
 // store the rfi bitmask so that it can be saved to disk.  These extra actions are enabled by
 // calling mask_counter::set_runtime_attrs(), externally to rf_pipelines in the CHIME L1 server.
 // This allows the same mask_counter class to be used for either offline or real-time analysis.
+//
+// If 'occupancy_Df' is nonzero, the mask_counter also accumulates a long-term "occupancy map":
+// the masked fraction in bins of 'occupancy_Df' frequency channels and 'occupancy_Dt' time samples
+// (toplevel resolution, i.e. without the downsampling factor 'nds' applied).  The map is written
+// to an HDF5 file "mask_occupancy_WHERE.h5" in the pipeline output directory, as a float32 dataset
+// 'masked_fraction' with shape (nfreq/occupancy_Df, nbins).  The last time bin may be partial, and
+// (like 'nunmasked_samples_WHERE') includes zero-weight padding past the end of the stream.
+// HDF5 I/O is done by a background thread, so the per-chunk cost is just the mask count.
+// Requires HAVE_HDF5.
 
 
 class mask_measurements_ringbuf;
+struct mask_occupancy_map;
 
 
 class mask_counter_transform : public wi_transform {
@@ -529,18 +902,23 @@ public:
     };	
 
     const std::string where;     // specified at construction
+    const int occupancy_Df;      // specified at construction (zero if occupancy map is disabled)
+    const int occupancy_Dt;      // specified at construction
     runtime_attrs attrs;         // specified in set_runtime_attrs()
 
     ssize_t nunmasked_tot = 0;   // cumulative number of unmasked samples during pipeline run
     std::shared_ptr<mask_measurements_ringbuf> ringbuf;   // nullptr iff (attrs.ringbuf_nhistory == 0)
 
-    mask_counter_transform(int nt_chunk_, std::string where_);
+    mask_counter_transform(int nt_chunk_, std::string where_, int occupancy_Df_=0, int occupancy_Dt_=0);
     void set_runtime_attrs(const runtime_attrs &a);
 
     virtual void _bind_transform(Json::Value &json_attrs) override;
     virtual void _start_pipeline(Json::Value &j) override;
+    virtual void _allocate() override;
     virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override;
     virtual void _end_pipeline(Json::Value &j) override;
+    virtual void _reset() override;
+    virtual void _deallocate() override;
     virtual ~mask_counter_transform() { }
 
     virtual Json::Value jsonize() const override;
@@ -550,6 +928,12 @@ protected:
     bool chime_fpga_counts_initialized = false;
     uint64_t chime_initial_fpga_count = 0;
     int chime_fpga_counts_per_sample = 0;    
+
+    // Per-frequency counts for the ring buffer, length nfreq (allocated in _allocate() iff ringbuf is nonempty).
+    std::vector<int> ringbuf_fcounts;
+
+    // Nonempty iff (occupancy_Df > 0), between _allocate() and _deallocate().
+    std::shared_ptr<mask_occupancy_map> occupancy;
 };
 
 
@@ -576,26 +960,73 @@ struct mask_measurements {
 };
 
 
+// The ring buffer is a single-producer, multi-reader seqlock.  The producer (the mask_counter's
+// _process_chunk()) never takes a lock, and never allocates after the first call to add().  Readers
+// (e.g. the L1 RPC server) never block the producer: each slot carries a sequence number, and a reader
+// which races with the producer discards the slot it was copying.  Since the producer only overwrites
+// the oldest slot, this can only happen for an entry which is about to fall out of the history anyway.
+
 class mask_measurements_ringbuf {
 public:
     mask_measurements_ringbuf(int nhistory=300);
 
+    // Reader API: lock-free, may be called from any thread.
+    //
+    // The stats functions are computed from prefix sums which are maintained in add(), so their cost
+    // is independent of 'nchunks'.  get_freq_masked_fractions() returns a length-nf vector containing the
+    // masked fraction in each frequency channel, over the last 'nchunks' entries (or an empty vector if
+    // no entries have been added).
+
     std::unordered_map<std::string, float> get_stats(int nchunks);
+    std::vector<float> get_freq_masked_fractions(int nchunks);
     std::vector<rf_pipelines::mask_measurements> get_all_measurements();
 
+    // Producer API: must be called from a single thread.  The per-frequency arrays are allocated
+    // on the first call to add(), and all subsequent calls must have the same value of 'nf'.
+    void add(ssize_t pos, int nf, int nt, int nsamples_unmasked, const int *freqs_unmasked);
     void add(rf_pipelines::mask_measurements& meas);
 
 protected:
-    std::vector<rf_pipelines::mask_measurements> ringbuf;
-    std::mutex mutex;
-    int next;
-    int maxsize;
+    struct slot {
+	// Sequence number: odd while the producer is writing, (2*igen+2) after the producer has
+	// written entry (igen*maxsize + islot).  Fields are atomics, so that racing reads are well-defined.
+	std::atomic<uint64_t> seq;
+	std::atomic<ssize_t> pos;
+	std::atomic<int> nt;
+	std::atomic<int> nsamples_unmasked;
+	std::atomic<int64_t> cum_nsamples;    // sum of 'nsamples' over all earlier entries
+	std::atomic<int64_t> cum_unmasked;    // sum of 'nsamples_unmasked' over all earlier entries
+    };
+
+    const int maxsize;
+    std::unique_ptr<slot[]> slots;                 // length maxsize
+    std::unique_ptr<std::atomic<int>[]> freqs;     // shape (maxsize, nf), allocated in first call to add()
+    std::unique_ptr<std::atomic<int64_t>[]> cum_freqs;   // shape (maxsize, nf), sum of 'freqs' over all earlier entries
+    int nf = 0;                                    // written once by producer, before first 'next' increment
+    std::atomic<int64_t> next;                     // number of entries added so far
+
+    // Running totals, only accessed by the producer.
+    int64_t tot_nsamples = 0;
+    int64_t tot_unmasked = 0;
+    std::vector<int64_t> tot_freqs;
+
+    // Copies entry 'i' into 'out', returning false if the entry has been (or is being) overwritten.
+    // If 'out_freqs' is non-null, it must point to an array of length nf.
+    bool _read_entry(int64_t i, mask_measurements &out, int *out_freqs) const;
+
+    // Reads prefix sums from entry 'i', returning false if the entry has been (or is being) overwritten.
+    // If 'inclusive' is true, the sums include entry 'i' itself.  If 'out_freqs' is non-null, it must point
+    // to an array of length nf.
+    bool _read_prefix(int64_t i, bool inclusive, int64_t &out_nsamples, int64_t &out_unmasked, int64_t *out_freqs) const;
+
+    // Sums over the last 'nchunks' entries, returning the number of entries in the window.
+    int64_t _read_window(int nchunks, int64_t &out_nsamples, int64_t &out_unmasked, std::vector<int64_t> *out_freqs) const;
 };
 
 
 
 // Externally callable
-std::shared_ptr<wi_transform> make_mask_counter(int nt_chunk, std::string where);
+std::shared_ptr<wi_transform> make_mask_counter(int nt_chunk, std::string where, int occupancy_Df=0, int occupancy_Dt=0);
 
 
 
@@ -258,14 +258,24 @@ static void print_timing(timing_dict_t &d, const vector<Json::Value> &v, string
     cout << string(4*indent_level, ' ');
     cout << "[" << cpu_time << " sec] " << name << endl;
 
-    if (class_name == "pipeline") {
+    if ((class_name == "pipeline") || (class_name == "dag_pipeline")) {
 	auto v2 = _get(v, "pipeline");
 	int m = v2[0].size();
 	for (int j = 0; j < m; j++)
 	    print_timing(d, _get(v2,j), "", indent_level+1);
     }
+    else if ((class_name == "wi_sub_fused") || (class_name == "wi_sub_async")) {
+	// Fused or async wi_sub_pipeline internals (see wi_sub_pipeline.cpp)
+	print_timing(d, _get(_get(v, "pipeline"), 0), "", indent_level+1);
+    }
     else if (class_name == "wi_sub_pipeline") {
 	auto v2 = _get(v, "pipeline");
+
+	if (v2[0].size() == 1) {
+	    print_timing(d, _get(v2,0), "", indent_level+1);
+	    return;
+	}
+
 	rf_assert(v2[0].size() == 3);
 
 	auto v3 = _get(v2, 1);
@@ -308,7 +318,7 @@ static void print_timing(const global_context &c)
     cout << "\nTotal time spent in each transform type:\n";
     for (const auto &s: class_names) {
 	// Skip container classes
-	if ((s == "pipeline") || (s == "wi_sub_pipeline"))
+	if ((s == "pipeline") || (s == "wi_sub_pipeline") || (s == "dag_pipeline"))
 	    continue;
 	cout << "    " << s << ": " << d[s] << " sec\n";
     }
@@ -32,6 +32,11 @@ ring_buffer::ring_buffer(const vector<ssize_t> &cdims_, ssize_t nds_, bool debug
 
 ring_buffer::~ring_buffer()
 {
+    if (cow_parent) {
+	vector<ring_buffer *> &v = cow_parent->cow_children;
+	v.erase(std::remove(v.begin(), v.end(), this), v.end());
+    }
+
     free(buf);
     buf = nullptr;
 }
@@ -82,13 +87,26 @@ void ring_buffer::_preallocate()
     rf_assert(nt_contig > 0);
     rf_assert(nt_maxlag >= nt_contig);
 
+    // Copy-on-write children read directly from this buffer (see set_cow_parent()), so we
+    // retain enough samples to cover the child's entire ring buffer, measured from our own
+    // append position.  This costs some memory, but means that samples are never copied
+    // into a child just because they are about to fall out of this buffer.
+    ssize_t nt_contig_eff = nt_contig;
+    ssize_t nt_maxlag_eff = nt_maxlag;
+
+    for (const ring_buffer *c: cow_children) {
+	ssize_t child_period = round_up((c->nt_maxlag + nds - 1) / nds, 32);   // same as c->period
+	nt_contig_eff = max(nt_contig_eff, c->nt_contig);
+	nt_maxlag_eff = max(nt_maxlag_eff, nt_maxlag + child_period * nds);
+    }
+
     // The memory alignment heuristics below are intended to improve L1 cache associativity.
     // FIXME: some day, define a boolean flag for toggling this, to see how much it actually helps!
 
-    this->period = (nt_maxlag + nds - 1) / nds;
+    this->period = (nt_maxlag_eff + nds - 1) / nds;
     this->period = round_up(period, 32);
 
-    this->stride = period + (nt_contig + nds - 2) / nds;
+    this->stride = period + (nt_contig_eff + nds - 2) / nds;
     this->stride = round_up(stride, 16);
 
     if (stride % 32 == 0)
@@ -114,6 +132,8 @@ void ring_buffer::reset()
     this->optimal_period = 0;
     this->nget_tot = 0;
     this->nget_mirror = 0;
+    this->nget_cow = 0;
+    this->cow_pos = 0;
 }
 
 
@@ -133,6 +153,7 @@ float *ring_buffer::get(ssize_t pos0, ssize_t pos1, int mode)
     rf_assert(mode != ACCESS_NONE);
     rf_assert(buf != nullptr);
     rf_assert(ap == nullptr);
+    rf_assert(!cow_parent || (mode != ACCESS_APPEND));   // creator calls cow_append() instead
 
     // Set ap_pos* before applying downsampling factor.
     // (Remaining fields 'ap' and 'ap_mode' will be set later.)
@@ -143,6 +164,9 @@ float *ring_buffer::get(ssize_t pos0, ssize_t pos1, int mode)
     pos0 /= nds;
     pos1 /= nds;
 
+    if (!cow_children.empty() && (mode & ACCESS_WRITE))
+	_cow_before_write(pos0, pos1, mode);
+
     if (mode == ACCESS_APPEND) {
 	// Range check and advance buffer
 	rf_assert(pos0 == curr_pos);
@@ -154,6 +178,21 @@ float *ring_buffer::get(ssize_t pos0, ssize_t pos1, int mode)
 	rf_assert(pos1 <= curr_pos);
     }
 
+    if (cow_parent && (pos1 > cow_pos)) {
+	if ((mode == ACCESS_READ) && (pos0 >= cow_pos)) {
+	    // Range hasn't been materialized, so we can return a pointer to the parent's storage.
+	    this->ap = cow_parent->_cow_peek(pos0, pos1);
+	    this->ap_mode = mode;
+	    this->ap_stride = cow_parent->stride;
+	    this->ap_cow = true;
+	    this->optimal_period = max(optimal_period, curr_pos - pos0);
+	    this->nget_tot += (pos1 - pos0);
+	    return ap;
+	}
+
+	_cow_materialize(pos1);
+    }
+
     // Sample range in memory
     ssize_t it0 = pos0 % period;
     ssize_t it1 = it0 + (pos1 - pos0);
@@ -168,6 +207,7 @@ float *ring_buffer::get(ssize_t pos0, ssize_t pos1, int mode)
 
     this->ap = this->buf + it0;
     this->ap_mode = mode;
+    this->ap_stride = stride;
     this->high_water_mark = max(high_water_mark, it1);
     this->optimal_period = max(optimal_period, curr_pos - pos0);
     this->nget_tot += (it1 - it0);   // note: nget_mirror is updated in ring_buffer::_copy()
@@ -189,6 +229,7 @@ void ring_buffer::put(float *p, ssize_t pos0, ssize_t pos1, int mode)
     rf_assert(ap_mode == mode);
 
     this->ap = nullptr;
+    this->ap_cow = false;
 
     if (!(mode & ACCESS_WRITE))
 	return;
@@ -199,6 +240,13 @@ void ring_buffer::put(float *p, ssize_t pos0, ssize_t pos1, int mode)
     ssize_t it0 = pos0 % period;
     ssize_t it1 = it0 + (pos1 - pos0);
 
+    _update_valid(it0, it1);
+}
+
+
+// Helper for put(): after samples [it0,it1) have been written, update the range of valid samples.
+void ring_buffer::_update_valid(ssize_t it0, ssize_t it1)
+{
 #if RF_RB_DEBUG
     ssize_t save_first_valid = first_valid_sample;
     ssize_t save_last_valid = last_valid_sample;
@@ -250,15 +298,144 @@ Json::Value ring_buffer::get_info()
     j["optimal_period"] = Json::Int64(optimal_period);
     j["nget_tot"] = Json::Int64(nget_tot);
     j["nget_mirror"] = Json::Int64(nget_mirror);
+    j["nget_cow"] = Json::Int64(nget_cow);
     j["mb"] = 4.0e-6 * double(stride) * double(csize);
 
     for (ssize_t d: cdims)
 	j["cdims"].append(Json::Int64(d));
 
+    if (cow_parent)
+	j["cow_parent"] = cow_parent->name;
+
     return j;
 }
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// Copy-on-write
+
+
+void ring_buffer::set_cow_parent(const shared_ptr<ring_buffer> &parent)
+{
+    rf_assert(parent);
+    rf_assert(parent.get() != this);
+    rf_assert(!cow_parent);
+    rf_assert(cow_children.empty());
+    rf_assert(buf == nullptr);
+    rf_assert(parent->buf == nullptr);
+
+    // Chains of copy-on-write buffers are not supported (caller should check has_cow_parent()).
+    if (parent->cow_parent)
+	throw runtime_error("rf_pipelines::ring_buffer::set_cow_parent(): parent is already a copy-on-write buffer");
+    if ((parent->cdims != cdims) || (parent->nds != nds))
+	throw runtime_error("rf_pipelines::ring_buffer::set_cow_parent(): parent has different shape or downsampling factor");
+
+    this->cow_parent = parent;
+    parent->cow_children.push_back(this);
+}
+
+
+void ring_buffer::cow_append(ssize_t pos0, ssize_t pos1)
+{
+    rf_assert(cow_parent);
+    rf_assert(buf != nullptr);
+    rf_assert(ap == nullptr);
+    rf_assert(pos0 <= pos1);
+    rf_assert(pos0 % nds == 0);
+    rf_assert(pos1 % nds == 0);
+    rf_assert(pos0 / nds == curr_pos);
+    rf_assert(pos1 / nds <= cow_parent->curr_pos);
+
+    this->curr_pos = pos1 / nds;
+}
+
+
+// Called on the parent, before returning a writeable pointer to samples [pos0,pos1).
+// Each child is materialized up to the end of the range which is about to be modified.
+// In the ACCESS_APPEND case, this is the range which is about to be overwritten.
+
+void ring_buffer::_cow_before_write(ssize_t pos0, ssize_t pos1, int mode)
+{
+    if (mode == ACCESS_APPEND) {
+	pos0 -= period;
+	pos1 -= period;
+    }
+
+    for (ring_buffer *c: cow_children) {
+	if (c->ap_cow && (c->ap_pos0 < pos1 * nds) && (c->ap_pos1 > pos0 * nds)) {
+	    throw runtime_error("rf_pipelines: ring_buffer '" + name + "' was written while its copy-on-write child '" + c->name
+				+ "' was being read (this access pattern requires a pipeline_fork with copy_on_write=false)");
+	}
+
+	c->_cow_materialize(pos1);
+    }
+}
+
+
+// Called on the child: copies samples [cow_pos,pos1) from the parent.
+void ring_buffer::_cow_materialize(ssize_t pos1)
+{
+    pos1 = min(pos1, curr_pos);
+
+    if (pos1 <= cow_pos)
+	return;
+
+    // Samples which have already dropped out of this ring buffer are never materialized.
+    // After skipping them, we're in the same state as after a long run of appends.
+    if (cow_pos < curr_pos - period) {
+	this->cow_pos = curr_pos - period;
+	this->first_valid_sample = 0;
+	this->last_valid_sample = period;
+    }
+
+    ssize_t pstride = cow_parent->stride;
+    ssize_t nmax = min(min(stride - period, period), min(pstride - cow_parent->period, cow_parent->period));
+
+    while (cow_pos < pos1) {
+	ssize_t n = min(pos1 - cow_pos, nmax);
+	ssize_t it0 = cow_pos % period;
+	ssize_t it1 = it0 + n;
+
+	const float *src = cow_parent->_cow_peek(cow_pos, cow_pos + n);
+
+	// Same logic as get(ACCESS_APPEND) followed by put().
+	_mirror_initial(it1);
+
+	for (ssize_t i = 0; i < csize; i++)
+	    memcpy(buf + i*stride + it0, src + i*pstride, n * sizeof(float));
+
+	_update_valid(it0, it1);
+
+	this->cow_pos += n;
+	this->nget_cow += n;
+    }
+}
+
+
+// Called on the parent: returns a pointer to samples [pos0,pos1), with mirroring applied, but
+// without setting the active pointer.
+float *ring_buffer::_cow_peek(ssize_t pos0, ssize_t pos1)
+{
+    if (ap && (int(ap_mode) & ACCESS_WRITE)) {
+	throw runtime_error("rf_pipelines: copy-on-write child of ring_buffer '" + name + "' was accessed while the parent was being written"
+			    " (this access pattern requires a pipeline_fork with copy_on_write=false)");
+    }
+
+    rf_assert(pos0 >= curr_pos - period);
+    rf_assert(pos1 <= curr_pos);
+
+    ssize_t it0 = pos0 % period;
+    ssize_t it1 = it0 + (pos1 - pos0);
+    rf_assert(it1 <= stride);
+
+    _mirror_initial(it0);
+    _mirror_final(it1);
+
+    return buf + it0;
+}
+
+
 void ring_buffer::_mirror_initial(ssize_t it0)
 {
     if (it0 < first_valid_sample) 
@@ -28,6 +28,10 @@ string run_params::mismatch(const run_params &p) const
     _mismatch_helper(ret, "img_nzoom", img_nzoom, p.img_nzoom);
     _mismatch_helper(ret, "img_nds", img_nds, p.img_nds);
     _mismatch_helper(ret, "img_nx", img_nx, p.img_nx);
+    _mismatch_helper(ret, "png_compression", png_compression, p.png_compression);
+    _mismatch_helper(ret, "png_filter", png_filter, p.png_filter);
+    _mismatch_helper(ret, "png_nthreads", png_nthreads, p.png_nthreads);
+    _mismatch_helper(ret, "png_store_intermediate", png_store_intermediate, p.png_store_intermediate);
     _mismatch_helper(ret, "verbosity", verbosity, p.verbosity);
     _mismatch_helper(ret, "debug", debug, p.debug);
 
@@ -48,6 +52,17 @@ void run_params::check() const
     // Note: the upsampling logic in zoomable_tileset_state::_emit_plot() assumes img_nx is even.
     if ((img_nx <= 0) || (img_nx % 2))
 	throw runtime_error("rf_pipelines: img_nx(=" + to_string(img_nx) + ") must be positive and even");
+
+    if ((png_compression < -1) || (png_compression > 9))
+	throw runtime_error("rf_pipelines: expected png_compression(=" + to_string(png_compression) + ") to be between -1 and 9");
+    if (png_nthreads < 0)
+	throw runtime_error("rf_pipelines: expected png_nthreads(=" + to_string(png_nthreads) + ") to be >= 0");
+
+    // Must be kept in sync with _png_filter_flags() in plot_utils.cpp.
+    static const vector<string> png_filters = { "default", "none", "sub", "up", "avg", "paeth", "all" };
+
+    if (std::find(png_filters.begin(), png_filters.end(), png_filter) == png_filters.end())
+	throw runtime_error("rf_pipelines: png_filter(=\"" + png_filter + "\") must be one of \"default\", \"none\", \"sub\", \"up\", \"avg\", \"paeth\", \"all\"");
 }
 
 
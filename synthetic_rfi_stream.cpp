@@ -0,0 +1,370 @@
+#include <thread>
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+// All random numbers in the synthetic_rfi_stream are generated by counter_rngs with the same seed,
+// and one of the following 'stream' indices.  Each random number is a pure function of its
+// (row, pos) coordinates, so the output doesn't depend on nt_chunk or nthreads.
+
+enum {
+    RNG_NOISE = 0,        // (row, pos) = (ifreq, it)
+    RNG_NB_CHANNEL = 1,   // (row, pos) = (ifreq, 0)
+    RNG_NB_BLOCK = 2,     // (row, pos) = (ifreq, it / narrowband_nt)
+    RNG_BB_BLOCK = 3,     // (row, pos) = (0, it / broadband_nt)
+    RNG_PACKET = 4,       // (row, pos) = (ifreq / packet_nfreq, it / packet_nt)
+    RNG_PULSE = 5         // (row, pos) = (0 for arrival time or 1 for DM, it / pulse_nt_spacing)
+};
+
+
+class synthetic_rfi_stream : public wi_stream
+{
+protected:
+    const ssize_t nt_tot;
+    const double freq_lo_MHz;
+    const double freq_hi_MHz;
+    const double dt_sample;
+    const synthetic_rfi_initializer ini_params;
+    const ssize_t seed;
+
+    // Initialized in constructor.
+    vector<float> gain;            // length nfreq, includes sample_rms and 16K ripple
+    vector<float> nb_amplitude;    // length nfreq, narrowband amplitude (zero in uncontaminated channels)
+    ssize_t pulse_max_delay = 0;   // max dispersion delay across band, in samples
+
+    struct pulse {
+	double t0;    // undispersed arrival time (at freq_hi), in samples
+	double dm;
+    };
+
+    // Per-chunk state, initialized in _fill_chunk() and then shared between threads (read-only).
+    vector<float> bb_chunk;        // length nt_chunk
+    vector<pulse> pulse_chunk;     // pulses which overlap the current chunk
+
+public:
+    synthetic_rfi_stream(ssize_t nfreq_, ssize_t nt_tot_, double freq_lo_MHz_, double freq_hi_MHz_, double dt_sample_, const synthetic_rfi_initializer &ini_params_) :
+	wi_stream("synthetic_rfi_stream"),
+	nt_tot(nt_tot_),
+	freq_lo_MHz(freq_lo_MHz_),
+	freq_hi_MHz(freq_hi_MHz_),
+	dt_sample(dt_sample_),
+	ini_params(ini_params_),
+	seed(ini_params_.seed ? ini_params_.seed : counter_rng::random_seed())
+    {
+	const synthetic_rfi_initializer &p = ini_params;
+
+	this->nfreq = nfreq_;
+	this->nt_chunk = p.nt_chunk ? p.nt_chunk : 1024;
+
+	if (nfreq <= 0)
+	    _throw("expected nfreq > 0");
+	if (nt_tot <= 0)
+	    _throw("expected nt_tot > 0");
+	if ((freq_lo_MHz <= 0.0) || (freq_lo_MHz >= freq_hi_MHz))
+	    _throw("expected 0 < freq_lo_MHz < freq_hi_MHz");
+	if (dt_sample <= 0.0)
+	    _throw("expected dt_sample > 0");
+	if (p.sample_rms < 0.0)
+	    _throw("expected sample_rms >= 0");
+	if ((p.nt_chunk < 0) || (seed < 0) || (p.nthreads <= 0))
+	    _throw("expected nt_chunk >= 0, seed >= 0, nthreads > 0");
+	if ((p.narrowband_frac < 0.0) || (p.narrowband_frac > 1.0) || (p.narrowband_duty_cycle < 0.0) || (p.narrowband_duty_cycle > 1.0))
+	    _throw("expected narrowband_frac, narrowband_duty_cycle in [0,1]");
+	if ((p.broadband_prob < 0.0) || (p.broadband_prob > 1.0) || (p.packet_loss_frac < 0.0) || (p.packet_loss_frac > 1.0))
+	    _throw("expected broadband_prob, packet_loss_frac in [0,1]");
+	if ((p.narrowband_nt <= 0) || (p.broadband_nt <= 0) || (p.packet_nfreq <= 0) || (p.packet_nt <= 0))
+	    _throw("expected narrowband_nt, broadband_nt, packet_nfreq, packet_nt > 0");
+	if ((p.ripple_amplitude < -1.0) || (p.ripple_amplitude > 2.0))
+	    _throw("expected -1 <= ripple_amplitude <= 2");
+	if ((p.pulse_nt_spacing < 0) || (p.pulse_dm_min < 0.0) || (p.pulse_dm_min > p.pulse_dm_max))
+	    _throw("expected pulse_nt_spacing >= 0, 0 <= pulse_dm_min <= pulse_dm_max");
+
+	// Same profile as chime_16k_derippler.
+	static constexpr float ripple[16] = {
+	    1.28255845837, 1.25644862084, 1.19869285334, 1.10585973916,
+	    0.982096806832, 0.844561662108, 0.722474301172, 0.648123020509,
+	    0.643478657879, 0.709964838879, 0.827771489632, 0.965153033863,
+	    1.09186607691, 1.18902487817, 1.25106135586, 1.28086420647
+	};
+
+	this->gain.resize(nfreq);
+	this->nb_amplitude.resize(nfreq, 0.0);
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	    gain[ifreq] = p.sample_rms * (1.0 + p.ripple_amplitude * (ripple[ifreq % 16] - 1.0));
+
+	if (p.narrowband_frac > 0.0) {
+	    counter_rng rng(seed, RNG_NB_CHANNEL);
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+		float u;
+		rng.fill_uniform(&u, 1, ifreq, 0);
+		if (u < p.narrowband_frac)
+		    nb_amplitude[ifreq] = p.narrowband_amplitude * p.sample_rms;
+	    }
+	}
+
+	if (p.pulse_nt_spacing > 0) {
+	    double dt = dispersion_delay(p.pulse_dm_max, freq_lo_MHz) - dispersion_delay(p.pulse_dm_max, freq_hi_MHz);
+	    this->pulse_max_delay = ssize_t(dt / dt_sample) + 2;
+	}
+    }
+
+    virtual ~synthetic_rfi_stream() { }
+
+    virtual void _bind_stream(Json::Value &json_attrs) override
+    {
+	json_attrs["freq_lo_MHz"] = this->freq_lo_MHz;
+	json_attrs["freq_hi_MHz"] = this->freq_hi_MHz;
+	json_attrs["dt_sample"] = this->dt_sample;
+    }
+
+    virtual void _allocate() override
+    {
+	this->bb_chunk.resize(nt_chunk, 0.0);
+    }
+
+    virtual void _deallocate() override
+    {
+	this->bb_chunk = vector<float> ();
+	this->pulse_chunk = vector<pulse> ();
+    }
+
+    virtual bool _fill_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	const synthetic_rfi_initializer &p = ini_params;
+
+	ssize_t nt = nt_chunk;
+	nt = min(nt, nt_tot - pos);
+	nt = max(nt, ssize_t(0));
+
+	// Broadband RFI (same in all channels, so computed once per chunk).
+	for (ssize_t it = 0; it < nt_chunk; it++)
+	    bb_chunk[it] = 0.0;
+
+	if ((p.broadband_prob > 0.0) && (nt > 0)) {
+	    counter_rng rng(seed, RNG_BB_BLOCK);
+	    ssize_t b0 = pos / p.broadband_nt;
+	    ssize_t b1 = (pos + nt - 1) / p.broadband_nt + 1;
+	    vector<float> u(b1 - b0);
+	    rng.fill_uniform(&u[0], b1-b0, 0, b0);
+
+	    for (ssize_t it = 0; it < nt; it++)
+		if (u[(pos+it) / p.broadband_nt - b0] < p.broadband_prob)
+		    bb_chunk[it] = p.broadband_amplitude * p.sample_rms;
+	}
+
+	// Dispersed pulses which can overlap the chunk.
+	pulse_chunk.clear();
+
+	if ((p.pulse_nt_spacing > 0) && (nt > 0)) {
+	    counter_rng rng(seed, RNG_PULSE);
+	    ssize_t k0 = max(pos - pulse_max_delay, ssize_t(0)) / p.pulse_nt_spacing;
+	    ssize_t k1 = (pos + nt) / p.pulse_nt_spacing + 1;
+	    vector<float> ut(k1-k0), udm(k1-k0);
+	    rng.fill_uniform(&ut[0], k1-k0, 0, k0);
+	    rng.fill_uniform(&udm[0], k1-k0, 1, k0);
+
+	    for (ssize_t k = k0; k < k1; k++) {
+		pulse pp;
+		pp.t0 = (k + ut[k-k0]) * p.pulse_nt_spacing;
+		pp.dm = p.pulse_dm_min + udm[k-k0] * (p.pulse_dm_max - p.pulse_dm_min);
+		pulse_chunk.push_back(pp);
+	    }
+	}
+
+	// Frequency channels are divided evenly between threads.
+	int nth = min(ssize_t(p.nthreads), nfreq);
+
+	if (nth <= 1)
+	    _fill_rows(intensity, istride, weights, wstride, pos, nt, 0, nfreq);
+	else {
+	    vector<std::thread> threads;
+	    for (int ith = 0; ith < nth; ith++) {
+		ssize_t f0 = (ith * nfreq) / nth;
+		ssize_t f1 = ((ith+1) * nfreq) / nth;
+		threads.push_back(std::thread(&synthetic_rfi_stream::_fill_rows, this, intensity, istride, weights, wstride, pos, nt, f0, f1));
+	    }
+	    for (auto &t: threads)
+		t.join();
+	}
+
+	if (nt == nt_chunk)
+	    return true;
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    memset(intensity + ifreq*istride + nt, 0, (nt_chunk-nt) * sizeof(float));
+	    memset(weights + ifreq*wstride + nt, 0, (nt_chunk-nt) * sizeof(float));
+	}
+
+	return false;
+    }
+
+    // Fills frequency channels [f0,f1).  Thread-safe, since the RNGs are stateless and per-chunk state is read-only.
+    void _fill_rows(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos, ssize_t nt, ssize_t f0, ssize_t f1) const
+    {
+	const synthetic_rfi_initializer &p = ini_params;
+	const double df = (freq_hi_MHz - freq_lo_MHz) / nfreq;
+
+	counter_rng noise_rng(seed, RNG_NOISE);
+	counter_rng nb_rng(seed, RNG_NB_BLOCK);
+	counter_rng packet_rng(seed, RNG_PACKET);
+
+	ssize_t nb0 = pos / p.narrowband_nt;
+	ssize_t nb1 = (nt > 0) ? ((pos + nt - 1) / p.narrowband_nt + 1) : nb0;
+	ssize_t np0 = pos / p.packet_nt;
+	ssize_t np1 = (nt > 0) ? ((pos + nt - 1) / p.packet_nt + 1) : np0;
+
+	vector<float> u_nb(nb1 - nb0);
+	vector<float> u_packet(np1 - np0);
+
+	for (ssize_t ifreq = f0; ifreq < f1; ifreq++) {
+	    float *irow = intensity + ifreq * istride;
+	    float *wrow = weights + ifreq * wstride;
+
+	    // Gaussian noise, including 16K ripple.
+	    noise_rng.fill_gaussian(irow, nt, ifreq, pos, gain[ifreq]);
+
+	    for (ssize_t it = 0; it < nt; it++) {
+		irow[it] += bb_chunk[it];
+		wrow[it] = 1.0;
+	    }
+
+	    // Narrowband RFI.
+	    if (nb_amplitude[ifreq] != 0.0) {
+		nb_rng.fill_uniform(&u_nb[0], nb1-nb0, ifreq, nb0);
+
+		for (ssize_t it = 0; it < nt; it++)
+		    if (u_nb[(pos+it) / p.narrowband_nt - nb0] < p.narrowband_duty_cycle)
+			irow[it] += nb_amplitude[ifreq];
+	    }
+
+	    // Dispersed pulses.  Note that rf_pipelines orders frequency channels from highest to lowest.
+	    for (const pulse &pp: pulse_chunk) {
+		double fhi = freq_hi_MHz - ifreq * df;
+		double flo = fhi - df;
+		double d0 = dispersion_delay(pp.dm, freq_hi_MHz);
+		double ta = pp.t0 + (dispersion_delay(pp.dm, fhi) - d0) / dt_sample;
+		double tb = pp.t0 + (dispersion_delay(pp.dm, flo) - d0) / dt_sample;
+
+		if (tb < ta + 1.0)
+		    tb = ta + 1.0;
+
+		_add_boxcar(irow, pos, nt, ta, tb, p.pulse_amplitude * p.sample_rms / (tb - ta));
+	    }
+
+	    // Dropped packets.  This is done last, so that dropped packets are exactly zero.
+	    if (p.packet_loss_frac > 0.0) {
+		packet_rng.fill_uniform(&u_packet[0], np1-np0, ifreq / p.packet_nfreq, np0);
+
+		for (ssize_t it = 0; it < nt; it++) {
+		    if (u_packet[(pos+it) / p.packet_nt - np0] < p.packet_loss_frac)
+			irow[it] = wrow[it] = 0.0;
+		}
+	    }
+	}
+    }
+
+    // Adds a boxcar with value 'amp' on the time interval [ta,tb) (in samples) to row[0:nt], where
+    // row[0] corresponds to sample index 'pos'.  Partially covered samples get a fractional contribution.
+    static void _add_boxcar(float *row, ssize_t pos, ssize_t nt, double ta, double tb, double amp)
+    {
+	ssize_t i0 = max(ssize_t(floor(ta)), pos);
+	ssize_t i1 = min(ssize_t(ceil(tb)), pos + nt);
+
+	for (ssize_t i = i0; i < i1; i++) {
+	    double overlap = min(tb, double(i+1)) - max(ta, double(i));
+	    row[i-pos] += amp * overlap;
+	}
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	const synthetic_rfi_initializer &p = ini_params;
+	Json::Value ret;
+
+	ret["class_name"] = "synthetic_rfi_stream";
+	ret["nfreq"] = Json::Int64(nfreq);
+	ret["nt_tot"] = Json::Int64(nt_tot);
+	ret["freq_lo_MHz"] = freq_lo_MHz;
+	ret["freq_hi_MHz"] = freq_hi_MHz;
+	ret["dt_sample"] = dt_sample;
+	ret["sample_rms"] = p.sample_rms;
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+	ret["seed"] = Json::Int64(seed);
+	ret["nthreads"] = p.nthreads;
+	ret["narrowband_frac"] = p.narrowband_frac;
+	ret["narrowband_amplitude"] = p.narrowband_amplitude;
+	ret["narrowband_duty_cycle"] = p.narrowband_duty_cycle;
+	ret["narrowband_nt"] = Json::Int64(p.narrowband_nt);
+	ret["broadband_prob"] = p.broadband_prob;
+	ret["broadband_amplitude"] = p.broadband_amplitude;
+	ret["broadband_nt"] = Json::Int64(p.broadband_nt);
+	ret["packet_loss_frac"] = p.packet_loss_frac;
+	ret["packet_nfreq"] = Json::Int64(p.packet_nfreq);
+	ret["packet_nt"] = Json::Int64(p.packet_nt);
+	ret["ripple_amplitude"] = p.ripple_amplitude;
+	ret["pulse_nt_spacing"] = Json::Int64(p.pulse_nt_spacing);
+	ret["pulse_amplitude"] = p.pulse_amplitude;
+	ret["pulse_dm_min"] = p.pulse_dm_min;
+	ret["pulse_dm_max"] = p.pulse_dm_max;
+
+	return ret;
+    }
+
+    static shared_ptr<synthetic_rfi_stream> from_json(const Json::Value &j)
+    {
+	synthetic_rfi_initializer p;
+
+	ssize_t nfreq = ssize_t_from_json(j, "nfreq");
+	ssize_t nt_tot = ssize_t_from_json(j, "nt_tot");
+	double freq_lo_MHz = double_from_json(j, "freq_lo_MHz");
+	double freq_hi_MHz = double_from_json(j, "freq_hi_MHz");
+	double dt_sample = double_from_json(j, "dt_sample");
+
+	p.sample_rms = double_from_json(j, "sample_rms");
+	p.nt_chunk = ssize_t_from_json(j, "nt_chunk");
+	p.seed = ssize_t_from_json(j, "seed");
+	p.nthreads = int_from_json(j, "nthreads");
+	p.narrowband_frac = double_from_json(j, "narrowband_frac");
+	p.narrowband_amplitude = double_from_json(j, "narrowband_amplitude");
+	p.narrowband_duty_cycle = double_from_json(j, "narrowband_duty_cycle");
+	p.narrowband_nt = ssize_t_from_json(j, "narrowband_nt");
+	p.broadband_prob = double_from_json(j, "broadband_prob");
+	p.broadband_amplitude = double_from_json(j, "broadband_amplitude");
+	p.broadband_nt = ssize_t_from_json(j, "broadband_nt");
+	p.packet_loss_frac = double_from_json(j, "packet_loss_frac");
+	p.packet_nfreq = ssize_t_from_json(j, "packet_nfreq");
+	p.packet_nt = ssize_t_from_json(j, "packet_nt");
+	p.ripple_amplitude = double_from_json(j, "ripple_amplitude");
+	p.pulse_nt_spacing = ssize_t_from_json(j, "pulse_nt_spacing");
+	p.pulse_amplitude = double_from_json(j, "pulse_amplitude");
+	p.pulse_dm_min = double_from_json(j, "pulse_dm_min");
+	p.pulse_dm_max = double_from_json(j, "pulse_dm_max");
+
+	return make_shared<synthetic_rfi_stream> (nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, p);
+    }
+};
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("synthetic_rfi_stream", synthetic_rfi_stream::from_json);
+	}
+    } init;
+}
+
+
+shared_ptr<wi_stream> make_synthetic_rfi_stream(ssize_t nfreq, ssize_t nt_tot, double freq_lo_MHz, double freq_hi_MHz, double dt_sample, const synthetic_rfi_initializer &ini_params)
+{
+    return make_shared<synthetic_rfi_stream> (nfreq, nt_tot, freq_lo_MHz, freq_hi_MHz, dt_sample, ini_params);
+}
+
+
+}   // namespace rf_pipelines
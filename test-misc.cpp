@@ -1,6 +1,8 @@
-// Right now, all that's here is test_median(), but I may add more tests later!
+// Miscellaneous unit tests: test_median(), test_counter_rng(), test_make_bitmask(), test_transpose_uint8_to_float(),
+// test_weighted_moments(), test_mask_measurements_ringbuf(), test_wi_sub_pipeline_equivalence().
 
 #include "rf_pipelines_internals.hpp"
+#include "rf_pipelines_inventory.hpp"
 
 using namespace std;
 using namespace rf_pipelines;
@@ -32,11 +34,601 @@ static void test_median(std::mt19937 &rng)
 }
 
 
+// Checks that counter_rng output is independent of how the sample range is split into calls,
+// and has roughly the right mean and variance.
+static void test_counter_rng(std::mt19937 &rng)
+{
+    const ssize_t n = 4096;
+    const ssize_t irow = randint(rng, 0, 1000);
+    const ssize_t pos0 = randint(rng, 0, 1000000);
+
+    counter_rng crng(randint(rng, 1, 1000000), 0);
+    counter_rng crng2(crng.seed, 1);
+
+    vector<float> g(n), u(n), u2(n);
+    crng.fill_gaussian(&g[0], n, irow, pos0);
+    crng.fill_uniform(&u[0], n, irow, pos0);
+    crng2.fill_uniform(&u2[0], n, irow, pos0);
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	ssize_t i = randint(rng, 0, n);
+	ssize_t j = randint(rng, i+1, n+1);
+	
+	vector<float> g2(j-i);
+	crng.fill_gaussian(&g2[0], j-i, irow, pos0+i);
+
+	for (ssize_t k = i; k < j; k++)
+	    rf_assert(g[k] == g2[k-i]);
+    }
+
+    double gsum = 0.0, gsum2 = 0.0, usum = 0.0;
+    ssize_t ndiff = 0;
+
+    for (ssize_t k = 0; k < n; k++) {
+	rf_assert(u[k] >= 0.0 && u[k] < 1.0);
+	gsum += g[k];
+	gsum2 += g[k] * g[k];
+	usum += u[k];
+	ndiff += (u[k] != u2[k]) ? 1 : 0;
+    }
+
+    // Loose (~6 sigma) thresholds.
+    rf_assert(fabs(gsum/n) < 0.1);
+    rf_assert(fabs(gsum2/n - 1.0) < 0.15);
+    rf_assert(fabs(usum/n - 0.5) < 0.03);
+    rf_assert(ndiff > n-10);   // different streams should be independent
+
+    cout << "test_counter_rng: pass\n";
+}
+
+
+// Checks each make_bitmask() kernel supported by the CPU against a straightforward implementation.
+static void test_make_bitmask(std::mt19937 &rng)
+{
+    for (int iouter = 0; iouter < 200; iouter++) {
+	ssize_t nfreq = randint(rng, 1, 10);
+	ssize_t nt = 8 * randint(rng, 1, 40);
+	ssize_t istride = nt + randint(rng, 0, 10);
+	ssize_t ostride = nt/8 + randint(rng, 0, 10);
+
+	vector<float> w = uniform_randvec(rng, nfreq * istride, -1.0, 1.0);
+	for (ssize_t i = 0; i < nfreq * istride; i += randint(rng, 1, 5))
+	    w[i] = 0.0;
+
+	for (int simd_level = 0; simd_level <= bitmask_simd_level(); simd_level++) {
+	    vector<uint8_t> out(nfreq * ostride, 0);
+	    make_bitmask(&out[0], ostride, nfreq, nt, &w[0], istride, simd_level);
+
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+		for (ssize_t it = 0; it < nt; it++) {
+		    bool b = (out[ifreq*ostride + it/8] >> (it % 8)) & 1;
+		    rf_assert(b == (w[ifreq*istride + it] > 0.0));
+		}
+	    }
+	}
+    }
+
+    cout << "test_make_bitmask: pass (simd_level=" << bitmask_simd_level() << ")\n";
+}
+
+
+// Sizes are chosen so that both the 16-by-16 tiles and the scalar edges get exercised.
+static void test_transpose_uint8_to_float(std::mt19937 &rng)
+{
+    for (int iouter = 0; iouter < 200; iouter++) {
+	ssize_t nfreq = randint(rng, 1, 100);
+	ssize_t nt = randint(rng, 0, 200);
+	ssize_t sstride = nfreq + randint(rng, 0, 20);
+	ssize_t dstride = nt + randint(rng, 0, 20);
+	bool reverse = (randint(rng, 0, 2) == 1);
+
+	vector<uint8_t> src(nt * sstride);
+	for (auto &x: src)
+	    x = randint(rng, 0, 256);
+
+	vector<float> dst(nfreq * dstride, -1.0);
+	float *d = reverse ? (&dst[0] + (nfreq-1)*dstride) : &dst[0];
+	transpose_uint8_to_float(d, reverse ? (-dstride) : dstride, &src[0], sstride, nfreq, nt);
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    ssize_t jfreq = reverse ? (nfreq-1-ifreq) : ifreq;
+	    for (ssize_t it = 0; it < nt; it++)
+		rf_assert(dst[jfreq*dstride + it] == float(src[it*sstride + ifreq]));
+	}
+    }
+
+    cout << "test_transpose_uint8_to_float: pass\n";
+}
+
+
+// Compares weighted_moments() to a slow double-precision two-pass reference.  The intensities have a large
+// offset relative to their rms, to check that the float32 accumulators in the kernel are not losing precision.
+static void test_weighted_moments(std::mt19937 &rng)
+{
+    for (int iouter = 0; iouter < 100; iouter++) {
+	int Df = randint(rng, 1, 4);
+	int Dt = randint(rng, 1, 4);
+	ssize_t nfreq = Df * randint(rng, 1, 5);
+	ssize_t nt = Dt * randint(rng, 1, 600);
+	ssize_t istride = nt + randint(rng, 0, 5);
+	ssize_t wstride = nt + randint(rng, 0, 5);
+
+	vector<float> intensity = uniform_randvec(rng, nfreq * istride, 99.0, 101.0);
+	vector<float> weights = uniform_randvec(rng, nfreq * wstride, 0.0, 1.0);
+
+	for (ssize_t i = 0; i < nfreq * wstride; i += randint(rng, 1, 10))
+	    weights[i] = 0.0;
+	for (ssize_t it = 0; it < nt; it++)
+	    weights[it] = 0.0;   // fully masked channel (or block of channels, if Df=1)
+
+	vector<double> out(5 * (nfreq/Df));
+	weighted_moments(&out[0], nfreq, nt, &intensity[0], istride, &weights[0], wstride, Df, Dt);
+
+	for (ssize_t ifreq_ds = 0; ifreq_ds < nfreq/Df; ifreq_ds++) {
+	    vector<double> wds(nt/Dt, 0.0);
+	    vector<double> xds(nt/Dt, 0.0);
+
+	    for (ssize_t ifreq = ifreq_ds*Df; ifreq < (ifreq_ds+1)*Df; ifreq++) {
+		for (ssize_t it = 0; it < nt; it++) {
+		    wds[it/Dt] += weights[ifreq*wstride + it];
+		    xds[it/Dt] += weights[ifreq*wstride + it] * intensity[ifreq*istride + it];
+		}
+	    }
+
+	    double m[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+	    for (ssize_t j = 0; j < nt/Dt; j++) {
+		m[0] += wds[j];
+		m[1] += xds[j];
+	    }
+
+	    if (m[0] > 0.0) {
+		m[1] /= m[0];
+		for (ssize_t j = 0; j < nt/Dt; j++) {
+		    if (wds[j] <= 0.0)
+			continue;
+		    double d = xds[j]/wds[j] - m[1];
+		    m[2] += wds[j] * d*d / m[0];
+		    m[3] += wds[j] * d*d*d / m[0];
+		    m[4] += wds[j] * d*d*d*d / m[0];
+		}
+	    }
+	    else
+		m[1] = 0.0;
+
+	    const double *o = &out[5*ifreq_ds];
+	    double eps = 1.0e-3;
+
+	    rf_assert(fabs(o[0] - m[0]) <= eps * (m[0] + 1.0));
+	    rf_assert(fabs(o[1] - m[1]) <= eps);
+	    rf_assert(fabs(o[2] - m[2]) <= eps * (m[2] + 1.0e-3));
+	    rf_assert(fabs(o[3] - m[3]) <= eps * (sqrt(m[2]*m[4]) + 1.0e-3));
+	    rf_assert(fabs(o[4] - m[4]) <= eps * (m[4] + 1.0e-3));
+	}
+    }
+
+    cout << "test_weighted_moments: pass\n";
+}
+
+
+// Helper for test_mask_measurements_ringbuf(): fills 'freqs_unmasked' with a deterministic function of
+// (i, nf, nt), so that a reader can check entries for consistency without synchronizing with the producer.
+static int fill_mask_entry(vector<int> &freqs_unmasked, ssize_t i, int nt)
+{
+    int nf = freqs_unmasked.size();
+    int ret = 0;
+
+    for (int ifreq = 0; ifreq < nf; ifreq++) {
+	freqs_unmasked[ifreq] = (i + 7*ifreq) % (nt+1);
+	ret += freqs_unmasked[ifreq];
+    }
+
+    return ret;
+}
+
+
+// Compares get_stats() and get_freq_masked_fractions() (which use prefix sums) to brute-force sums over
+// get_all_measurements(), for windows ranging from 1 entry to more than the ring buffer size.
+static void test_mask_ringbuf_stats(std::mt19937 &rng)
+{
+    for (int iouter = 0; iouter < 100; iouter++) {
+	int nhistory = randint(rng, 1, 20);
+	int nf = randint(rng, 1, 20);
+	mask_measurements_ringbuf rb(nhistory);
+
+	rf_assert(rb.get_all_measurements().empty());
+	rf_assert(rb.get_freq_masked_fractions(1).empty());
+	rf_assert(rb.get_stats(1)["rfi_mask_pct_masked"] == 0.0);
+
+	for (int i = 0; i < 3*nhistory; i++) {
+	    int nt = randint(rng, 1, 100);
+	    vector<int> freqs_unmasked(nf);
+	    int nunmasked = 0;
+
+	    for (int ifreq = 0; ifreq < nf; ifreq++) {
+		freqs_unmasked[ifreq] = randint(rng, 0, nt+1);
+		nunmasked += freqs_unmasked[ifreq];
+	    }
+
+	    rb.add(i * 1024, nf, nt, nunmasked, &freqs_unmasked[0]);
+
+	    vector<mask_measurements> all = rb.get_all_measurements();
+	    rf_assert(int(all.size()) == min(i+1, nhistory));
+	    rf_assert(all.back().pos == i * 1024);
+
+	    for (int nchunks = 1; nchunks <= nhistory + 2; nchunks++) {
+		int n = min(nchunks, int(all.size()));
+		double nsamples = 0.0;
+		double nmasked = 0.0;
+		vector<double> fmasked(nf, 0.0);
+		vector<double> fsamples(nf, 0.0);
+
+		for (int j = all.size() - n; j < int(all.size()); j++) {
+		    nsamples += all[j].nsamples;
+		    nmasked += all[j].nsamples - all[j].nsamples_unmasked;
+
+		    for (int ifreq = 0; ifreq < nf; ifreq++) {
+			fmasked[ifreq] += all[j].nt - all[j].freqs_unmasked.get()[ifreq];
+			fsamples[ifreq] += all[j].nt;
+		    }
+		}
+
+		float pct = rb.get_stats(nchunks)["rfi_mask_pct_masked"];
+		rf_assert(fabs(pct - 100. * nmasked / nsamples) < 1.0e-3);
+
+		vector<float> fr = rb.get_freq_masked_fractions(nchunks);
+		rf_assert(int(fr.size()) == nf);
+
+		for (int ifreq = 0; ifreq < nf; ifreq++)
+		    rf_assert(fabs(fr[ifreq] - fmasked[ifreq] / fsamples[ifreq]) < 1.0e-5);
+	    }
+	}
+    }
+
+    cout << "test_mask_ringbuf_stats: pass\n";
+}
+
+
+// Runs readers concurrently with the producer, and checks that no reader sees a torn entry.  Each round
+// uses a new ring buffer, and the readers start polling before the first add(), since the first add()
+// also allocates the per-frequency arrays and initializes 'nf'.
+static void test_mask_ringbuf_concurrent()
+{
+    const int nhistory = 7;
+    const int nf = 16;
+    const int nt = 8;
+    const int nreaders = 2;
+    const int nrounds = 100;
+    const ssize_t nadd = 2000;
+
+    ssize_t nreads_tot = 0;
+
+    for (int iround = 0; iround < nrounds; iround++) {
+	mask_measurements_ringbuf rb(nhistory);
+	std::atomic<bool> done(false);
+	std::atomic<int> nstarted(0);
+	std::atomic<ssize_t> nbad(0);
+	std::atomic<ssize_t> nreads(0);
+
+	auto reader = [&]() {
+	    vector<int> expected(nf);
+	    bool started = false;
+
+	    while (!done) {
+		vector<mask_measurements> all = rb.get_all_measurements();
+
+		if (all.size() > size_t(nhistory))
+		    nbad++;
+
+		for (size_t j = 0; j < all.size(); j++) {
+		    const mask_measurements &m = all[j];
+		    ssize_t i = m.pos / nt;
+
+		    // Entries which are overwritten during the copy are dropped, but only from the front.
+		    if ((j > 0) && (m.pos != all[j-1].pos + nt))
+			nbad++;
+		    if ((m.nf != nf) || (m.nt != nt) || (m.nsamples_unmasked != fill_mask_entry(expected, i, nt)))
+			nbad++;
+		    if (!std::equal(expected.begin(), expected.end(), m.freqs_unmasked.get()))
+			nbad++;
+		}
+
+		for (int nchunks: { 1, nhistory-1, nhistory, nhistory+1 }) {
+		    float pct = rb.get_stats(nchunks)["rfi_mask_pct_masked"];
+		    if ((pct < 0.0) || (pct > 100.0))
+			nbad++;
+
+		    vector<float> fr = rb.get_freq_masked_fractions(nchunks);
+		    if ((fr.size() != 0) && (fr.size() != size_t(nf)))
+			nbad++;
+
+		    for (float f: fr)
+			if ((f < 0.0) || (f > 1.0))
+			    nbad++;
+		}
+
+		if (!started) {
+		    started = true;
+		    nstarted++;
+		}
+
+		nreads++;
+	    }
+	};
+
+	vector<std::thread> readers;
+	for (int ir = 0; ir < nreaders; ir++)
+	    readers.push_back(std::thread(reader));
+
+	// Wait until all readers are polling the (empty) ring buffer.
+	while (nstarted < nreaders)
+	    std::this_thread::yield();
+
+	vector<int> freqs_unmasked(nf);
+
+	for (ssize_t i = 0; i < nadd; i++) {
+	    int nunmasked = fill_mask_entry(freqs_unmasked, i, nt);
+	    rb.add(i * nt, nf, nt, nunmasked, &freqs_unmasked[0]);
+	}
+
+	done = true;
+	for (auto &t: readers)
+	    t.join();
+
+	rf_assert(nbad == 0);
+
+	vector<mask_measurements> all = rb.get_all_measurements();
+	rf_assert(all.size() == size_t(nhistory));
+	rf_assert(all.front().pos == (nadd - nhistory) * nt);
+	rf_assert(all.back().pos == (nadd - 1) * nt);
+
+	nreads_tot += nreads;
+    }
+
+    cout << "test_mask_ringbuf_concurrent: pass (" << nreads_tot << " reads)\n";
+}
+
+
+// Checks that add() throws if 'nf' changes between calls, and leaves the ring buffer unmodified.
+static void test_mask_ringbuf_nf_change()
+{
+    mask_measurements_ringbuf rb(4);
+    vector<int> freqs_unmasked(5, 1);
+
+    rb.add(0, 4, 1, 4, &freqs_unmasked[0]);
+
+    bool thrown = false;
+    try {
+	rb.add(1, 5, 1, 5, &freqs_unmasked[0]);
+    } catch (std::runtime_error &) {
+	thrown = true;
+    }
+
+    rf_assert(thrown);
+    rf_assert(rb.get_all_measurements().size() == 1);
+    rf_assert(rb.get_freq_masked_fractions(4).size() == 4);
+
+    cout << "test_mask_ringbuf_nf_change: pass\n";
+}
+
+
+static void test_mask_measurements_ringbuf(std::mt19937 &rng)
+{
+    test_mask_ringbuf_stats(rng);
+    test_mask_ringbuf_concurrent();
+    test_mask_ringbuf_nf_change();
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// test_wi_sub_pipeline_equivalence(): runs the same nested wi_sub_pipelines with the pyramid, fused,
+// and async code paths enabled and disabled, and checks that the output is identical.
+//
+// The input has small integer intensities with occasional spikes, unit weights, and all downsampling
+// factors are powers of two.  With this input, every pyramid level is an exact average, so sharing a
+// pyramid level gives bitwise identical results (not just equal up to float reassociation).
+
+
+struct wsp_test_stream : wi_stream {
+    const ssize_t nt_tot;
+    const vector<float> data;   // shape (nfreq, nt_tot)
+
+    wsp_test_stream(const vector<float> &data_, ssize_t nfreq_, ssize_t nt_tot_) :
+	wi_stream("wsp_test_stream"),
+	nt_tot(nt_tot_),
+	data(data_)
+    {
+	this->nfreq = nfreq_;
+	this->nt_chunk = 1024;
+    }
+
+    virtual bool _fill_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    for (ssize_t it = 0; it < nt_chunk; it++) {
+		bool valid = (pos + it < nt_tot);
+		intensity[ifreq*istride + it] = valid ? data[ifreq*nt_tot + pos + it] : 0.0;
+		weights[ifreq*wstride + it] = valid ? 1.0 : 0.0;
+	    }
+	}
+
+	return (pos + nt_chunk < nt_tot);
+    }
+};
+
+
+// Saves the first 'nt_tot' samples of the intensity and weights arrays.
+struct wsp_test_sink : wi_transform {
+    const ssize_t nt_tot;
+    vector<float> intensity;  // shape (nfreq, nt_tot)
+    vector<float> weights;    // shape (nfreq, nt_tot)
+
+    wsp_test_sink(ssize_t nfreq_, ssize_t nt_tot_) :
+	wi_transform("wsp_test_sink"),
+	nt_tot(nt_tot_),
+	intensity(nfreq_ * nt_tot_, 0.0),
+	weights(nfreq_ * nt_tot_, 0.0)
+    {
+	this->nfreq = nfreq_;
+	this->nt_chunk = 1024;
+    }
+
+    virtual void _process_chunk(float *intensity_, ssize_t istride, float *weights_, ssize_t wstride, ssize_t pos) override
+    {
+	ssize_t n = min(nt_chunk, nt_tot - pos);
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+	    for (ssize_t it = 0; it < n; it++) {
+		intensity[ifreq*nt_tot + pos + it] = intensity_[ifreq*istride + it];
+		weights[ifreq*nt_tot + pos + it] = weights_[ifreq*wstride + it];
+	    }
+	}
+    }
+};
+
+
+// Throws an exception in the chunk with index 'fail_at' (or never, if fail_at < 0).
+struct wsp_test_thrower : wi_transform {
+    ssize_t fail_at = -1;
+    ssize_t ichunk = 0;
+
+    wsp_test_thrower(ssize_t fail_at_) :
+	wi_transform("wsp_test_thrower"),
+	fail_at(fail_at_)
+    {
+	this->nt_chunk = 1024;
+	this->nds = 0;   // any downsampling factor is allowed
+    }
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	if (ichunk++ == fail_at)
+	    throw runtime_error("wsp_test_thrower: failing as requested");
+    }
+
+    virtual void _reset() override
+    {
+	this->ichunk = 0;
+    }
+};
+
+
+// Returns pipeline [ stream, wi_sub_pipeline(clipper), wi_sub_pipeline(clipper, thrower, wi_sub_pipeline(clipper),
+// wi_sub_pipeline(clipper)), sink ].  If 'fused' is false, each clipper is wrapped in a one-element pipeline, so that
+// it can't be fused.  If 'pyramid' is false, each wi_sub_pipeline is wrapped in a one-element pipeline, so that it
+// can't share pyramid levels with its siblings.
+
+static shared_ptr<pipeline> make_wsp_test_pipeline(const shared_ptr<pipeline_object> &stream, const shared_ptr<pipeline_object> &thrower,
+						   const shared_ptr<pipeline_object> &sink, bool pyramid, bool fused, bool async)
+{
+    using pvec = vector<shared_ptr<pipeline_object>>;
+
+    auto clipper = [fused](double sigma) -> shared_ptr<pipeline_object>
+    {
+	shared_ptr<pipeline_object> t = make_intensity_clipper(1024, rf_kernels::AXIS_NONE, sigma);
+	return fused ? t : make_shared<pipeline> (pvec{ t });
+    };
+
+    auto sub = [pyramid,async](const shared_ptr<pipeline_object> &p, ssize_t Df, ssize_t Dt) -> shared_ptr<pipeline_object>
+    {
+	wi_sub_pipeline::initializer ini_params;
+	ini_params.Df = Df;
+	ini_params.Dt = Dt;
+	ini_params.nbuf_async = async ? 2 : 0;
+
+	shared_ptr<pipeline_object> s = make_shared<wi_sub_pipeline> (p, ini_params);
+	return pyramid ? s : make_shared<pipeline> (pvec{ s });
+    };
+
+    auto inner = make_shared<pipeline> (pvec{ clipper(3.0), thrower, sub(clipper(2.5),2,1), sub(clipper(2.5),4,1) });
+    return make_shared<pipeline> (pvec{ stream, sub(clipper(3.0),2,2), sub(inner,4,2), sink });
+}
+
+
+static void test_wi_sub_pipeline_equivalence(std::mt19937 &rng)
+{
+    const ssize_t nfreq = 64;
+    const ssize_t nt_tot = 20*1024 + 100;
+
+    vector<float> data(nfreq * nt_tot);
+    for (float &x: data)
+	x = (randint(rng,0,200) == 0) ? (64 * randint(rng,-1,2)) : randint(rng,-4,5);
+
+    run_params params;
+    params.outdir = "";
+    params.verbosity = 0;
+
+    vector<float> intensity0;
+    vector<float> weights0;
+
+    for (int flags = 0; flags < 8; flags++) {
+	bool pyramid = flags & 1;
+	bool fused = flags & 2;
+	bool async = flags & 4;
+
+	auto stream = make_shared<wsp_test_stream> (data, nfreq, nt_tot);
+	auto thrower = make_shared<wsp_test_thrower> (-1);
+	auto sink = make_shared<wsp_test_sink> (nfreq, nt_tot);
+	auto p = make_wsp_test_pipeline(stream, thrower, sink, pyramid, fused, async);
+
+	p->run(params);
+
+	if (flags == 0) {
+	    intensity0 = sink->intensity;
+	    weights0 = sink->weights;
+
+	    // Check that the test is nontrivial, i.e. some (but not all) samples were masked.
+	    ssize_t nmasked = std::count(weights0.begin(), weights0.end(), 0.0f);
+	    rf_assert((nmasked > 0) && (nmasked < nfreq * nt_tot / 2));
+	    continue;
+	}
+
+	rf_assert(sink->intensity == intensity0);
+	rf_assert(sink->weights == weights0);
+    }
+
+    // Async worker thread throws: the exception should be reported exactly once, and shouldn't
+    // leak into the next run after reset().
+
+    auto stream = make_shared<wsp_test_stream> (data, nfreq, nt_tot);
+    auto thrower = make_shared<wsp_test_thrower> (5);
+    auto sink = make_shared<wsp_test_sink> (nfreq, nt_tot);
+    auto p = make_wsp_test_pipeline(stream, thrower, sink, true, true, true);
+
+    string msg;
+    try {
+	p->run(params);
+    } catch (std::exception &e) {
+	msg = e.what();
+    }
+
+    string expected = "wsp_test_thrower: failing as requested";
+    size_t i = msg.find(expected);
+    rf_assert(i != string::npos);
+    rf_assert(msg.find(expected, i+1) == string::npos);
+
+    thrower->fail_at = -1;
+    p->reset();
+    p->run(params);
+
+    rf_assert(sink->intensity == intensity0);
+    rf_assert(sink->weights == weights0);
+
+    cout << "test_wi_sub_pipeline_equivalence: pass\n";
+}
+
+
 int main(int argc, char **argv)
 {
     std::random_device rd;
     std::mt19937 rng(rd());
 
     test_median(rng);
+    test_counter_rng(rng);
+    test_make_bitmask(rng);
+    test_transpose_uint8_to_float(rng);
+    test_weighted_moments(rng);
+    test_mask_measurements_ringbuf(rng);
+    test_wi_sub_pipeline_equivalence(rng);
     return 0;
 }
@@ -83,6 +83,99 @@ static void test_ring_buffer(std::mt19937 &rng, const vector<ssize_t> &cdims, ss
 }
 
 
+// Tests a copy-on-write (parent, child) pair, in the same access pattern as a pipeline_fork
+// with copy_on_write=true: the child's append position lags the parent's by at most
+// 'nt_maxlag_p', and each buffer is read/written within its own 'nt_maxlag' window.
+
+static void test_cow_ring_buffer(std::mt19937 &rng, const vector<ssize_t> &cdims, ssize_t nds, ssize_t nt_contig_p, ssize_t nt_maxlag_p, ssize_t nt_contig_c, ssize_t nt_maxlag_c)
+{
+    shared_ptr<ring_buffer> rb_p = make_shared<ring_buffer> (cdims, nds, true);   // debug=true
+    shared_ptr<ring_buffer> rb_c = make_shared<ring_buffer> (cdims, nds, true);
+    
+    rb_c->set_cow_parent(rb_p);
+    rb_p->update_params(nt_contig_p * nds, nt_maxlag_p * nds);
+    rb_c->update_params(nt_contig_c * nds, nt_maxlag_c * nds);
+    rb_p->allocate();
+    rb_c->allocate();
+
+    ssize_t csize = rb_p->csize;
+    ssize_t pos_p = 0;
+    ssize_t pos_c = 0;
+
+    // Reference arrays, indexed by (time, ic), without wraparound.
+    vector<float> ref_p;
+    vector<float> ref_c;
+
+    for (int iter = 0; iter < 5000; iter++) {
+	bool child = (uniform_rand(rng) < 0.5);
+	shared_ptr<ring_buffer> &rb = child ? rb_c : rb_p;
+	vector<float> &ref = child ? ref_c : ref_p;
+	ssize_t nt_contig = child ? nt_contig_c : nt_contig_p;
+	ssize_t nt_maxlag = child ? nt_maxlag_c : nt_maxlag_p;
+	ssize_t pos = child ? pos_c : pos_p;
+
+	if (uniform_rand(rng) < 0.3) {
+	    // Append.  The child is "appended" by copying (in the reference array) from the parent.
+	    ssize_t n = randint(rng, 1, nt_contig+1);
+
+	    if (child) {
+		n = min(n, pos_p - pos_c);
+		if (n == 0)
+		    continue;
+
+		rb_c->cow_append(pos_c * nds, (pos_c+n) * nds);
+		ref_c.insert(ref_c.end(), ref_p.begin() + pos_c*csize, ref_p.begin() + (pos_c+n)*csize);
+		pos_c += n;
+		continue;
+	    }
+
+	    n = min(n, pos_c + nt_maxlag_p - pos_p);
+	    if (n <= 0)
+		continue;
+
+	    float *p = rb_p->get(pos_p * nds, (pos_p+n) * nds, ring_buffer::ACCESS_APPEND);
+	    ssize_t stride = rb_p->get_stride();
+
+	    for (ssize_t it = 0; it < n; it++) {
+		for (ssize_t ic = 0; ic < csize; ic++) {
+		    p[ic*stride+it] = uniform_rand(rng);
+		    ref_p.push_back(p[ic*stride+it]);
+		}
+	    }
+
+	    rb_p->put(p, pos_p * nds, (pos_p+n) * nds, ring_buffer::ACCESS_APPEND);
+	    pos_p += n;
+	    continue;
+	}
+
+	ssize_t pos_lo = max(pos - nt_maxlag, ssize_t(0));
+	ssize_t nmax = min(pos - pos_lo, nt_contig);
+
+	if (nmax == 0)
+	    continue;
+
+	ssize_t n = randint(rng, 1, nmax+1);
+	ssize_t pos0 = randint(rng, pos_lo, pos-n+1);
+	ssize_t pos1 = pos0 + n;
+	int mode = randint(rng, ring_buffer::ACCESS_READ, ring_buffer::ACCESS_RW+1);
+
+	ring_buffer_subarray a(rb, pos0 * nds, pos1 * nds, mode);
+
+	for (ssize_t it = pos0; it < pos1; it++) {
+	    for (ssize_t ic = 0; ic < csize; ic++) {
+		float &x = a.data[ic*a.stride + (it-pos0)];
+		float &r = ref[it*csize + ic];
+
+		if (mode & ring_buffer::ACCESS_READ)
+		    rf_assert(x == r);
+		if (mode & ring_buffer::ACCESS_WRITE)
+		    x = r = uniform_rand(rng);
+	    }
+	}
+    }
+}
+
+
 int main(int argc, char **argv)
 {
     const int nouter = 1000;
@@ -100,6 +193,10 @@ int main(int argc, char **argv)
 	ssize_t nds = randint(rng, 1, 5);
 
 	test_ring_buffer(rng, cdims, nds, nt_contig, nt_maxlag);
+
+	ssize_t nt_contig_c = randint(rng, 1, 50);
+	ssize_t nt_maxlag_c = randint(rng, nt_contig_c, 10 * nt_contig_c);
+	test_cow_ring_buffer(rng, cdims, nds, nt_contig, nt_maxlag, nt_contig_c, nt_maxlag_c);
     }
 
     cout << "test-ring-buffer: pass" << endl;
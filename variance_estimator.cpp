@@ -0,0 +1,335 @@
+// C++ version of the python variance_estimator (rf_pipelines/transforms/variance_estimator.py).
+//
+// From python, the two versions are constructed as 'variance_estimator' and 'variance_estimator_cpp'.
+// In the pipeline json output, they are represented as 'variance_estimator' and 'variance_estimator_cpp'.
+//
+// The output HDF5 file has the same layout as the python version, so it can be read with
+// rf_pipelines.utils.Variance_Estimates (e.g. for use with the frb_injector_transform).
+
+#include "rf_pipelines_internals.hpp"
+
+#ifdef HAVE_HDF5
+#include <sp_hdf5.hpp>
+#endif
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+#ifndef HAVE_HDF5
+
+shared_ptr<wi_transform> make_variance_estimator(const string &var_filename, ssize_t v1_chunk, ssize_t v2_chunk, ssize_t nt_chunk)
+{
+    throw runtime_error("rf_pipelines::make_variance_estimator() was called, but this rf_pipelines was compiled without HAVE_HDF5");
+}
+
+struct variance_estimator {
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	throw runtime_error("rf_pipelines: attempt to deserialize variance_estimator_cpp, but this rf_pipelines was compiled without HAVE_HDF5");
+    }
+};
+
+#else // HAVE_HDF5
+
+
+// The variance_estimator computes the weighted variance in blocks of 'v1_chunk' samples (the "v1" estimates),
+// then takes the median of 'v2_chunk' consecutive v1 estimates (the "v2" estimates), which are written to disk.
+//
+//   - If fewer than 25% of the weights in a v1 block are nonzero, the v1 estimate is 0.
+//   - If fewer than 25% of the v1 estimates in a v2 block are nonzero, the v2 estimate is 0.
+//     Otherwise, the v2 estimate is the median of the nonzero v1 estimates.
+//
+// The v2 estimates are accumulated in batches of 'nv2_per_batch' and handed off to an hdf5_writer_thread,
+// which does all HDF5 I/O (including opening and closing the file), so that the pipeline never blocks on disk.
+
+struct variance_estimator : public wi_transform
+{
+    static constexpr ssize_t nv2_per_batch = 64;
+
+    const string var_filename;
+    const ssize_t v1_chunk;
+    const ssize_t v2_chunk;
+
+    double t_initial = 0.0;
+    double dt_sample = 0.0;
+
+    // Shape (nfreq, v2_chunk) array of v1 estimates for the current v2 block.
+    uptr<float> v1;
+    ssize_t iv1 = 0;
+
+    // Temp buffer used to calculate median.
+    vector<float> median_buf;
+
+    // Current batch of v2 estimates: 'variance' array has shape (nfreq, nv2_per_batch), the first nv2 columns are valid.
+    struct batch {
+	vector<float> variance;
+	vector<float> time;
+	ssize_t nv2 = 0;
+    };
+
+    batch curr_batch;
+
+    // Only accessed by jobs running in the writer thread (see _open_file() etc. below).
+    H5::H5File h5_file;
+    unique_ptr<sp_hdf5::hdf5_extendable_dataset<float>> v_dset;
+    unique_ptr<sp_hdf5::hdf5_extendable_dataset<float>> t_dset;
+
+    // Declared after the HDF5 state, so that it's destroyed (and joined) first.
+    hdf5_writer_thread writer;
+
+
+    variance_estimator(const string &var_filename_, ssize_t v1_chunk_, ssize_t v2_chunk_, ssize_t nt_chunk_) :
+	wi_transform("variance_estimator_cpp"),
+	var_filename(var_filename_),
+	v1_chunk(v1_chunk_),
+	v2_chunk(v2_chunk_)
+    {
+	stringstream ss;
+	ss << "variance_estimator_cpp(var_filename=" << var_filename << ", v1_chunk=" << v1_chunk
+	   << ", v2_chunk=" << v2_chunk << ", nt_chunk=" << nt_chunk_ << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nds = 1;
+
+	if (var_filename.size() == 0)
+	    _throw("expected nonempty 'var_filename'");
+	if ((v1_chunk <= 0) || (v2_chunk <= 0) || (nt_chunk <= 0))
+	    _throw("expected v1_chunk, v2_chunk, nt_chunk > 0");
+	if (nt_chunk % v1_chunk)
+	    _throw("nt_chunk (=" + to_string(nt_chunk) + ") must be a multiple of v1_chunk (=" + to_string(v1_chunk) + ")");
+    }
+
+    virtual ~variance_estimator()
+    {
+	// Only reached with the writer still running if the pipeline was destroyed in the middle of a run.
+	writer.join();
+    }
+
+    virtual void _bind_transform(Json::Value &json_attrs) override
+    {
+	if (!json_attrs.isMember("dt_sample"))
+	    _throw("expected json_attrs to contain member 'dt_sample'");
+
+	// Unlike the python version, we don't require 't_initial' (in order to allow synthetic streams).
+	this->dt_sample = json_attrs["dt_sample"].asDouble();
+	this->t_initial = json_attrs.isMember("t_initial") ? json_attrs["t_initial"].asDouble() : 0.0;
+    }
+
+    virtual void _allocate() override
+    {
+	this->v1 = make_uptr<float> (nfreq * v2_chunk);
+	this->median_buf.reserve(v2_chunk);
+    }
+
+    virtual void _start_pipeline(Json::Value &json_attrs) override
+    {
+	this->iv1 = 0;
+	this->curr_batch = _new_batch();
+
+	writer.start();
+	writer.push([this]() { this->_open_file(); });
+    }
+
+    virtual void _process_chunk(float *intensity, ssize_t istride, float *weights, ssize_t wstride, ssize_t pos) override
+    {
+	for (ssize_t i = 0; i < nt_chunk; i += v1_chunk) {
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+		v1[ifreq*v2_chunk + iv1] = _v1(intensity + ifreq*istride + i, weights + ifreq*wstride + i);
+
+	    if (++iv1 < v2_chunk)
+		continue;
+
+	    // Completed a v2 block, whose last sample is (pos + i + v1_chunk).  The timestamp is the midpoint of the block.
+	    ssize_t nv2 = curr_batch.nv2;
+	    double t = t_initial + dt_sample * (pos + i + v1_chunk - 0.5 * v1_chunk * v2_chunk);
+
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+		curr_batch.variance[ifreq*nv2_per_batch + nv2] = _v2(&v1[ifreq*v2_chunk]);
+
+	    curr_batch.time[nv2] = t;
+	    curr_batch.nv2++;
+	    this->iv1 = 0;
+
+	    if (curr_batch.nv2 == nv2_per_batch) {
+		_push_batch(std::move(curr_batch));
+		this->curr_batch = _new_batch();
+	    }
+	}
+    }
+
+    // Weighted variance of one v1 block (the loops are written so that they vectorize).
+    inline float _v1(const float *ivec, const float *wvec) const
+    {
+	float wsum = 0.0;
+	float wiisum = 0.0;
+	int nnz = 0;
+
+	for (ssize_t j = 0; j < v1_chunk; j++) {
+	    wsum += wvec[j];
+	    wiisum += wvec[j] * ivec[j] * ivec[j];
+	    nnz += (wvec[j] != 0.0f) ? 1 : 0;
+	}
+
+	if ((4 * nnz < v1_chunk) || (wsum <= 0.0))
+	    return 0.0;
+
+	return wiisum / wsum;
+    }
+
+    // Median of the nonzero v1 estimates in one v2 block.
+    inline float _v2(const float *v1vec)
+    {
+	median_buf.clear();
+
+	for (ssize_t j = 0; j < v2_chunk; j++)
+	    if (v1vec[j] != 0.0f)
+		median_buf.push_back(v1vec[j]);
+
+	if (4 * ssize_t(median_buf.size()) < v2_chunk)
+	    return 0.0;
+
+	return median(median_buf);
+    }
+
+    virtual void _end_pipeline(Json::Value &json_output) override
+    {
+	// Write any remaining data, and close the file.  If the writer thread failed, the error
+	// is rethrown here only if it wasn't already delivered by _process_chunk().
+	auto b = make_shared<batch> (std::move(curr_batch));
+	this->curr_batch = batch();
+
+	if (writer.failed())
+	    json_output["writer_failed"] = true;
+
+	writer.stop([this,b]() {
+	    if (b->nv2 > 0)
+		this->_write_batch(*b);
+	    this->_close_file();
+	});
+
+	if (writer.failed())
+	    return;
+
+	// FIXME if (verbosity >= 2) ...
+	cout << "variance_estimator_cpp: wrote " << var_filename << endl;
+    }
+
+    virtual void _reset() override
+    {
+	writer.join();
+	_close_file();
+    }
+
+    virtual void _deallocate() override
+    {
+	this->v1.reset();
+	this->median_buf = vector<float> ();
+	this->curr_batch = batch();
+    }
+
+    batch _new_batch() const
+    {
+	batch ret;
+	ret.variance.resize(nfreq * nv2_per_batch, 0.0);
+	ret.time.resize(nv2_per_batch, 0.0);
+	return ret;
+    }
+
+    void _push_batch(batch &&b)
+    {
+	auto bp = make_shared<batch> (std::move(b));
+	writer.push([this,bp]() { this->_write_batch(*bp); });
+    }
+
+    // The remaining member functions run in the writer thread.
+
+    void _open_file()
+    {
+	this->h5_file = sp_hdf5::hdf5_open_trunc(var_filename);
+
+	// File attributes, as in the python version.
+	for (const auto &p: { make_pair("v1_chunk", v1_chunk), make_pair("v2_chunk", v2_chunk) }) {
+	    int val = p.second;
+	    H5::Attribute a = h5_file.createAttribute(p.first, H5::PredType::NATIVE_INT, H5::DataSpace(H5S_SCALAR));
+	    a.write(H5::PredType::NATIVE_INT, &val);
+	}
+
+	// As in the python version, the 'time' dataset is 2-d with shape (1,N).
+	vector<hsize_t> v_chunk_shape = { hsize_t(nfreq), 1 };
+	vector<hsize_t> t_chunk_shape = { 1, 1 };
+	this->v_dset = make_unique<sp_hdf5::hdf5_extendable_dataset<float>> (h5_file, "variance", v_chunk_shape, 1);
+	this->t_dset = make_unique<sp_hdf5::hdf5_extendable_dataset<float>> (h5_file, "time", t_chunk_shape, 1);
+    }
+
+    void _write_batch(const batch &b)
+    {
+	// Repack (nfreq, nv2_per_batch) -> (nfreq, nv2).
+	ssize_t nv2 = b.nv2;
+	vector<float> buf(nfreq * nv2);
+
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	    memcpy(&buf[ifreq*nv2], &b.variance[ifreq*nv2_per_batch], nv2 * sizeof(float));
+
+	v_dset->write(&buf[0], { hsize_t(nfreq), hsize_t(nv2) });
+	t_dset->write(&b.time[0], { 1, hsize_t(nv2) });
+    }
+
+    void _close_file()
+    {
+	this->v_dset.reset();
+	this->t_dset.reset();
+	this->h5_file.close();
+    }
+
+    virtual Json::Value jsonize() const override
+    {
+	Json::Value ret;
+
+	ret["class_name"] = "variance_estimator_cpp";
+	ret["var_filename"] = var_filename;
+	ret["v1_chunk"] = Json::Int64(v1_chunk);
+	ret["v2_chunk"] = Json::Int64(v2_chunk);
+	ret["nt_chunk"] = Json::Int64(this->get_prebind_nt_chunk());
+
+	return ret;
+    }
+
+    static shared_ptr<pipeline_object> from_json(const Json::Value &j)
+    {
+	string var_filename = string_from_json(j, "var_filename");
+	ssize_t v1_chunk = ssize_t_from_json(j, "v1_chunk");
+	ssize_t v2_chunk = ssize_t_from_json(j, "v2_chunk");
+	ssize_t nt_chunk = ssize_t_from_json(j, "nt_chunk");
+
+	return make_shared<variance_estimator> (var_filename, v1_chunk, v2_chunk, nt_chunk);
+    }
+};
+
+
+shared_ptr<wi_transform> make_variance_estimator(const string &var_filename, ssize_t v1_chunk, ssize_t v2_chunk, ssize_t nt_chunk)
+{
+    return make_shared<variance_estimator> (var_filename, v1_chunk, v2_chunk, nt_chunk);
+}
+
+#endif // HAVE_HDF5
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+namespace {
+    struct _init {
+	_init() {
+	    pipeline_object::register_json_deserializer("variance_estimator_cpp", variance_estimator::from_json);
+	}
+    } init;
+}
+
+
+}  // namespace rf_pipelines
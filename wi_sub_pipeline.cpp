@@ -1,5 +1,8 @@
 #include <rf_kernels/upsample.hpp>
 #include <rf_kernels/downsample.hpp>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "rf_pipelines_internals.hpp"
 
 using namespace std;
@@ -18,24 +21,65 @@ namespace rf_pipelines {
 // and rfp-time.
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// Helper used by downsampler, fused_sub_kernel, async_sub_kernel below.
+// If 'kernel' is null, then (Df,Dt)=(1,1), and we copy, zeroing intensity where the weight is zero
+// (as the downsampling kernel would do).
+
+
+static void _downsample_chunk(rf_kernels::wi_downsampler *kernel, ssize_t nfreq_out, ssize_t nt_out,
+			      float *i_out, ssize_t i_ostride, float *w_out, ssize_t w_ostride,
+			      const float *i_in, ssize_t i_istride, const float *w_in, ssize_t w_istride)
+{
+    if (kernel) {
+	kernel->downsample(nfreq_out, nt_out, i_out, i_ostride, w_out, w_ostride, i_in, i_istride, w_in, w_istride);
+	return;
+    }
+
+    for (ssize_t ifreq = 0; ifreq < nfreq_out; ifreq++) {
+	const float *isrc = i_in + ifreq * i_istride;
+	const float *wsrc = w_in + ifreq * w_istride;
+	float *idst = i_out + ifreq * i_ostride;
+	float *wdst = w_out + ifreq * w_ostride;
+
+	for (ssize_t it = 0; it < nt_out; it++) {
+	    idst[it] = (wsrc[it] > 0.0f) ? isrc[it] : 0.0f;
+	    wdst[it] = wsrc[it];
+	}
+    }
+}
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // Downsampler
+//
+// Downsamples buffers INTENSITY_SRC, WEIGHTS_SRC by (Df,Dt), and creates buffers INTENSITY, WEIGHTS.
+// Usually, the SRC buffers are the full-resolution buffers, but they can also be a pyramid level
+// which was published by a previous wi_sub_pipeline (see "pyramid" comment below), in which case
+// (Df,Dt) are relative to the pyramid level.
+//
+// If 'publish' is true, then pristine copies of the downsampled buffers are also written to new
+// buffers INTENSITY_PYRAMID, WEIGHTS_PYRAMID, for use by subsequent wi_sub_pipelines.
 
 
 struct downsampler : chunked_pipeline_object {
-    downsampler(ssize_t Df, ssize_t Dt, ssize_t nt_chunk);
+    downsampler(ssize_t Df, ssize_t Dt, ssize_t nt_chunk, bool publish);
 
     // Inherits 'nt_chunk' from base class.
     const ssize_t Df;
     const ssize_t Dt;
-    rf_kernels::wi_downsampler kernel;
+    const bool publish;
+    unique_ptr<rf_kernels::wi_downsampler> kernel;   // empty if (Df,Dt) = (1,1)
 
     // Initialized in _bindc().
     shared_ptr<ring_buffer> rb_intensity_in;
     shared_ptr<ring_buffer> rb_weights_in;
     shared_ptr<ring_buffer> rb_intensity_out;
     shared_ptr<ring_buffer> rb_weights_out;
+    shared_ptr<ring_buffer> rb_intensity_pyr;   // only if publish=true
+    shared_ptr<ring_buffer> rb_weights_pyr;     // only if publish=true
     ssize_t nfreq_out = 0;
     ssize_t nds_out = 0;
     ssize_t nt_out = 0;
@@ -46,21 +90,24 @@ struct downsampler : chunked_pipeline_object {
 };
 
 
-downsampler::downsampler(ssize_t Df_, ssize_t Dt_, ssize_t nt_chunk_) :
+downsampler::downsampler(ssize_t Df_, ssize_t Dt_, ssize_t nt_chunk_, bool publish_) :
     chunked_pipeline_object("wi_sub_downsampler", false),  // can_be_first=false
     Df(Df_),
     Dt(Dt_),
-    kernel(Df_, Dt_)
+    publish(publish_)
 { 
     this->nt_chunk = nt_chunk_;
     rf_assert(nt_chunk > 0);
+
+    if ((Df > 1) || (Dt > 1))
+	this->kernel = make_unique<rf_kernels::wi_downsampler> (Df, Dt);
 }
 
 
 void downsampler::_bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
 {
-    this->rb_intensity_in = get_buffer(rb_dict, "INTENSITY_HIRES");
-    this->rb_weights_in = get_buffer(rb_dict, "WEIGHTS_HIRES");
+    this->rb_intensity_in = get_buffer(rb_dict, "INTENSITY_SRC");
+    this->rb_weights_in = get_buffer(rb_dict, "WEIGHTS_SRC");
 
     // Error checking is imperfect here, since the wi_sub_pipeline constructor
     // contains a complete set of checks.
@@ -80,6 +127,11 @@ void downsampler::_bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
 
     this->rb_intensity_out = create_buffer(rb_dict, "INTENSITY", { nfreq_out }, nds_out);
     this->rb_weights_out = create_buffer(rb_dict, "WEIGHTS", { nfreq_out }, nds_out);
+
+    if (publish) {
+	this->rb_intensity_pyr = create_buffer(rb_dict, "INTENSITY_PYRAMID", { nfreq_out }, nds_out);
+	this->rb_weights_pyr = create_buffer(rb_dict, "WEIGHTS_PYRAMID", { nfreq_out }, nds_out);
+    }
 }
 
 
@@ -90,11 +142,20 @@ bool downsampler::_process_chunk(ssize_t pos)
     ring_buffer_subarray i_out(rb_intensity_out, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
     ring_buffer_subarray w_out(rb_weights_out, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
 
-    kernel.downsample(this->nfreq_out, this->nt_out, 
-		      i_out.data, i_out.stride,
-		      w_out.data, w_out.stride,
-		      i_in.data, i_in.stride,
-		      w_in.data, w_in.stride);
+    _downsample_chunk(kernel.get(), nfreq_out, nt_out,
+		      i_out.data, i_out.stride, w_out.data, w_out.stride,
+		      i_in.data, i_in.stride, w_in.data, w_in.stride);
+
+    if (!publish)
+	return true;
+
+    ring_buffer_subarray i_pyr(rb_intensity_pyr, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
+    ring_buffer_subarray w_pyr(rb_weights_pyr, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
+
+    for (ssize_t ifreq = 0; ifreq < nfreq_out; ifreq++) {
+	memcpy(i_pyr.data + ifreq * i_pyr.stride, i_out.data + ifreq * i_out.stride, nt_out * sizeof(float));
+	memcpy(w_pyr.data + ifreq * w_pyr.stride, w_out.data + ifreq * w_out.stride, nt_out * sizeof(float));
+    }
 
     return true;
 }
@@ -106,16 +167,23 @@ void downsampler::_unbindc()
     this->rb_weights_in.reset();
     this->rb_intensity_out.reset();
     this->rb_weights_out.reset();
+    this->rb_intensity_pyr.reset();
+    this->rb_weights_pyr.reset();
 }
 
 
 // -------------------------------------------------------------------------------------------------
 //
 // Upsampler
+//
+// Applies the mask in buffer WEIGHTS to buffer WEIGHTS_HIRES.  The mask is also applied to
+// pyramid levels (buffer names given by 'pyramid_bufnames'), which must be at resolution
+// equal to WEIGHTS, or at a finer resolution (given by 'pyramid_Df', 'pyramid_Dt').
 
 
 struct upsampler : chunked_pipeline_object {
-    upsampler(ssize_t Df, ssize_t Dt, ssize_t nt_chunk, double w_cutoff);
+    upsampler(ssize_t Df, ssize_t Dt, ssize_t nt_chunk, double w_cutoff, const vector<string> &pyramid_bufnames,
+	      const vector<ssize_t> &pyramid_Df, const vector<ssize_t> &pyramid_Dt);
 
     // Inherits 'nt_chunk' from base class.
     const ssize_t Df;
@@ -123,27 +191,46 @@ struct upsampler : chunked_pipeline_object {
     const double w_cutoff;
     rf_kernels::weight_upsampler kernel;
 
+    // Upsampling factors between WEIGHTS and pyramid levels.
+    const vector<string> pyramid_bufnames;
+    const vector<ssize_t> pyramid_Df;
+    const vector<ssize_t> pyramid_Dt;
+    vector<unique_ptr<rf_kernels::weight_upsampler>> pyramid_kernels;  // empty pointer if factors are (1,1)
+
     // Initialized in _bindc().
     shared_ptr<ring_buffer> rb_weights_in;
     shared_ptr<ring_buffer> rb_weights_out;
+    vector<shared_ptr<ring_buffer>> rb_weights_pyr;
     ssize_t nfreq_in = 0;
     ssize_t nds_in = 0;
     ssize_t nt_in = 0;
 
     virtual void _bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override;
     virtual bool _process_chunk(ssize_t pos) override;
+    virtual void _unbindc() override;
 };
 
 
-upsampler::upsampler(ssize_t Df_, ssize_t Dt_, ssize_t nt_chunk_, double w_cutoff_) :
+upsampler::upsampler(ssize_t Df_, ssize_t Dt_, ssize_t nt_chunk_, double w_cutoff_, const vector<string> &pyramid_bufnames_,
+		     const vector<ssize_t> &pyramid_Df_, const vector<ssize_t> &pyramid_Dt_) :
     chunked_pipeline_object("wi_sub_upsampler", false),  // can_be_first=false
     Df(Df_),
     Dt(Dt_),
     w_cutoff(w_cutoff_),
-    kernel(Df_, Dt_)
+    kernel(Df_, Dt_),
+    pyramid_bufnames(pyramid_bufnames_),
+    pyramid_Df(pyramid_Df_),
+    pyramid_Dt(pyramid_Dt_)
 { 
     this->nt_chunk = nt_chunk_;
     rf_assert(nt_chunk > 0);
+    rf_assert(pyramid_Df.size() == pyramid_bufnames.size());
+    rf_assert(pyramid_Dt.size() == pyramid_bufnames.size());
+
+    for (size_t i = 0; i < pyramid_Df.size(); i++) {
+	bool trivial = (pyramid_Df[i] == 1) && (pyramid_Dt[i] == 1);
+	pyramid_kernels.push_back(trivial ? nullptr : make_unique<rf_kernels::weight_upsampler> (pyramid_Df[i], pyramid_Dt[i]));
+    }
 }
 
 
@@ -164,6 +251,17 @@ void upsampler::_bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
 
     rf_assert(nt_chunk % (8*nds_in) == 0);
     this->nt_in = xdiv(nt_chunk, nds_in);
+
+    this->rb_weights_pyr.clear();
+
+    for (size_t i = 0; i < pyramid_Df.size(); i++) {
+	auto rb = get_buffer(rb_dict, pyramid_bufnames[i]);
+
+	if ((rb->cdims.size() != 1) || (rb->cdims[0] != nfreq_in * pyramid_Df[i]) || (rb->nds * pyramid_Dt[i] != nds_in))
+	    _throw("internal error: pyramid level has unexpected shape");
+
+	this->rb_weights_pyr.push_back(rb);
+    }
 }
 
 
@@ -173,10 +271,675 @@ bool upsampler::_process_chunk(ssize_t pos)
     ring_buffer_subarray w_out(rb_weights_out, pos, pos + nt_chunk, ring_buffer::ACCESS_RW);
 
     kernel.upsample(nfreq_in, nt_in, w_out.data, w_out.stride, w_in.data, w_in.stride, w_cutoff);
+
+    for (size_t i = 0; i < rb_weights_pyr.size(); i++) {
+	ring_buffer_subarray w_pyr(rb_weights_pyr[i], pos, pos + nt_chunk, ring_buffer::ACCESS_RW);
+
+	if (pyramid_kernels[i]) {
+	    pyramid_kernels[i]->upsample(nfreq_in, nt_in, w_pyr.data, w_pyr.stride, w_in.data, w_in.stride, w_cutoff);
+	    continue;
+	}
+
+	for (ssize_t ifreq = 0; ifreq < nfreq_in; ifreq++) {
+	    const float *src = w_in.data + ifreq * w_in.stride;
+	    float *dst = w_pyr.data + ifreq * w_pyr.stride;
+
+	    for (ssize_t it = 0; it < nt_in; it++)
+		dst[it] = (src[it] > w_cutoff) ? dst[it] : 0.0f;
+	}
+    }
+
+    return true;
+}
+
+
+void upsampler::_unbindc()
+{
+    this->rb_weights_in.reset();
+    this->rb_weights_out.reset();
+    this->rb_weights_pyr.clear();
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Fused downsampler/transform/upsampler
+//
+// Used when the sub_pipeline is a single clipper or detrender (see wi_sub_pipeline::_is_fusable()).
+// In the unfused case, the downsampler writes the low-resolution INTENSITY/WEIGHTS ring buffers,
+// which are sized for the full pipeline lag, and the transform and upsampler read them back later.
+// Here, the low-resolution ring buffers are private, and hold a single chunk.  In each chunk, we
+// downsample, call the transform's _process_chunk() directly, and apply the mask, so that the
+// low-resolution data is still in cache when it is reused.
+//
+// The transform goes through the usual bind/allocate/start/end/reset/unbind lifecycle, but its
+// advance() is never called.  Its cpu_time is accumulated here, and subtracted from our own.
+
+
+struct fused_sub_kernel : chunked_pipeline_object {
+    fused_sub_kernel(const shared_ptr<wi_transform> &transform, ssize_t Df_src, ssize_t Dt_src, ssize_t Df, ssize_t Dt, double w_cutoff);
+
+    // Inherits 'nt_chunk' from base class.
+    const shared_ptr<wi_transform> transform;
+    const ssize_t Df_src;   // downsampling factors, relative to INTENSITY_SRC/WEIGHTS_SRC
+    const ssize_t Dt_src;
+    const ssize_t Df;       // upsampling factors, relative to WEIGHTS_HIRES
+    const ssize_t Dt;
+    const double w_cutoff;
+    unique_ptr<rf_kernels::wi_downsampler> ds_kernel;   // empty if (Df_src,Dt_src) = (1,1)
+    rf_kernels::weight_upsampler us_kernel;
+
+    // Initialized in _bindc().
+    shared_ptr<ring_buffer> rb_intensity_in;
+    shared_ptr<ring_buffer> rb_weights_in;
+    shared_ptr<ring_buffer> rb_weights_hires;
+    shared_ptr<ring_buffer> rb_intensity_lo;   // private, not in any ring_buffer_dict
+    shared_ptr<ring_buffer> rb_weights_lo;     // private, not in any ring_buffer_dict
+    ssize_t nfreq_lo = 0;
+    ssize_t nt_lo = 0;
+
+    virtual void _bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override;
+    virtual bool _process_chunk(ssize_t pos) override;
+    virtual void _unbindc() override;
+
+    virtual void _allocate() override;
+    virtual void _deallocate() override;
+    virtual void _start_pipeline(Json::Value &json_attrs) override;
+    virtual void _end_pipeline(Json::Value &json_output) override;
+    virtual void _reset() override;
+    virtual void _get_info(Json::Value &json_output) override;
+};
+
+
+fused_sub_kernel::fused_sub_kernel(const shared_ptr<wi_transform> &transform_, ssize_t Df_src_, ssize_t Dt_src_, ssize_t Df_, ssize_t Dt_, double w_cutoff_) :
+    chunked_pipeline_object("wi_sub_fused", false),  // can_be_first=false
+    transform(transform_),
+    Df_src(Df_src_),
+    Dt_src(Dt_src_),
+    Df(Df_),
+    Dt(Dt_),
+    w_cutoff(w_cutoff_),
+    us_kernel(Df_, Dt_)
+{
+    rf_assert(transform);
+    rf_assert(transform->nt_chunk > 0);
+
+    this->nt_chunk = transform->nt_chunk;
+
+    if ((Df_src > 1) || (Dt_src > 1))
+	this->ds_kernel = make_unique<rf_kernels::wi_downsampler> (Df_src, Dt_src);
+}
+
+
+void fused_sub_kernel::_bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
+{
+    this->rb_intensity_in = get_buffer(rb_dict, "INTENSITY_SRC");
+    this->rb_weights_in = get_buffer(rb_dict, "WEIGHTS_SRC");
+    this->rb_weights_hires = get_buffer(rb_dict, "WEIGHTS_HIRES");
+
+    if ((rb_intensity_in->cdims != rb_weights_in->cdims) || (rb_intensity_in->nds != rb_weights_in->nds) || (rb_intensity_in->cdims.size() != 1))
+	_throw("internal error: unexpected INTENSITY_SRC/WEIGHTS_SRC shapes");
+
+    this->nfreq_lo = xdiv(rb_intensity_in->cdims[0], Df_src);
+    ssize_t nds_lo = rb_intensity_in->nds * Dt_src;
+
+    if ((rb_weights_hires->cdims.size() != 1) || (rb_weights_hires->cdims[0] != nfreq_lo * Df) || (rb_weights_hires->nds * Dt != nds_lo))
+	_throw("internal error: unexpected WEIGHTS_HIRES shape");
+
+    rf_assert(nt_chunk % (8*nds_lo) == 0);
+    this->nt_lo = xdiv(nt_chunk, nds_lo);
+
+    bool debug = this->get_params().debug;
+    this->rb_intensity_lo = make_shared<ring_buffer> (vector<ssize_t> { nfreq_lo }, nds_lo, debug, "INTENSITY");
+    this->rb_weights_lo = make_shared<ring_buffer> (vector<ssize_t> { nfreq_lo }, nds_lo, debug, "WEIGHTS");
+
+    ring_buffer_dict rb_dict2;
+    rb_dict2["INTENSITY"] = rb_intensity_lo;
+    rb_dict2["WEIGHTS"] = rb_weights_lo;
+
+    run_params params = this->get_params();
+    params.container_depth++;
+    params.container_index = 0;
+
+    // nt_maxlag = nt_chunk, so that the private ring buffers only hold one chunk.
+    transform->bind(params, rb_dict2, nt_chunk, nt_chunk, json_attrs, this->out_mp);
+
+    if (transform->nt_chunk != nt_chunk)
+	_throw("internal error: transform nt_chunk changed during bind()");
+}
+
+
+bool fused_sub_kernel::_process_chunk(ssize_t pos)
+{
+    ring_buffer_subarray i_lo(rb_intensity_lo, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
+    ring_buffer_subarray w_lo(rb_weights_lo, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
+
+    // Note: WEIGHTS_SRC may be the same ring_buffer as WEIGHTS_HIRES, so the subarrays are scoped
+    // (a ring_buffer only allows one outstanding subarray).
+    {
+	ring_buffer_subarray i_in(rb_intensity_in, pos, pos + nt_chunk, ring_buffer::ACCESS_READ);
+	ring_buffer_subarray w_in(rb_weights_in, pos, pos + nt_chunk, ring_buffer::ACCESS_READ);
+	
+	_downsample_chunk(ds_kernel.get(), nfreq_lo, nt_lo,
+			  i_lo.data, i_lo.stride, w_lo.data, w_lo.stride,
+			  i_in.data, i_in.stride, w_in.data, w_in.stride);
+    }
+
+    struct timeval tv0 = get_time();
+    transform->_process_chunk(i_lo.data, i_lo.stride, w_lo.data, w_lo.stride, pos);
+    transform->time_spent_in_transform += time_diff(tv0, get_time());
+
+    ring_buffer_subarray w_hires(rb_weights_hires, pos, pos + nt_chunk, ring_buffer::ACCESS_RW);
+    us_kernel.upsample(nfreq_lo, nt_lo, w_hires.data, w_hires.stride, w_lo.data, w_lo.stride, w_cutoff);
+
+    return true;
+}
+
+
+void fused_sub_kernel::_unbindc()
+{
+    transform->unbind();
+
+    this->rb_intensity_in.reset();
+    this->rb_weights_in.reset();
+    this->rb_weights_hires.reset();
+    this->rb_intensity_lo.reset();
+    this->rb_weights_lo.reset();
+}
+
+
+void fused_sub_kernel::_allocate()
+{
+    rb_intensity_lo->allocate();
+    rb_weights_lo->allocate();
+    transform->allocate();
+}
+
+
+void fused_sub_kernel::_deallocate()
+{
+    transform->deallocate();
+    rb_intensity_lo->deallocate();
+    rb_weights_lo->deallocate();
+}
+
+
+void fused_sub_kernel::_start_pipeline(Json::Value &json_attrs)
+{
+    // Note: transform->start_pipeline() resets the private ring buffers.
+    transform->start_pipeline(json_attrs);
+}
+
+
+void fused_sub_kernel::_end_pipeline(Json::Value &json_output)
+{
+    json_output["pipeline"].append(Json::Value(Json::objectValue));
+    transform->end_pipeline(json_output["pipeline"][0]);
+    json_output["cpu_time"] = time_spent_in_transform - transform->time_spent_in_transform;
+}
+
+
+void fused_sub_kernel::_reset()
+{
+    transform->reset();
+}
+
+
+void fused_sub_kernel::_get_info(Json::Value &j)
+{
+    Json::Value jt = transform->get_info();
+    double mb = double_from_json(j, "mb_local");
+
+    for (const auto &rb: { rb_intensity_lo, rb_weights_lo }) {
+	Json::Value jr = rb->get_info();
+	j["ring_buffers"].append(jr);
+	mb += double_from_json(jr, "mb");
+    }
+
+    j["mb_local"] = mb;
+    j["mb_cumul"] = mb + double_from_json(jt, "mb_cumul");
+    j["pipeline"] = Json::Value(Json::arrayValue);
+    j["pipeline"].append(jt);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Async mode (ini_params.nbuf_async > 0)
+//
+// The async_sub_kernel replaces the downsampler/sub_pipeline/upsampler.  In the main thread, each
+// chunk is downsampled into one of 'nslots' slot buffers, and handed off to a helper thread, which
+// runs the sub_pipeline in an inner pipeline (async_source -> sub_pipeline -> async_sink).  The
+// async_sink copies the low-resolution weights into the slot, and later the main thread applies the
+// mask to WEIGHTS_HIRES.  Until then, the async_sub_kernel's pos_lo lags behind, so downstream
+// pipeline_objects never see unmasked data.
+//
+// The downsampling is done in the main thread, since the helper thread can't safely access ring
+// buffers in the main pipeline.  (The downsampled data is small compared to the hires data.)
+//
+// Chunk k has been submitted if k < nsubmitted, processed by the sub_pipeline if k < ncompleted,
+// and had its mask applied if k < napplied.  Slot (k % nslots) is in use if napplied <= k < nsubmitted.
+// The number of slots is nbuf_async plus the lag of the sub_pipeline (in chunks), so that the main
+// thread can always make progress by waiting for the helper thread.
+//
+// Exceptions thrown in the helper thread are rethrown in the next call to _advance() or _end_pipeline().
+
+
+struct async_sub_kernel;
+
+
+// First element of the inner pipeline: copies from slot buffers to INTENSITY/WEIGHTS.
+struct async_source : chunked_pipeline_object {
+    async_sub_kernel *parent;
+    shared_ptr<ring_buffer> rb_intensity;
+    shared_ptr<ring_buffer> rb_weights;
+
+    async_source(async_sub_kernel *parent, ssize_t nt_chunk);
+
+    virtual void _bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override;
+    virtual bool _process_chunk(ssize_t pos) override;
+    virtual void _unbindc() override;
+};
+
+
+// Last element of the inner pipeline: copies from WEIGHTS to slot buffers, and signals the main thread.
+struct async_sink : chunked_pipeline_object {
+    async_sub_kernel *parent;
+    shared_ptr<ring_buffer> rb_weights;
+
+    async_sink(async_sub_kernel *parent, ssize_t nt_chunk);
+
+    virtual void _bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override;
+    virtual bool _process_chunk(ssize_t pos) override;
+    virtual void _unbindc() override;
+};
+
+
+struct async_sub_kernel : pipeline_object {
+    async_sub_kernel(const shared_ptr<pipeline_object> &sub_pipeline, ssize_t Df_src, ssize_t Dt_src, ssize_t Df, ssize_t Dt, double w_cutoff, ssize_t nt_chunk, ssize_t nbuf_async);
+    virtual ~async_sub_kernel();
+
+    const shared_ptr<pipeline_object> sub_pipeline;
+    const ssize_t Df_src;   // downsampling factors, relative to INTENSITY_SRC/WEIGHTS_SRC
+    const ssize_t Dt_src;
+    const ssize_t Df;       // upsampling factors, relative to WEIGHTS_HIRES
+    const ssize_t Dt;
+    const double w_cutoff;
+    const ssize_t nt_chunk;
+    const ssize_t nbuf_async;
+    unique_ptr<rf_kernels::wi_downsampler> ds_kernel;   // empty if (Df_src,Dt_src) = (1,1)
+    rf_kernels::weight_upsampler us_kernel;
+
+    // Initialized in _bind().
+    shared_ptr<ring_buffer> rb_intensity_in;
+    shared_ptr<ring_buffer> rb_weights_in;
+    shared_ptr<ring_buffer> rb_weights_hires;
+    shared_ptr<pipeline> inner;
+    ssize_t nfreq_lo = 0;
+    ssize_t nds_lo = 0;
+    ssize_t nt_lo = 0;
+    ssize_t nslots = 0;
+
+    // Shape (nslots, nfreq_lo, nt_lo) arrays, allocated in _allocate().
+    vector<float> slot_intensity;
+    vector<float> slot_weights;
+
+    // Helper thread state, protected by 'lock'.
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable cv;
+    ssize_t nsubmitted = 0;
+    ssize_t ncompleted = 0;
+    ssize_t napplied = 0;     // only accessed by main thread
+    bool worker_done = false;
+    std::exception_ptr worker_error;
+
+    inline float *slot_i(ssize_t pos) { return &slot_intensity[((pos/nt_chunk) % nslots) * nfreq_lo * nt_lo]; }
+    inline float *slot_w(ssize_t pos) { return &slot_weights[((pos/nt_chunk) % nslots) * nfreq_lo * nt_lo]; }
+
+    virtual void _bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs) override;
+    virtual ssize_t _advance() override;
+    virtual void _allocate() override;
+    virtual void _deallocate() override;
+    virtual void _start_pipeline(Json::Value &json_attrs) override;
+    virtual void _end_pipeline(Json::Value &json_output) override;
+    virtual void _reset() override;
+    virtual void _unbind() override;
+    virtual void _get_info(Json::Value &json_output) override;
+
+    void _worker_main();
+    void _stop_worker();
+    void _rethrow_worker_error();
+};
+
+
+async_source::async_source(async_sub_kernel *parent_, ssize_t nt_chunk_) :
+    chunked_pipeline_object("wi_sub_async_source", false),  // can_be_first=false
+    parent(parent_)
+{
+    this->nt_chunk = nt_chunk_;
+}
+
+
+void async_source::_bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
+{
+    this->rb_intensity = create_buffer(rb_dict, "INTENSITY", { parent->nfreq_lo }, parent->nds_lo);
+    this->rb_weights = create_buffer(rb_dict, "WEIGHTS", { parent->nfreq_lo }, parent->nds_lo);
+}
+
+
+bool async_source::_process_chunk(ssize_t pos)
+{
+    ring_buffer_subarray i_out(rb_intensity, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
+    ring_buffer_subarray w_out(rb_weights, pos, pos + nt_chunk, ring_buffer::ACCESS_APPEND);
+
+    ssize_t nf = parent->nfreq_lo;
+    ssize_t nt = parent->nt_lo;
+    const float *i_in = parent->slot_i(pos);
+    const float *w_in = parent->slot_w(pos);
+
+    for (ssize_t ifreq = 0; ifreq < nf; ifreq++) {
+	memcpy(i_out.data + ifreq * i_out.stride, i_in + ifreq * nt, nt * sizeof(float));
+	memcpy(w_out.data + ifreq * w_out.stride, w_in + ifreq * nt, nt * sizeof(float));
+    }
+
     return true;
 }
 
 
+void async_source::_unbindc()
+{
+    this->rb_intensity.reset();
+    this->rb_weights.reset();
+}
+
+
+async_sink::async_sink(async_sub_kernel *parent_, ssize_t nt_chunk_) :
+    chunked_pipeline_object("wi_sub_async_sink", false),  // can_be_first=false
+    parent(parent_)
+{
+    this->nt_chunk = nt_chunk_;
+}
+
+
+void async_sink::_bindc(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
+{
+    this->rb_weights = get_buffer(rb_dict, "WEIGHTS");
+
+    if ((rb_weights->cdims != vector<ssize_t> { parent->nfreq_lo }) || (rb_weights->nds != parent->nds_lo))
+	_throw("sub_pipeline changed the shape of the WEIGHTS buffer");
+}
+
+
+bool async_sink::_process_chunk(ssize_t pos)
+{
+    // Chunks arrive in order, and the slot is not reused until the main thread applies the mask.
+    {
+	ring_buffer_subarray w_in(rb_weights, pos, pos + nt_chunk, ring_buffer::ACCESS_READ);
+
+	ssize_t nf = parent->nfreq_lo;
+	ssize_t nt = parent->nt_lo;
+	float *w_out = parent->slot_w(pos);
+
+	for (ssize_t ifreq = 0; ifreq < nf; ifreq++)
+	    memcpy(w_out + ifreq * nt, w_in.data + ifreq * w_in.stride, nt * sizeof(float));
+    }
+
+    lock_guard<mutex> l(parent->lock);
+    rf_assert(parent->ncompleted * nt_chunk == pos);
+    parent->ncompleted++;
+    parent->cv.notify_all();
+    return true;
+}
+
+
+void async_sink::_unbindc()
+{
+    this->rb_weights.reset();
+}
+
+
+async_sub_kernel::async_sub_kernel(const shared_ptr<pipeline_object> &sub_pipeline_, ssize_t Df_src_, ssize_t Dt_src_, ssize_t Df_, ssize_t Dt_, double w_cutoff_, ssize_t nt_chunk_, ssize_t nbuf_async_) :
+    pipeline_object("wi_sub_async"),
+    sub_pipeline(sub_pipeline_),
+    Df_src(Df_src_),
+    Dt_src(Dt_src_),
+    Df(Df_),
+    Dt(Dt_),
+    w_cutoff(w_cutoff_),
+    nt_chunk(nt_chunk_),
+    nbuf_async(nbuf_async_),
+    us_kernel(Df_, Dt_)
+{
+    rf_assert(nt_chunk > 0);
+    rf_assert(nbuf_async > 0);
+
+    if ((Df_src > 1) || (Dt_src > 1))
+	this->ds_kernel = make_unique<rf_kernels::wi_downsampler> (Df_src, Dt_src);
+}
+
+
+async_sub_kernel::~async_sub_kernel()
+{
+    _stop_worker();
+}
+
+
+void async_sub_kernel::_bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
+{
+    this->rb_intensity_in = get_buffer(rb_dict, "INTENSITY_SRC");
+    this->rb_weights_in = get_buffer(rb_dict, "WEIGHTS_SRC");
+    this->rb_weights_hires = get_buffer(rb_dict, "WEIGHTS_HIRES");
+
+    if ((rb_intensity_in->cdims != rb_weights_in->cdims) || (rb_intensity_in->nds != rb_weights_in->nds) || (rb_intensity_in->cdims.size() != 1))
+	_throw("internal error: unexpected INTENSITY_SRC/WEIGHTS_SRC shapes");
+
+    this->nfreq_lo = xdiv(rb_intensity_in->cdims[0], Df_src);
+    this->nds_lo = rb_intensity_in->nds * Dt_src;
+
+    if ((rb_weights_hires->cdims.size() != 1) || (rb_weights_hires->cdims[0] != nfreq_lo * Df) || (rb_weights_hires->nds * Dt != nds_lo))
+	_throw("internal error: unexpected WEIGHTS_HIRES shape");
+
+    rf_assert(nt_chunk % (8*nds_lo) == 0);
+    this->nt_lo = xdiv(nt_chunk, nds_lo);
+
+    // The inner pipeline has its own ring_buffer_dict, and is only advanced by the helper thread.
+    this->inner = make_shared<pipeline> (vector<shared_ptr<pipeline_object>> {
+	    make_shared<async_source> (this, nt_chunk),
+	    sub_pipeline,
+	    make_shared<async_sink> (this, nt_chunk) });
+
+    ring_buffer_dict rb_dict2;
+    run_params params = this->get_params();
+    params.container_depth++;
+    params.container_index = 0;
+
+    inner->bind(params, rb_dict2, nt_chunk, nt_chunk, json_attrs, this->out_mp);
+
+    this->nslots = nbuf_async + (inner->nt_maxgap + nt_chunk - 1) / nt_chunk;
+    this->nt_chunk_out = nt_chunk;
+    this->nt_maxgap = (nt_chunk - gcd(nt_chunk_in, nt_chunk)) + nslots * nt_chunk;
+    this->nt_contig = nt_chunk;
+}
+
+
+ssize_t async_sub_kernel::_advance()
+{
+    unique_lock<mutex> l(lock, std::defer_lock);
+
+    for (;;) {
+	// Apply all completed masks (main thread only).
+	l.lock();
+	ssize_t nc = ncompleted;
+	l.unlock();
+
+	for ( ; napplied < nc; napplied++) {
+	    ssize_t pos = napplied * nt_chunk;
+	    ring_buffer_subarray w_hires(rb_weights_hires, pos, pos + nt_chunk, ring_buffer::ACCESS_RW);
+	    us_kernel.upsample(nfreq_lo, nt_lo, w_hires.data, w_hires.stride, slot_w(pos), nt_lo, w_cutoff);
+	}
+
+	this->pos_lo = napplied * nt_chunk;
+
+	l.lock();
+	_rethrow_worker_error();
+
+	if ((nsubmitted+1) * nt_chunk > pos_hi)
+	    return SSIZE_MAX;
+
+	// Wait for a free slot.
+	if (nsubmitted - napplied >= nslots) {
+	    while ((ncompleted == napplied) && !worker_error)
+		cv.wait(l);
+	    l.unlock();
+	    continue;
+	}
+
+	ssize_t pos = nsubmitted * nt_chunk;
+	l.unlock();
+
+	// The helper thread doesn't access the slot until 'nsubmitted' is incremented below.
+	ring_buffer_subarray i_in(rb_intensity_in, pos, pos + nt_chunk, ring_buffer::ACCESS_READ);
+	ring_buffer_subarray w_in(rb_weights_in, pos, pos + nt_chunk, ring_buffer::ACCESS_READ);
+
+	_downsample_chunk(ds_kernel.get(), nfreq_lo, nt_lo,
+			  slot_i(pos), nt_lo, slot_w(pos), nt_lo,
+			  i_in.data, i_in.stride, w_in.data, w_in.stride);
+
+	l.lock();
+	nsubmitted++;
+	cv.notify_all();
+	l.unlock();
+    }
+}
+
+
+void async_sub_kernel::_worker_main()
+{
+    try {
+	for (ssize_t nadvanced = 0; ; nadvanced++) {
+	    unique_lock<mutex> l(lock);
+	    while ((nadvanced == nsubmitted) && !worker_done)
+		cv.wait(l);
+
+	    if (nadvanced == nsubmitted)
+		break;
+
+	    l.unlock();
+
+	    ssize_t pos = (nadvanced+1) * nt_chunk;
+	    inner->advance(pos, pos);
+	}
+    } catch (...) {
+	// Saved for the main thread, which will rethrow.
+	lock_guard<mutex> l(lock);
+	worker_error = std::current_exception();
+	cv.notify_all();
+    }
+}
+
+
+// Signals the helper thread to exit (after processing all submitted chunks), and joins it.
+void async_sub_kernel::_stop_worker()
+{
+    if (!worker.joinable())
+	return;
+
+    unique_lock<mutex> l(lock);
+    worker_done = true;
+    cv.notify_all();
+    l.unlock();
+
+    worker.join();
+}
+
+
+// Caller must hold the lock.  The error is only rethrown once.
+void async_sub_kernel::_rethrow_worker_error()
+{
+    if (!worker_error)
+	return;
+
+    std::exception_ptr e = worker_error;
+    worker_error = nullptr;
+    std::rethrow_exception(e);
+}
+
+
+void async_sub_kernel::_allocate()
+{
+    this->slot_intensity.resize(nslots * nfreq_lo * nt_lo, 0.0);
+    this->slot_weights.resize(nslots * nfreq_lo * nt_lo, 0.0);
+    inner->allocate();
+}
+
+
+void async_sub_kernel::_deallocate()
+{
+    inner->deallocate();
+    this->slot_intensity = vector<float> ();
+    this->slot_weights = vector<float> ();
+}
+
+
+void async_sub_kernel::_start_pipeline(Json::Value &json_attrs)
+{
+    inner->start_pipeline(json_attrs);
+
+    this->nsubmitted = 0;
+    this->ncompleted = 0;
+    this->napplied = 0;
+    this->worker_done = false;
+    this->worker_error = nullptr;
+    this->worker = std::thread(&async_sub_kernel::_worker_main, this);
+}
+
+
+void async_sub_kernel::_end_pipeline(Json::Value &json_output)
+{
+    _stop_worker();
+
+    // Same json layout as fused_sub_kernel.
+    Json::Value j(Json::objectValue);
+    inner->end_pipeline(j);
+    json_output["pipeline"].append(j["pipeline"][1]);
+
+    lock_guard<mutex> l(lock);
+    _rethrow_worker_error();
+}
+
+
+void async_sub_kernel::_reset()
+{
+    _stop_worker();
+    inner->reset();
+}
+
+
+void async_sub_kernel::_unbind()
+{
+    _stop_worker();
+    inner->unbind();
+
+    this->inner.reset();
+    this->rb_intensity_in.reset();
+    this->rb_weights_in.reset();
+    this->rb_weights_hires.reset();
+}
+
+
+void async_sub_kernel::_get_info(Json::Value &j)
+{
+    Json::Value ji = inner->get_info();
+    double mb = double_from_json(j, "mb_local") + 8.0e-6 * double(nslots) * double(nfreq_lo * nt_lo);
+
+    j["mb_local"] = mb;
+    j["mb_cumul"] = mb + double_from_json(ji, "mb_cumul");
+    j["pipeline"] = Json::Value(Json::arrayValue);
+    j["pipeline"].append(ji["pipeline"][1]);
+}
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // wi_sub_pipeline
@@ -192,6 +955,8 @@ wi_sub_pipeline::wi_sub_pipeline(const shared_ptr<pipeline_object> &sub_pipeline
 	_throw("ini_params.w_cutoff cannot be negative");
     if (ini_params.nt_chunk < 0)
 	_throw("ini_params.nt_chunk cannot be negative");
+    if (ini_params.nbuf_async < 0)
+	_throw("ini_params.nbuf_async cannot be negative");
     if (ini_params.nfreq_out < 0)
 	_throw("expected ini_params.nfreq_out >= 0");
     if (ini_params.nds_out < 0)
@@ -219,42 +984,151 @@ wi_sub_pipeline::wi_sub_pipeline(const shared_ptr<pipeline_object> &sub_pipeline
 	ss << ",Dt=" << ini_params.Dt;
     if (ini_params.nds_out > 0)
 	ss << ",nds_out=" << ini_params.nds_out;
+    if (ini_params.nbuf_async > 0)
+	ss << ",nbuf_async=" << ini_params.nbuf_async;
     ss << ")";
 
     this->name = ss.str();
 }
 
 
-void wi_sub_pipeline::_bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
+// -------------------------------------------------------------------------------------------------
+//
+// Pyramid
+//
+// When a pipeline contains a sequence of consecutive wi_sub_pipelines, it is wasteful for each one to
+// downsample from full resolution.  Instead, a wi_sub_pipeline can "publish" a pristine copy of its
+// downsampled data (a "pyramid level"), and a later wi_sub_pipeline can downsample from the pyramid
+// level.  For example, in a sequence of wi_sub_pipelines with Df=2,4,8, the second and third can be
+// built from the 2x and 4x levels respectively.
+//
+// For this to give the same result as downsampling from full resolution, the pyramid level must see
+// all masking which happens between publication and use.  Therefore, each wi_sub_pipeline applies its
+// upsampled mask to every "live" pyramid level, in addition to WEIGHTS_HIRES.  This is only exact if the
+// mask is constant on each pyramid pixel, so we require the pyramid level's (Df,Dt) to divide the (Df,Dt)
+// of every wi_sub_pipeline between publication and use.  (The intensity is never modified by the
+// wi_sub_pipeline outside its sub_pipeline, so a pristine copy is sufficient.)
+//
+// We only share between consecutive wi_sub_pipelines, since an intervening pipeline_object
+// could modify the full-resolution data.
+//
+// Note: results can differ from the unshared case at the level of floating-point roundoff, since the
+// sums in the downsampling kernel are associated differently.
+
+
+// Helper for _plan_pyramid(): returns true if (Df1,Dt1) divides (Df2,Dt2).
+static inline bool _divides(ssize_t Df1, ssize_t Dt1, ssize_t Df2, ssize_t Dt2)
 {
-    if (!has_key(rb_dict, "INTENSITY"))
-	_throw("buffer 'INTENSITY' does not exist in pipeline");
-    if (!has_key(rb_dict, "WEIGHTS"))
-	_throw("buffer 'WEIGHTS' does not exist in pipeline");
+    return (xmod(Df2,Df1) == 0) && (xmod(Dt2,Dt1) == 0);
+}
 
-    // Don't call pipeline_object::get_buffer() since this has side effects.    
-    auto rb_intensity = rb_dict["INTENSITY"];
-    auto rb_weights = rb_dict["WEIGHTS"];
 
-    if (rb_intensity->cdims != rb_weights->cdims)
-	_throw("'intensity' and 'weights' buffers have different dimensions");
-    if (rb_intensity->nds != rb_weights->nds)
-	_throw("'intensity' and 'weights' buffers have different downsampling");
-    if (rb_intensity->cdims.size() != 1)
-	_throw("expected intensity/weights arrays to be two-dimensional");
+// Helper for _plan_pyramid(): returns the pipeline_object as a wi_sub_pipeline, if it can share
+// pyramid levels, or an empty pointer.  (Async wi_sub_pipelines don't participate.)
+static inline shared_ptr<wi_sub_pipeline> _pyramid_member(const shared_ptr<pipeline_object> &p)
+{
+    auto s = dynamic_pointer_cast<wi_sub_pipeline> (p);
+    return (s && (s->ini_params.nbuf_async == 0)) ? s : nullptr;
+}
 
-    ssize_t nfreq_in = rb_intensity->cdims[0];
-    ssize_t nds_in = rb_intensity->nds;
 
+// static member function
+void wi_sub_pipeline::_plan_pyramid(const vector<shared_ptr<pipeline_object>> &elements, size_t i0, const ring_buffer_dict &rb_dict)
+{
+    // If elements[i0-1] can share, then the sequence containing elements[i0] has already been planned.
+    if ((i0 > 0) && _pyramid_member(elements[i0-1]))
+	return;
+
+    vector<shared_ptr<wi_sub_pipeline>> subs;
+
+    for (size_t i = i0; i < elements.size(); i++) {
+	auto s = _pyramid_member(elements[i]);
+	if (!s || (s->state != UNBOUND))
+	    break;
+	subs.push_back(s);
+    }
+
+    ssize_t n = subs.size();
+
+    for (const auto &s: subs) {
+	s->pyramid_src.reset();
+	s->pyramid_out.reset();
+	s->pyramid_masked.clear();
+    }
+
+    if (n < 2)
+	return;
+
+    // If anything is wrong with the buffers, we just return, and let wi_sub_pipeline::_bind() report the error.
+    auto it_i = rb_dict.find("INTENSITY");
+    auto it_w = rb_dict.find("WEIGHTS");
+
+    if ((it_i == rb_dict.end()) || (it_w == rb_dict.end()))
+	return;
+    if ((it_i->second->cdims.size() != 1) || (it_i->second->cdims != it_w->second->cdims) || (it_i->second->nds != it_w->second->nds))
+	return;
+
+    ssize_t nfreq_in = it_i->second->cdims[0];
+    ssize_t nds_in = it_i->second->nds;
+    vector<ssize_t> Df(n), Dt(n);
+
+    for (ssize_t k = 0; k < n; k++)
+	subs[k]->_get_DfDt(nfreq_in, nds_in, Df[k], Dt[k]);
+
+    // For each wi_sub_pipeline j, choose the coarsest earlier level i which is compatible.
+    // Ties are broken in favor of the later level, to minimize the number of live levels.
+    vector<shared_ptr<pyramid_level>> levels(n);
+    vector<ssize_t> last_use(n, -1);
+
+    for (ssize_t j = 1; j < n; j++) {
+	ssize_t ibest = -1;
+
+	for (ssize_t i = 0; i < j; i++) {
+	    if (Df[i] * Dt[i] <= 1)
+		continue;   // not useful
+	    if ((ibest >= 0) && (Df[i]*Dt[i] < Df[ibest]*Dt[ibest]))
+		continue;
+
+	    bool ok = true;
+	    for (ssize_t k = i; k <= j; k++)
+		ok = ok && _divides(Df[i], Dt[i], Df[k], Dt[k]);
+
+	    if (ok)
+		ibest = i;
+	}
+
+	if (ibest < 0)
+	    continue;
+
+	if (!levels[ibest]) {
+	    levels[ibest] = make_shared<pyramid_level> ();
+	    levels[ibest]->Df = Df[ibest];
+	    levels[ibest]->Dt = Dt[ibest];
+	    subs[ibest]->pyramid_out = levels[ibest];
+	}
+
+	subs[j]->pyramid_src = levels[ibest];
+	last_use[ibest] = j;
+    }
+
+    // Each wi_sub_pipeline k applies its mask to levels which are live after k is done.
+    for (ssize_t k = 0; k < n; k++)
+	for (ssize_t p = 0; p <= k; p++)
+	    if (levels[p] && (last_use[p] > k))
+		subs[k]->pyramid_masked.push_back(levels[p]);
+}
+
+
+void wi_sub_pipeline::_get_DfDt(ssize_t nfreq_in, ssize_t nds_in, ssize_t &Df, ssize_t &Dt) const
+{
     if ((ini_params.Df != 0) && (ini_params.nfreq_out != 0) && (nfreq_in != ini_params.nfreq_out * ini_params.Df))
 	_throw("nfreq_in (" + to_string(nfreq_in) + ") does not match expected value (" + to_string(ini_params.nfreq_out * ini_params.Df) + ")");
 
     if ((ini_params.Dt != 0) && (ini_params.nds_out != 0) && (nds_in != xdiv(ini_params.nds_out, ini_params.Dt)))
 	_throw("nds_in (" + to_string(nds_in) + ") does not match expected value (" + to_string(xdiv(ini_params.nds_out, ini_params.Dt)));
 
-    // Compute (Df,Dt)
-    ssize_t Df = ini_params.Df;  // can be zero
-    ssize_t Dt = ini_params.Dt;  // can be zero
+    Df = ini_params.Df;  // can be zero
+    Dt = ini_params.Dt;  // can be zero
     
     if (Df == 0) {
 	// Note: wi_sub_pipeline constructor has already checked (ini_params.nfreq_out > 0).
@@ -269,6 +1143,33 @@ void wi_sub_pipeline::_bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
 	    _throw("nds_in (" + to_string(nds_in) + ") does not divide ini_params.nds_out (" + to_string(nds_in) + ")");
 	Dt = xdiv(ini_params.nds_out, nds_in);
     }
+}
+
+
+void wi_sub_pipeline::_bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
+{
+    if (!has_key(rb_dict, "INTENSITY"))
+	_throw("buffer 'INTENSITY' does not exist in pipeline");
+    if (!has_key(rb_dict, "WEIGHTS"))
+	_throw("buffer 'WEIGHTS' does not exist in pipeline");
+
+    // Don't call pipeline_object::get_buffer() since this has side effects.    
+    auto rb_intensity = rb_dict["INTENSITY"];
+    auto rb_weights = rb_dict["WEIGHTS"];
+
+    if (rb_intensity->cdims != rb_weights->cdims)
+	_throw("'intensity' and 'weights' buffers have different dimensions");
+    if (rb_intensity->nds != rb_weights->nds)
+	_throw("'intensity' and 'weights' buffers have different downsampling");
+    if (rb_intensity->cdims.size() != 1)
+	_throw("expected intensity/weights arrays to be two-dimensional");
+
+    ssize_t nfreq_in = rb_intensity->cdims[0];
+    ssize_t nds_in = rb_intensity->nds;
+
+    // Compute (Df,Dt)
+    ssize_t Df, Dt;
+    _get_DfDt(nfreq_in, nds_in, Df, Dt);
 
     // Choose nt_chunk for downsampler/upsampler.
     // The logic here is similar to chunked_pipeline_object::finalize_nt_chunk().
@@ -281,17 +1182,119 @@ void wi_sub_pipeline::_bind(ring_buffer_dict &rb_dict, Json::Value &json_attrs)
     else if ((ini_params.nt_chunk % min_nt_chunk) != 0)
 	_throw("ini_params.nt_chunk (" + to_string(ini_params.nt_chunk) + " must be a multiple of " + to_string(min_nt_chunk) + " in this pipeline");
 
-    // Note: can't call pipeline::add() directly (get error message "...add() was called after bind()")
-    rf_assert(this->elements.size() == 0);
-    this->elements.push_back(make_shared<downsampler> (Df, Dt, nt_chunk));
-    this->elements.push_back(sub_pipeline);
-    this->elements.push_back(make_shared<upsampler> (Df, Dt, nt_chunk, ini_params.w_cutoff));
-
     ring_buffer_dict rb_dict2;    
     rb_dict2["INTENSITY_HIRES"] = rb_dict["INTENSITY"];
     rb_dict2["WEIGHTS_HIRES"] = rb_dict["WEIGHTS"];
 
+    // Source buffers for the downsampler: either full resolution, or a pyramid level.
+    ssize_t Df_src = Df;
+    ssize_t Dt_src = Dt;
+
+    if (pyramid_src) {
+	rf_assert(pyramid_src->rb_intensity && pyramid_src->rb_weights);
+	rb_dict2["INTENSITY_SRC"] = pyramid_src->rb_intensity;
+	rb_dict2["WEIGHTS_SRC"] = pyramid_src->rb_weights;
+	Df_src = xdiv(Df, pyramid_src->Df);
+	Dt_src = xdiv(Dt, pyramid_src->Dt);
+    }
+    else {
+	rb_dict2["INTENSITY_SRC"] = rb_dict["INTENSITY"];
+	rb_dict2["WEIGHTS_SRC"] = rb_dict["WEIGHTS"];
+    }
+
+    vector<string> pyramid_bufnames;
+    vector<ssize_t> pyramid_Df;
+    vector<ssize_t> pyramid_Dt;
+
+    for (size_t i = 0; i < pyramid_masked.size(); i++) {
+	const auto &pl = pyramid_masked[i];
+	pyramid_Df.push_back(xdiv(Df, pl->Df));
+	pyramid_Dt.push_back(xdiv(Dt, pl->Dt));
+
+	// If the pyramid level is published by this wi_sub_pipeline, then it doesn't exist yet
+	// (it will be created by the downsampler, as WEIGHTS_PYRAMID).
+	if (pl == pyramid_out) {
+	    pyramid_bufnames.push_back("WEIGHTS_PYRAMID");
+	    continue;
+	}
+
+	rf_assert(pl->rb_weights);
+	pyramid_bufnames.push_back("WEIGHTS_PYRAMID_" + to_string(i));
+	rb_dict2[pyramid_bufnames.back()] = pl->rb_weights;
+    }
+
+    // Note: can't call pipeline::add() directly (get error message "...add() was called after bind()")
+    rf_assert(this->elements.size() == 0);
+
+    if (ini_params.nbuf_async > 0) {
+	rf_assert(!pyramid_src && !pyramid_out && (pyramid_masked.size() == 0));
+	this->elements.push_back(make_shared<async_sub_kernel> (sub_pipeline, Df, Dt, Df, Dt, ini_params.w_cutoff, nt_chunk, ini_params.nbuf_async));
+	pipeline::_bind(rb_dict2, json_attrs);
+	return;
+    }
+
+    if (_is_fusable(min_nt_chunk)) {
+	auto t = dynamic_pointer_cast<wi_transform> (sub_pipeline);
+	this->elements.push_back(make_shared<fused_sub_kernel> (t, Df_src, Dt_src, Df, Dt, ini_params.w_cutoff));
+	pipeline::_bind(rb_dict2, json_attrs);
+	return;
+    }
+
+    this->elements.push_back(make_shared<downsampler> (Df_src, Dt_src, nt_chunk, bool(pyramid_out)));
+    this->elements.push_back(sub_pipeline);
+    this->elements.push_back(make_shared<upsampler> (Df, Dt, nt_chunk, ini_params.w_cutoff, pyramid_bufnames, pyramid_Df, pyramid_Dt));
+
     pipeline::_bind(rb_dict2, json_attrs);
+
+    if (pyramid_out) {
+	pyramid_out->rb_intensity = rb_dict2["INTENSITY_PYRAMID"];
+	pyramid_out->rb_weights = rb_dict2["WEIGHTS_PYRAMID"];
+    }
+}
+
+
+// virtual override
+void wi_sub_pipeline::_unbind()
+{
+    pipeline::_unbind();
+
+    // The downsampler/upsampler are recreated in the next call to _bind().
+    this->elements.clear();
+    this->pyramid_src.reset();
+    this->pyramid_out.reset();
+    this->pyramid_masked.clear();
+}
+
+
+// Returns true if the downsampler, sub_pipeline, and upsampler can be replaced by a single
+// fused_sub_kernel (see above).  This is the case if the sub_pipeline is a single clipper or
+// detrender whose nt_chunk is a multiple of 'min_nt_chunk' (and agrees with ini_params.nt_chunk),
+// and this wi_sub_pipeline doesn't publish or mask any pyramid levels.  (Downsampling from a
+// pyramid level is fine.)
+
+bool wi_sub_pipeline::_is_fusable(ssize_t min_nt_chunk) const
+{
+    static const unordered_set<string> fusable_class_names = {
+	"intensity_clipper",
+	"std_dev_clipper",
+	"polynomial_detrender",
+	"spline_detrender"
+    };
+
+    auto t = dynamic_pointer_cast<wi_transform> (sub_pipeline);
+
+    if (!t || !fusable_class_names.count(t->class_name))
+	return false;
+    if (pyramid_out || (pyramid_masked.size() > 0))
+	return false;
+    if ((t->state != UNBOUND) || (t->nt_chunk <= 0))
+	return false;
+
+    // If nt_chunk was specified in ini_params, then it must match the transform.
+    if ((ini_params.nt_chunk > 0) && (ini_params.nt_chunk != t->nt_chunk))
+	return false;
+
+    return (t->nt_chunk % min_nt_chunk) == 0;
 }
 
 
@@ -333,6 +1336,7 @@ Json::Value wi_sub_pipeline::jsonize() const
     ret["nds_out"] = Json::Int64(ini_params.nds_out);
     ret["Df"] = Json::Int64(ini_params.Df);
     ret["Dt"] = Json::Int64(ini_params.Dt);
+    ret["nbuf_async"] = Json::Int64(ini_params.nbuf_async);
 
     return ret;
 }
@@ -347,6 +1351,7 @@ shared_ptr<wi_sub_pipeline> wi_sub_pipeline::from_json(const Json::Value &j)
     ini_params.nds_out = int_from_json(j, "nds_out");
     ini_params.Df = int_from_json(j, "Df");
     ini_params.Dt = int_from_json(j, "Dt");
+    ini_params.nbuf_async = j.isMember("nbuf_async") ? int_from_json(j, "nbuf_async") : 0;
 
     if (!j.isMember("sub_pipeline"))
 	throw runtime_error("rf_pipelines::wi_sub_pipeline::from_json(): json member 'sub_pipeline' does not exist");
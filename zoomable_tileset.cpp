@@ -1,5 +1,12 @@
 #include "rf_pipelines_internals.hpp"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RF_ZT_X86 1
+#else
+#define RF_ZT_X86 0
+#endif
+
 using namespace std;
 
 namespace rf_pipelines {
@@ -36,9 +43,98 @@ zoomable_tileset::zoomable_tileset(const vector<vector<ssize_t>> &cdims_, const
 }
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// Downsampling kernels: out[k] = 0.5 * (in[2*k] + in[2*k+1]), for 0 <= k < n.
+//
+// As in bitmask_maker.cpp, the kernel is selected at runtime based on the CPU, and each SIMD
+// kernel falls through to the scalar kernel for the remainder.  All kernels give bitwise
+// identical results (multiplication by 0.5 is exact).
+
+
+static void _downsample2_scalar(float *out, const float *in, ssize_t n, ssize_t k0=0)
+{
+    for (ssize_t k = k0; k < n; k++)
+	out[k] = 0.5f * (in[2*k] + in[2*k+1]);
+}
+
+
+#if RF_ZT_X86
+
+__attribute__((target("sse2")))
+static void _downsample2_sse2(float *out, const float *in, ssize_t n)
+{
+    const __m128 half = _mm_set1_ps(0.5f);
+    ssize_t n4 = n & ~ssize_t(3);
+
+    for (ssize_t k = 0; k < n4; k += 4) {
+	__m128 a = _mm_loadu_ps(in + 2*k);
+	__m128 b = _mm_loadu_ps(in + 2*k + 4);
+	__m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+	__m128 odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+	_mm_storeu_ps(out + k, _mm_mul_ps(_mm_add_ps(even, odd), half));
+    }
+
+    _downsample2_scalar(out, in, n, n4);
+}
+
+
+__attribute__((target("avx2")))
+static void _downsample2_avx2(float *out, const float *in, ssize_t n)
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    ssize_t n8 = n & ~ssize_t(7);
+
+    for (ssize_t k = 0; k < n8; k += 8) {
+	__m256 a = _mm256_loadu_ps(in + 2*k);
+	__m256 b = _mm256_loadu_ps(in + 2*k + 8);
+
+	// Within each 128-bit lane, shuffle_ps gives (a0 a2 b0 b2 | a4 a6 b4 b6), so we
+	// permute 64-bit pairs afterwards to get (a0 a2 a4 a6 | b0 b2 b4 b6).
+	__m256 even = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+	__m256 odd = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+	__m256 x = _mm256_mul_ps(_mm256_add_ps(even, odd), half);
+	x = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(x), _MM_SHUFFLE(3,1,2,0)));
+
+	_mm256_storeu_ps(out + k, x);
+    }
+
+    _downsample2_scalar(out, in, n, n8);
+}
+
+#endif  // RF_ZT_X86
+
+
+using downsample2_kernel_t = void (*)(float *, const float *, ssize_t);
+
+static void _downsample2_scalar_n(float *out, const float *in, ssize_t n)
+{
+    _downsample2_scalar(out, in, n);
+}
+
+static downsample2_kernel_t _select_downsample2_kernel()
+{
+#if RF_ZT_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+	return _downsample2_avx2;
+    if (__builtin_cpu_supports("sse2"))
+	return _downsample2_sse2;
+#endif
+
+    return _downsample2_scalar_n;
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
 // Default virtual
 void zoomable_tileset::downsample_rbvec(rbvec_t &rb_out, rbvec_t &rb_in, ssize_t pos, ssize_t nt)
 {
+    static const downsample2_kernel_t downsample2 = _select_downsample2_kernel();
+
     for (size_t i = 0; i < rb_out.size(); i++) {
 	ssize_t nt_out = xdiv(nt, rb_out[i]->nds);
 	ssize_t csize = rb_out[i]->csize;
@@ -49,16 +145,8 @@ void zoomable_tileset::downsample_rbvec(rbvec_t &rb_out, rbvec_t &rb_in, ssize_t
 	ssize_t ostride = a_out.stride;
 	ssize_t istride = a_in.stride;
 
-	// FIXME (low-priority): assembly-language kernel would speed this up.
-	// But plotting is unlikely to be a bottleneck!
-
-	for (ssize_t j = 0; j < csize; j++) {
-	    float *p_out = a_out.data + j*ostride;
-	    float *p_in = a_in.data + j*istride;
-
-	    for (ssize_t k = 0; k < nt_out; k++)
-		p_out[k] = 0.5 * (p_in[2*k] + p_in[2*k+1]);
-	}
+	for (ssize_t j = 0; j < csize; j++)
+	    downsample2(a_out.data + j*ostride, a_in.data + j*istride, nt_out);
     }
 }
 
@@ -100,7 +188,10 @@ zoomable_tileset_state::zoomable_tileset_state(const shared_ptr<zoomable_tileset
     img_ny(zt_->img_ny),
     nds_arr(zt_->nds_arr),
     ny_arr(zt_->ny_arr),
-    debug(p._params.debug)
+    debug(p._params.debug),
+    png_compression(p._params.png_compression),
+    png_filter(p._params.png_filter),
+    png_store_intermediate(p._params.png_store_intermediate)
 {
     // These asserts should have been checked previously, either in run_params::check()
     // or in the zoomable_tileset constructor.
@@ -170,12 +261,6 @@ void zoomable_tileset_state::allocate()
 	this->rgb_zoom[i] = p;
     }
 
-    if (ny_arr != img_ny) {
-	uint8_t *p = new uint8_t[img_ny * img_nx * 3];
-	this->rgb_alloc.push_back(unique_ptr<uint8_t[]> (p));
-	this->rgb_us = p;
-    }
-
     this->is_allocated = true;
 }
 
@@ -194,7 +279,6 @@ void zoomable_tileset_state::deallocate()
     for (ssize_t i = 0; i < img_nzoom; i++)
 	this->rgb_zoom[i] = nullptr;
 
-    this->rgb_us = nullptr;
     this->rgb_alloc.clear();
     this->is_allocated = false;
 }
@@ -313,29 +397,30 @@ void zoomable_tileset_state::_emit_plot(int izoom, ssize_t iplot)
 {
     uint8_t *rgb = rgb_zoom[izoom];
 
-    // We may need to upsample from shape (ny_arr, img_nx, 3) to shape (img_ny, img_nx, 3).
-    if (img_ny != ny_arr) {
-	ssize_t Dy = xdiv(img_ny, ny_arr);
-	ssize_t stride = 3 * img_nx;
+    // The png file is written by a background thread (see outdir_manager.cpp), so we copy
+    // to a new shape (img_ny, img_nx, 3) array, upsampling from (ny_arr, img_nx, 3) if needed.
 
-	for (ssize_t i = 0; i < ny_arr; i++)
-	    for (ssize_t j = 0; j < Dy; j++)
-		memcpy(rgb_us + (i*Dy+j)*stride, rgb + i*stride, stride);
+    ssize_t Dy = xdiv(img_ny, ny_arr);
+    ssize_t stride = 3 * img_nx;
+    vector<uint8_t> tile(img_ny * stride);
 
-	rgb = rgb_us;
-    }
+    for (ssize_t i = 0; i < ny_arr; i++)
+	for (ssize_t j = 0; j < Dy; j++)
+	    memcpy(&tile[(i*Dy+j)*stride], rgb + i*stride, stride);
 
-    // Now 'rgb' is a shape (img_ny, img_nx, 3) array.
-    // Next step is to write the png file.
-    
     stringstream ss;
     ss << "img_" << izoom << "_" << iplot << ".png";
 
     string basename = ss.str();
     string fullname = mp->add_file(basename);
 
-    // write_rgb8_png(filename, rgb, m, n, ymajor, ytop_to_bottom)
-    write_rgb8_png(fullname, rgb, img_ny, img_nx, true, false);
+    // If png_store_intermediate=true, then intermediate zoom levels are written without compression.
+    bool store = png_store_intermediate && (izoom > 0) && (izoom < img_nzoom-1);
+    int compression = store ? 0 : png_compression;
+    string filter = store ? "none" : png_filter;
+
+    // write_png_async(filename, rgb, m, n, ymajor, ytop_to_bottom, compression, filter)
+    mp->write_png_async(fullname, std::move(tile), img_ny, img_nx, true, false, compression, filter);
 
     Json::Value j;
     j["filename"] = fullname;